@@ -0,0 +1,433 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use jxl::bit_reader::BitReader;
+use jxl::bmff::CodestreamSegments;
+use jxl::decoder::{probe, DecoderStatus, JxlDecoder};
+use jxl::entropy_coding::context_map::decode_context_map;
+use jxl::entropy_coding::decode::Histograms;
+use jxl::entropy_coding::hybrid_uint::HybridUint;
+use jxl::error::Error;
+use jxl::frame::seek::SeekIndex;
+use jxl::headers::transform_data::CustomTransformData;
+use jxl::headers::{FileHeaders, JxlHeader};
+use jxl::render::pipeline::{RenderPipeline, RowSink, RowSource, Stage, StripBuffers};
+use jxl::render::stages::{Gaborish, Upsample};
+use jxl::simd::SimdLevel;
+use jxl::test_util::BitWriter;
+use jxl::var_dct::idct::{inverse_transform, TransformScratch};
+use jxl::var_dct::transform_type::TransformType;
+use std::env;
+use std::ffi::OsStr;
+use std::fs;
+use std::path::PathBuf;
+
+const NUM_SYMBOLS: usize = 1 << 16;
+
+/// Returns the files of the directory in `JXL_BENCH_CORPUS`, or of benches/corpus if it is not
+/// set, sorted by name. benches/corpus only has small codestreams; set `JXL_BENCH_CORPUS` to a
+/// directory of real images (e.g. the conformance files, which cover ANS, modular and VarDCT)
+/// to measure actual decoding.
+fn corpus() -> Vec<(String, Vec<u8>)> {
+    let dir = match env::var_os("JXL_BENCH_CORPUS") {
+        Some(dir) => PathBuf::from(dir),
+        None => PathBuf::from(env!("CARGO_MANIFEST_DIR")).join("benches/corpus"),
+    };
+    let mut files: Vec<_> = fs::read_dir(&dir)
+        .expect("Something went wrong reading the corpus")
+        .map(|entry| entry.unwrap().path())
+        .filter(|path| path.extension() == Some(OsStr::new("jxl")))
+        .collect();
+    files.sort();
+    files
+        .into_iter()
+        .map(|path| {
+            let name = path.file_stem().unwrap().to_string_lossy().into_owned();
+            (name, fs::read(&path).unwrap())
+        })
+        .collect()
+}
+
+/// Deterministic pseudo-random numbers, so that runs are comparable.
+fn pseudo_random(n: usize) -> impl Iterator<Item = u64> {
+    let mut state = 0x2545_f491_4f6c_dd1du64;
+    (0..n).map(move |_| {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        state
+    })
+}
+
+// Writes `code` of length `len` as a prefix code, i.e. starting from the most significant bit.
+fn write_code(bw: &mut BitWriter, len: u8, code: u32) {
+    for i in (0..len).rev() {
+        bw.write(1, ((code >> i) & 1) as u64);
+    }
+}
+
+// Canonical prefix code for `code_lengths`, as (length, code).
+fn canonical_codes(code_lengths: &[u8]) -> Vec<(u8, u32)> {
+    let mut codes = vec![(0, 0); code_lengths.len()];
+    let mut code = 0u32;
+    for len in 1..=15 {
+        for (sym, _) in code_lengths.iter().enumerate().filter(|(_, l)| **l == len) {
+            codes[sym] = (len, code);
+            code += 1;
+        }
+        code <<= 1;
+    }
+    codes
+}
+
+/// Writes a single prefix code histogram with a direct uint config, as `Histograms::decode`
+/// with one context and no LZ77 expects it.
+fn write_prefix_histograms(bw: &mut BitWriter, code_lengths: &[u8]) {
+    // No LZ77, prefix codes, split_exponent = 15.
+    bw.write(1, 0);
+    bw.write(1, 1);
+    bw.write(4, 15);
+    // Alphabet size, as 1 + varint16.
+    let size = code_lengths.len() as u64 - 1;
+    if size == 0 {
+        bw.write(1, 0);
+    } else {
+        let nbits = 63 - size.leading_zeros() as usize;
+        bw.write(1, 1);
+        bw.write(4, nbits as u64);
+        bw.write(nbits, size - (1 << nbits));
+    }
+    // Complex code, where code lengths 0..16 all use 4-bit codes. In the static code used
+    // for code length code lengths, 4 is written as 0b01 and 0 as 0b00.
+    bw.write(2, 0);
+    const CODE_LENGTH_CODE_ORDER: [u8; 18] =
+        [1, 2, 3, 4, 0, 5, 17, 6, 16, 7, 8, 9, 10, 11, 12, 13, 14, 15];
+    for sym in CODE_LENGTH_CODE_ORDER.iter() {
+        if *sym < 16 {
+            bw.write(2, 0b01);
+        } else {
+            bw.write(2, 0b00);
+        }
+    }
+    let last = code_lengths.iter().rposition(|l| *l != 0).unwrap();
+    for len in code_lengths[..=last].iter() {
+        write_code(bw, 4, *len as u32);
+    }
+}
+
+/// A stream with prefix code histograms and `NUM_SYMBOLS` symbols, with a
+/// distribution that matches the code lengths.
+fn prefix_coded_stream(code_lengths: &[u8]) -> Vec<u8> {
+    let codes = canonical_codes(code_lengths);
+    let mut bw = BitWriter::default();
+    write_prefix_histograms(&mut bw, code_lengths);
+    for r in pseudo_random(NUM_SYMBOLS) {
+        // Picks among the 2^15 leaves of the code tree, so that symbols are drawn with
+        // probability 2^-len.
+        let mut leaf = (r & 0x7fff) as u32;
+        let sym = code_lengths
+            .iter()
+            .position(|len| {
+                let size = if *len == 0 { 0 } else { 1 << (15 - len) };
+                if leaf < size {
+                    true
+                } else {
+                    leaf -= size;
+                    false
+                }
+            })
+            .unwrap();
+        let (len, code) = codes[sym];
+        write_code(&mut bw, len, code);
+    }
+    bw.finish()
+}
+
+fn histogram_shapes() -> Vec<(&'static str, Vec<u8>)> {
+    vec![
+        ("four_symbols", vec![1, 2, 3, 3]),
+        ("flat_256", vec![8; 256]),
+        ("mixed_96", [vec![6; 32], vec![7; 64]].concat()),
+        ("skewed_long", (1..=15).chain(std::iter::once(15)).collect()),
+    ]
+}
+
+fn bench_bit_reader(c: &mut Criterion) {
+    let data: Vec<u8> = pseudo_random(1 << 17).map(|r| r as u8).collect();
+    let mut group = c.benchmark_group("bit_reader");
+    group.throughput(Throughput::Bytes(data.len() as u64));
+    for &bits in [1, 5, 13, 32].iter() {
+        group.bench_with_input(BenchmarkId::new("read", bits), &bits, |b, &bits| {
+            b.iter(|| {
+                let mut br = BitReader::new(&data);
+                let mut sum = 0u64;
+                for _ in 0..data.len() * 8 / bits {
+                    sum = sum.wrapping_add(br.read(bits).unwrap());
+                }
+                sum
+            })
+        });
+        group.bench_with_input(
+            BenchmarkId::new("read_unchecked", bits),
+            &bits,
+            |b, &bits| {
+                b.iter(|| {
+                    let mut br = BitReader::new(&data);
+                    let mut sum = 0u64;
+                    for _ in 0..data.len() * 8 / bits {
+                        br.refill_unchecked();
+                        sum = sum.wrapping_add(br.read_unchecked(bits));
+                    }
+                    br.check_overflow().unwrap();
+                    sum
+                })
+            },
+        );
+    }
+    group.bench_function("skip_bits", |b| {
+        b.iter(|| {
+            let mut br = BitReader::new(&data);
+            for skip in pseudo_random(data.len() / 64) {
+                br.skip_bits((skip % 1000) as usize).unwrap();
+            }
+            br.total_bits_read()
+        })
+    });
+    group.finish();
+}
+
+fn bench_prefix_codes(c: &mut Criterion) {
+    let mut group = c.benchmark_group("prefix_codes");
+    for (name, code_lengths) in histogram_shapes() {
+        let stream = prefix_coded_stream(&code_lengths);
+        group.throughput(Throughput::Elements(1));
+        group.bench_with_input(BenchmarkId::new("build", name), &stream, |b, stream| {
+            b.iter(|| Histograms::decode(1, &mut BitReader::new(stream), false).unwrap())
+        });
+        group.throughput(Throughput::Bytes(stream.len() as u64));
+        group.bench_with_input(BenchmarkId::new("read", name), &stream, |b, stream| {
+            b.iter(|| {
+                let mut br = BitReader::new(stream);
+                let histograms = Histograms::decode(1, &mut br, false).unwrap();
+                let mut reader = histograms.make_reader(&mut br).unwrap();
+                let mut sum = 0u32;
+                for _ in 0..NUM_SYMBOLS {
+                    sum = sum.wrapping_add(reader.read(&mut br, 0).unwrap());
+                }
+                sum
+            })
+        });
+        group.bench_with_input(BenchmarkId::new("read_many", name), &stream, |b, stream| {
+            let mut out = vec![0; NUM_SYMBOLS];
+            b.iter(|| {
+                let mut br = BitReader::new(stream);
+                let histograms = Histograms::decode(1, &mut br, false).unwrap();
+                let mut reader = histograms.make_reader(&mut br).unwrap();
+                reader.read_many(&mut br, 0, &mut out).unwrap();
+                out[NUM_SYMBOLS - 1]
+            })
+        });
+    }
+    group.finish();
+}
+
+fn bench_hybrid_uint(c: &mut Criterion) {
+    // split_exponent = 4, msb_in_token = 1, lsb_in_token = 1.
+    let mut bw = BitWriter::default();
+    bw.write(4, 4);
+    bw.write(3, 1);
+    bw.write(2, 1);
+    let config_data = bw.finish();
+    let config = HybridUint::decode(8, &mut BitReader::new(&config_data)).unwrap();
+    let symbols: Vec<u32> = pseudo_random(NUM_SYMBOLS)
+        .map(|r| (r % 64) as u32)
+        .collect();
+    let data: Vec<u8> = pseudo_random(NUM_SYMBOLS * 4).map(|r| r as u8).collect();
+
+    let mut group = c.benchmark_group("hybrid_uint");
+    group.throughput(Throughput::Elements(NUM_SYMBOLS as u64));
+    group.bench_function("read", |b| {
+        b.iter(|| {
+            let mut br = BitReader::new(&data);
+            let mut sum = 0u32;
+            for &sym in symbols.iter() {
+                sum = sum.wrapping_add(config.read(black_box(sym), &mut br).unwrap());
+            }
+            sum
+        })
+    });
+    group.finish();
+}
+
+fn bench_context_map(c: &mut Criterion) {
+    let num_contexts = 4096;
+    // Simple context map with 4 bits per entry.
+    let mut bw = BitWriter::default();
+    bw.write(1, 1);
+    bw.write(2, 2);
+    let entries: Vec<u64> = pseudo_random(num_contexts).map(|r| r % 16).collect();
+    // Every cluster must be used.
+    for (i, entry) in entries.iter().enumerate() {
+        bw.write(4, if i < 16 { i as u64 } else { *entry });
+    }
+    let simple = bw.finish();
+
+    // Entropy-coded context map without MTF, over 16 clusters.
+    let code_lengths = vec![4u8; 16];
+    let codes = canonical_codes(&code_lengths);
+    let mut bw = BitWriter::default();
+    bw.write(1, 0);
+    bw.write(1, 0);
+    write_prefix_histograms(&mut bw, &code_lengths);
+    for (i, entry) in entries.iter().enumerate() {
+        let (len, code) = codes[if i < 16 { i } else { *entry as usize }];
+        write_code(&mut bw, len, code);
+    }
+    let coded = bw.finish();
+
+    let mut group = c.benchmark_group("context_map");
+    group.throughput(Throughput::Elements(num_contexts as u64));
+    for (name, data) in [("simple", simple), ("prefix_coded", coded)].iter() {
+        group.bench_with_input(BenchmarkId::from_parameter(name), data, |b, data| {
+            b.iter(|| decode_context_map(num_contexts, &mut BitReader::new(data)).unwrap())
+        });
+    }
+    group.finish();
+}
+
+fn read_file_headers(file: &[u8]) -> Result<FileHeaders, Error> {
+    let segments = CodestreamSegments::new(file)?;
+    FileHeaders::read(&mut segments.bit_reader())
+}
+
+fn bench_headers(c: &mut Criterion) {
+    let mut group = c.benchmark_group("headers");
+    for (name, file) in corpus() {
+        group.throughput(Throughput::Bytes(file.len() as u64));
+        group.bench_with_input(BenchmarkId::new("file_headers", &name), &file, |b, file| {
+            b.iter(|| read_file_headers(file).unwrap())
+        });
+        group.bench_with_input(BenchmarkId::new("frame_header", &name), &file, |b, file| {
+            b.iter(|| probe(file, true).unwrap())
+        });
+    }
+    group.finish();
+}
+
+/// Everything the decoder reads of each file: headers, ICC profile, frame header and TOC, then
+/// the header, TOC and references of every frame.
+fn bench_decode(c: &mut Criterion) {
+    let mut group = c.benchmark_group("decode");
+    for (name, file) in corpus() {
+        group.throughput(Throughput::Bytes(file.len() as u64));
+        group.bench_with_input(BenchmarkId::new("decoder", &name), &file, |b, file| {
+            b.iter(|| {
+                let mut decoder = JxlDecoder::from_bytes(file).unwrap();
+                while decoder.process().unwrap() != DecoderStatus::Done {}
+                decoder
+            })
+        });
+        group.bench_with_input(BenchmarkId::new("seek_index", &name), &file, |b, file| {
+            b.iter(|| SeekIndex::build(file).unwrap())
+        });
+    }
+    group.finish();
+}
+
+fn bench_idct(c: &mut Criterion) {
+    let mut group = c.benchmark_group("idct");
+    let types = [
+        TransformType::Dct8,
+        TransformType::Dct4x4,
+        TransformType::Dct16,
+        TransformType::Dct32x16,
+        TransformType::Dct64,
+        TransformType::Dct256,
+    ];
+    for ty in types.iter().copied() {
+        let (rows, cols) = ty.size();
+        let coefficients: Vec<f32> = pseudo_random(rows * cols)
+            .map(|x| (x % 1024) as f32 / 512.0 - 1.0)
+            .collect();
+        let mut pixels = vec![0.0; rows * cols];
+        let mut scratch = TransformScratch::new();
+        group.throughput(Throughput::Elements((rows * cols) as u64));
+        for level in [SimdLevel::Scalar, SimdLevel::detected()].iter().copied() {
+            let id = BenchmarkId::new(format!("{:?}", level), format!("{:?}", ty));
+            group.bench_function(id, |b| {
+                SimdLevel::set_max_level(level);
+                b.iter(|| {
+                    inverse_transform(ty, &coefficients, &mut pixels, cols, &mut scratch).unwrap();
+                    black_box(&pixels);
+                });
+                SimdLevel::reset_max_level();
+            });
+        }
+    }
+    group.finish();
+}
+
+struct ConstantSource;
+
+impl RowSource for ConstantSource {
+    fn fill_row(&self, _: usize, x0: usize, y: usize, row: &mut [f32]) {
+        for (x, v) in row.iter_mut().enumerate() {
+            *v = ((x0 + x) ^ y) as f32 / 1024.0;
+        }
+    }
+}
+
+struct DiscardSink;
+
+impl RowSink for DiscardSink {
+    fn write_row(&mut self, _: usize, _: usize, rows: &mut [&mut [f32]]) -> Result<(), Error> {
+        black_box(rows);
+        Ok(())
+    }
+}
+
+fn bench_render(c: &mut Criterion) {
+    let mut group = c.benchmark_group("render");
+    let (width, height) = (2048, 2048);
+    let transform_data = CustomTransformData::default();
+    for tile_width in [256, 1024, width].iter().copied() {
+        let stages = vec![
+            Stage::InOut(Box::new(Gaborish::new([[0.115, 0.061]; 3], 3))),
+            Stage::InOut(Box::new(Upsample::new(
+                2,
+                transform_data.upsampling_weights(2),
+                vec![0, 1, 2],
+            ))),
+        ];
+        let pipeline =
+            RenderPipeline::new(width, height, vec![1; 3], stages).with_strip_size(tile_width, 64);
+        let mut buffers = StripBuffers::default();
+        group.throughput(Throughput::Elements((width * height) as u64));
+        group.bench_function(BenchmarkId::new("gaborish_upsample2", tile_width), |b| {
+            b.iter(|| {
+                for strip in 0..pipeline.num_strips() {
+                    pipeline
+                        .render_strip(strip, &ConstantSource, &mut buffers, &mut DiscardSink)
+                        .unwrap();
+                }
+            })
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    bench_bit_reader,
+    bench_prefix_codes,
+    bench_hybrid_uint,
+    bench_context_map,
+    bench_headers,
+    bench_decode,
+    bench_idct,
+    bench_render
+);
+criterion_main!(benches);
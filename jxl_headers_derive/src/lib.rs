@@ -8,12 +8,16 @@ extern crate proc_macro;
 use proc_macro::TokenStream;
 use proc_macro2::TokenStream as TokenStream2;
 use proc_macro_error::{abort, proc_macro_error};
-use quote::quote;
+use quote::{format_ident, quote};
 use syn::{parse_macro_input, DeriveInput};
 
 #[cfg(feature = "tex")]
 use std::fs;
 
+// Maximum number of bits that are read at once for a run of fixed-width fields, i.e.
+// `MAX_BITS_PER_CALL` of the bit reader.
+const MAX_FUSED_BITS: usize = 56;
+
 #[cfg(feature = "tex")]
 const THIN_LINE: &str = "    \\noalign{\\color{gray!50}\\hrule height 0.1pt}\n";
 
@@ -135,6 +139,46 @@ fn parse_coder(input: syn::Expr) -> TokenStream2 {
     }
 }
 
+// Makes the coder a constant, so that it is never built at runtime. Only valid for coders that do
+// not depend on the values of other fields.
+fn const_coder(coder: TokenStream2) -> TokenStream2 {
+    quote! { { const CODER: U32Coder = #coder; CODER } }
+}
+
+// Returns the number of bits and the offset for coders of the form Bits(n) or Bits(n) + off,
+// which can be read together with neighbouring fields.
+fn fixed_width_coder(input: &syn::Expr) -> Option<(usize, Option<syn::ExprLit>)> {
+    let bits = |expr: &syn::Expr| match expr {
+        syn::Expr::Call(expr_call) if expr_call.args.len() == 1 => {
+            match (&*expr_call.func, &expr_call.args[0]) {
+                (
+                    syn::Expr::Path(ep),
+                    syn::Expr::Lit(syn::ExprLit {
+                        lit: syn::Lit::Int(n),
+                        ..
+                    }),
+                ) if ep.path.is_ident("Bits") => n.base10_parse::<usize>().ok(),
+                _ => None,
+            }
+        }
+        _ => None,
+    };
+    match input {
+        syn::Expr::Binary(syn::ExprBinary {
+            left,
+            op: syn::BinOp::Add(_),
+            right,
+            ..
+        }) => match (&**left, &**right) {
+            (syn::Expr::Lit(off), expr) | (expr, syn::Expr::Lit(off)) => {
+                bits(expr).map(|n| (n, Some(off.clone())))
+            }
+            _ => None,
+        },
+        _ => bits(input).map(|n| (n, None)),
+    }
+}
+
 fn parse_size_coder(mut input: syn::Expr) -> TokenStream2 {
     match input {
         syn::Expr::Call(syn::ExprCall {
@@ -149,7 +193,7 @@ fn parse_size_coder(mut input: syn::Expr) -> TokenStream2 {
             match &**func {
                 syn::Expr::Path(expr_path) if expr_path.path.is_ident("implicit") => {
                     let arg = args.first().unwrap().clone();
-                    parse_coder(arg)
+                    const_coder(parse_coder(arg))
                 }
                 syn::Expr::Path(expr_path) if expr_path.path.is_ident("explicit") => {
                     quote! { U32Coder::Direct(U32::Val(#args)) }
@@ -292,6 +336,14 @@ enum FieldKind {
     Defaulted(Condition, Coder),
 }
 
+// A field that is stored in a fixed number of bits.
+#[derive(Debug)]
+struct FixedWidth {
+    bits: usize,
+    offset: Option<syn::ExprLit>,
+    is_bool: bool,
+}
+
 #[derive(Debug)]
 struct Field {
     name: proc_macro2::Ident,
@@ -300,6 +352,7 @@ struct Field {
     default: Option<TokenStream2>,
     default_element: Option<TokenStream2>,
     nonserialized_inits: Vec<TokenStream2>,
+    fixed_width: Option<FixedWidth>,
 }
 
 impl Field {
@@ -320,6 +373,8 @@ impl Field {
 
         let mut default_element = None;
 
+        let mut fixed_width = None;
+
         // Parse attributes.
         for a in &f.attrs {
             match a.path.get_ident().map(syn::Ident::to_string).as_deref() {
@@ -329,8 +384,9 @@ impl Field {
                     }
                     let coder_ast = a.parse_args::<syn::Expr>().unwrap();
                     let pretty = prettify_coder(&coder_ast);
+                    fixed_width = fixed_width_coder(&coder_ast);
                     coder = Some(Coder::U32(U32 {
-                        coder: parse_coder(coder_ast),
+                        coder: const_coder(parse_coder(coder_ast)),
                         pretty,
                     }));
                 }
@@ -385,7 +441,7 @@ impl Field {
                     let coder_ast = a.parse_args::<syn::Expr>().unwrap();
                     let pretty = prettify_coder(&coder_ast);
                     coder_false = Some(U32 {
-                        coder: parse_coder(coder_ast),
+                        coder: const_coder(parse_coder(coder_ast)),
                         pretty,
                     });
                 }
@@ -396,7 +452,7 @@ impl Field {
                     let coder_ast = a.parse_args::<syn::Expr>().unwrap();
                     let pretty = prettify_coder(&coder_ast);
                     coder_true = Some(U32 {
-                        coder: parse_coder(coder_ast),
+                        coder: const_coder(parse_coder(coder_ast)),
                         pretty,
                     });
                 }
@@ -477,6 +533,30 @@ impl Field {
         if is_all_default {
             *all_default_field = Some(f.ident.as_ref().unwrap().clone());
         }
+
+        // Fields that are read with a fixed number of bits, and whose value is either read or the
+        // default, can be read together with their neighbours.
+        let ty = &f.ty;
+        let fixed_width = match &kind {
+            _ if is_all_default || !nonserialized.is_empty() || default_element.is_some() => None,
+            FieldKind::Unconditional(coder) | FieldKind::Defaulted(_, coder) => {
+                match (coder, quote! {#ty}.to_string().as_str()) {
+                    (Coder::WithoutConfig(_), "bool") => Some(FixedWidth {
+                        bits: 1,
+                        offset: None,
+                        is_bool: true,
+                    }),
+                    (Coder::U32(_), "u32") => fixed_width.map(|(bits, offset)| FixedWidth {
+                        bits,
+                        offset,
+                        is_bool: false,
+                    }),
+                    _ => None,
+                }
+            }
+            FieldKind::Conditional(_, _) => None,
+        };
+
         Field {
             name: ident.clone(),
             kind,
@@ -484,6 +564,105 @@ impl Field {
             default,
             default_element,
             nonserialized_inits: nonserialized,
+            fixed_width,
+        }
+    }
+
+    fn condition(&self) -> Option<&Condition> {
+        match &self.kind {
+            FieldKind::Unconditional(_) => None,
+            FieldKind::Conditional(condition, _) | FieldKind::Defaulted(condition, _) => {
+                Some(condition)
+            }
+        }
+    }
+
+    // Produces the code that sets the field when the all_default field is true, without reading
+    // anything but the sizes of vectors of default elements.
+    fn read_all_default(&self, all_default_field: &Option<syn::Ident>) -> TokenStream2 {
+        let ident = &self.name;
+        let ty = &self.ty;
+        let nonserialized_inits = &self.nonserialized_inits;
+        match &self.kind {
+            FieldKind::Unconditional(_) => self.read_fun(all_default_field, false),
+            FieldKind::Conditional(_, _) => quote! {
+                let #ident: #ty = Default::default();
+            },
+            FieldKind::Defaulted(_, coder) => match &self.default_element {
+                Some(default) => {
+                    let (cfg_ty, cfg) = coder.config(all_default_field);
+                    quote! {
+                        let #ident = {
+                            let cfg = #cfg;
+                            let default = #default;
+                            type NS = <#ty as DefaultedCoder<#cfg_ty>>::Nonserialized;
+                            let nonserialized = NS { #(#nonserialized_inits),* };
+                            <#ty>::read_defaulted_element(&cfg, false, default, br, &nonserialized)?
+                        };
+                    }
+                }
+                None => {
+                    let default = &self.default;
+                    quote! {
+                        let #ident: #ty = #default;
+                    }
+                }
+            },
+        }
+    }
+
+    // Produces reading code for a run of fixed-width fields with the same condition, which are
+    // read with a single call to the bit reader.
+    fn read_fused(fields: &[Field], all_default_field: &Option<syn::Ident>) -> TokenStream2 {
+        let total_bits: usize = fields
+            .iter()
+            .map(|f| f.fixed_width.as_ref().unwrap().bits)
+            .sum();
+        let bits = format_ident!("fused_{}", fields[0].name);
+        let mut shift = 0;
+        let mut values = vec![];
+        for f in fields {
+            let fixed_width = f.fixed_width.as_ref().unwrap();
+            let shifted = if shift == 0 {
+                quote! { #bits }
+            } else {
+                quote! { (#bits >> #shift) }
+            };
+            let value = if fixed_width.is_bool {
+                quote! { (#shifted & 1) != 0 }
+            } else {
+                let mask = (1u64 << fixed_width.bits) - 1;
+                let offset = fixed_width.offset.as_ref().map(|off| quote! { + #off });
+                quote! { (#shifted & #mask) as u32 #offset }
+            };
+            shift += fixed_width.bits;
+            values.push((&f.name, value, &f.default));
+        }
+        match fields[0].condition() {
+            None => {
+                let values = values.iter().map(|(ident, value, _)| {
+                    quote! { let #ident = #value; }
+                });
+                quote! {
+                    let #bits = br.read(#total_bits)?;
+                    #(#values)*
+                }
+            }
+            Some(condition) => {
+                let cnd = condition.get_expr(all_default_field).unwrap();
+                let values = values.iter().map(|(ident, value, default)| {
+                    quote! {
+                        let #ident = match #bits {
+                            Some(#bits) => #value,
+                            None => #default,
+                        };
+                    }
+                });
+                quote! {
+                    let #bits = if #cnd { Some(br.read(#total_bits)?) } else { None };
+                    #(#values)*
+                }
+            }
         }
     }
 
@@ -576,14 +755,14 @@ impl Field {
             Coder::WithoutConfig(ty) => {
                 let (href_ty, ty) = prettify_type(ty);
                 add_row(
-                    cond.as_deref(),
+                    cond,
                     &("\\hyperref[hdr:".to_owned() + &href_ty + "]{" + &minted(&ty) + "}"),
-                    dfl.as_deref(),
+                    dfl,
                     ident,
                 );
             }
             Coder::U32(U32 { coder: _, pretty }) => {
-                add_row(cond.as_deref(), &minted(pretty), dfl.as_deref(), ident);
+                add_row(cond, &minted(pretty), dfl, ident);
             }
             Coder::Select(
                 Condition {
@@ -610,13 +789,8 @@ impl Field {
                 } else {
                     "!(".to_owned() + condition + ")"
                 };
-                add_row(Some(&cond_true), &minted(coder_true), dfl.as_deref(), ident);
-                add_row(
-                    Some(&cond_false),
-                    &minted(coder_false),
-                    dfl.as_deref(),
-                    ident,
-                );
+                add_row(Some(&cond_true), &minted(coder_true), dfl, ident);
+                add_row(Some(&cond_false), &minted(coder_false), dfl, ident);
             }
             Coder::Vector(size_coder, value_coder) => {
                 Field::texify_coder_and_cond(
@@ -628,7 +802,7 @@ impl Field {
                 );
                 Field::texify_coder_and_cond(
                     Some(&("0..num_".to_owned() + ident)),
-                    &**value_coder,
+                    value_coder,
                     dfl,
                     ident,
                     add_row,
@@ -762,8 +936,38 @@ fn derive_struct(input: DeriveInput) -> TokenStream2 {
         .enumerate()
         .map(|(n, f)| Field::parse(f, n, &mut all_default_field))
         .collect();
-    let fields_read = fields.iter().map(|x| x.read_fun(&all_default_field, trace));
-    let fields_names = fields.iter().map(|x| &x.name);
+    // Group runs of fixed-width fields with the same condition.
+    let condition_key = |f: &Field| {
+        f.condition()
+            .map(|c| c.get_expr(&all_default_field).unwrap().to_string())
+    };
+    let mut groups: Vec<&[Field]> = vec![];
+    let mut start = 0;
+    while start < fields.len() {
+        let mut end = start + 1;
+        if let (false, Some(first)) = (trace, &fields[start].fixed_width) {
+            let mut total_bits = first.bits;
+            while let Some(next) = fields.get(end).and_then(|f| f.fixed_width.as_ref()) {
+                if total_bits + next.bits > MAX_FUSED_BITS
+                    || condition_key(&fields[end]) != condition_key(&fields[start])
+                {
+                    break;
+                }
+                total_bits += next.bits;
+                end += 1;
+            }
+        }
+        groups.push(&fields[start..end]);
+        start = end;
+    }
+    let fields_read: Vec<_> = groups
+        .iter()
+        .map(|group| match group {
+            [field] => field.read_fun(&all_default_field, trace),
+            _ => Field::read_fused(group, &all_default_field),
+        })
+        .collect();
+    let fields_names: Vec<_> = fields.iter().map(|x| &x.name).collect();
 
     let impl_default = if fields.iter().all(|x| x.default.is_some()) {
         let defaults = fields.iter().map(|f| {
@@ -796,6 +1000,28 @@ fn derive_struct(input: DeriveInput) -> TokenStream2 {
         false => quote! {},
     };
 
+    // When the all_default field is set, the other fields are set to their defaults directly,
+    // without evaluating their conditions and coders.
+    let read_all_default = match &all_default_field {
+        Some(all_default) if !trace => {
+            let defaults = fields[1..]
+                .iter()
+                .map(|f| f.read_all_default(&all_default_field));
+            quote! {
+                if #all_default {
+                    #(#defaults)*
+                    let return_value = #name {
+                        #(#fields_names),*
+                    };
+                    #impl_validate
+                    return Ok(return_value);
+                }
+            }
+        }
+        _ => quote! {},
+    };
+    let (first_field_read, fields_read) = fields_read.split_first().unwrap();
+
     texify(&quote! {#name}.to_string(), &fields);
 
     quote! {
@@ -808,11 +1034,12 @@ fn derive_struct(input: DeriveInput) -> TokenStream2 {
                 use crate::headers::encodings::DefaultedCoder;
                 use crate::headers::encodings::DefaultedElementCoder;
                 #align
+                #first_field_read
+                #read_all_default
                 #(#fields_read)*
                 let return_value = #name {
                     #(#fields_names),*
                 };
-                #align
                 #impl_validate
                 Ok(return_value)
             }
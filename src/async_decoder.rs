@@ -0,0 +1,334 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use std::future::Future;
+use std::io;
+use std::pin::Pin;
+use std::task::{Context, Poll};
+
+use crate::decoder::{DecoderStatus, JxlDecoder};
+use crate::error::Error;
+use crate::runner::{CancelToken, CancellableRunner, Runner};
+
+/// Number of bytes requested from the reader at a time.
+const READ_CHUNK_SIZE: usize = 1 << 16;
+
+/// Asynchronous source of bytes. It has the same shape as the `AsyncRead` traits of `futures` and
+/// tokio, so their readers can be adapted with a small wrapper, without this crate depending on
+/// any runtime.
+pub trait AsyncRead {
+    /// Reads some bytes into `buf` and returns how many; 0 means the end of the input.
+    fn poll_read(
+        self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &mut [u8],
+    ) -> Poll<io::Result<usize>>;
+}
+
+impl AsyncRead for &[u8] {
+    fn poll_read(
+        mut self: Pin<&mut Self>,
+        _: &mut Context<'_>,
+        buf: &mut [u8],
+    ) -> Poll<io::Result<usize>> {
+        let num = buf.len().min(self.len());
+        let (head, tail) = self.split_at(num);
+        buf[..num].copy_from_slice(head);
+        *self = tail;
+        Poll::Ready(Ok(num))
+    }
+}
+
+impl<T: AsyncRead + Unpin + ?Sized> AsyncRead for &mut T {
+    fn poll_read(
+        mut self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &mut [u8],
+    ) -> Poll<io::Result<usize>> {
+        Pin::new(&mut **self).poll_read(cx, buf)
+    }
+}
+
+impl<T: AsyncRead + Unpin + ?Sized> AsyncRead for Box<T> {
+    fn poll_read(
+        mut self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &mut [u8],
+    ) -> Poll<io::Result<usize>> {
+        Pin::new(&mut **self).poll_read(cx, buf)
+    }
+}
+
+struct ReadChunk<'a, R: ?Sized> {
+    reader: &'a mut R,
+    buf: &'a mut [u8],
+}
+
+impl<R: AsyncRead + Unpin + ?Sized> Future for ReadChunk<'_, R> {
+    type Output = io::Result<usize>;
+
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<usize>> {
+        let this = &mut *self;
+        Pin::new(&mut *this.reader).poll_read(cx, this.buf)
+    }
+}
+
+/// Returns `Pending` once, after waking the task, so that the executor runs other tasks before
+/// decoding continues.
+struct YieldNow {
+    yielded: bool,
+}
+
+impl Future for YieldNow {
+    type Output = ();
+
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<()> {
+        if self.yielded {
+            return Poll::Ready(());
+        }
+        self.yielded = true;
+        cx.waker().wake_by_ref();
+        Poll::Pending
+    }
+}
+
+fn yield_now() -> YieldNow {
+    YieldNow { yielded: false }
+}
+
+/// Decoder that pulls its input from an `AsyncRead`, for use in async code without a blocking
+/// thread per image. It works with any executor: it only waits on the reader, and it yields back
+/// to the executor after each chunk of input and each decoded stage, so decoding a large file
+/// does not hold an executor thread for its whole duration.
+///
+/// Decoding stops at the next yield point when the future is dropped, or when the token of
+/// `cancel_token` is cancelled; frame decoding with the runner returned by `runner` also stops
+/// between groups.
+pub struct AsyncDecoder<R> {
+    reader: R,
+    decoder: JxlDecoder<'static>,
+    buf: Vec<u8>,
+    token: CancelToken,
+    input_finished: bool,
+}
+
+impl<R: AsyncRead + Unpin> AsyncDecoder<R> {
+    pub fn new(reader: R) -> AsyncDecoder<R> {
+        AsyncDecoder::with_decoder(reader, JxlDecoder::new())
+    }
+
+    /// Uses `decoder`, e.g. one created with `JxlDecoder::with_config`, which must not have been
+    /// created with `from_bytes`.
+    pub fn with_decoder(reader: R, decoder: JxlDecoder<'static>) -> AsyncDecoder<R> {
+        AsyncDecoder {
+            reader,
+            decoder,
+            buf: vec![],
+            token: CancelToken::new(),
+            input_finished: false,
+        }
+    }
+
+    /// Token that cancels this decode; clone it to cancel from another task.
+    pub fn cancel_token(&self) -> &CancelToken {
+        &self.token
+    }
+
+    /// Wraps `runner` so that the tasks it runs for this decode stop when it is cancelled.
+    pub fn runner<T: Runner>(&self, runner: T) -> CancellableRunner<T> {
+        CancellableRunner::new(runner, self.token.clone())
+    }
+
+    pub fn decoder(&self) -> &JxlDecoder<'static> {
+        &self.decoder
+    }
+
+    pub fn into_decoder(self) -> JxlDecoder<'static> {
+        self.decoder
+    }
+
+    /// Same as `JxlDecoder::process`, but waits for more input instead of returning
+    /// `DecoderStatus::NeedMoreInput`.
+    pub async fn process(&mut self) -> Result<DecoderStatus, Error> {
+        loop {
+            self.token.check()?;
+            let status = self.decoder.process()?;
+            if status != DecoderStatus::NeedMoreInput {
+                yield_now().await;
+                return Ok(status);
+            }
+            if self.input_finished {
+                return Err(Error::FileTruncated);
+            }
+            self.buf.resize(READ_CHUNK_SIZE, 0);
+            let num = ReadChunk {
+                reader: &mut self.reader,
+                buf: &mut self.buf,
+            }
+            .await?;
+            self.token.check()?;
+            if num == 0 {
+                self.input_finished = true;
+                self.decoder.finish_input()?;
+            } else {
+                self.decoder.feed(&self.buf[..num])?;
+            }
+            yield_now().await;
+        }
+    }
+
+    /// Decodes everything that can be decoded, i.e. until `process` returns
+    /// `DecoderStatus::Done`.
+    pub async fn decode(&mut self) -> Result<(), Error> {
+        while self.process().await? != DecoderStatus::Done {}
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::test_util::IMAGE;
+    use std::sync::Arc;
+    use std::task::{Wake, Waker};
+    use std::thread::{self, Thread};
+
+    struct ThreadWaker(Thread);
+
+    impl Wake for ThreadWaker {
+        fn wake(self: Arc<Self>) {
+            self.0.unpark();
+        }
+    }
+
+    // Runs `future` to completion, and returns its output and how many times it was pending.
+    fn block_on<F: Future>(future: F) -> (F::Output, usize) {
+        let waker = Waker::from(Arc::new(ThreadWaker(thread::current())));
+        let mut cx = Context::from_waker(&waker);
+        let mut future = Box::pin(future);
+        let mut num_pending = 0;
+        loop {
+            match future.as_mut().poll(&mut cx) {
+                Poll::Ready(output) => return (output, num_pending),
+                Poll::Pending => {
+                    num_pending += 1;
+                    thread::park();
+                }
+            }
+        }
+    }
+
+    // Returns the data in chunks of `chunk_size` bytes, and is not ready every other call.
+    struct SlowReader<'a> {
+        data: &'a [u8],
+        chunk_size: usize,
+        ready: bool,
+    }
+
+    impl AsyncRead for SlowReader<'_> {
+        fn poll_read(
+            mut self: Pin<&mut Self>,
+            cx: &mut Context<'_>,
+            buf: &mut [u8],
+        ) -> Poll<io::Result<usize>> {
+            self.ready = !self.ready;
+            if !self.ready {
+                cx.waker().wake_by_ref();
+                return Poll::Pending;
+            }
+            let num = buf.len().min(self.chunk_size).min(self.data.len());
+            buf[..num].copy_from_slice(&self.data[..num]);
+            self.data = &self.data[num..];
+            Poll::Ready(Ok(num))
+        }
+    }
+
+    fn assert_send<T: Send>(_: &T) {}
+
+    #[test]
+    fn test_async_decode() {
+        for chunk_size in [1, 7, 100] {
+            let reader = SlowReader {
+                data: &IMAGE,
+                chunk_size,
+                ready: false,
+            };
+            let mut decoder = AsyncDecoder::new(reader);
+            let (statuses, num_pending) = block_on(async {
+                let mut statuses = vec![];
+                loop {
+                    let status = decoder.process().await.unwrap();
+                    statuses.push(status);
+                    if status == DecoderStatus::Done {
+                        return statuses;
+                    }
+                }
+            });
+            assert_eq!(
+                statuses,
+                [
+                    DecoderStatus::FileHeaders,
+                    DecoderStatus::FrameHeader,
+                    DecoderStatus::Done
+                ]
+            );
+            // Reads are pending, and the decoder also yields after each stage.
+            assert!(num_pending > statuses.len());
+            assert!(decoder.decoder().frame_header().unwrap().is_last);
+        }
+    }
+
+    #[test]
+    fn test_async_decode_slice() {
+        let mut decoder = AsyncDecoder::new(&IMAGE[..]);
+        let future = decoder.decode();
+        assert_send(&future);
+        assert!(block_on(future).0.is_ok());
+        assert!(decoder.into_decoder().frame_header().unwrap().is_last);
+    }
+
+    #[test]
+    fn test_async_truncated() {
+        let mut decoder = AsyncDecoder::new(&IMAGE[..3]);
+        assert!(matches!(
+            block_on(decoder.decode()).0,
+            Err(Error::FileTruncated)
+        ));
+    }
+
+    #[test]
+    fn test_async_cancel() {
+        let reader = SlowReader {
+            data: &IMAGE,
+            chunk_size: 1,
+            ready: false,
+        };
+        let mut decoder = AsyncDecoder::new(reader);
+        let token = decoder.cancel_token().clone();
+        let runner = decoder.runner(crate::runner::SingleThreadRunner);
+        let (res, _) = block_on(async {
+            // Cancel from another task after the first yield.
+            let cancel = async {
+                yield_now().await;
+                token.cancel();
+            };
+            let decode = decoder.decode();
+            let mut cancel = Some(Box::pin(cancel));
+            let mut decode = Box::pin(decode);
+            std::future::poll_fn(|cx| {
+                // A completed future must not be polled again.
+                if let Some(future) = cancel.as_mut() {
+                    if future.as_mut().poll(cx).is_ready() {
+                        cancel = None;
+                    }
+                }
+                decode.as_mut().poll(cx)
+            })
+            .await
+        });
+        assert!(matches!(res, Err(Error::Cancelled)));
+        assert!(matches!(runner.run(1, &|_| Ok(())), Err(Error::Cancelled)));
+    }
+}
@@ -9,9 +9,13 @@ use byteorder::{ByteOrder, LittleEndian};
 /// Reads bits from a sequence of bytes.
 pub struct BitReader<'a> {
     data: &'a [u8],
+    // Segments that follow `data`, for codestreams that are split in multiple pieces.
+    next_segments: &'a [&'a [u8]],
     bit_buf: u64,
     bits_in_buf: usize,
     total_bits_read: usize,
+    // Bits consumed past the end of the data by `consume_unchecked`.
+    overread_bits: usize,
 }
 
 pub const MAX_BITS_PER_CALL: usize = 56;
@@ -21,9 +25,38 @@ impl<'a> BitReader<'a> {
     pub fn new(data: &[u8]) -> BitReader {
         BitReader {
             data,
+            next_segments: &[],
             bit_buf: 0,
             bits_in_buf: 0,
             total_bits_read: 0,
+            overread_bits: 0,
+        }
+    }
+
+    /// Constructs a BitReader that reads the concatenation of `segments`, without copying them.
+    /// ```
+    /// # use jxl::bit_reader::BitReader;
+    /// let segments: [&[u8]; 3] = [&[0x21], &[], &[0x43, 0x05]];
+    /// let mut br = BitReader::new_segmented(&segments);
+    /// assert_eq!(br.read(4)?, 1);
+    /// assert_eq!(br.read(12)?, 0x432);
+    /// br.skip_bits(4)?;
+    /// assert_eq!(br.read(4)?, 0);
+    /// assert!(br.read(1).is_err());
+    /// # Ok::<(), jxl::error::Error>(())
+    /// ```
+    pub fn new_segmented(segments: &'a [&'a [u8]]) -> BitReader<'a> {
+        let (data, next_segments) = match segments.split_first() {
+            Some((first, rest)) => (*first, rest),
+            None => (&[][..], segments),
+        };
+        BitReader {
+            data,
+            next_segments,
+            bit_buf: 0,
+            bits_in_buf: 0,
+            total_bits_read: 0,
+            overread_bits: 0,
         }
     }
 
@@ -62,6 +95,60 @@ impl<'a> BitReader<'a> {
         Ok(ret)
     }
 
+    /// Fills the buffer, so that at least `MAX_BITS_PER_CALL` bits can be read with
+    /// `peek_unchecked` and `consume_unchecked` without refilling again. Bits past the end of
+    /// the data read as 0; use `check_overflow` to detect if any of those were consumed.
+    #[inline]
+    pub fn refill_unchecked(&mut self) {
+        self.refill();
+    }
+
+    /// Reads `num` bits from the buffer without refilling it or consuming them.
+    #[inline]
+    pub fn peek_unchecked(&self, num: usize) -> u64 {
+        debug_assert!(num <= MAX_BITS_PER_CALL);
+        self.bit_buf & ((1u64 << num) - 1)
+    }
+
+    /// Advances by `num` bits without checking that they are in the buffer. At most
+    /// `MAX_BITS_PER_CALL` bits can be consumed after each call to `refill_unchecked`.
+    #[inline]
+    pub fn consume_unchecked(&mut self, num: usize) {
+        let available = num.min(self.bits_in_buf);
+        self.bit_buf >>= num;
+        self.bits_in_buf -= available;
+        self.overread_bits += num - available;
+        self.total_bits_read += num;
+    }
+
+    /// Reads `num` bits with `peek_unchecked` and `consume_unchecked`.
+    /// ```
+    /// # use jxl::bit_reader::BitReader;
+    /// let mut br = BitReader::new(&[0x21, 0x43]);
+    /// br.refill_unchecked();
+    /// assert_eq!(br.read_unchecked(4), 1);
+    /// assert_eq!(br.read_unchecked(8), 0x32);
+    /// br.check_overflow()?;
+    /// assert_eq!(br.read_unchecked(8), 4);
+    /// assert!(br.check_overflow().is_err());
+    /// # Ok::<(), jxl::error::Error>(())
+    /// ```
+    #[inline]
+    pub fn read_unchecked(&mut self, num: usize) -> u64 {
+        let ret = self.peek_unchecked(num);
+        self.consume_unchecked(num);
+        ret
+    }
+
+    /// Returns an error if any unchecked read went past the end of the data.
+    pub fn check_overflow(&self) -> Result<(), Error> {
+        if self.overread_bits != 0 {
+            Err(Error::OutOfBounds)
+        } else {
+            Ok(())
+        }
+    }
+
     /// Returns the total number of bits that have been read or skipped.
     pub fn total_bits_read(&self) -> usize {
         self.total_bits_read
@@ -86,10 +173,16 @@ impl<'a> BitReader<'a> {
         }
         num -= self.bits_in_buf;
         self.bits_in_buf = 0;
+        self.bit_buf = 0;
+        while num >= self.data.len() * 8 && !self.next_segments.is_empty() {
+            num -= self.data.len() * 8;
+            self.next_segment();
+        }
         if num > self.data.len() * 8 {
             return Err(Error::OutOfBounds);
         }
         self.data = &self.data[num / 8..];
+        num %= 8;
         self.refill();
         if num > self.bits_in_buf {
             return Err(Error::OutOfBounds);
@@ -132,15 +225,29 @@ impl<'a> BitReader<'a> {
         }
     }
 
+    fn next_segment(&mut self) {
+        self.data = self.next_segments[0];
+        self.next_segments = &self.next_segments[1..];
+    }
+
     #[inline(never)]
     fn refill_slow(&mut self) {
         while self.bits_in_buf < 56 {
             if self.data.is_empty() {
-                return;
+                if self.next_segments.is_empty() {
+                    return;
+                }
+                self.next_segment();
+                continue;
             }
-            self.bit_buf |= (self.data[0] as u64) << self.bits_in_buf;
-            self.bits_in_buf += 8;
-            self.data = &self.data[1..];
+            // Load the last bytes of the segment through a zero-padded copy, instead of one at
+            // a time.
+            let num_bytes = self.data.len().min((63 - self.bits_in_buf) >> 3);
+            let mut tail = [0u8; 8];
+            tail[..num_bytes].copy_from_slice(&self.data[..num_bytes]);
+            self.bit_buf |= LittleEndian::read_u64(&tail) << self.bits_in_buf;
+            self.bits_in_buf += num_bytes * 8;
+            self.data = &self.data[num_bytes..];
         }
     }
 }
@@ -3,9 +3,12 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+use crate::bit_reader::BitReader;
 use crate::error::Error;
 use byteorder::{BigEndian, ByteOrder};
+use std::ops::Range;
 
+/// Codestream extracted from a file, stored in a single owned buffer.
 pub struct JxlCodestream {
     data: Vec<u8>,
     codestream_start: usize,
@@ -23,112 +26,456 @@ impl JxlCodestream {
         &self.data[self.codestream_start..self.codestream_end]
     }
     pub fn new(data: Vec<u8>) -> Result<JxlCodestream, Error> {
-        // Box-based file format.
-        if data.starts_with(&[
-            0x00, 0x00, 0x00, 0x0C, b'J', b'X', b'L', b' ', 0x0D, 0x0A, 0x87, 0x0A,
-        ]) {
-            let mut state = State::Empty;
-            let mut assembled_codestream = vec![];
-            let mut pos = 0usize;
-            loop {
-                if let State::Jxlp(_) = state {
-                    if pos >= data.len() {
-                        return Err(Error::FileTruncated);
-                    }
-                }
-                if pos + 8 >= data.len() {
-                    return Err(Error::FileTruncated);
-                }
-                let box_start = pos;
-                let mut box_size: usize = BigEndian::read_u32(&data[pos..]) as usize;
-                pos += 4;
-                let ty = &data[pos..pos + 4];
-                pos += 4;
-                if pos + 8 >= data.len() {
-                    return Err(Error::FileTruncated);
+        let segments = CodestreamSegments::new(&data)?;
+        let range = match segments.segments() {
+            // Bare codestream or single jxlc/jxlp box: no need to copy anything.
+            [segment] => {
+                let start = segments.file_offset(0);
+                Ok(start..start + segment.len())
+            }
+            segments => Err(segments.concat()),
+        };
+        Ok(match range {
+            Ok(range) => JxlCodestream {
+                data,
+                codestream_start: range.start,
+                codestream_end: range.end,
+            },
+            Err(assembled_codestream) => JxlCodestream {
+                codestream_start: 0,
+                codestream_end: assembled_codestream.len(),
+                data: assembled_codestream,
+            },
+        })
+    }
+}
+
+/// Codestream extracted from a file, as a list of slices of the file (one per jxlp box).
+/// ```
+/// # use jxl::bmff::CodestreamSegments;
+/// let segments = CodestreamSegments::new(&[0xff, 0x0a, 0x01])?;
+/// assert_eq!(segments.segments(), &[&[0xff, 0x0a, 0x01][..]]);
+/// # Ok::<(), jxl::error::Error>(())
+/// ```
+pub struct CodestreamSegments<'a> {
+    file: &'a [u8],
+    segments: Vec<&'a [u8]>,
+}
+
+impl<'a> CodestreamSegments<'a> {
+    pub fn new(data: &'a [u8]) -> Result<CodestreamSegments<'a>, Error> {
+        let (segments, parser) = CodestreamSegments::parse(data)?;
+        parser.finish()?;
+        Ok(segments)
+    }
+
+    /// Like `new`, but `data` can be just the beginning of the file; the codestream is then
+    /// truncated as well.
+    pub fn from_prefix(data: &'a [u8]) -> Result<CodestreamSegments<'a>, Error> {
+        Ok(CodestreamSegments::parse(data)?.0)
+    }
+
+    fn parse(data: &'a [u8]) -> Result<(CodestreamSegments<'a>, ContainerParser), Error> {
+        let mut parser = ContainerParser::new();
+        let mut segments = vec![];
+        parser.feed(data, |cs| {
+            if !cs.is_empty() {
+                segments.push(cs)
+            }
+        })?;
+        Ok((
+            CodestreamSegments {
+                file: data,
+                segments,
+            },
+            parser,
+        ))
+    }
+
+    /// Returns the position in the file of the byte at position `pos` in the codestream. `pos`
+    /// can be the size of the codestream.
+    pub fn file_offset(&self, mut pos: usize) -> usize {
+        let file_start = self.file.as_ptr() as usize;
+        for segment in self.segments.iter() {
+            if pos < segment.len() {
+                return segment.as_ptr() as usize - file_start + pos;
+            }
+            pos -= segment.len();
+        }
+        match self.segments.last() {
+            Some(segment) => segment.as_ptr() as usize - file_start + segment.len() + pos,
+            None => pos,
+        }
+    }
+
+    pub fn segments(&self) -> &[&'a [u8]] {
+        &self.segments
+    }
+
+    /// Total size of the codestream, in bytes.
+    pub fn len(&self) -> usize {
+        self.segments.iter().map(|s| s.len()).sum()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.segments.is_empty()
+    }
+
+    /// Returns a BitReader over the whole codestream that reads through box boundaries.
+    pub fn bit_reader(&self) -> BitReader<'_> {
+        BitReader::new_segmented(&self.segments)
+    }
+
+    /// Positions of the segments in the file.
+    pub fn segment_map(&self) -> SegmentMap {
+        let file_start = self.file.as_ptr() as usize;
+        let mut map = SegmentMap::default();
+        for segment in self.segments.iter() {
+            map.push(segment.as_ptr() as usize - file_start, segment.len());
+        }
+        map
+    }
+}
+
+/// Positions in the file of the consecutive parts of a codestream, to convert ranges of the
+/// codestream to ranges of the file. An empty map is a bare codestream.
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct SegmentMap {
+    // Position in the file and size of each part, with adjacent parts merged.
+    segments: Vec<(usize, usize)>,
+}
+
+impl SegmentMap {
+    /// Appends a part of `len` bytes of the codestream, at `file_offset` in the file.
+    pub fn push(&mut self, file_offset: usize, len: usize) {
+        if len == 0 {
+            return;
+        }
+        match self.segments.last_mut() {
+            Some((offset, size)) if *offset + *size == file_offset => *size += len,
+            _ => self.segments.push((file_offset, len)),
+        }
+    }
+
+    /// Position in the file and size of each part of the codestream.
+    pub fn segments(&self) -> &[(usize, usize)] {
+        &self.segments
+    }
+
+    /// Ranges of the file that contain `ranges` of the codestream, which must be sorted and
+    /// non-overlapping. Ranges that cross a box boundary are split, and ranges that are
+    /// adjacent in the file are merged. Bytes past the end of the map are assumed to directly
+    /// follow its last part.
+    pub fn file_ranges(&self, ranges: &[Range<usize>]) -> Vec<Range<usize>> {
+        let mut file_ranges: Vec<Range<usize>> = Vec::with_capacity(ranges.len());
+        let mut push = |range: Range<usize>| match file_ranges.last_mut() {
+            Some(last) if last.end == range.start => last.end = range.end,
+            _ => file_ranges.push(range),
+        };
+        for range in ranges {
+            // Position of the current part in the codestream.
+            let mut pos = 0;
+            let mut start = range.start;
+            for &(file_offset, len) in self.segments.iter() {
+                let end = pos + len;
+                if start < range.end && start < end {
+                    let part_end = range.end.min(end);
+                    push(file_offset + start - pos..file_offset + part_end - pos);
+                    start = part_end;
                 }
-                if box_size == 1 {
-                    let sz = BigEndian::read_u64(&data[pos..]);
-                    if sz >= usize::MAX as u64 {
-                        return Err(Error::InvalidBox);
+                pos = end;
+            }
+            if start < range.end {
+                let file_end = self.segments.last().map_or(0, |(offset, len)| offset + len);
+                push(file_end + start - pos..file_end + range.end - pos);
+            }
+        }
+        file_ranges
+    }
+}
+
+const CONTAINER_SIGNATURE: [u8; 12] = [
+    0x00, 0x00, 0x00, 0x0C, b'J', b'X', b'L', b' ', 0x0D, 0x0A, 0x87, 0x0A,
+];
+const CODESTREAM_SIGNATURE: [u8; 2] = [0xff, 0x0A];
+
+#[derive(PartialEq, Debug)]
+enum ParserState {
+    Signature,
+    BareCodestream,
+    BoxHeader,
+    // Remaining bytes in the current box, None for boxes that extend to the end of the file.
+    JxlpIndex(Option<u64>),
+    // Contents of a jxlc or of the last jxlp box.
+    LastCodestream(Option<u64>),
+    // Contents of a jxlp box, followed by more boxes.
+    PartialCodestream(Option<u64>),
+    SkipBox(Option<u64>),
+    Done,
+}
+
+/// Push-style parser for the JPEG XL container format.
+///
+/// Input can be fed in arbitrarily-sized chunks; the codestream bytes it contains are forwarded,
+/// as borrowed slices of the input, to a callback. The only data that is buffered internally are
+/// (possibly split) box headers, so memory usage does not depend on the size of the file.
+/// ```
+/// # use jxl::bmff::ContainerParser;
+/// let mut parser = ContainerParser::new();
+/// let mut codestream = vec![];
+/// parser.feed(&[0xff], |cs| codestream.extend_from_slice(cs))?;
+/// parser.feed(&[0x0a, 0x00], |cs| codestream.extend_from_slice(cs))?;
+/// parser.finish()?;
+/// assert_eq!(codestream, vec![0xff, 0x0a, 0x00]);
+/// # Ok::<(), jxl::error::Error>(())
+/// ```
+pub struct ContainerParser {
+    state: ParserState,
+    header: Vec<u8>,
+    jxlp: State,
+    // Number of bytes of the file fed so far.
+    bytes_fed: usize,
+}
+
+impl Default for ContainerParser {
+    fn default() -> ContainerParser {
+        ContainerParser::new()
+    }
+}
+
+impl ContainerParser {
+    pub fn new() -> ContainerParser {
+        ContainerParser {
+            state: ParserState::Signature,
+            header: Vec::with_capacity(16),
+            jxlp: State::Empty,
+            bytes_fed: 0,
+        }
+    }
+
+    /// Returns true once the end of the codestream has been found. Any further input is ignored.
+    pub fn is_done(&self) -> bool {
+        self.state == ParserState::Done
+    }
+
+    /// Moves bytes from `data` into the header buffer until it contains `len` bytes.
+    /// Returns true if enough bytes are available.
+    fn fill_header(&mut self, data: &mut &[u8], len: usize) -> bool {
+        let needed = len.saturating_sub(self.header.len()).min(data.len());
+        self.header.extend_from_slice(&data[..needed]);
+        *data = &data[needed..];
+        self.header.len() >= len
+    }
+
+    /// Processes the next chunk of the file. `codestream` is called with every piece of
+    /// codestream found in `data`, in order.
+    pub fn feed<'a, F>(&mut self, data: &'a [u8], mut codestream: F) -> Result<(), Error>
+    where
+        F: FnMut(&'a [u8]),
+    {
+        self.feed_with_offsets(data, |_, cs| codestream(cs))
+    }
+
+    /// Same as `feed`, but `codestream` is also given the position of each piece in the file.
+    pub fn feed_with_offsets<'a, F>(
+        &mut self,
+        mut data: &'a [u8],
+        mut codestream: F,
+    ) -> Result<(), Error>
+    where
+        F: FnMut(usize, &'a [u8]),
+    {
+        let chunk_start = self.bytes_fed;
+        let chunk = data.as_ptr() as usize;
+        self.bytes_fed += data.len();
+        let file_offset = |data: &[u8]| chunk_start + (data.as_ptr() as usize - chunk);
+        while !data.is_empty() {
+            match self.state {
+                ParserState::Signature => {
+                    if self.header.is_empty() && data.starts_with(&CODESTREAM_SIGNATURE) {
+                        // Avoid splitting the codestream if the signature is not split.
+                        self.state = ParserState::BareCodestream;
+                        continue;
                     }
-                    box_size = sz as usize;
-                    pos += 8;
-                }
-                if box_start + box_size > data.len() {
-                    return Err(Error::FileTruncated);
+                    if !self.fill_header(&mut data, CODESTREAM_SIGNATURE.len()) {
+                        continue;
+                    }
+                    if self.header.starts_with(&CODESTREAM_SIGNATURE) {
+                        codestream(0, &CODESTREAM_SIGNATURE);
+                        self.header.clear();
+                        self.state = ParserState::BareCodestream;
+                        continue;
+                    }
+                    if !self.fill_header(&mut data, CONTAINER_SIGNATURE.len()) {
+                        continue;
+                    }
+                    if self.header[..] != CONTAINER_SIGNATURE {
+                        return Err(Error::InvalidSignature(self.header[0], self.header[1]));
+                    }
+                    self.header.clear();
+                    self.state = ParserState::BoxHeader;
                 }
-                let eof_box = box_size == 0;
-                if box_size == 0 {
-                    box_size = data.len() - box_start;
+                ParserState::BareCodestream => {
+                    codestream(file_offset(data), data);
+                    data = &[];
                 }
-                let mut handle_jxlp =
-                    |jxlp_idx: Option<usize>| -> Result<Option<JxlCodestream>, Error> {
-                        if box_size <= 4 {
-                            return Err(Error::InvalidBox);
-                        }
-                        let jxlp_count_and_last = BigEndian::read_u32(&data[pos..]);
-                        pos += 4;
-                        let jxlp_count = jxlp_count_and_last & ((1u32 << 31) - 1);
-                        if jxlp_count as usize != jxlp_idx.map_or_else(|| 0, |x| x + 1) {
-                            return Err(Error::InvalidBox);
+                ParserState::BoxHeader => {
+                    if !self.fill_header(&mut data, 8) {
+                        continue;
+                    }
+                    let mut box_size = BigEndian::read_u32(&self.header[..]) as u64;
+                    let mut header_size = 8;
+                    if box_size == 1 {
+                        if !self.fill_header(&mut data, 16) {
+                            continue;
                         }
-                        let jxlp_is_last = jxlp_count_and_last >= (1u32 << 31);
-                        if eof_box && !jxlp_is_last {
+                        box_size = BigEndian::read_u64(&self.header[8..]);
+                        header_size = 16;
+                    }
+                    let remaining = match box_size {
+                        0 => None,
+                        sz if sz < header_size => return Err(Error::InvalidBox),
+                        sz => Some(sz - header_size),
+                    };
+                    self.state = match (&self.header[4..8], &self.jxlp) {
+                        (b"jxlc", State::Empty) => ParserState::LastCodestream(remaining),
+                        (b"jxlc", State::Jxlp(_)) => {
+                            // Can't mix jxlp and jxlc.
                             return Err(Error::InvalidBox);
                         }
-                        assembled_codestream.extend_from_slice(&data[pos..box_size + box_start]);
-                        if !jxlp_is_last {
-                            Ok(None)
-                        } else {
-                            let mut cs = vec![];
-                            std::mem::swap(&mut cs, &mut assembled_codestream);
-                            let len = cs.len();
-                            Ok(Some(JxlCodestream {
-                                data: cs,
-                                codestream_start: 0,
-                                codestream_end: len,
-                            }))
-                        }
+                        (b"jxlp", _) => ParserState::JxlpIndex(remaining),
+                        _ => ParserState::SkipBox(remaining),
                     };
-                println!("{:?}", std::str::from_utf8(ty));
-                match (ty, &state) {
-                    (b"jxlc", State::Empty) => {
-                        break Ok(JxlCodestream {
-                            data,
-                            codestream_start: pos,
-                            codestream_end: box_size + box_start,
-                        });
+                    self.header.clear();
+                }
+                ParserState::JxlpIndex(remaining) => {
+                    if matches!(remaining, Some(r) if r < 4) {
+                        return Err(Error::InvalidBox);
+                    }
+                    if !self.fill_header(&mut data, 4) {
+                        continue;
                     }
-                    (b"jxlc", State::Jxlp(_)) => {
-                        // Can't mix jxlp and jxlc.
+                    let jxlp_count_and_last = BigEndian::read_u32(&self.header[..]);
+                    let jxlp_count = jxlp_count_and_last & ((1u32 << 31) - 1);
+                    let expected = match self.jxlp {
+                        State::Empty => 0,
+                        State::Jxlp(idx) => idx + 1,
+                    };
+                    if jxlp_count as usize != expected {
                         return Err(Error::InvalidBox);
                     }
-                    (b"jxlp", State::Empty) => {
-                        if let Some(cs) = handle_jxlp(None)? {
-                            break Ok(cs);
-                        }
-                        state = State::Jxlp(0);
+                    let jxlp_is_last = jxlp_count_and_last >= (1u32 << 31);
+                    if remaining.is_none() && !jxlp_is_last {
+                        return Err(Error::InvalidBox);
                     }
-                    (b"jxlp", &State::Jxlp(idx)) => {
-                        if let Some(cs) = handle_jxlp(Some(idx))? {
-                            break Ok(cs);
-                        }
-                        state = State::Jxlp(idx + 1);
+                    self.jxlp = State::Jxlp(expected);
+                    self.header.clear();
+                    let remaining = remaining.map(|r| r - 4);
+                    self.state = if jxlp_is_last {
+                        ParserState::LastCodestream(remaining)
+                    } else {
+                        ParserState::PartialCodestream(remaining)
+                    };
+                }
+                ParserState::LastCodestream(remaining)
+                | ParserState::PartialCodestream(remaining)
+                | ParserState::SkipBox(remaining) => {
+                    let available = match remaining {
+                        Some(r) if r < data.len() as u64 => r as usize,
+                        _ => data.len(),
+                    };
+                    if !matches!(self.state, ParserState::SkipBox(_)) {
+                        codestream(file_offset(data), &data[..available]);
                     }
-                    _ => {}
+                    data = &data[available..];
+                    let remaining = remaining.map(|r| r - available as u64);
+                    self.state = match (&self.state, remaining) {
+                        (ParserState::LastCodestream(_), Some(0)) => ParserState::Done,
+                        (_, Some(0)) => ParserState::BoxHeader,
+                        (ParserState::LastCodestream(_), r) => ParserState::LastCodestream(r),
+                        (ParserState::PartialCodestream(_), r) => ParserState::PartialCodestream(r),
+                        (_, r) => ParserState::SkipBox(r),
+                    };
+                }
+                ParserState::Done => {
+                    data = &[];
                 }
-                pos = box_size + box_start;
             }
-        } else if data.starts_with(&[0xff, 0x0A]) {
-            let codestream_end = data.len();
-            Ok(JxlCodestream {
-                data,
-                codestream_start: 0usize,
-                codestream_end,
-            })
-        } else {
-            Err(Error::InvalidSignature(data[0], data[1]))
         }
+        Ok(())
+    }
+
+    /// Signals the end of the input.
+    pub fn finish(&self) -> Result<(), Error> {
+        match self.state {
+            ParserState::BareCodestream | ParserState::Done => Ok(()),
+            ParserState::LastCodestream(None) | ParserState::LastCodestream(Some(0)) => Ok(()),
+            _ => Err(Error::FileTruncated),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn jxlp_box(index: u32, is_last: bool, payload: &[u8]) -> Vec<u8> {
+        let mut b = (payload.len() as u32 + 12).to_be_bytes().to_vec();
+        b.extend_from_slice(b"jxlp");
+        b.extend_from_slice(&(index | ((is_last as u32) << 31)).to_be_bytes());
+        b.extend_from_slice(payload);
+        b
+    }
+
+    #[test]
+    fn test_jxlp_segments() -> Result<(), Error> {
+        let mut file = CONTAINER_SIGNATURE.to_vec();
+        file.extend(jxlp_box(0, false, &[0xff, 0x0a, 0x34]));
+        file.extend_from_slice(&[0, 0, 0, 9, b'x', b'm', b'l', b' ', 0]);
+        file.extend(jxlp_box(1, false, &[]));
+        file.extend(jxlp_box(2, true, &[0x12, 0xab]));
+        let segments = CodestreamSegments::new(&file)?;
+        assert_eq!(segments.segments().len(), 2);
+        assert_eq!(segments.len(), 5);
+        let mut br = segments.bit_reader();
+        assert_eq!(br.read(24)?, 0x340aff);
+        assert_eq!(br.read(16)?, 0xab12);
+        assert!(br.read(1).is_err());
+        assert_eq!(
+            JxlCodestream::new(file.clone())?.get(),
+            &[0xff, 0x0a, 0x34, 0x12, 0xab]
+        );
+        Ok(())
+    }
+
+    #[test]
+    fn test_segment_map() -> Result<(), Error> {
+        let mut file = CONTAINER_SIGNATURE.to_vec();
+        file.extend(jxlp_box(0, false, &[0xff, 0x0a, 0x34]));
+        file.extend(jxlp_box(1, true, &[0x12, 0xab]));
+        let map = CodestreamSegments::new(&file)?.segment_map();
+        assert_eq!(map.segments(), [(24, 3), (39, 2)]);
+        assert_eq!(map.file_ranges(&[0..1, 2..4]), [24..25, 26..27, 39..40]);
+        assert_eq!(map.file_ranges(&[0..1, 1..2, 3..4]), [24..26, 39..40]);
+        assert_eq!(map.file_ranges(&[3..5, 6..8]), [39..41, 42..44]);
+        assert_eq!(
+            SegmentMap::default().file_ranges(&[1..3, 5..6]),
+            [1..3, 5..6]
+        );
+
+        let mut map = SegmentMap::default();
+        map.push(0, 2);
+        map.push(2, 3);
+        map.push(9, 0);
+        assert_eq!(map.segments(), [(0, 5)]);
+        Ok(())
+    }
+
+    #[test]
+    fn test_jxlp_wrong_index() {
+        let mut file = CONTAINER_SIGNATURE.to_vec();
+        file.extend(jxlp_box(0, false, &[0xff, 0x0a]));
+        file.extend(jxlp_box(2, true, &[0x12]));
+        assert!(CodestreamSegments::new(&file).is_err());
     }
 }
@@ -0,0 +1,212 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#![allow(clippy::excessive_precision)]
+
+use std::f32::consts::{LN_2, LOG2_E};
+
+use crate::error::Error;
+use crate::headers::color_encoding::{CustomTransferFunction, TransferFunction};
+
+/// Transfer function that encodes linear samples, where 1.0 is the intensity target, into the
+/// output color encoding.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum OutputTransfer {
+    Linear,
+    Srgb,
+    Bt709,
+    /// PQ, with linear samples first scaled to nits / 10000.
+    Pq {
+        scale: f32,
+    },
+    /// HLG OETF, without the OOTF.
+    Hlg,
+    Dci,
+    /// `linear^gamma`.
+    Gamma(f32),
+}
+
+impl OutputTransfer {
+    pub fn new(
+        tf: &CustomTransferFunction,
+        intensity_target: f32,
+    ) -> Result<OutputTransfer, Error> {
+        if tf.have_gamma {
+            return Ok(OutputTransfer::Gamma(tf.gamma()));
+        }
+        Ok(match tf.transfer_function {
+            TransferFunction::Linear => OutputTransfer::Linear,
+            TransferFunction::SRGB => OutputTransfer::Srgb,
+            TransferFunction::BT709 => OutputTransfer::Bt709,
+            TransferFunction::PQ => OutputTransfer::Pq {
+                scale: intensity_target / 10000.0,
+            },
+            TransferFunction::HLG => OutputTransfer::Hlg,
+            TransferFunction::DCI => OutputTransfer::Dci,
+            TransferFunction::Unknown => return Err(Error::InvalidColorEncoding),
+        })
+    }
+
+    /// Applies the transfer function to a linear sample. Negative samples (out of gamut) are
+    /// mirrored, and the powers are approximated with a relative error below 1e-5, so that
+    /// loops over rows vectorize.
+    #[inline(always)]
+    pub fn apply(&self, linear: f32) -> f32 {
+        let v = linear.abs();
+        let encoded = match *self {
+            OutputTransfer::Linear => v,
+            OutputTransfer::Srgb => {
+                if v <= 0.0031308 {
+                    v * 12.92
+                } else {
+                    1.055 * pow(v, 1.0 / 2.4) - 0.055
+                }
+            }
+            OutputTransfer::Bt709 => {
+                if v < 0.018 {
+                    v * 4.5
+                } else {
+                    1.099 * pow(v, 0.45) - 0.099
+                }
+            }
+            OutputTransfer::Pq { scale } => {
+                const M1: f32 = 2610.0 / 16384.0;
+                const M2: f32 = 2523.0 / 4096.0 * 128.0;
+                const C1: f32 = 3424.0 / 4096.0;
+                const C2: f32 = 2413.0 / 4096.0 * 32.0;
+                const C3: f32 = 2392.0 / 4096.0 * 32.0;
+                let y = pow(v * scale, M1);
+                pow((C1 + C2 * y) / (1.0 + C3 * y), M2)
+            }
+            OutputTransfer::Hlg => {
+                const A: f32 = 0.17883277;
+                const B: f32 = 0.28466892;
+                const C: f32 = 0.55991073;
+                if v <= 1.0 / 12.0 {
+                    (3.0 * v).sqrt()
+                } else {
+                    A * log2(12.0 * v - B) * LN_2 + C
+                }
+            }
+            OutputTransfer::Dci => pow(v, 1.0 / 2.6),
+            OutputTransfer::Gamma(gamma) => pow(v, gamma),
+        };
+        encoded.copysign(linear)
+    }
+}
+
+/// `log2(x)` for positive normal `x`.
+#[inline(always)]
+fn log2(x: f32) -> f32 {
+    // x = m * 2^e with m in [sqrt(1/2), sqrt(2)), and log(m) = 2 atanh(t) with t = (m-1)/(m+1).
+    let bits = x.to_bits() as i32;
+    let bits_minus_sqrt_half = bits - 0x3f35_04f3;
+    let e = bits_minus_sqrt_half >> 23;
+    let m = f32::from_bits((bits - (e << 23)) as u32);
+    let t = (m - 1.0) / (m + 1.0);
+    let t2 = t * t;
+    let series = 1.0 + t2 * (1.0 / 3.0 + t2 * (1.0 / 5.0 + t2 * (1.0 / 7.0)));
+    e as f32 + 2.0 * LOG2_E * t * series
+}
+
+/// `2^x` for `x` in [-126, 127].
+#[inline(always)]
+fn exp2(x: f32) -> f32 {
+    let x = x.clamp(-126.0, 127.0);
+    let i = (x + 0.5).floor();
+    let f = (x - i) * LN_2;
+    // e^f for f in [-ln(2) / 2, ln(2) / 2].
+    let p = 1.0
+        + f * (1.0
+            + f * (1.0 / 2.0
+                + f * (1.0 / 6.0 + f * (1.0 / 24.0 + f * (1.0 / 120.0 + f * (1.0 / 720.0))))));
+    p * f32::from_bits((((i as i32) + 127) << 23) as u32)
+}
+
+/// `x^y` for non-negative `x`; 0 for `x` below the normal range.
+#[inline(always)]
+fn pow(x: f32, y: f32) -> f32 {
+    if x < f32::MIN_POSITIVE {
+        0.0
+    } else {
+        exp2(log2(x) * y)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn reference(tf: OutputTransfer, v: f64) -> f64 {
+        match tf {
+            OutputTransfer::Linear => v,
+            OutputTransfer::Srgb if v <= 0.0031308f32 as f64 => v * 12.92,
+            OutputTransfer::Srgb => 1.055 * v.powf(1.0 / 2.4) - 0.055,
+            OutputTransfer::Bt709 if v < 0.018f32 as f64 => v * 4.5,
+            OutputTransfer::Bt709 => 1.099 * v.powf(0.45) - 0.099,
+            OutputTransfer::Pq { scale } => {
+                let (m1, m2) = (2610.0 / 16384.0, 2523.0 / 4096.0 * 128.0);
+                let (c1, c2, c3) = (
+                    3424.0 / 4096.0,
+                    2413.0 / 4096.0 * 32.0,
+                    2392.0 / 4096.0 * 32.0,
+                );
+                let y = (v * scale as f64).powf(m1);
+                ((c1 + c2 * y) / (1.0 + c3 * y)).powf(m2)
+            }
+            OutputTransfer::Hlg if v <= (1.0f32 / 12.0) as f64 => (3.0 * v).sqrt(),
+            OutputTransfer::Hlg => 0.17883277 * (12.0 * v - 0.28466892).ln() + 0.55991073,
+            OutputTransfer::Dci => v.powf(1.0 / 2.6),
+            OutputTransfer::Gamma(gamma) => v.powf(gamma as f64),
+        }
+    }
+
+    #[test]
+    fn test_transfer_functions() {
+        let tfs = [
+            OutputTransfer::Linear,
+            OutputTransfer::Srgb,
+            OutputTransfer::Bt709,
+            OutputTransfer::Pq { scale: 0.0255 },
+            OutputTransfer::Hlg,
+            OutputTransfer::Dci,
+            OutputTransfer::Gamma(1.0 / 2.2),
+        ];
+        for tf in tfs.iter().copied() {
+            for i in 0..=1000 {
+                let v = i as f32 / 1000.0;
+                let expected = reference(tf, v as f64);
+                let got = tf.apply(v) as f64;
+                assert!(
+                    (got - expected).abs() <= 1e-5,
+                    "{:?} {} {} {}",
+                    tf,
+                    v,
+                    got,
+                    expected
+                );
+                assert_eq!(tf.apply(-v), -tf.apply(v));
+            }
+        }
+    }
+
+    #[test]
+    fn test_pow() {
+        for i in 1..1000 {
+            let x = i as f32 * 0.37;
+            for y in [0.1f32, 0.5, 1.0, 2.4].iter() {
+                let expected = (x as f64).powf(*y as f64);
+                let got = pow(x, *y) as f64;
+                assert!(
+                    (got - expected).abs() <= 1e-5 * expected,
+                    "{} {} {}",
+                    x,
+                    y,
+                    got
+                );
+            }
+        }
+    }
+}
@@ -0,0 +1,164 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use crate::color::tf::OutputTransfer;
+use crate::error::Error;
+use crate::headers::color_encoding::ColorEncoding;
+use crate::headers::transform_data::OpsinInverseMatrix;
+use crate::simd::simd_function;
+
+/// Intensity target that the inverse opsin matrix maps to 1.0.
+const DEFAULT_INTENSITY_TARGET: f32 = 255.0;
+
+/// Converts rows of XYB samples to the output color encoding in a single pass: XYB to LMS
+/// mixed values, LMS to linear RGB with the inverse opsin matrix, then the transfer function.
+#[derive(Debug, Clone)]
+pub struct XybToRgb {
+    /// Row major, scaled so that 1.0 is the intensity target.
+    matrix: [f32; 9],
+    biases: [f32; 3],
+    biases_cbrt: [f32; 3],
+    transfer: OutputTransfer,
+}
+
+impl XybToRgb {
+    /// Precomputes the constants of the conversion; this is done once per frame.
+    pub fn new(
+        opsin: &OpsinInverseMatrix,
+        intensity_target: f32,
+        output: &ColorEncoding,
+    ) -> Result<XybToRgb, Error> {
+        if output.want_icc {
+            return Err(Error::InvalidColorEncoding);
+        }
+        let mut matrix = opsin.inverse_matrix;
+        let scale = DEFAULT_INTENSITY_TARGET / intensity_target;
+        matrix.iter_mut().for_each(|v| *v *= scale);
+        Ok(XybToRgb {
+            matrix,
+            biases: opsin.opsin_biases,
+            biases_cbrt: [
+                opsin.opsin_biases[0].cbrt(),
+                opsin.opsin_biases[1].cbrt(),
+                opsin.opsin_biases[2].cbrt(),
+            ],
+            transfer: OutputTransfer::new(&output.tf, intensity_target)?,
+        })
+    }
+
+    /// Converts the planar rows `x`, `y`, `b` in place into the rows of the red, green and
+    /// blue channels of the output. They must have the same length.
+    pub fn convert_rows(&self, x: &mut [f32], y: &mut [f32], b: &mut [f32]) {
+        assert!(x.len() == y.len() && x.len() == b.len());
+        convert_rows_kernel(self, x, y, b);
+    }
+}
+
+simd_function!(
+    fn convert_rows_kernel(xyb: &XybToRgb, x: &mut [f32], y: &mut [f32], b: &mut [f32]) {
+        // One loop per transfer function, so that the inner loops do not branch on it.
+        match xyb.transfer {
+            OutputTransfer::Linear => convert(xyb, x, y, b, |v| v),
+            OutputTransfer::Srgb => convert(xyb, x, y, b, |v| OutputTransfer::Srgb.apply(v)),
+            OutputTransfer::Bt709 => convert(xyb, x, y, b, |v| OutputTransfer::Bt709.apply(v)),
+            OutputTransfer::Pq { scale } => {
+                convert(xyb, x, y, b, |v| OutputTransfer::Pq { scale }.apply(v))
+            }
+            OutputTransfer::Hlg => convert(xyb, x, y, b, |v| OutputTransfer::Hlg.apply(v)),
+            OutputTransfer::Dci => convert(xyb, x, y, b, |v| OutputTransfer::Dci.apply(v)),
+            OutputTransfer::Gamma(gamma) => {
+                convert(xyb, x, y, b, |v| OutputTransfer::Gamma(gamma).apply(v))
+            }
+        }
+    }
+);
+
+#[inline(always)]
+fn convert(
+    xyb: &XybToRgb,
+    x: &mut [f32],
+    y: &mut [f32],
+    b: &mut [f32],
+    transfer: impl Fn(f32) -> f32,
+) {
+    let m = &xyb.matrix;
+    let mix = |gamma: f32, c: usize| {
+        let v = gamma + xyb.biases_cbrt[c];
+        v * v * v - xyb.biases[c]
+    };
+    for ((x, y), b) in x.iter_mut().zip(y.iter_mut()).zip(b.iter_mut()) {
+        let l = mix(*y + *x, 0);
+        let m_ = mix(*y - *x, 1);
+        let s = mix(*b, 2);
+        *x = transfer(m[0] * l + m[1] * m_ + m[2] * s);
+        *y = transfer(m[3] * l + m[4] * m_ + m[5] * s);
+        *b = transfer(m[6] * l + m[7] * m_ + m[8] * s);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::headers::color_encoding::TransferFunction;
+
+    fn encoding(tf: TransferFunction) -> ColorEncoding {
+        let mut encoding = ColorEncoding::default();
+        encoding.tf.transfer_function = tf;
+        encoding
+    }
+
+    #[test]
+    fn test_gray() {
+        let opsin = OpsinInverseMatrix::default();
+        let xyb = XybToRgb::new(&opsin, 255.0, &encoding(TransferFunction::Linear)).unwrap();
+        let mut y: Vec<f32> = (0..50).map(|i| i as f32 / 60.0).collect();
+        let mut x = vec![0.0; y.len()];
+        let mut b = y.clone();
+        let expected: Vec<f32> = y
+            .iter()
+            .map(|y| {
+                let bias = opsin.opsin_biases[0];
+                (y + bias.cbrt()).powi(3) - bias
+            })
+            .collect();
+        xyb.convert_rows(&mut x, &mut y, &mut b);
+        for (i, e) in expected.iter().enumerate() {
+            assert!((x[i] - e).abs() < 1e-4, "{} {} {}", i, x[i], e);
+            assert!((y[i] - e).abs() < 1e-4 && (b[i] - e).abs() < 1e-4);
+        }
+    }
+
+    #[test]
+    fn test_fused_transfer() {
+        let opsin = OpsinInverseMatrix::default();
+        let linear = XybToRgb::new(&opsin, 255.0, &encoding(TransferFunction::Linear)).unwrap();
+        for tf in [TransferFunction::SRGB, TransferFunction::PQ]
+            .iter()
+            .copied()
+        {
+            let xyb = XybToRgb::new(&opsin, 255.0, &encoding(tf)).unwrap();
+            let transfer = OutputTransfer::new(&encoding(tf).tf, 255.0).unwrap();
+            let row = |offset: f32| -> Vec<f32> {
+                (0..37)
+                    .map(|i| offset + i as f32 / 80.0)
+                    .collect::<Vec<_>>()
+            };
+            let (mut x, mut y, mut b) = (row(-0.01), row(0.1), row(0.05));
+            let (mut lx, mut ly, mut lb) = (x.clone(), y.clone(), b.clone());
+            xyb.convert_rows(&mut x, &mut y, &mut b);
+            linear.convert_rows(&mut lx, &mut ly, &mut lb);
+            for (got, lin) in x
+                .iter()
+                .chain(&y)
+                .chain(&b)
+                .zip(lx.iter().chain(&ly).chain(&lb))
+            {
+                assert!((got - transfer.apply(*lin)).abs() < 1e-6);
+            }
+        }
+        let unknown = encoding(TransferFunction::Unknown);
+        assert!(XybToRgb::new(&opsin, 255.0, &unknown).is_err());
+    }
+}
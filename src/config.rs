@@ -0,0 +1,123 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use crate::entropy_coding::decode::HistogramsCache;
+use crate::entropy_coding::scratch::EntropyScratch;
+use crate::frame::budget::DecodeLimits;
+use crate::headers::frame_header::PassLimit;
+use crate::headers::transform_data::{
+    CustomTransformData, DEFAULT_KERN_2, DEFAULT_KERN_4, DEFAULT_KERN_8,
+};
+use crate::render::pipeline::{StripBuffers, DEFAULT_STRIP_HEIGHT, DEFAULT_TILE_WIDTH};
+use crate::render::stages::UpsampleKernels;
+use crate::var_dct::idct::{TransformScratch, TransformTables};
+
+/// Options and precomputed tables that do not depend on the file being decoded. It is never
+/// modified, so a single configuration (e.g. in an `Arc`) can be shared by all the threads that
+/// decode files.
+#[derive(Debug, Clone)]
+pub struct DecoderConfig {
+    /// How much of progressive frames to decode.
+    pub pass_limit: PassLimit,
+    /// Size of the tiles of the render pipeline, see `RenderPipeline::with_strip_size`.
+    pub tile_width: usize,
+    pub strip_height: usize,
+    /// Files that exceed these limits are rejected as soon as their headers are read.
+    pub limits: DecodeLimits,
+    transform_tables: TransformTables,
+    /// Kernels for the default weights, for upsampling 2, 4 and 8 times.
+    default_upsampling: [UpsampleKernels; 3],
+}
+
+impl Default for DecoderConfig {
+    fn default() -> DecoderConfig {
+        DecoderConfig {
+            pass_limit: PassLimit::All,
+            tile_width: DEFAULT_TILE_WIDTH,
+            strip_height: DEFAULT_STRIP_HEIGHT,
+            limits: DecodeLimits::unlimited(),
+            transform_tables: TransformTables::default(),
+            default_upsampling: [
+                UpsampleKernels::new(2, &DEFAULT_KERN_2),
+                UpsampleKernels::new(4, &DEFAULT_KERN_4),
+                UpsampleKernels::new(8, &DEFAULT_KERN_8),
+            ],
+        }
+    }
+}
+
+impl DecoderConfig {
+    pub fn new() -> DecoderConfig {
+        DecoderConfig::default()
+    }
+
+    /// Upsampling kernels for `factor` with the weights of `transform_data`; they are only
+    /// computed if the weights are not the default ones.
+    pub fn upsampling_kernels(
+        &self,
+        factor: u32,
+        transform_data: &CustomTransformData,
+    ) -> UpsampleKernels {
+        if transform_data.has_custom_upsampling_weights(factor) {
+            UpsampleKernels::new(factor, transform_data.upsampling_weights(factor))
+        } else {
+            self.default_upsampling[factor.trailing_zeros() as usize - 1].clone()
+        }
+    }
+
+    /// Creates the state for decoding files with this configuration on one thread.
+    pub fn new_state(&self) -> DecodeState {
+        DecodeState {
+            entropy: EntropyScratch::new(),
+            histograms: HistogramsCache::new(),
+            transform: TransformScratch::with_tables(self.transform_tables.clone()),
+            strips: vec![],
+        }
+    }
+}
+
+/// Buffers used while decoding a file, which can be reused for the next files decoded on the
+/// same thread, so that decoding small images does not spend its time allocating. Each thread
+/// needs its own.
+#[derive(Debug, Default)]
+pub struct DecodeState {
+    pub entropy: EntropyScratch,
+    /// Histograms of the files decoded with a content hash, see `JxlDecoder::set_content_hash`.
+    pub histograms: HistogramsCache,
+    pub transform: TransformScratch,
+    /// Buffers for `RenderPipeline::render_with_buffers`.
+    pub strips: Vec<StripBuffers>,
+}
+
+impl DecodeState {
+    /// Releases the buffers, e.g. after decoding an unusually large file.
+    pub fn clear(&mut self) {
+        self.entropy.clear();
+        self.histograms.clear();
+        self.strips.clear();
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn assert_send_sync<T: Send + Sync>() {}
+
+    #[test]
+    fn test_shared_config() {
+        assert_send_sync::<DecoderConfig>();
+        let config = DecoderConfig::new();
+        let transform_data = CustomTransformData::default();
+        for factor in [2, 4, 8] {
+            let kernels = config.upsampling_kernels(factor, &transform_data);
+            assert_eq!(kernels.factor(), factor);
+            assert_eq!(
+                kernels,
+                UpsampleKernels::new(factor, transform_data.upsampling_weights(factor))
+            );
+        }
+    }
+}
@@ -0,0 +1,857 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use crate::bit_reader::BitReader;
+use crate::bmff::{CodestreamSegments, ContainerParser, SegmentMap};
+use crate::config::{DecodeState, DecoderConfig};
+use crate::error::Error;
+use crate::frame::budget::DecodeCost;
+use crate::frame::toc::{FrameIndex, Toc};
+use crate::headers::frame_header::{PassLimit, Rect};
+use crate::headers::{
+    encodings::UnconditionalCoder,
+    frame_header::{FrameHeader, FrameHeaderNonserialized},
+    FileHeaders, JxlHeader,
+};
+use crate::icc::{read_encoded_icc_cached, read_encoded_icc_with_scratch, skip_icc};
+use crate::stats::{DecodeStats, StatsCollector};
+use crate::trace::StageTrace;
+use std::ops::Range;
+use std::sync::Arc;
+
+pub(crate) fn read_file_headers(br: &mut BitReader) -> Result<FileHeaders, Error> {
+    let stage = StageTrace::start("file_headers", br);
+    let file_headers = FileHeaders::read(br)?;
+    stage.note(|| {
+        format!(
+            "{}x{}, icc: {}",
+            file_headers.size.xsize(),
+            file_headers.size.ysize(),
+            file_headers.image_metadata.color_encoding.want_icc
+        )
+    });
+    stage.finish(br);
+    Ok(file_headers)
+}
+
+fn read_frame_header(
+    br: &mut BitReader,
+    nonserialized: &FrameHeaderNonserialized,
+) -> Result<FrameHeader, Error> {
+    let stage = StageTrace::start("frame_header", br);
+    let frame_header = FrameHeader::read_unconditional(&(), br, nonserialized)?;
+    stage.finish(br);
+    Ok(frame_header)
+}
+
+/// Reads a frame header and the TOC that follows it.
+pub(crate) fn read_frame_header_and_toc(
+    br: &mut BitReader,
+    nonserialized: &FrameHeaderNonserialized,
+) -> Result<(FrameHeader, Toc), Error> {
+    let frame_header = read_frame_header(br, nonserialized)?;
+    let dimensions = frame_header.dimensions(nonserialized.img_width, nonserialized.img_height);
+    let toc = Toc::read(br, dimensions)?;
+    Ok((frame_header, toc))
+}
+
+/// Skips the preview frame, if the image has one; it comes right after the file headers and the
+/// ICC profile.
+pub(crate) fn skip_preview_frame(
+    br: &mut BitReader,
+    file_headers: &FileHeaders,
+) -> Result<(), Error> {
+    if let Some(nonserialized) = FrameHeaderNonserialized::for_preview(file_headers) {
+        let (_, toc) = read_frame_header_and_toc(br, &nonserialized)?;
+        br.skip_bits(toc.total_size() * 8)?;
+    }
+    Ok(())
+}
+
+/// Codestream bytes that have been received but not fully parsed yet.
+struct CodestreamBuffer {
+    data: Vec<u8>,
+    // Number of bits of data[0] that have already been consumed.
+    bit_offset: usize,
+    // Number of bytes of the codestream that were dropped from the front of data.
+    bytes_dropped: usize,
+    input_finished: bool,
+    // Length that data must reach before parsing is retried, after it ran out of data: more
+    // than it was, and at least up to where the failed attempt read (e.g. the end of a skipped
+    // section), so that a large section fed in small chunks is not parsed again for every chunk.
+    retry_len: usize,
+    // Position of the codestream received so far in the file.
+    segments: SegmentMap,
+}
+
+enum Input<'a> {
+    // Input is pushed by the caller, and copied in the buffer until it has been parsed.
+    Buffered(ContainerParser, CodestreamBuffer),
+    // The whole file is available (for example, memory mapped) and is never copied.
+    Borrowed {
+        segments: CodestreamSegments<'a>,
+        bits_read: usize,
+    },
+}
+
+impl<'a> Input<'a> {
+    /// Runs `f` on the data that has not been parsed yet. If `f` succeeds, the bits it read are
+    /// marked as parsed (and dropped from the buffer, if any); if it runs out of data, parsing
+    /// can be retried from the same position once more data is available, and `Ok(None)` is
+    /// returned. `f` is not run again until there is at least as much data as the failed
+    /// attempt was known to need.
+    fn try_read<T, F>(&mut self, f: F) -> Result<Option<T>, Error>
+    where
+        F: FnOnce(&mut BitReader) -> Result<T, Error>,
+    {
+        match self {
+            Input::Buffered(_, buffer) => {
+                if buffer.data.len() < buffer.retry_len && !buffer.input_finished {
+                    return Ok(None);
+                }
+                let mut br = BitReader::new(&buffer.data);
+                let res = br.skip_bits(buffer.bit_offset).and_then(|_| f(&mut br));
+                match res {
+                    Ok(v) => {
+                        let bits = br.total_bits_read();
+                        buffer.data.drain(..bits / 8);
+                        buffer.bytes_dropped += bits / 8;
+                        buffer.bit_offset = bits % 8;
+                        buffer.retry_len = 0;
+                        Ok(Some(v))
+                    }
+                    Err(Error::OutOfBounds) if !buffer.input_finished => {
+                        let needed = br.total_bits_read().div_ceil(8);
+                        buffer.retry_len = needed.max(buffer.data.len() + 1);
+                        Ok(None)
+                    }
+                    Err(Error::OutOfBounds) => Err(Error::FileTruncated),
+                    Err(e) => Err(e),
+                }
+            }
+            Input::Borrowed {
+                segments,
+                bits_read,
+            } => {
+                let mut br = segments.bit_reader();
+                let res = br.skip_bits(*bits_read).and_then(|_| f(&mut br));
+                match res {
+                    Ok(v) => {
+                        *bits_read = br.total_bits_read();
+                        Ok(Some(v))
+                    }
+                    Err(Error::OutOfBounds) => Err(Error::FileTruncated),
+                    Err(e) => Err(e),
+                }
+            }
+        }
+    }
+
+    /// Position in the codestream of the start of the readers passed to `f` by `try_read`, in
+    /// bits.
+    fn reader_origin(&self) -> usize {
+        match self {
+            Input::Buffered(_, buffer) => buffer.bytes_dropped * 8,
+            Input::Borrowed { .. } => 0,
+        }
+    }
+
+    /// Position of the codestream in the file, as far as it is known.
+    fn segment_map(&self) -> SegmentMap {
+        match self {
+            Input::Buffered(_, buffer) => buffer.segments.clone(),
+            Input::Borrowed { segments, .. } => segments.segment_map(),
+        }
+    }
+
+    /// Number of bits of the codestream that were parsed.
+    fn bits_read(&self) -> usize {
+        match self {
+            Input::Buffered(_, buffer) => buffer.bytes_dropped * 8 + buffer.bit_offset,
+            Input::Borrowed { bits_read, .. } => *bits_read,
+        }
+    }
+
+    /// Drops any data that has been buffered but not parsed.
+    fn discard(&mut self) {
+        if let Input::Buffered(_, buffer) = self {
+            buffer.data = vec![];
+        }
+    }
+}
+
+#[derive(Debug, PartialEq, Clone, Copy)]
+enum Stage {
+    FileHeaders,
+    Icc,
+    Preview,
+    FrameHeader,
+    Done,
+}
+
+#[derive(Debug, PartialEq, Clone, Copy)]
+pub enum DecoderStatus {
+    /// More input is needed to make progress; see `JxlDecoder::feed`.
+    NeedMoreInput,
+    /// File headers and the encoded ICC profile (if any) have been decoded.
+    FileHeaders,
+    /// The first frame header and its TOC have been decoded.
+    FrameHeader,
+    /// Nothing else can be decoded. Frame data is not decoded yet, so this happens right after
+    /// the first frame header and TOC.
+    Done,
+}
+
+/// Push-style decoder: input can be provided in chunks of any size as it becomes available, and
+/// `process` decodes as much as possible, returning `DecoderStatus::NeedMoreInput` when it runs
+/// out of data. Only the part of the input that has not been decoded yet is kept in memory.
+///
+/// Alternatively, if the whole file is already in memory (or memory mapped), `from_bytes` creates
+/// a decoder that reads it in place, without any copy.
+/// ```
+/// # use jxl::decoder::{DecoderStatus, JxlDecoder};
+/// let mut decoder = JxlDecoder::new();
+/// assert_eq!(decoder.process()?, DecoderStatus::NeedMoreInput);
+/// decoder.feed(&[0xff, 0x0a])?;
+/// assert_eq!(decoder.process()?, DecoderStatus::NeedMoreInput);
+/// decoder.finish_input()?;
+/// assert!(decoder.process().is_err());
+/// # Ok::<(), jxl::error::Error>(())
+/// ```
+pub struct JxlDecoder<'a> {
+    input: Input<'a>,
+    config: Arc<DecoderConfig>,
+    state: DecodeState,
+    stage: Stage,
+    file_headers: Option<FileHeaders>,
+    encoded_icc: Option<Vec<u8>>,
+    frame_header: Option<FrameHeader>,
+    frame_index: Option<FrameIndex>,
+    content_hash: Option<u64>,
+    stats: StatsCollector,
+}
+
+impl Default for JxlDecoder<'static> {
+    fn default() -> JxlDecoder<'static> {
+        JxlDecoder::new()
+    }
+}
+
+impl JxlDecoder<'static> {
+    /// Creates a decoder whose input is provided with `feed`.
+    pub fn new() -> JxlDecoder<'static> {
+        JxlDecoder::with_config(Arc::new(DecoderConfig::new()), DecodeState::default())
+    }
+
+    /// Same as `new`, but with a configuration that can be shared with other decoders, and the
+    /// state of a previous decoder of the same thread (see `into_state`).
+    pub fn with_config(config: Arc<DecoderConfig>, state: DecodeState) -> JxlDecoder<'static> {
+        let input = Input::Buffered(
+            ContainerParser::new(),
+            CodestreamBuffer {
+                data: vec![],
+                bit_offset: 0,
+                bytes_dropped: 0,
+                input_finished: false,
+                retry_len: 0,
+                segments: SegmentMap::default(),
+            },
+        );
+        JxlDecoder::with_input(input, config, state)
+    }
+}
+
+impl<'a> JxlDecoder<'a> {
+    /// Creates a decoder that reads the whole file from `data`. Only the box headers and the
+    /// parts of the codestream that are actually decoded are accessed, so, for memory-mapped
+    /// files, reading the headers only touches the first pages of the codestream.
+    /// ```
+    /// # use jxl::decoder::{DecoderStatus, JxlDecoder};
+    /// let mut decoder = JxlDecoder::from_bytes(&[0xff, 0x0a])?;
+    /// assert!(decoder.process().is_err());
+    /// # Ok::<(), jxl::error::Error>(())
+    /// ```
+    pub fn from_bytes(data: &'a [u8]) -> Result<JxlDecoder<'a>, Error> {
+        let config = Arc::new(DecoderConfig::new());
+        JxlDecoder::from_bytes_with_config(data, config, DecodeState::default())
+    }
+
+    /// Same as `from_bytes`, with a shared configuration and a reused state, as in
+    /// `with_config`.
+    pub fn from_bytes_with_config(
+        data: &'a [u8],
+        config: Arc<DecoderConfig>,
+        state: DecodeState,
+    ) -> Result<JxlDecoder<'a>, Error> {
+        let input = Input::Borrowed {
+            segments: CodestreamSegments::new(data)?,
+            bits_read: 0,
+        };
+        Ok(JxlDecoder::with_input(input, config, state))
+    }
+
+    fn with_input(
+        input: Input<'a>,
+        config: Arc<DecoderConfig>,
+        state: DecodeState,
+    ) -> JxlDecoder<'a> {
+        JxlDecoder {
+            input,
+            config,
+            state,
+            stage: Stage::FileHeaders,
+            file_headers: None,
+            encoded_icc: None,
+            frame_header: None,
+            frame_index: None,
+            content_hash: None,
+            stats: StatsCollector::new(),
+        }
+    }
+
+    /// Provides the next chunk of the file (container or bare codestream). Decoders created
+    /// with `from_bytes` already have the whole file, and return
+    /// `Error::FeedOnBorrowedInput`.
+    pub fn feed(&mut self, chunk: &[u8]) -> Result<(), Error> {
+        let (container, buffer) = match &mut self.input {
+            Input::Buffered(container, buffer) => (container, buffer),
+            Input::Borrowed { .. } => return Err(Error::FeedOnBorrowedInput),
+        };
+        if self.stage == Stage::Done {
+            // The frame data is not kept, but the boxes that contain it are still located, for
+            // the byte ranges of the frame index.
+            return match &mut self.frame_index {
+                Some(index) => container
+                    .feed_with_offsets(chunk, |offset, cs| index.segments.push(offset, cs.len())),
+                None => Ok(()),
+            };
+        }
+        let (data, segments) = (&mut buffer.data, &mut buffer.segments);
+        container.feed_with_offsets(chunk, |offset, cs| {
+            segments.push(offset, cs.len());
+            data.extend_from_slice(cs)
+        })
+    }
+
+    /// Identifies the file being decoded, e.g. with a hash of its contents, so that its
+    /// histograms are kept in the `DecodeState` and reused when the same file is decoded again
+    /// with that state (e.g. for another crop). Files with the same hash must have the same
+    /// codestream.
+    pub fn set_content_hash(&mut self, content_hash: u64) {
+        self.content_hash = Some(content_hash);
+    }
+
+    /// Signals that no more input will be provided.
+    pub fn finish_input(&mut self) -> Result<(), Error> {
+        match &mut self.input {
+            Input::Buffered(container, buffer) => {
+                buffer.input_finished = true;
+                container.finish()
+            }
+            Input::Borrowed { .. } => Ok(()),
+        }
+    }
+
+    /// Decodes as much as possible of the input received so far.
+    pub fn process(&mut self) -> Result<DecoderStatus, Error> {
+        let stats = self.stats.clone();
+        stats.collect(|| self.process_stage())
+    }
+
+    fn process_stage(&mut self) -> Result<DecoderStatus, Error> {
+        let status = match self.stage {
+            Stage::FileHeaders => {
+                let file_headers = match self.input.try_read(read_file_headers)? {
+                    Some(fh) => fh,
+                    None => return Ok(DecoderStatus::NeedMoreInput),
+                };
+                self.stage = if file_headers.image_metadata.color_encoding.want_icc {
+                    Stage::Icc
+                } else {
+                    Stage::Preview
+                };
+                let limits_check = self.config.limits.check_image(&file_headers);
+                self.file_headers = Some(file_headers);
+                if let Err(e) = limits_check {
+                    self.stage = Stage::Done;
+                    self.input.discard();
+                    return Err(e);
+                }
+                if self.stage == Stage::Icc {
+                    return self.process_stage();
+                }
+                DecoderStatus::FileHeaders
+            }
+            Stage::Icc => {
+                let origin = self.input.reader_origin();
+                let state = &mut self.state;
+                let content_hash = self.content_hash;
+                self.encoded_icc = match self.input.try_read(|br| match content_hash {
+                    Some(hash) => read_encoded_icc_cached(
+                        br,
+                        &mut state.histograms,
+                        hash,
+                        origin,
+                        &mut state.entropy,
+                    ),
+                    None => read_encoded_icc_with_scratch(br, &mut state.entropy),
+                })? {
+                    Some(icc) => Some(icc),
+                    None => return Ok(DecoderStatus::NeedMoreInput),
+                };
+                self.stage = Stage::Preview;
+                DecoderStatus::FileHeaders
+            }
+            Stage::Preview => {
+                let file_headers = self.file_headers.as_ref().unwrap();
+                match self
+                    .input
+                    .try_read(|br| skip_preview_frame(br, file_headers))?
+                {
+                    Some(()) => self.stage = Stage::FrameHeader,
+                    None => return Ok(DecoderStatus::NeedMoreInput),
+                }
+                return self.process_stage();
+            }
+            Stage::FrameHeader => {
+                let nonserialized = FrameHeaderNonserialized::from_file_headers(
+                    self.file_headers.as_ref().unwrap(),
+                );
+                let (frame_header, toc) = match self
+                    .input
+                    .try_read(|br| read_frame_header_and_toc(br, &nonserialized))?
+                {
+                    Some(res) => res,
+                    None => return Ok(DecoderStatus::NeedMoreInput),
+                };
+                let cost = DecodeCost::estimate(self.file_headers.as_ref().unwrap(), &frame_header);
+                self.frame_header = Some(frame_header);
+                self.frame_index = Some(FrameIndex {
+                    data_offset: self.input.bits_read() / 8,
+                    toc,
+                    segments: self.input.segment_map(),
+                });
+                self.stage = Stage::Done;
+                // Frame data is not decoded yet, so there is no point in keeping it around.
+                self.input.discard();
+                // The headers stay available after a failure, e.g. to decode only a crop of the
+                // frame with `crop_byte_ranges` instead.
+                self.config.limits.check(&cost)?;
+                DecoderStatus::FrameHeader
+            }
+            Stage::Done => DecoderStatus::Done,
+        };
+        Ok(status)
+    }
+
+    pub fn file_headers(&self) -> Option<&FileHeaders> {
+        self.file_headers.as_ref()
+    }
+
+    pub fn config(&self) -> &DecoderConfig {
+        &self.config
+    }
+
+    /// Returns the buffers of the decoder, to reuse them for the next file.
+    pub fn into_state(self) -> DecodeState {
+        self.state
+    }
+
+    /// The ICC stream, if any, before the ICC-specific prediction is undone (see
+    /// `read_encoded_icc`).
+    pub fn encoded_icc(&self) -> Option<&[u8]> {
+        self.encoded_icc.as_deref()
+    }
+
+    pub fn frame_header(&self) -> Option<&FrameHeader> {
+        self.frame_header.as_ref()
+    }
+
+    /// Estimated resources needed to decode the first frame, once its header is decoded.
+    pub fn decode_cost(&self) -> Option<DecodeCost> {
+        Some(DecodeCost::estimate(
+            self.file_headers.as_ref()?,
+            self.frame_header.as_ref()?,
+        ))
+    }
+
+    /// Counters of the decoding done so far; empty unless the `stats` feature is enabled.
+    pub fn stats(&self) -> DecodeStats {
+        self.stats.stats()
+    }
+
+    /// Location of the sections of the first frame in the codestream.
+    pub fn frame_index(&self) -> Option<&FrameIndex> {
+        self.frame_index.as_ref()
+    }
+
+    /// Byte ranges of the file that are needed to decode `image_rect` of the first frame, up to
+    /// `limit`, including the borders needed by upsampling and the restoration filters. Only
+    /// the groups that intersect the rectangle, and only their passes up to the limit, are
+    /// included, so these are the only parts of the frame that need to be read (e.g. from a
+    /// memory mapped file, or with range requests). With pushed input, the boxes of the frame
+    /// data are only located as far as the input has been fed; see `SegmentMap::file_ranges`.
+    pub fn crop_byte_ranges(
+        &self,
+        image_rect: &Rect,
+        limit: PassLimit,
+    ) -> Option<Vec<Range<usize>>> {
+        let frame_header = self.frame_header.as_ref()?;
+        let index = self.frame_index.as_ref()?;
+        let num_passes = frame_header.passes_needed(limit);
+        Some(
+            match frame_header.frame_rect(image_rect, index.toc.dimensions()) {
+                Some(rect) => {
+                    index.byte_ranges(&index.toc.sections_for_rect_and_passes(&rect, num_passes))
+                }
+                None => vec![],
+            },
+        )
+    }
+}
+
+/// Result of `probe`.
+#[derive(Debug)]
+pub struct ImageInfo {
+    /// Image size and metadata.
+    pub file_headers: FileHeaders,
+    /// Header of the first frame, if requested.
+    pub frame_header: Option<FrameHeader>,
+    /// TOC of the first frame, if its header was requested.
+    pub frame_index: Option<FrameIndex>,
+    /// Number of bytes from the beginning of the file that were needed to read the headers.
+    pub bytes_read: usize,
+}
+
+impl ImageInfo {
+    /// Estimated resources needed to decode the first frame, if its header was requested.
+    pub fn decode_cost(&self) -> Option<DecodeCost> {
+        Some(DecodeCost::estimate(
+            &self.file_headers,
+            self.frame_header.as_ref()?,
+        ))
+    }
+}
+
+/// Reads the image size and metadata, and optionally the first frame header and TOC, from
+/// `data`, which can be just a prefix of the file. If it is too short, `Error::FileTruncated` is returned.
+///
+/// Nothing is copied or decoded besides the headers themselves, except that, if a frame header is
+/// requested and the image has an ICC profile, the ICC stream needs to be entropy-decoded to know
+/// where it ends.
+/// ```
+/// # use jxl::decoder::probe;
+/// # use jxl::error::Error;
+/// assert!(matches!(probe(&[0xff, 0x0a], false), Err(Error::FileTruncated)));
+/// ```
+pub fn probe(data: &[u8], with_frame_header: bool) -> Result<ImageInfo, Error> {
+    let segments = CodestreamSegments::from_prefix(data)?;
+    let mut br = segments.bit_reader();
+    let mut read_headers = || -> Result<_, Error> {
+        let file_headers = read_file_headers(&mut br)?;
+        let frame = if with_frame_header {
+            if file_headers.image_metadata.color_encoding.want_icc {
+                skip_icc(&mut br)?;
+            }
+            skip_preview_frame(&mut br, &file_headers)?;
+            let nonserialized = FrameHeaderNonserialized::from_file_headers(&file_headers);
+            let (frame_header, toc) = read_frame_header_and_toc(&mut br, &nonserialized)?;
+            let frame_index = FrameIndex {
+                data_offset: br.total_bits_read() / 8,
+                toc,
+                segments: segments.segment_map(),
+            };
+            Some((frame_header, frame_index))
+        } else {
+            None
+        };
+        Ok((file_headers, frame))
+    };
+    let (file_headers, frame) = match read_headers() {
+        Err(Error::OutOfBounds) => return Err(Error::FileTruncated),
+        res => res?,
+    };
+    let (frame_header, frame_index) = match frame {
+        Some((frame_header, frame_index)) => (Some(frame_header), Some(frame_index)),
+        None => (None, None),
+    };
+    Ok(ImageInfo {
+        file_headers,
+        frame_header,
+        frame_index,
+        bytes_read: segments.file_offset(br.total_bits_read().div_ceil(8)),
+    })
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::frame::budget::DecodeLimits;
+    use crate::frame::toc::Section;
+    use crate::test_util::{container, image_with_preview, IMAGE, IMAGE_HEADERS_SIZE};
+
+    fn decode_in_chunks(file: &[u8], chunk_size: usize) -> JxlDecoder<'static> {
+        let mut decoder = JxlDecoder::new();
+        let mut chunks = file.chunks(chunk_size);
+        loop {
+            match decoder.process().unwrap() {
+                DecoderStatus::NeedMoreInput => match chunks.next() {
+                    Some(chunk) => decoder.feed(chunk).unwrap(),
+                    None => decoder.finish_input().unwrap(),
+                },
+                DecoderStatus::FrameHeader => break,
+                _ => {}
+            }
+        }
+        decoder
+    }
+
+    #[test]
+    fn test_chunked_codestream() {
+        for chunk_size in [1, 3, 7, 64] {
+            let decoder = decode_in_chunks(&IMAGE, chunk_size);
+            let size = &decoder.file_headers().unwrap().size;
+            assert_eq!((size.xsize(), size.ysize()), (1, 1));
+            assert!(decoder.frame_header().unwrap().is_last);
+        }
+    }
+
+    #[test]
+    fn test_chunked_container() {
+        for split in [1, 5, 30] {
+            for chunk_size in [1, 5, 13] {
+                let decoder = decode_in_chunks(&container(&IMAGE, split), chunk_size);
+                assert!(decoder.frame_header().unwrap().is_last);
+            }
+        }
+    }
+
+    #[test]
+    fn test_retry() {
+        let mut decoder = JxlDecoder::new();
+        decoder.feed(&IMAGE[..2]).unwrap();
+        let mut attempts = 0;
+        // A section is skipped: it is only parsed again once it has been fed entirely.
+        for _ in 2..1000 {
+            let res = decoder.input.try_read(|br| {
+                attempts += 1;
+                br.skip_bits(1000 * 8)
+            });
+            assert!(res.unwrap().is_none());
+            decoder.feed(&[0]).unwrap();
+        }
+        assert!(decoder
+            .input
+            .try_read(|br| br.skip_bits(1000 * 8))
+            .unwrap()
+            .is_some());
+        assert_eq!(attempts, 1);
+        // Fields are read one after the other: parsing is retried as soon as data is added.
+        for i in 0..10 {
+            let res = decoder
+                .input
+                .try_read(|br| (0..10).try_for_each(|_| br.read(8).map(drop)));
+            assert!(res.unwrap().is_none(), "{}", i);
+            decoder.feed(&[0]).unwrap();
+        }
+        assert!(decoder
+            .input
+            .try_read(|br| (0..10).try_for_each(|_| br.read(8).map(drop)))
+            .unwrap()
+            .is_some());
+    }
+
+    #[test]
+    fn test_preview() {
+        let file = image_with_preview();
+        let frame_start = file.len() - (IMAGE.len() - IMAGE_HEADERS_SIZE);
+        let data_offset = probe(&IMAGE, true)
+            .unwrap()
+            .frame_index
+            .unwrap()
+            .data_offset;
+        let expected = data_offset - IMAGE_HEADERS_SIZE + frame_start;
+        for chunk_size in [1, 7, 200] {
+            let decoder = decode_in_chunks(&file, chunk_size);
+            assert_eq!(decoder.file_headers().unwrap().size.xsize(), 8);
+            assert_eq!(decoder.frame_index().unwrap().data_offset, expected);
+        }
+        let info = probe(&file, true).unwrap();
+        assert_eq!(info.frame_index.unwrap().data_offset, expected);
+        let nonserialized = FrameHeaderNonserialized::for_preview(&info.file_headers).unwrap();
+        assert_eq!((nonserialized.img_width, nonserialized.img_height), (1, 1));
+        assert!(
+            FrameHeaderNonserialized::for_preview(&probe(&IMAGE, false).unwrap().file_headers)
+                .is_none()
+        );
+    }
+
+    #[test]
+    fn test_borrowed() {
+        let file = container(&IMAGE, 5);
+        let mut decoder = JxlDecoder::from_bytes(&file).unwrap();
+        assert_eq!(decoder.process().unwrap(), DecoderStatus::FileHeaders);
+        assert_eq!(decoder.process().unwrap(), DecoderStatus::FrameHeader);
+        assert!(decoder.frame_header().unwrap().is_last);
+        assert_eq!(decoder.process().unwrap(), DecoderStatus::Done);
+        assert!(matches!(
+            decoder.feed(&IMAGE),
+            Err(Error::FeedOnBorrowedInput)
+        ));
+    }
+
+    #[test]
+    fn test_frame_index() {
+        let decoder = decode_in_chunks(&IMAGE, 5);
+        let index = decoder.frame_index().unwrap();
+        assert!(index.toc.is_single_section());
+        assert_eq!(index.toc.dimensions().num_groups(), 1);
+        assert_eq!(index.end_offset(), IMAGE.len());
+        let borrowed = probe(&IMAGE, true).unwrap().frame_index.unwrap();
+        assert_eq!(borrowed.data_offset, index.data_offset);
+        assert_eq!(
+            borrowed.section_range(Section::LfGlobal),
+            index.section_range(Section::HfGlobal)
+        );
+    }
+
+    #[test]
+    fn test_crop_byte_ranges() {
+        let decoder = decode_in_chunks(&IMAGE, 64);
+        let index = decoder.frame_index().unwrap();
+        let rect = |x0| Rect {
+            x0,
+            y0: 0,
+            width: 1,
+            height: 1,
+        };
+        let ranges = decoder.crop_byte_ranges(&rect(0), PassLimit::All).unwrap();
+        assert_eq!(ranges.len(), 1);
+        assert_eq!(ranges[0], index.data_offset..IMAGE.len());
+        assert!(decoder
+            .crop_byte_ranges(&rect(5), PassLimit::All)
+            .unwrap()
+            .is_empty());
+        assert!(JxlDecoder::new()
+            .crop_byte_ranges(&rect(0), PassLimit::All)
+            .is_none());
+    }
+
+    #[test]
+    fn test_crop_byte_ranges_container() {
+        let data_offset = probe(&IMAGE, true)
+            .unwrap()
+            .frame_index
+            .unwrap()
+            .data_offset;
+        // The frame data is split in two jxlp boxes.
+        let file = container(&IMAGE, data_offset + 5);
+        let rect = Rect {
+            x0: 0,
+            y0: 0,
+            width: 1,
+            height: 1,
+        };
+        let mut pushed = JxlDecoder::new();
+        // The second box is only fed once the frame header is decoded.
+        let (head, tail) = file.split_at(file.len() - (IMAGE.len() - data_offset - 5) - 12);
+        pushed.feed(head).unwrap();
+        while pushed.process().unwrap() != DecoderStatus::FrameHeader {}
+        pushed.feed(tail).unwrap();
+        let mut borrowed = JxlDecoder::from_bytes(&file).unwrap();
+        while borrowed.process().unwrap() != DecoderStatus::FrameHeader {}
+        for decoder in [pushed, borrowed] {
+            let ranges = decoder.crop_byte_ranges(&rect, PassLimit::All).unwrap();
+            assert_eq!(ranges.len(), 2);
+            let bytes: Vec<u8> = ranges
+                .iter()
+                .flat_map(|r| file[r.clone()].to_vec())
+                .collect();
+            assert_eq!(bytes, &IMAGE[data_offset..]);
+        }
+    }
+
+    #[test]
+    fn test_probe() {
+        let file = container(&IMAGE, 30);
+        let info = probe(&file, false).unwrap();
+        let size = &info.file_headers.size;
+        assert_eq!((size.xsize(), size.ysize()), (1, 1));
+        assert!(info.frame_header.is_none());
+        let info_fh = probe(&file, true).unwrap();
+        assert!(info_fh.frame_header.unwrap().is_last);
+        assert!(info.bytes_read < info_fh.bytes_read);
+        // Just enough data is enough.
+        assert!(probe(&file[..info_fh.bytes_read], true).is_ok());
+        assert!(matches!(
+            probe(&file[..info.bytes_read - 1], false),
+            Err(Error::FileTruncated)
+        ));
+    }
+
+    #[test]
+    fn test_shared_config() {
+        let config = Arc::new(DecoderConfig::new());
+        let mut state = DecodeState::default();
+        for _ in 0..3 {
+            let mut decoder =
+                JxlDecoder::from_bytes_with_config(&IMAGE, config.clone(), state).unwrap();
+            assert_eq!(decoder.process().unwrap(), DecoderStatus::FileHeaders);
+            assert_eq!(decoder.process().unwrap(), DecoderStatus::FrameHeader);
+            state = decoder.into_state();
+        }
+        assert_eq!(Arc::strong_count(&config), 1);
+    }
+
+    #[test]
+    fn test_limits() {
+        let limited = |max_pixels, max_memory| {
+            let mut config = DecoderConfig::new();
+            config.limits = DecodeLimits {
+                max_pixels,
+                max_memory,
+            };
+            JxlDecoder::from_bytes_with_config(&IMAGE, Arc::new(config), DecodeState::default())
+                .unwrap()
+        };
+        let mut decoder = limited(0, u64::MAX);
+        assert!(matches!(decoder.process(), Err(Error::TooManyPixels(1, 0))));
+        assert!(decoder.file_headers().is_some());
+        assert_eq!(decoder.process().unwrap(), DecoderStatus::Done);
+
+        let mut decoder = limited(1, 8);
+        assert_eq!(decoder.process().unwrap(), DecoderStatus::FileHeaders);
+        assert!(matches!(
+            decoder.process(),
+            Err(Error::MemoryLimitExceeded(_, 8))
+        ));
+        assert!(decoder.frame_index().is_some());
+        let cost = decoder.decode_cost().unwrap();
+        assert!(limited(1, cost.memory).process().is_ok());
+    }
+
+    #[cfg(feature = "stats")]
+    #[test]
+    fn test_stats() {
+        let mut decoder = JxlDecoder::from_bytes(&IMAGE).unwrap();
+        while decoder.process().unwrap() != DecoderStatus::Done {}
+        let stats = decoder.stats();
+        let names: Vec<_> = stats.sections.iter().map(|s| s.name).collect();
+        assert_eq!(names, ["file_headers", "frame_header", "toc"]);
+        assert!(stats.sections.iter().all(|s| s.bits > 0));
+        // Another decode is not counted.
+        JxlDecoder::from_bytes(&IMAGE).unwrap().process().unwrap();
+        assert_eq!(decoder.stats(), stats);
+    }
+
+    #[test]
+    fn test_truncated() {
+        let mut decoder = JxlDecoder::new();
+        decoder.feed(&IMAGE[..3]).unwrap();
+        assert_eq!(decoder.process().unwrap(), DecoderStatus::NeedMoreInput);
+        decoder.finish_input().unwrap();
+        assert!(matches!(decoder.process(), Err(Error::FileTruncated)));
+    }
+}
@@ -8,3 +8,5 @@ pub mod context_map;
 pub mod decode;
 pub mod huffman;
 pub mod hybrid_uint;
+pub mod lz77;
+pub mod scratch;
@@ -3,5 +3,481 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
-//use crate::bit_reader::BitReader;
-//use crate::error::Error;
+use crate::bit_reader::BitReader;
+use crate::entropy_coding::scratch::EntropyScratch;
+use crate::error::Error;
+
+pub const ANS_LOG_TAB_SIZE: usize = 12;
+const ANS_TAB_SIZE: u32 = 1 << ANS_LOG_TAB_SIZE;
+const ANS_SIGNATURE: u32 = 0x13;
+const RLE_LOGCOUNT: u8 = ANS_LOG_TAB_SIZE as u8 + 1;
+
+/* Prefix code for logcounts: [num bits, logcount], indexed by the next 7 bits. */
+#[rustfmt::skip]
+const LOGCOUNT_HUFF: [(u8, u8); 128] = [
+    (3, 10), (7, 12), (3, 7), (4, 3), (3, 6), (3, 8), (3, 9), (4, 5),
+    (3, 10), (4, 4), (3, 7), (4, 1), (3, 6), (3, 8), (3, 9), (4, 2),
+    (3, 10), (5, 0), (3, 7), (4, 3), (3, 6), (3, 8), (3, 9), (4, 5),
+    (3, 10), (4, 4), (3, 7), (4, 1), (3, 6), (3, 8), (3, 9), (4, 2),
+    (3, 10), (6, 11), (3, 7), (4, 3), (3, 6), (3, 8), (3, 9), (4, 5),
+    (3, 10), (4, 4), (3, 7), (4, 1), (3, 6), (3, 8), (3, 9), (4, 2),
+    (3, 10), (5, 0), (3, 7), (4, 3), (3, 6), (3, 8), (3, 9), (4, 5),
+    (3, 10), (4, 4), (3, 7), (4, 1), (3, 6), (3, 8), (3, 9), (4, 2),
+    (3, 10), (7, 13), (3, 7), (4, 3), (3, 6), (3, 8), (3, 9), (4, 5),
+    (3, 10), (4, 4), (3, 7), (4, 1), (3, 6), (3, 8), (3, 9), (4, 2),
+    (3, 10), (5, 0), (3, 7), (4, 3), (3, 6), (3, 8), (3, 9), (4, 5),
+    (3, 10), (4, 4), (3, 7), (4, 1), (3, 6), (3, 8), (3, 9), (4, 2),
+    (3, 10), (6, 11), (3, 7), (4, 3), (3, 6), (3, 8), (3, 9), (4, 5),
+    (3, 10), (4, 4), (3, 7), (4, 1), (3, 6), (3, 8), (3, 9), (4, 2),
+    (3, 10), (5, 0), (3, 7), (4, 3), (3, 6), (3, 8), (3, 9), (4, 5),
+    (3, 10), (4, 4), (3, 7), (4, 1), (3, 6), (3, 8), (3, 9), (4, 2),
+];
+
+fn decode_varlen_uint8(br: &mut BitReader) -> Result<usize, Error> {
+    if br.read(1)? != 0 {
+        let nbits = br.read(3)? as usize;
+        if nbits == 0 {
+            Ok(1)
+        } else {
+            Ok((1 << nbits) + br.read(nbits)? as usize)
+        }
+    } else {
+        Ok(0)
+    }
+}
+
+fn population_count_precision(logcount: u32, shift: u32) -> u32 {
+    let r =
+        (logcount as i32).min(shift as i32 - ((ANS_LOG_TAB_SIZE as i32 - logcount as i32) >> 1));
+    r.max(0) as u32
+}
+
+/// Reads a histogram whose counts sum to `ANS_TAB_SIZE` into `counts`.
+fn decode_counts(
+    br: &mut BitReader,
+    counts: &mut Vec<u32>,
+    scratch: &mut EntropyScratch,
+) -> Result<(), Error> {
+    counts.clear();
+    let simple_code = br.read(1)? != 0;
+    if simple_code {
+        let num_symbols = br.read(1)? as usize + 1;
+        let mut symbols = [0usize; 2];
+        for symbol in symbols.iter_mut().take(num_symbols) {
+            *symbol = decode_varlen_uint8(br)?;
+        }
+        counts.resize(symbols.iter().max().unwrap() + 1, 0);
+        if num_symbols == 1 {
+            counts[symbols[0]] = ANS_TAB_SIZE;
+        } else {
+            if symbols[0] == symbols[1] {
+                return Err(Error::InvalidAnsHistogram);
+            }
+            counts[symbols[0]] = br.read(ANS_LOG_TAB_SIZE)? as u32;
+            counts[symbols[1]] = ANS_TAB_SIZE - counts[symbols[0]];
+        }
+        return Ok(());
+    }
+
+    let is_flat = br.read(1)? != 0;
+    if is_flat {
+        let alphabet_size = decode_varlen_uint8(br)? + 1;
+        let count = ANS_TAB_SIZE / alphabet_size as u32;
+        let rem_counts = (ANS_TAB_SIZE % alphabet_size as u32) as usize;
+        counts.extend((0..alphabet_size).map(|i| count + (i < rem_counts) as u32));
+        return Ok(());
+    }
+
+    let mut log = 0;
+    while log < 3 && br.read(1)? != 0 {
+        log += 1;
+    }
+    let shift = (br.read(log)? as u32 | (1 << log)) - 1;
+    if shift > ANS_LOG_TAB_SIZE as u32 + 1 {
+        return Err(Error::InvalidAnsHistogram);
+    }
+
+    let length = decode_varlen_uint8(br)? + 3;
+    let mut logcounts = scratch.bytes.take();
+    let mut same = scratch.counts.take();
+    let result = decode_logcounts(br, shift, length, &mut logcounts, &mut same, counts);
+    scratch.bytes.give(logcounts);
+    scratch.counts.give(same);
+    result
+}
+
+/// Decodes the `length` counts of a histogram that is neither simple nor flat, using
+/// `logcounts` and `same` as temporary buffers.
+fn decode_logcounts(
+    br: &mut BitReader,
+    shift: u32,
+    length: usize,
+    logcounts: &mut Vec<u8>,
+    same: &mut Vec<u32>,
+    counts: &mut Vec<u32>,
+) -> Result<(), Error> {
+    logcounts.resize(length, 0);
+    // Number of repetitions of the previous count, for positions that start a RLE run.
+    same.resize(length, 0);
+    let mut omit: Option<(u8, usize)> = None;
+    let mut i = 0;
+    while i < length {
+        let (bits, logcount) = LOGCOUNT_HUFF[br.peek(7) as usize];
+        br.consume(bits as usize)?;
+        logcounts[i] = logcount;
+        if logcount == RLE_LOGCOUNT {
+            let rle_length = decode_varlen_uint8(br)?;
+            same[i] = rle_length as u32 + 4;
+            i += rle_length + 4;
+            continue;
+        }
+        match omit {
+            Some((omit_log, _)) if omit_log >= logcount => {}
+            _ => omit = Some((logcount, i)),
+        }
+        i += 1;
+    }
+    let omit_pos = match omit {
+        Some((_, pos)) => pos,
+        None => return Err(Error::InvalidAnsHistogram),
+    };
+    if logcounts.get(omit_pos + 1) == Some(&RLE_LOGCOUNT) {
+        return Err(Error::InvalidAnsHistogram);
+    }
+
+    counts.resize(length, 0);
+    let mut total_count = 0u32;
+    let mut numsame = 0u32;
+    let mut prev = 0;
+    for i in 0..length {
+        if same[i] != 0 {
+            numsame = same[i];
+            prev = if i > 0 { counts[i - 1] } else { 0 };
+        }
+        if numsame > 0 {
+            counts[i] = prev;
+            numsame -= 1;
+        } else {
+            let code = logcounts[i] as u32;
+            if i == omit_pos || code == 0 {
+                continue;
+            } else if code == 1 {
+                counts[i] = 1;
+            } else {
+                let bitcount = population_count_precision(code - 1, shift);
+                counts[i] = (1 << (code - 1))
+                    + ((br.read(bitcount as usize)? as u32) << (code - 1 - bitcount));
+            }
+        }
+        total_count += counts[i];
+    }
+    if total_count >= ANS_TAB_SIZE {
+        // The omitted symbol must have a count of at least 1.
+        return Err(Error::InvalidAnsHistogram);
+    }
+    counts[omit_pos] = ANS_TAB_SIZE - total_count;
+    Ok(())
+}
+
+/* Alias table entry, packed in a single u64:
+- bits 0..8: cutoff
+- bits 8..16: right_value
+- bits 16..32: freq0
+- bits 32..48: offsets1
+- bits 48..64: freq1 ^ freq0 */
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct AliasEntry(u64);
+
+impl AliasEntry {
+    fn new(cutoff: u32, right_value: u32, freq0: u32, offsets1: u32, freq1: u32) -> AliasEntry {
+        debug_assert!(cutoff < 256 && right_value < 256);
+        debug_assert!(freq0 <= ANS_TAB_SIZE && freq1 <= ANS_TAB_SIZE && offsets1 <= ANS_TAB_SIZE);
+        AliasEntry(
+            cutoff as u64
+                | (right_value as u64) << 8
+                | (freq0 as u64) << 16
+                | (offsets1 as u64) << 32
+                | ((freq1 ^ freq0) as u64) << 48,
+        )
+    }
+
+    /// Returns (symbol, offset, frequency) for position `pos` in the bucket of symbol `i`.
+    #[inline]
+    fn lookup(self, i: u32, pos: u32) -> (u32, u32, u32) {
+        let entry = self.0;
+        let cutoff = (entry & 0xff) as u32;
+        let freq0 = ((entry >> 16) & 0xffff) as u32;
+        if pos < cutoff {
+            (i, pos, freq0)
+        } else {
+            let right_value = ((entry >> 8) & 0xff) as u32;
+            let offsets1 = ((entry >> 32) & 0xffff) as u32;
+            let freq1 = ((entry >> 48) as u32) ^ freq0;
+            (right_value, offsets1 + pos, freq1)
+        }
+    }
+}
+
+/// Appends the alias table for `counts` to `table`. See InitAliasTable() in C++ code.
+/// Trailing zeros of `counts` are removed.
+fn build_alias_table(
+    counts: &mut Vec<u32>,
+    log_alpha_size: usize,
+    table: &mut Vec<AliasEntry>,
+    scratch: &mut EntropyScratch,
+) {
+    while counts.last() == Some(&0) {
+        counts.pop();
+    }
+    if counts.is_empty() {
+        counts.push(ANS_TAB_SIZE);
+    }
+    let table_size = 1 << log_alpha_size;
+    debug_assert!(counts.len() <= table_size);
+    let entry_size = ANS_TAB_SIZE >> log_alpha_size;
+
+    // Special case for single-symbol distributions, so that decoding does not change the state.
+    if let Some(sym) = counts.iter().position(|&c| c == ANS_TAB_SIZE) {
+        table.extend(
+            (0..table_size as u32)
+                .map(|i| AliasEntry::new(0, sym as u32, 0, entry_size * i, ANS_TAB_SIZE)),
+        );
+        return;
+    }
+
+    let mut cutoffs = scratch.counts.take();
+    cutoffs.resize(table_size, 0);
+    let mut right_values = scratch.counts.take();
+    right_values.resize(table_size, 0);
+    let mut offsets1 = scratch.counts.take();
+    offsets1.resize(table_size, 0);
+    let mut underfull = scratch.counts.take();
+    let mut overfull = scratch.counts.take();
+    for (i, &c) in counts.iter().enumerate() {
+        cutoffs[i] = c;
+        if c > entry_size {
+            overfull.push(i as u32);
+        } else if c < entry_size {
+            underfull.push(i as u32);
+        }
+    }
+    underfull.extend(counts.len() as u32..table_size as u32);
+
+    while let Some(overfull_i) = overfull.pop() {
+        let overfull_i = overfull_i as usize;
+        // Counts sum to ANS_TAB_SIZE, so there is always an underfull bucket here.
+        let underfull_i = underfull.pop().unwrap() as usize;
+        cutoffs[overfull_i] -= entry_size - cutoffs[underfull_i];
+        // The right part of bucket underfull_i is taken from the end of bucket overfull_i.
+        right_values[underfull_i] = overfull_i as u32;
+        offsets1[underfull_i] = cutoffs[overfull_i];
+        if cutoffs[overfull_i] < entry_size {
+            underfull.push(overfull_i as u32);
+        } else if cutoffs[overfull_i] > entry_size {
+            overfull.push(overfull_i as u32);
+        }
+    }
+
+    let freq = |i: usize| counts.get(i).copied().unwrap_or(0);
+    table.extend((0..table_size).map(|i| {
+        let (cutoff, right_value, offsets1) = if cutoffs[i] == entry_size {
+            (0, i as u32, 0)
+        } else {
+            (cutoffs[i], right_values[i], offsets1[i] - cutoffs[i])
+        };
+        AliasEntry::new(
+            cutoff,
+            right_value,
+            freq(i),
+            offsets1,
+            freq(right_value as usize),
+        )
+    }));
+    for buf in [cutoffs, right_values, offsets1, underfull, overfull] {
+        scratch.counts.give(buf);
+    }
+}
+
+/// Alias tables for all the clusters of a `Histograms`, stored contiguously.
+#[derive(Debug)]
+pub struct AnsCodes {
+    log_alpha_size: usize,
+    log_entry_size: usize,
+    tables: Vec<AliasEntry>,
+}
+
+impl AnsCodes {
+    pub fn decode(
+        num: usize,
+        log_alpha_size: usize,
+        br: &mut BitReader,
+        scratch: &mut EntropyScratch,
+    ) -> Result<AnsCodes, Error> {
+        let mut tables = scratch.alias_entries.take();
+        tables.reserve(num << log_alpha_size);
+        let mut counts = scratch.counts.take();
+        let result = (0..num).try_for_each(|_| {
+            decode_counts(br, &mut counts, scratch)?;
+            if counts.len() > 1 << log_alpha_size {
+                return Err(Error::AlphabetTooLargeAns(
+                    counts.len(),
+                    1 << log_alpha_size,
+                ));
+            }
+            build_alias_table(&mut counts, log_alpha_size, &mut tables, scratch);
+            Ok(())
+        });
+        scratch.counts.give(counts);
+        let codes = AnsCodes {
+            log_alpha_size,
+            log_entry_size: ANS_LOG_TAB_SIZE - log_alpha_size,
+            tables,
+        };
+        match result {
+            Ok(()) => Ok(codes),
+            Err(err) => {
+                codes.recycle(scratch);
+                Err(err)
+            }
+        }
+    }
+
+    /// Returns the buffers of the tables to `scratch`.
+    pub fn recycle(self, scratch: &mut EntropyScratch) {
+        scratch.alias_entries.give(self.tables);
+    }
+}
+
+/// State of an rANS stream.
+#[derive(Debug)]
+pub struct AnsReader {
+    state: u32,
+}
+
+impl AnsReader {
+    /// Initializes the state from the bitstream.
+    pub fn new(br: &mut BitReader) -> Result<AnsReader, Error> {
+        Ok(AnsReader {
+            state: br.read(32)? as u32,
+        })
+    }
+
+    /// Returns a reader that is not backed by an ANS stream.
+    pub fn new_unused() -> AnsReader {
+        AnsReader {
+            state: ANS_SIGNATURE << 16,
+        }
+    }
+
+    /// Returns the decoded symbol and the state before renormalization.
+    #[inline]
+    fn next_state(&self, codes: &AnsCodes, ctx: usize) -> (u32, u32) {
+        let res = self.state & (ANS_TAB_SIZE - 1);
+        let i = res >> codes.log_entry_size;
+        let pos = res & ((1 << codes.log_entry_size) - 1);
+        let entry = codes.tables[(ctx << codes.log_alpha_size) + i as usize];
+        let (symbol, offset, freq) = entry.lookup(i, pos);
+        (symbol, freq * (self.state >> ANS_LOG_TAB_SIZE) + offset)
+    }
+
+    #[inline]
+    pub fn read(&mut self, codes: &AnsCodes, br: &mut BitReader, ctx: usize) -> Result<u32, Error> {
+        let (symbol, state) = self.next_state(codes, ctx);
+        self.state = state;
+        if self.state < (1 << 16) {
+            self.state = (self.state << 16) | br.read(16)? as u32;
+        }
+        Ok(symbol)
+    }
+
+    /// Like `read`, but needs 16 bits to be available in `br` for `BitReader::read_unchecked`.
+    #[inline]
+    pub fn read_unchecked(&mut self, codes: &AnsCodes, br: &mut BitReader, ctx: usize) -> u32 {
+        let (symbol, state) = self.next_state(codes, ctx);
+        // Branchless renormalization: read 16 bits or 0 bits.
+        let normalize = state < (1 << 16);
+        let shift = 16 * normalize as usize;
+        self.state = (state << shift) | br.read_unchecked(shift) as u32;
+        symbol
+    }
+
+    pub fn check_final_state(&self) -> Result<(), Error> {
+        if self.state == ANS_SIGNATURE << 16 {
+            Ok(())
+        } else {
+            Err(Error::InvalidAnsState(self.state))
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn check_alias_table(counts: Vec<u32>, log_alpha_size: usize) {
+        let mut table = vec![];
+        build_alias_table(
+            &mut counts.clone(),
+            log_alpha_size,
+            &mut table,
+            &mut EntropyScratch::new(),
+        );
+        let log_entry_size = ANS_LOG_TAB_SIZE - log_alpha_size;
+        let mut seen = vec![vec![false; ANS_TAB_SIZE as usize]; 1 << log_alpha_size];
+        for res in 0..ANS_TAB_SIZE {
+            let i = res >> log_entry_size;
+            let pos = res & ((1 << log_entry_size) - 1);
+            let (symbol, offset, freq) = table[i as usize].lookup(i, pos);
+            assert_eq!(freq, counts[symbol as usize]);
+            assert!(offset < freq);
+            assert!(!seen[symbol as usize][offset as usize]);
+            seen[symbol as usize][offset as usize] = true;
+        }
+    }
+
+    #[test]
+    fn test_alias_table() {
+        check_alias_table(vec![ANS_TAB_SIZE], 5);
+        check_alias_table(vec![0, 0, ANS_TAB_SIZE, 0], 8);
+        check_alias_table(vec![2048, 1024, 1024], 5);
+        check_alias_table(vec![1, 4094, 1], 6);
+        check_alias_table(
+            (0..32)
+                .map(|i| if i < 31 { 100 + i } else { 4096 - 3565 })
+                .collect(),
+            5,
+        );
+        let mut counts: Vec<u32> = (0..200).map(|i| (i * 7919) % 13 + 1).collect();
+        counts.push(ANS_TAB_SIZE - counts.iter().sum::<u32>());
+        check_alias_table(counts, 8);
+    }
+
+    #[test]
+    fn test_flat_histogram() -> Result<(), Error> {
+        // simple_code = 0, is_flat = 1, alphabet_size = 1 + varlen(1) = 2.
+        let mut br = BitReader::new(&[0b110]);
+        let mut counts = vec![];
+        decode_counts(&mut br, &mut counts, &mut EntropyScratch::new())?;
+        assert_eq!(counts, vec![2048, 2048]);
+        assert_eq!(br.total_bits_read(), 6);
+        Ok(())
+    }
+
+    #[test]
+    fn test_single_symbol_stream() -> Result<(), Error> {
+        // simple_code = 1, num_symbols = 1, symbol = varlen(1).
+        let mut br = BitReader::new(&[0b101, 0x00, 0x00, 0x13, 0x00]);
+        let codes = AnsCodes::decode(1, 5, &mut br, &mut EntropyScratch::new())?;
+        br.jump_to_byte_boundary()?;
+        let mut reader = AnsReader::new(&mut br)?;
+        for _ in 0..5 {
+            assert_eq!(reader.read(&codes, &mut br, 0)?, 1);
+        }
+        br.refill_unchecked();
+        for _ in 0..5 {
+            assert_eq!(reader.read_unchecked(&codes, &mut br, 0), 1);
+        }
+        br.check_overflow()?;
+        reader.check_final_state()
+    }
+}
@@ -5,15 +5,14 @@
 
 use crate::bit_reader::BitReader;
 use crate::error::Error;
-use std::collections::HashSet;
 
 use crate::entropy_coding::decode::*;
+use crate::entropy_coding::scratch::EntropyScratch;
 
-fn move_to_front(v: &mut [u8], index: u8) {
-    let value = v[index as usize];
-    for i in (1..=index as usize).rev() {
-        v[i] = v[i - 1];
-    }
+fn move_to_front(v: &mut [u8; 256], index: u8) {
+    let index = index as usize;
+    let value = v[index];
+    v.copy_within(..index, 1);
     v[0] = value;
 }
 
@@ -30,8 +29,12 @@ fn inverse_move_to_front(v: &mut [u8]) {
 }
 
 fn verify_context_map(ctx_map: &[u8]) -> Result<(), Error> {
+    let mut seen = [0u64; 4];
+    for &v in ctx_map {
+        seen[v as usize / 64] |= 1 << (v % 64);
+    }
     let num_histograms = *ctx_map.iter().max().unwrap() as u32 + 1;
-    let distinct_histograms = ctx_map.iter().collect::<HashSet<_>>().len() as u32;
+    let distinct_histograms = seen.iter().map(|s| s.count_ones()).sum();
     if distinct_histograms != num_histograms {
         return Err(Error::InvalidContextMapHole(
             num_histograms,
@@ -41,37 +44,95 @@ fn verify_context_map(ctx_map: &[u8]) -> Result<(), Error> {
     Ok(())
 }
 
+fn read_entries(
+    reader: &mut Reader<'_>,
+    br: &mut BitReader,
+    ctx_map: &mut [u8],
+) -> Result<(), Error> {
+    let mut symbols = [0u32; 64];
+    for chunk in ctx_map.chunks_mut(symbols.len()) {
+        let symbols = &mut symbols[..chunk.len()];
+        reader.read_many(br, 0, symbols)?;
+        for (v, &mv) in chunk.iter_mut().zip(symbols.iter()) {
+            if mv > u8::MAX as u32 {
+                return Err(Error::InvalidContextMap(mv));
+            }
+            *v = mv as u8;
+        }
+    }
+    reader.check_final_state()
+}
+
 pub fn decode_context_map(num_contexts: usize, br: &mut BitReader) -> Result<Vec<u8>, Error> {
+    let mut ctx_map = vec![];
+    decode_context_map_into(num_contexts, br, &mut ctx_map, &mut EntropyScratch::new())?;
+    Ok(ctx_map)
+}
+
+/// Same as `decode_context_map`, but reuses the allocation of `ctx_map`, and takes the buffers
+/// of the context map histograms from `scratch`.
+pub fn decode_context_map_into(
+    num_contexts: usize,
+    br: &mut BitReader,
+    ctx_map: &mut Vec<u8>,
+    scratch: &mut EntropyScratch,
+) -> Result<(), Error> {
+    ctx_map.clear();
+    ctx_map.resize(num_contexts, 0);
     let is_simple = br.read(1)? != 0;
     if is_simple {
         let bits_per_entry = br.read(2)? as usize;
         if bits_per_entry != 0 {
-            (0..num_contexts)
-                .map(|_| Ok(br.read(bits_per_entry)? as u8))
-                .collect()
-        } else {
-            Ok(vec![0u8; num_contexts])
+            for v in ctx_map.iter_mut() {
+                *v = br.read(bits_per_entry)? as u8;
+            }
         }
     } else {
         let use_mtf = br.read(1)? != 0;
-        let histograms = Histograms::decode(1, br, /*allow_lz77=*/ num_contexts > 2)?;
-        let reader = histograms.make_reader(br)?;
-
-        let mut ctx_map: Vec<u8> = (0..num_contexts)
-            .map(|_| {
-                let mv = reader.read(br, 0usize)?;
-                if mv > u8::MAX as u32 {
-                    Err(Error::InvalidContextMap(mv))
-                } else {
-                    Ok(mv as u8)
-                }
-            })
-            .collect::<Result<_, _>>()?;
-        reader.check_final_state()?;
+        let histograms =
+            Histograms::decode_with_scratch(1, br, /*allow_lz77=*/ num_contexts > 2, scratch)?;
+        let result = histograms
+            .make_reader_with_scratch(br, None, scratch)
+            .and_then(|mut reader| {
+                let result = read_entries(&mut reader, br, ctx_map);
+                reader.recycle(scratch);
+                result
+            });
+        histograms.recycle(scratch);
+        result?;
         if use_mtf {
             inverse_move_to_front(&mut ctx_map[..]);
         }
-        verify_context_map(&ctx_map[..])?;
-        Ok(ctx_map)
+    }
+    verify_context_map(&ctx_map[..])
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_inverse_move_to_front() {
+        let mut v = [0, 1, 1, 0, 2, 255, 0];
+        inverse_move_to_front(&mut v);
+        assert_eq!(v, [0, 1, 0, 0, 2, 255, 255]);
+    }
+
+    #[test]
+    fn test_verify_context_map() {
+        assert!(verify_context_map(&[0, 2, 1, 2]).is_ok());
+        assert!(verify_context_map(&[255, 0, 200, 64, 63]).is_err());
+        let all: Vec<u8> = (0..=255).rev().collect();
+        assert!(verify_context_map(&all).is_ok());
+    }
+
+    #[test]
+    fn test_simple_context_map() -> Result<(), Error> {
+        // Simple, 2 bits per entry: 0, 1, 3, 2.
+        let mut br = BitReader::new(&[0xa5, 0x05]);
+        let mut ctx_map = vec![7; 20];
+        decode_context_map_into(4, &mut br, &mut ctx_map, &mut EntropyScratch::new())?;
+        assert_eq!(ctx_map, [0, 1, 3, 2]);
+        Ok(())
     }
 }
@@ -8,13 +8,18 @@ extern crate jxl_headers_derive;
 use jxl_headers_derive::UnconditionalCoder;
 
 use crate::bit_reader::BitReader;
-#[allow(unused_imports)]
 use crate::entropy_coding::ans::*;
 use crate::entropy_coding::context_map::*;
 use crate::entropy_coding::huffman::*;
 use crate::entropy_coding::hybrid_uint::*;
+use crate::entropy_coding::lz77::*;
+use crate::entropy_coding::scratch::EntropyScratch;
 use crate::error::Error;
 use crate::headers::encodings::*;
+use crate::stats::{record_table_build, Timer};
+use crate::trace::StageTrace;
+use std::collections::HashMap;
+use std::sync::Arc;
 
 pub fn decode_varint16(br: &mut BitReader) -> Result<u16, Error> {
     if br.read(1)? != 0 {
@@ -43,6 +48,7 @@ struct LZ77Params {
 #[derive(Debug)]
 enum Codes {
     Huffman(HuffmanCodes),
+    Ans(AnsCodes),
 }
 
 #[derive(Debug)]
@@ -55,33 +61,195 @@ pub struct Histograms {
     codes: Codes,
 }
 
+#[derive(Debug)]
+struct Lz77State {
+    window: Lz77Window,
+    min_symbol: u32,
+    min_length: u32,
+    dist_multiplier: usize,
+    distance_cluster: usize,
+}
+
 #[derive(Debug)]
 pub struct Reader<'a> {
     histograms: &'a Histograms,
+    ans_reader: AnsReader,
+    lz77: Option<Lz77State>,
+    // Symbols read with each cluster.
+    #[cfg(feature = "stats")]
+    symbol_counts: Vec<u64>,
+    // Collector of the decode that reads with the histograms (which may come from a cache),
+    // and index of the histograms in its stats.
+    #[cfg(feature = "stats")]
+    stats: Option<(crate::stats::StatsCollector, usize)>,
+}
+
+#[cfg(feature = "stats")]
+impl Drop for Reader<'_> {
+    fn drop(&mut self) {
+        if let Some((collector, index)) = &self.stats {
+            collector.collect(|| crate::stats::record_symbols(*index, &self.symbol_counts));
+        }
+    }
 }
 
 impl<'a> Reader<'a> {
-    fn read_internal(
-        &self,
+    #[cfg(feature = "stats")]
+    #[inline]
+    fn count_symbols(&mut self, cluster: usize, num: usize) {
+        self.symbol_counts[cluster] += num as u64;
+    }
+
+    #[cfg(not(feature = "stats"))]
+    #[inline(always)]
+    fn count_symbols(&mut self, _cluster: usize, _num: usize) {}
+
+    #[inline]
+    fn read_token(
+        codes: &Codes,
+        ans_reader: &mut AnsReader,
         br: &mut BitReader,
-        uint_config: &HybridUint,
         cluster: usize,
     ) -> Result<u32, Error> {
-        let symbol = match &self.histograms.codes {
-            Codes::Huffman(hc) => hc.read(br, cluster)?,
-        };
-        uint_config.read(symbol, br)
+        match codes {
+            Codes::Huffman(hc) => hc.read(br, cluster),
+            Codes::Ans(ans) => ans_reader.read(ans, br, cluster),
+        }
+    }
+
+    fn read_lz77(&mut self, br: &mut BitReader, cluster: usize) -> Result<u32, Error> {
+        let histograms = self.histograms;
+        let lz77 = self.lz77.as_mut().unwrap();
+        if let Some(symbol) = lz77.window.next_copied() {
+            return Ok(symbol);
+        }
+        let token = Self::read_token(&histograms.codes, &mut self.ans_reader, br, cluster)?;
+        if token < lz77.min_symbol {
+            let symbol = histograms.uint_configs[cluster].read(token, br)?;
+            lz77.window.push_literal(symbol);
+            return Ok(symbol);
+        }
+        let length = histograms
+            .lz77_length_uint
+            .as_ref()
+            .unwrap()
+            .read(token - lz77.min_symbol, br)? as usize
+            + lz77.min_length as usize;
+        let cluster = lz77.distance_cluster;
+        let token = Self::read_token(&histograms.codes, &mut self.ans_reader, br, cluster)?;
+        let distance = histograms.uint_configs[cluster].read(token, br)? as usize;
+        let distance = lz77_distance(distance, lz77.dist_multiplier);
+        Ok(lz77.window.start_copy(distance, length))
+    }
+
+    pub fn read(&mut self, br: &mut BitReader, context: usize) -> Result<u32, Error> {
+        let cluster = self.histograms.context_map[context] as usize;
+        self.count_symbols(cluster, 1);
+        if self.lz77.is_some() {
+            return self.read_lz77(br, cluster);
+        }
+        let token = Self::read_token(&self.histograms.codes, &mut self.ans_reader, br, cluster)?;
+        self.histograms.uint_configs[cluster].read(token, br)
     }
 
-    pub fn read(&self, br: &mut BitReader, context: usize) -> Result<u32, Error> {
-        assert!(!self.histograms.lz77_params.enabled);
+    /// Reads `out.len()` symbols that all use the given context.
+    pub fn read_many(
+        &mut self,
+        br: &mut BitReader,
+        context: usize,
+        out: &mut [u32],
+    ) -> Result<(), Error> {
         let cluster = self.histograms.context_map[context] as usize;
-        self.read_internal(br, &self.histograms.uint_configs[cluster], cluster)
+        self.count_symbols(cluster, out.len());
+        if self.lz77.is_some() {
+            let mut pos = 0;
+            while pos < out.len() {
+                pos += self
+                    .lz77
+                    .as_mut()
+                    .unwrap()
+                    .window
+                    .drain_copied(&mut out[pos..]);
+                if pos < out.len() {
+                    out[pos] = self.read_lz77(br, cluster)?;
+                    pos += 1;
+                }
+            }
+            return Ok(());
+        }
+        // Each iteration needs at most 12 bits for one or two prefix codes (or 16 for ANS),
+        // plus 29 bits for the uint config, so a single refill is enough.
+        let uint_config = &self.histograms.uint_configs[cluster];
+        match &self.histograms.codes {
+            Codes::Huffman(hc) => {
+                let mut pos = 0;
+                while pos < out.len() {
+                    br.refill_unchecked();
+                    // If two symbols were read, the first one is below the split token and
+                    // does not need to go through the uint config.
+                    let n = hc.read_up_to_two_unchecked(br, cluster, &mut out[pos..])?;
+                    pos += n;
+                    out[pos - 1] = uint_config.read_unchecked(out[pos - 1], br)?;
+                }
+            }
+            Codes::Ans(ans) => {
+                for v in out.iter_mut() {
+                    br.refill_unchecked();
+                    let token = self.ans_reader.read_unchecked(ans, br, cluster);
+                    *v = uint_config.read_unchecked(token, br)?;
+                }
+            }
+        }
+        br.check_overflow()
     }
 
-    pub fn check_final_state(self) -> Result<(), Error> {
+    /// Reads one symbol for each entry of `contexts` into the corresponding entry of `out`.
+    pub fn read_many_with_contexts(
+        &mut self,
+        br: &mut BitReader,
+        contexts: &[usize],
+        out: &mut [u32],
+    ) -> Result<(), Error> {
+        assert_eq!(contexts.len(), out.len());
+        let histograms = self.histograms;
+        for &ctx in contexts {
+            self.count_symbols(histograms.context_map[ctx] as usize, 1);
+        }
+        if self.lz77.is_some() {
+            for (v, &ctx) in out.iter_mut().zip(contexts) {
+                *v = self.read_lz77(br, histograms.context_map[ctx] as usize)?;
+            }
+            return Ok(());
+        }
+        match &histograms.codes {
+            Codes::Huffman(hc) => {
+                for (v, &ctx) in out.iter_mut().zip(contexts) {
+                    let cluster = histograms.context_map[ctx] as usize;
+                    *v = histograms.uint_configs[cluster].read(hc.read(br, cluster)?, br)?;
+                }
+            }
+            Codes::Ans(ans) => {
+                for (v, &ctx) in out.iter_mut().zip(contexts) {
+                    let cluster = histograms.context_map[ctx] as usize;
+                    let token = self.ans_reader.read(ans, br, cluster)?;
+                    *v = histograms.uint_configs[cluster].read(token, br)?;
+                }
+            }
+        }
+        Ok(())
+    }
+
+    pub fn check_final_state(&self) -> Result<(), Error> {
         match &self.histograms.codes {
             Codes::Huffman(_) => Ok(()),
+            Codes::Ans(_) => self.ans_reader.check_final_state(),
+        }
+    }
+
+    /// Returns the LZ77 window to `scratch`.
+    pub fn recycle(mut self, scratch: &mut EntropyScratch) {
+        if let Some(lz77) = self.lz77.take() {
+            scratch.lz77_windows.give(lz77.window.into_buffer());
         }
     }
 }
@@ -92,6 +260,18 @@ impl Histograms {
         br: &mut BitReader,
         allow_lz77: bool,
     ) -> Result<Histograms, Error> {
+        Histograms::decode_with_scratch(num_contexts, br, allow_lz77, &mut EntropyScratch::new())
+    }
+
+    /// Same as `decode`, but takes all the buffers from `scratch`. Use `recycle` to return
+    /// them once the histograms are no longer needed.
+    pub fn decode_with_scratch(
+        num_contexts: usize,
+        br: &mut BitReader,
+        allow_lz77: bool,
+        scratch: &mut EntropyScratch,
+    ) -> Result<Histograms, Error> {
+        let stage = StageTrace::start("histograms", br);
         let lz77_params = LZ77Params::read_unconditional(&(), br, &Empty {})?;
         if !allow_lz77 && lz77_params.enabled {
             return Err(Error::LZ77Disallowed);
@@ -105,16 +285,67 @@ impl Histograms {
             (num_contexts, None)
         };
 
-        let context_map = if num_contexts > 1 {
-            decode_context_map(num_contexts, br)?
-        } else {
-            vec![0]
-        };
-        // TODO(veluca93): debug print.
-        println!(
-            "nc: {} {:?} {:?} {:?}",
-            num_contexts, lz77_params, context_map, lz77_length_uint
+        let mut context_map = scratch.bytes.take();
+        let mut uint_configs = scratch.uint_configs.take();
+        let result = Histograms::decode_clusters(
+            num_contexts,
+            br,
+            lz77_params.enabled,
+            &mut context_map,
+            &mut uint_configs,
+            scratch,
         );
+        let (log_alpha_size, codes) = match result {
+            Ok(result) => result,
+            Err(err) => {
+                scratch.bytes.give(context_map);
+                scratch.uint_configs.give(uint_configs);
+                return Err(err);
+            }
+        };
+        let num_histograms = uint_configs.len();
+        let use_prefix_code = matches!(codes, Codes::Huffman(_));
+
+        stage.note(|| {
+            format!(
+                "{} contexts, {} clusters, {}, lz77: {:?}",
+                num_contexts,
+                num_histograms,
+                if use_prefix_code {
+                    "prefix codes"
+                } else {
+                    "ANS"
+                },
+                lz77_params
+            )
+        });
+        stage.finish(br);
+
+        Ok(Histograms {
+            lz77_params,
+            lz77_length_uint,
+            context_map,
+            log_alpha_size,
+            uint_configs,
+            codes,
+        })
+    }
+
+    /// Decodes the context map into `context_map`, the uint configs of the clusters into
+    /// `uint_configs`, and returns the log alphabet size and the entropy codes.
+    fn decode_clusters(
+        num_contexts: usize,
+        br: &mut BitReader,
+        lz77_enabled: bool,
+        context_map: &mut Vec<u8>,
+        uint_configs: &mut Vec<HybridUint>,
+        scratch: &mut EntropyScratch,
+    ) -> Result<(usize, Codes), Error> {
+        if num_contexts > 1 {
+            decode_context_map_into(num_contexts, br, context_map, scratch)?;
+        } else {
+            context_map.push(0);
+        }
         assert_eq!(context_map.len(), num_contexts);
 
         let use_prefix_code = br.read(1)? != 0;
@@ -124,37 +355,84 @@ impl Histograms {
             br.read(2)? as usize + 5
         };
         let num_histograms = *context_map.iter().max().unwrap() + 1;
-        let uint_configs = ((0..num_histograms).map(|_| HybridUint::decode(log_alpha_size, br)))
-            .collect::<Result<_, _>>()?;
+        for _ in 0..num_histograms {
+            uint_configs.push(HybridUint::decode(log_alpha_size, br)?);
+        }
 
+        let timer = Timer::start();
         let codes = if use_prefix_code {
-            Codes::Huffman(HuffmanCodes::decode(num_histograms as usize, br)?)
+            // With LZ77, a token may be followed by a distance token, so it cannot be paired
+            // with the next one.
+            let mut pair_limits = scratch.counts.take();
+            pair_limits.extend(uint_configs.iter().map(|c| {
+                if lz77_enabled {
+                    0
+                } else {
+                    c.split_token()
+                }
+            }));
+            let codes = HuffmanCodes::decode(&pair_limits, br, scratch);
+            scratch.counts.give(pair_limits);
+            Codes::Huffman(codes?)
         } else {
-            unimplemented!();
+            Codes::Ans(AnsCodes::decode(
+                num_histograms as usize,
+                log_alpha_size,
+                br,
+                scratch,
+            )?)
         };
+        record_table_build(timer);
+        Ok((log_alpha_size, codes))
+    }
 
-        Ok(Histograms {
-            lz77_params,
-            lz77_length_uint,
-            context_map,
-            log_alpha_size,
-            uint_configs,
-            codes,
-        })
+    /// Returns the buffers of the histograms to `scratch`.
+    pub fn recycle(self, scratch: &mut EntropyScratch) {
+        scratch.bytes.give(self.context_map);
+        scratch.uint_configs.give(self.uint_configs);
+        match self.codes {
+            Codes::Huffman(hc) => hc.recycle(scratch),
+            Codes::Ans(ans) => ans.recycle(scratch),
+        }
     }
-    fn make_reader_impl(
+
+    /// Same as `make_reader` or `make_reader_with_width`, but takes the LZ77 window from
+    /// `scratch`. Use `Reader::recycle` to return it.
+    pub fn make_reader_with_scratch(
         &self,
-        _br: &mut BitReader,
-        _image_width: Option<usize>,
-    ) -> Result<Reader, Error> {
-        if self.lz77_params.enabled {
-            unimplemented!()
-        }
-        Ok(Reader { histograms: self })
+        br: &mut BitReader,
+        image_width: Option<usize>,
+        scratch: &mut EntropyScratch,
+    ) -> Result<Reader<'_>, Error> {
+        let ans_reader = match self.codes {
+            Codes::Huffman(_) => AnsReader::new_unused(),
+            Codes::Ans(_) => AnsReader::new(br)?,
+        };
+        let lz77 = if self.lz77_params.enabled {
+            Some(Lz77State {
+                window: Lz77Window::with_buffer(scratch.lz77_windows.take()),
+                min_symbol: self.lz77_params.min_symbol.unwrap(),
+                min_length: self.lz77_params.min_length.unwrap(),
+                dist_multiplier: image_width.unwrap_or(0),
+                distance_cluster: *self.context_map.last().unwrap() as usize,
+            })
+        } else {
+            None
+        };
+        Ok(Reader {
+            histograms: self,
+            ans_reader,
+            lz77,
+            #[cfg(feature = "stats")]
+            symbol_counts: vec![0; self.uint_configs.len()],
+            #[cfg(feature = "stats")]
+            stats: crate::stats::record_histograms(self.context_map.len(), self.uint_configs.len())
+                .map(|index| (crate::stats::StatsCollector::current(), index)),
+        })
     }
 
     pub fn make_reader(&self, br: &mut BitReader) -> Result<Reader, Error> {
-        self.make_reader_impl(br, None)
+        self.make_reader_with_scratch(br, None, &mut EntropyScratch::new())
     }
 
     pub fn make_reader_with_width(
@@ -162,6 +440,336 @@ impl Histograms {
         br: &mut BitReader,
         image_width: usize,
     ) -> Result<Reader, Error> {
-        self.make_reader_impl(br, Some(image_width))
+        self.make_reader_with_scratch(br, Some(image_width), &mut EntropyScratch::new())
+    }
+}
+
+/// Identifies a `Histograms` section in a `HistogramsCache`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct HistogramsKey {
+    /// Identifies the file, e.g. a hash of its contents.
+    pub content_hash: u64,
+    /// Position of the section from the start of the codestream, in bits.
+    pub bit_offset: usize,
+    pub num_contexts: usize,
+    pub allow_lz77: bool,
+}
+
+#[derive(Debug)]
+struct CacheEntry {
+    histograms: Arc<Histograms>,
+    // Size of the encoded histograms, in bits.
+    num_bits: usize,
+    last_use: u64,
+}
+
+/// Opt-in cache of decoded `Histograms`, for callers that decode the same sections of a file
+/// repeatedly (e.g. for different crops). On a hit, table construction is skipped entirely and
+/// the reader just skips over the section. Once the cache is full, the least recently used
+/// histograms are evicted.
+#[derive(Debug)]
+pub struct HistogramsCache {
+    entries: HashMap<HistogramsKey, CacheEntry>,
+    max_entries: usize,
+    num_uses: u64,
+}
+
+impl Default for HistogramsCache {
+    fn default() -> HistogramsCache {
+        HistogramsCache::new()
+    }
+}
+
+impl HistogramsCache {
+    const DEFAULT_MAX_ENTRIES: usize = 64;
+
+    pub fn new() -> HistogramsCache {
+        HistogramsCache::with_capacity(HistogramsCache::DEFAULT_MAX_ENTRIES)
+    }
+
+    /// Creates a cache that holds at most `max_entries` histograms.
+    pub fn with_capacity(max_entries: usize) -> HistogramsCache {
+        HistogramsCache {
+            entries: HashMap::new(),
+            max_entries,
+            num_uses: 0,
+        }
+    }
+
+    /// Same as `Histograms::decode`, but returns a cached copy if the histograms at this
+    /// position of this file were decoded before. `bit_offset` is the position of `br` from
+    /// the start of the codestream, in bits, and `content_hash` identifies the file; files with
+    /// the same hash must have the same codestream.
+    pub fn decode(
+        &mut self,
+        content_hash: u64,
+        bit_offset: usize,
+        num_contexts: usize,
+        br: &mut BitReader,
+        allow_lz77: bool,
+    ) -> Result<Arc<Histograms>, Error> {
+        let key = HistogramsKey {
+            content_hash,
+            bit_offset,
+            num_contexts,
+            allow_lz77,
+        };
+        self.num_uses += 1;
+        if let Some(entry) = self.entries.get_mut(&key) {
+            br.skip_bits(entry.num_bits)?;
+            entry.last_use = self.num_uses;
+            return Ok(entry.histograms.clone());
+        }
+        let start = br.total_bits_read();
+        let histograms = Arc::new(Histograms::decode(num_contexts, br, allow_lz77)?);
+        if self.max_entries == 0 {
+            return Ok(histograms);
+        }
+        if self.entries.len() >= self.max_entries {
+            let oldest = *self
+                .entries
+                .iter()
+                .min_by_key(|(_, entry)| entry.last_use)
+                .unwrap()
+                .0;
+            self.entries.remove(&oldest);
+        }
+        let entry = CacheEntry {
+            histograms: histograms.clone(),
+            num_bits: br.total_bits_read() - start,
+            last_use: self.num_uses,
+        };
+        self.entries.insert(key, entry);
+        Ok(histograms)
+    }
+
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+
+    pub fn clear(&mut self) {
+        self.entries.clear();
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::test_util::BitWriter;
+
+    // Histograms with a single prefix code over the alphabet 0..256, in which
+    // 0, 1, 2 and `last` have 2-bit codes.
+    fn write_histograms(bw: &mut BitWriter, lz77: bool, last: u64) {
+        bw.write(1, lz77 as u64);
+        if lz77 {
+            // min_symbol = 224, min_length = 3.
+            bw.write(2, 0);
+            bw.write(2, 0);
+            // LZ77 length uint config: split_exponent = 8.
+            bw.write(4, 8);
+            // Simple context map, with both contexts in cluster 0.
+            bw.write(1, 1);
+            bw.write(2, 0);
+        }
+        // Prefix codes, uint config with split_exponent = 15.
+        bw.write(1, 1);
+        bw.write(4, 15);
+        // Alphabet size: 1 + varint16(255).
+        bw.write(1, 1);
+        bw.write(4, 7);
+        bw.write(7, 127);
+        // Simple code with 4 symbols of 8 bits each.
+        bw.write(2, 1);
+        bw.write(2, 3);
+        for sym in [0, 1, 2, last].iter() {
+            bw.write(8, *sym);
+        }
+        bw.write(1, 0);
+    }
+
+    /// Writes the 2-bit code of the symbol at `index` in the code of `write_histograms`; prefix
+    /// codes are written starting from their most significant bit.
+    fn write_code(bw: &mut BitWriter, index: u64) {
+        bw.write(2, (index >> 1) | (index & 1) << 1);
+    }
+
+    fn check_read_many(
+        lz77: bool,
+        last: u64,
+        codes: &[u64],
+        expected: &[u32],
+    ) -> Result<(), Error> {
+        let mut bw = BitWriter::default();
+        write_histograms(&mut bw, lz77, last);
+        for code in codes.iter() {
+            write_code(&mut bw, *code);
+        }
+        bw.write(64, 0);
+        let num_contexts = 1;
+
+        let mut br = BitReader::new(&bw.data);
+        let histograms = Histograms::decode(num_contexts, &mut br, true)?;
+        let mut reader = histograms.make_reader(&mut br)?;
+        let single: Vec<u32> = (0..expected.len())
+            .map(|_| reader.read(&mut br, 0))
+            .collect::<Result<_, _>>()?;
+        assert_eq!(single, expected);
+
+        let mut br = BitReader::new(&bw.data);
+        let histograms = Histograms::decode(num_contexts, &mut br, true)?;
+        let mut reader = histograms.make_reader(&mut br)?;
+        let mut many = vec![0; expected.len()];
+        reader.read_many(&mut br, 0, &mut many[..2])?;
+        reader.read_many(&mut br, 0, &mut many[2..])?;
+        assert_eq!(many, expected);
+
+        let mut br = BitReader::new(&bw.data);
+        let histograms = Histograms::decode(num_contexts, &mut br, true)?;
+        let mut reader = histograms.make_reader(&mut br)?;
+        let contexts = vec![0; expected.len()];
+        reader.read_many_with_contexts(&mut br, &contexts, &mut many)?;
+        assert_eq!(many, expected);
+        Ok(())
+    }
+
+    #[test]
+    fn test_read_many() -> Result<(), Error> {
+        check_read_many(false, 3, &[0, 1, 2, 3, 3, 1], &[0, 1, 2, 3, 3, 1])
+    }
+
+    #[test]
+    fn test_read_many_lz77() -> Result<(), Error> {
+        // Symbol 225 is a copy of length 4, with distance symbol 0 (distance 1).
+        check_read_many(true, 225, &[1, 2, 3, 0, 1], &[1, 2, 2, 2, 2, 2, 1])
+    }
+
+    #[test]
+    fn test_scratch_reuse() -> Result<(), Error> {
+        let mut bw = BitWriter::default();
+        write_histograms(&mut bw, true, 225);
+        for code in [1, 2, 3, 0, 1].iter() {
+            write_code(&mut bw, *code);
+        }
+        bw.write(64, 0);
+
+        let mut scratch = EntropyScratch::new();
+        let mut num_free_buffers = vec![];
+        for _ in 0..3 {
+            let mut br = BitReader::new(&bw.data);
+            let histograms = Histograms::decode_with_scratch(1, &mut br, true, &mut scratch)?;
+            let mut reader = histograms.make_reader_with_scratch(&mut br, None, &mut scratch)?;
+            let mut out = vec![0; 7];
+            reader.read_many(&mut br, 0, &mut out)?;
+            assert_eq!(out, [1, 2, 2, 2, 2, 2, 1]);
+            reader.recycle(&mut scratch);
+            histograms.recycle(&mut scratch);
+            num_free_buffers.push(scratch.num_free_buffers());
+        }
+        // All the buffers taken after the first decode were reused.
+        assert!(num_free_buffers[0] > 0);
+        assert_eq!(num_free_buffers[1], num_free_buffers[0]);
+        assert_eq!(num_free_buffers[2], num_free_buffers[0]);
+        scratch.clear();
+        assert_eq!(scratch.num_free_buffers(), 0);
+        Ok(())
+    }
+
+    #[test]
+    fn test_scratch_reuse_after_error() -> Result<(), Error> {
+        let mut bw = BitWriter::default();
+        write_histograms(&mut bw, true, 225);
+        let data = bw.data;
+
+        let mut scratch = EntropyScratch::new();
+        let histograms =
+            Histograms::decode_with_scratch(1, &mut BitReader::new(&data), true, &mut scratch)?;
+        histograms.recycle(&mut scratch);
+        let num_free_buffers = scratch.num_free_buffers();
+        let mut num_errors = 0;
+        for len in 0..data.len() {
+            let mut br = BitReader::new(&data[..len]);
+            match Histograms::decode_with_scratch(1, &mut br, true, &mut scratch) {
+                Ok(histograms) => histograms.recycle(&mut scratch),
+                Err(_) => num_errors += 1,
+            }
+            // Failed decodes give back the buffers they took.
+            assert_eq!(scratch.num_free_buffers(), num_free_buffers);
+        }
+        assert!(num_errors > 0);
+        Ok(())
+    }
+
+    #[test]
+    fn test_histograms_cache() -> Result<(), Error> {
+        let mut bw = BitWriter::default();
+        bw.write(7, 0);
+        write_histograms(&mut bw, false, 3);
+        bw.write(2, 3);
+        bw.write(64, 0);
+
+        let mut cache = HistogramsCache::with_capacity(2);
+        let mut decode = |hash, bit_offset| -> Result<_, Error> {
+            let mut br = BitReader::new(&bw.data);
+            br.skip_bits(7)?;
+            let histograms = cache.decode(hash, bit_offset, 1, &mut br, false)?;
+            assert_eq!(histograms.make_reader(&mut br)?.read(&mut br, 0)?, 3);
+            Ok((histograms, br.total_bits_read()))
+        };
+        let (first, first_bits) = decode(1, 7)?;
+        let (second, second_bits) = decode(1, 7)?;
+        assert!(Arc::ptr_eq(&first, &second));
+        assert_eq!(first_bits, second_bits);
+        // Another file, or another position, is not a hit.
+        let (other_file, _) = decode(2, 7)?;
+        assert!(!Arc::ptr_eq(&first, &other_file));
+        // The cache is full, so the least recently used entry, (1, 7), is evicted.
+        let (other_offset, _) = decode(1, 1007)?;
+        assert!(!Arc::ptr_eq(&first, &other_offset));
+        assert!(Arc::ptr_eq(&decode(1, 1007)?.0, &other_offset));
+        assert!(Arc::ptr_eq(&decode(2, 7)?.0, &other_file));
+        assert!(!Arc::ptr_eq(&decode(1, 7)?.0, &first));
+        assert_eq!(cache.len(), 2);
+        Ok(())
+    }
+
+    #[cfg(feature = "stats")]
+    #[test]
+    fn test_cached_histograms_stats() -> Result<(), Error> {
+        use crate::stats::StatsCollector;
+        let mut bw = BitWriter::default();
+        write_histograms(&mut bw, false, 3);
+        bw.write(2, 3);
+        bw.write(2, 3);
+        bw.write(64, 0);
+
+        let mut cache = HistogramsCache::new();
+        let mut decode = |num_symbols| -> Result<_, Error> {
+            let collector = StatsCollector::new();
+            let histograms = collector.collect(|| -> Result<_, Error> {
+                let mut br = BitReader::new(&bw.data);
+                let histograms = cache.decode(1, 0, 1, &mut br, false)?;
+                let mut reader = histograms.make_reader(&mut br)?;
+                for _ in 0..num_symbols {
+                    assert_eq!(reader.read(&mut br, 0)?, 3);
+                }
+                // The counts are recorded when the reader is dropped.
+                drop(reader);
+                Ok(histograms)
+            })?;
+            Ok((histograms, collector.stats()))
+        };
+        let (first, first_stats) = decode(1)?;
+        let (second, second_stats) = decode(2)?;
+        assert!(Arc::ptr_eq(&first, &second));
+        // Each decode counts the symbols it read with the cached histograms.
+        assert_eq!(first_stats.histograms.len(), 1);
+        assert_eq!(first_stats.histograms[0].symbols, [1]);
+        assert_eq!(second_stats.histograms.len(), 1);
+        assert_eq!(second_stats.histograms[0].symbols, [2]);
+        Ok(())
     }
 }
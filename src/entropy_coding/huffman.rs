@@ -5,24 +5,109 @@
 
 use crate::bit_reader::BitReader;
 use crate::entropy_coding::decode::*;
+use crate::entropy_coding::scratch::EntropyScratch;
 use crate::error::Error;
 use crate::util::*;
 
 pub const HUFFMAN_MAX_BITS: usize = 15;
-const TABLE_BITS: usize = 8;
-const TABLE_SIZE: usize = 1 << TABLE_BITS;
+/* Lookup tables of the simple codes, indexed by the next bits of the stream: the length of each
+code and the index of its symbol. They are never larger than their longest code. */
+const SIMPLE_CODE_1: [(u8, u8); 1] = [(0, 0)];
+const SIMPLE_CODE_2: [(u8, u8); 2] = [(1, 0), (1, 1)];
+const SIMPLE_CODE_3: [(u8, u8); 4] = [(1, 0), (2, 1), (1, 0), (2, 2)];
+const SIMPLE_CODE_4: [(u8, u8); 4] = [(2, 0), (2, 2), (2, 1), (2, 3)];
+const SIMPLE_CODE_4_TREE: [(u8, u8); 8] = [
+    (1, 0),
+    (2, 1),
+    (1, 0),
+    (3, 2),
+    (1, 0),
+    (2, 1),
+    (1, 0),
+    (3, 3),
+];
+/// Largest root size of the single-level lookup tables used for decoding.
+pub const MAX_ROOT_TABLE_BITS: usize = 12;
 const CODE_LENGTHS_CODE: usize = 18;
 const DEFAULT_CODE_LENGTH: u8 = 8;
 const CODE_LENGTH_REPEAT_CODE: u8 = 16;
 
 #[derive(Debug, Clone, Copy)]
-struct TableEntry {
+pub(crate) struct TableEntry {
     bits: u8,
     value: u16,
 }
 
+/* Lookup table entry, packed in a single u32:
+- bits 0..4: length of the first code
+- bits 4..8: total length of both codes, for pairs
+- bits 8..10: kind of entry:
+  - ENTRY_LONG: the code is longer than the root table, and must be decoded with `entries`
+  - ENTRY_SINGLE: one symbol, in bits 10..25
+  - ENTRY_PAIR: two symbols, in bits 10..21 and 21..32 */
+#[derive(Debug, Clone, Copy)]
+pub(crate) struct PackedEntry(u32);
+
+const ENTRY_LONG: u32 = 0;
+const ENTRY_SINGLE: u32 = 1;
+const ENTRY_PAIR: u32 = 2;
+const PAIR_SYMBOL_BITS: usize = 11;
+
+impl PackedEntry {
+    fn single(bits: u8, value: u16) -> PackedEntry {
+        PackedEntry(bits as u32 | ENTRY_SINGLE << 8 | (value as u32) << 10)
+    }
+
+    fn pair(bits0: u8, value0: u16, bits1: u8, value1: u16) -> PackedEntry {
+        debug_assert!(bits0 + bits1 < 16);
+        debug_assert!((value0 as u32) < 1 << PAIR_SYMBOL_BITS);
+        debug_assert!((value1 as u32) < 1 << PAIR_SYMBOL_BITS);
+        PackedEntry(
+            bits0 as u32
+                | ((bits0 + bits1) as u32) << 4
+                | ENTRY_PAIR << 8
+                | (value0 as u32) << 10
+                | (value1 as u32) << (10 + PAIR_SYMBOL_BITS),
+        )
+    }
+
+    #[inline]
+    fn kind(self) -> u32 {
+        (self.0 >> 8) & 3
+    }
+
+    #[inline]
+    fn first_bits(self) -> usize {
+        (self.0 & 0xf) as usize
+    }
+
+    #[inline]
+    fn total_bits(self) -> usize {
+        ((self.0 >> 4) & 0xf) as usize
+    }
+
+    #[inline]
+    fn first_value(self) -> u32 {
+        if self.kind() == ENTRY_SINGLE {
+            (self.0 >> 10) & 0x7fff
+        } else {
+            (self.0 >> 10) & ((1 << PAIR_SYMBOL_BITS) - 1)
+        }
+    }
+
+    #[inline]
+    fn second_value(self) -> u32 {
+        self.0 >> (10 + PAIR_SYMBOL_BITS)
+    }
+}
+
 #[derive(Debug)]
-struct Table {
+pub(crate) struct Table {
+    root_bits: usize,
+    // Indexed by the next `root_bits` bits of the stream.
+    packed: Vec<PackedEntry>,
+    // Two-level table with a root of `root_bits` bits, only kept if some codes are
+    // longer than that.
     entries: Vec<TableEntry>,
 }
 
@@ -62,7 +147,11 @@ fn next_table_bit_size(count: &[u16], len: usize, root_bits: usize) -> usize {
 }
 
 impl Table {
-    fn decode_simple_table(al_size: usize, br: &mut BitReader) -> Result<Vec<TableEntry>, Error> {
+    fn decode_simple_table(
+        al_size: usize,
+        br: &mut BitReader,
+        ret: &mut Vec<TableEntry>,
+    ) -> Result<(), Error> {
         let max_bits = al_size.ceil_log2();
         let num_symbols = (br.read(2)? + 1) as usize;
         let mut symbols = [0u16; 4];
@@ -73,7 +162,7 @@ impl Table {
             }
             *symbol = sym as u16;
         }
-        if (0..num_symbols - 1).any(|i| symbols[..i].contains(&symbols[i + 1])) {
+        if (1..num_symbols).any(|i| symbols[..i].contains(&symbols[i])) {
             return Err(Error::InvalidHuffman);
         }
 
@@ -82,132 +171,63 @@ impl Table {
         } else {
             false
         };
-        if !special_4_symbols {
-            symbols.sort_unstable();
-        };
-        match (num_symbols, special_4_symbols) {
-            (1, _) => Ok(vec![
-                TableEntry {
-                    bits: 0,
-                    value: symbols[0]
-                };
-                TABLE_SIZE
-            ]),
+        // Codes of the same length are in the order of their symbols.
+        let layout: &[(u8, u8)] = match (num_symbols, special_4_symbols) {
+            (1, _) => &SIMPLE_CODE_1,
             (2, _) => {
-                let mut ret = Vec::with_capacity(TABLE_SIZE);
-                for _ in 0..(TABLE_SIZE >> 1) {
-                    ret.push(TableEntry {
-                        bits: 1,
-                        value: symbols[0],
-                    });
-                    ret.push(TableEntry {
-                        bits: 1,
-                        value: symbols[1],
-                    });
-                }
-                Ok(ret)
+                symbols[..2].sort_unstable();
+                &SIMPLE_CODE_2
             }
             (3, _) => {
-                let mut ret = Vec::with_capacity(TABLE_SIZE);
-                for _ in 0..(TABLE_SIZE >> 2) {
-                    ret.push(TableEntry {
-                        bits: 1,
-                        value: symbols[0],
-                    });
-                    ret.push(TableEntry {
-                        bits: 1,
-                        value: symbols[0],
-                    });
-                    ret.push(TableEntry {
-                        bits: 2,
-                        value: symbols[1],
-                    });
-                    ret.push(TableEntry {
-                        bits: 2,
-                        value: symbols[2],
-                    });
-                }
-                Ok(ret)
+                symbols[1..3].sort_unstable();
+                &SIMPLE_CODE_3
             }
             (4, false) => {
-                let mut ret = Vec::with_capacity(TABLE_SIZE);
-                for _ in 0..(TABLE_SIZE >> 2) {
-                    ret.push(TableEntry {
-                        bits: 2,
-                        value: symbols[0],
-                    });
-                    ret.push(TableEntry {
-                        bits: 2,
-                        value: symbols[1],
-                    });
-                    ret.push(TableEntry {
-                        bits: 2,
-                        value: symbols[2],
-                    });
-                    ret.push(TableEntry {
-                        bits: 2,
-                        value: symbols[3],
-                    });
-                }
-                Ok(ret)
+                symbols.sort_unstable();
+                &SIMPLE_CODE_4
             }
             (4, true) => {
-                let mut ret = Vec::with_capacity(TABLE_SIZE);
                 symbols[2..4].sort_unstable();
-                for _ in 0..(TABLE_SIZE >> 3) {
-                    ret.push(TableEntry {
-                        bits: 1,
-                        value: symbols[0],
-                    });
-                    ret.push(TableEntry {
-                        bits: 2,
-                        value: symbols[1],
-                    });
-                    ret.push(TableEntry {
-                        bits: 1,
-                        value: symbols[0],
-                    });
-                    ret.push(TableEntry {
-                        bits: 3,
-                        value: symbols[2],
-                    });
-                    ret.push(TableEntry {
-                        bits: 1,
-                        value: symbols[0],
-                    });
-                    ret.push(TableEntry {
-                        bits: 2,
-                        value: symbols[1],
-                    });
-                    ret.push(TableEntry {
-                        bits: 1,
-                        value: symbols[0],
-                    });
-                    ret.push(TableEntry {
-                        bits: 3,
-                        value: symbols[3],
-                    });
-                }
-                Ok(ret)
+                &SIMPLE_CODE_4_TREE
             }
             _ => unreachable!(),
-        }
+        };
+        ret.extend(layout.iter().map(|&(bits, index)| TableEntry {
+            bits,
+            value: symbols[index as usize],
+        }));
+        Ok(())
     }
 
     fn decode_huffman_code_lengths(
         code_length_code_lengths: [u8; CODE_LENGTHS_CODE],
         al_size: usize,
         br: &mut BitReader,
-    ) -> Result<Vec<u8>, Error> {
-        let table = Table::build(5, &code_length_code_lengths)?;
+        code_lengths: &mut Vec<u8>,
+        scratch: &mut EntropyScratch,
+    ) -> Result<(), Error> {
+        let mut table = scratch.table_entries.take();
+        let result = Table::build(5, &code_length_code_lengths, &mut table, scratch)
+            .and_then(|()| Table::read_code_lengths(&table, al_size, br, code_lengths));
+        scratch.table_entries.give(table);
+        result
+    }
 
+    /// Reads the `al_size` code lengths with the code length code in `table`.
+    fn read_code_lengths(
+        table: &[TableEntry],
+        al_size: usize,
+        br: &mut BitReader,
+        code_lengths: &mut Vec<u8>,
+    ) -> Result<(), Error> {
         let mut symbol = 0;
         let mut prev_code_len = DEFAULT_CODE_LENGTH;
-        let mut repeat = 0;
+        let mut repeat = 0usize;
         let mut repeat_code_len = 0;
-        let mut space = 1 << 15;
+        let mut space = 1isize << 15;
 
-        let mut code_lengths = vec![0u8; al_size];
+        code_lengths.clear();
+        code_lengths.resize(al_size, 0);
 
         while symbol < al_size && space > 0 {
             let idx = br.peek(5) as usize;
@@ -219,12 +239,10 @@ impl Table {
                 symbol += 1;
                 if code_len != 0 {
                     prev_code_len = code_len;
-                    space -= 32768usize >> code_len;
+                    space -= 32768 >> code_len;
                 }
             } else {
                 let extra_bits = code_len - 14;
-                let old_repeat;
-                let repeat_delta;
                 let new_len = if code_len == CODE_LENGTH_REPEAT_CODE {
                     prev_code_len
                 } else {
@@ -234,32 +252,38 @@ impl Table {
                     repeat = 0;
                     repeat_code_len = new_len;
                 }
-                old_repeat = repeat;
+                let old_repeat = repeat;
                 if repeat > 0 {
                     repeat -= 2;
                     repeat <<= extra_bits;
                 }
-                repeat += br.read(extra_bits as usize)? as u8 + 3;
-                repeat_delta = repeat - old_repeat;
-                if symbol + repeat_delta as usize > al_size {
+                repeat += br.read(extra_bits as usize)? as usize + 3;
+                let repeat_delta = repeat - old_repeat;
+                if symbol + repeat_delta > al_size {
                     return Err(Error::InvalidHuffman);
                 }
-                for i in 0..repeat_code_len {
-                    code_lengths[symbol + i as usize] = repeat_delta;
+                for len in code_lengths[symbol..symbol + repeat_delta].iter_mut() {
+                    *len = repeat_code_len;
                 }
-                symbol += repeat_delta as usize;
+                symbol += repeat_delta;
                 if repeat_code_len != 0 {
-                    space -= (repeat_delta as usize) << (15 - repeat_code_len);
+                    space -= (repeat_delta << (15 - repeat_code_len)) as isize;
                 }
             }
         }
         if space != 0 {
             return Err(Error::InvalidHuffman);
         }
-        Ok(code_lengths)
+        Ok(())
     }
 
-    fn build(root_bits: usize, code_lengths: &[u8]) -> Result<Vec<TableEntry>, Error> {
+    /// Builds the two-level table for `code_lengths` in `table`.
+    fn build(
+        root_bits: usize,
+        code_lengths: &[u8],
+        table: &mut Vec<TableEntry>,
+        scratch: &mut EntropyScratch,
+    ) -> Result<(), Error> {
         if code_lengths.len() > 1 << HUFFMAN_MAX_BITS {
             return Err(Error::InvalidHuffman);
         }
@@ -269,7 +293,8 @@ impl Table {
         }
 
         /* symbols sorted by code length */
-        let mut sorted = vec![0u16; code_lengths.len()];
+        let mut sorted = scratch.symbols.take();
+        sorted.resize(code_lengths.len(), 0);
 
         /* offsets in sorted table for each length */
         let mut offset = [0; HUFFMAN_MAX_BITS + 1];
@@ -298,7 +323,8 @@ impl Table {
         let mut table_bits = root_bits;
         let mut table_size = 1 << table_bits;
         let mut table_pos = 0;
-        let mut table = vec![TableEntry { bits: 0, value: 0 }; table_size];
+        table.clear();
+        table.resize(table_size, TableEntry { bits: 0, value: 0 });
 
         /* special case code with only one value */
         if offset[HUFFMAN_MAX_BITS] == 1 {
@@ -306,7 +332,8 @@ impl Table {
                 v.bits = 0;
                 v.value = sorted[0];
             }
-            return Ok(table);
+            scratch.symbols.give(sorted);
+            return Ok(());
         }
 
         /* fill in root table */
@@ -360,13 +387,14 @@ impl Table {
                     table_pos += table_size;
                     table_bits = next_table_bit_size(&counts, len, root_bits);
                     table_size = 1 << table_bits;
+                    table.resize(table_pos + table_size, TableEntry { bits: 0, value: 0 });
                     low = key & mask;
                     table[low as usize].bits = (table_bits + root_bits) as u8;
                     table[low as usize].value = (table_pos - low as usize) as u16;
                 }
                 counts[len] -= 1;
                 let bits = (len - root_bits) as u8;
-                let value = sorted[symbol] as u16;
+                let value = sorted[symbol];
                 symbol += 1;
                 let pos = table_pos + (key as usize >> root_bits);
                 replicate_value(&mut table[pos..], step, TableEntry { bits, value });
@@ -374,17 +402,45 @@ impl Table {
             }
             step <<= 1;
         }
-        Ok(table)
+        scratch.symbols.give(sorted);
+        Ok(())
+    }
+
+    /// Decodes a prefix code. Symbols below `pair_limit` that are followed by another short
+    /// enough code are also stored as pairs in the lookup table.
+    pub fn decode(
+        al_size: usize,
+        br: &mut BitReader,
+        pair_limit: u32,
+        scratch: &mut EntropyScratch,
+    ) -> Result<Table, Error> {
+        let mut two_level = scratch.table_entries.take();
+        match Table::decode_two_level(al_size, br, &mut two_level, scratch) {
+            Ok(root_bits) => Ok(Table::pack(root_bits, two_level, pair_limit, scratch)),
+            Err(err) => {
+                scratch.table_entries.give(two_level);
+                Err(err)
+            }
+        }
     }
 
-    pub fn decode(al_size: usize, br: &mut BitReader) -> Result<Table, Error> {
-        let entries = if al_size == 1 {
-            vec![TableEntry { bits: 0, value: 0 }; TABLE_SIZE]
+    /// Decodes the prefix code into the two-level table `two_level`, and returns its number of
+    /// root bits.
+    fn decode_two_level(
+        al_size: usize,
+        br: &mut BitReader,
+        two_level: &mut Vec<TableEntry>,
+        scratch: &mut EntropyScratch,
+    ) -> Result<usize, Error> {
+        let root_bits = if al_size == 1 {
+            two_level.push(TableEntry { bits: 0, value: 0 });
+            0
         } else {
             assert!(al_size < 1 << HUFFMAN_MAX_BITS);
             let simple_code_or_skip = br.read(2)? as usize;
             if simple_code_or_skip == 1 {
-                Table::decode_simple_table(al_size, br)?
+                Table::decode_simple_table(al_size, br, two_level)?;
+                two_level.iter().map(|e| e.bits).max().unwrap() as usize
             } else {
                 let mut code_length_code_lengths = [0u8; CODE_LENGTHS_CODE];
                 let mut space = 32;
@@ -409,26 +465,124 @@ impl Table {
                 if num_codes != 1 && space != 0 {
                     return Err(Error::InvalidHuffman);
                 }
-                let code_lengths =
-                    Table::decode_huffman_code_lengths(code_length_code_lengths, al_size, br)?;
-                Table::build(TABLE_BITS, &code_lengths)?
+                let mut code_lengths = scratch.bytes.take();
+                let result = Table::decode_huffman_code_lengths(
+                    code_length_code_lengths,
+                    al_size,
+                    br,
+                    &mut code_lengths,
+                    scratch,
+                )
+                .and_then(|()| {
+                    let max_bits = *code_lengths.iter().max().unwrap() as usize;
+                    let root_bits = max_bits.min(MAX_ROOT_TABLE_BITS);
+                    Table::build(root_bits, &code_lengths, two_level, scratch).map(|()| root_bits)
+                });
+                scratch.bytes.give(code_lengths);
+                result?
             }
         };
-        Ok(Table { entries })
+        Ok(root_bits)
     }
 
-    pub fn read(&self, br: &mut BitReader) -> Result<u32, Error> {
-        let mut pos = br.peek(TABLE_BITS) as usize;
+    /* Builds the packed lookup table from a two-level table with `root_bits` of root. */
+    fn pack(
+        root_bits: usize,
+        mut entries: Vec<TableEntry>,
+        pair_limit: u32,
+        scratch: &mut EntropyScratch,
+    ) -> Table {
+        let size = 1 << root_bits;
+        let mut has_long_codes = false;
+        let mut packed = scratch.packed_entries.take();
+        packed.extend(entries[..size].iter().map(|e| {
+            if e.bits as usize > root_bits {
+                has_long_codes = true;
+                PackedEntry(ENTRY_LONG)
+            } else {
+                PackedEntry::single(e.bits, e.value)
+            }
+        }));
+        if pair_limit > 0 {
+            let pair_limit = pair_limit.min(1 << PAIR_SYMBOL_BITS) as u16;
+            for i in 0..size {
+                let first = entries[i];
+                if first.bits as usize > root_bits || first.value >= pair_limit {
+                    continue;
+                }
+                let second = entries[i >> first.bits];
+                if first.bits + second.bits > root_bits as u8
+                    || second.value as u32 >= 1 << PAIR_SYMBOL_BITS
+                {
+                    continue;
+                }
+                packed[i] = PackedEntry::pair(first.bits, first.value, second.bits, second.value);
+            }
+        }
+        if !has_long_codes {
+            scratch.table_entries.give(entries);
+            entries = vec![];
+        }
+        Table {
+            root_bits,
+            packed,
+            entries,
+        }
+    }
+
+    #[inline(never)]
+    fn read_long(&self, br: &mut BitReader) -> Result<u32, Error> {
+        let mut pos = br.peek(self.root_bits) as usize;
         let mut n_bits = self.entries[pos].bits as usize;
-        if n_bits > TABLE_BITS {
-            br.consume(TABLE_BITS)?;
-            n_bits -= TABLE_BITS;
+        if n_bits > self.root_bits {
+            br.consume(self.root_bits)?;
+            n_bits -= self.root_bits;
             pos += self.entries[pos].value as usize;
             pos += br.peek(n_bits) as usize;
         }
         br.consume(self.entries[pos].bits as usize)?;
         Ok(self.entries[pos].value as u32)
     }
+
+    #[inline]
+    pub fn read(&self, br: &mut BitReader) -> Result<u32, Error> {
+        let entry = self.packed[br.peek(self.root_bits) as usize];
+        if entry.kind() == ENTRY_LONG {
+            return self.read_long(br);
+        }
+        br.consume(entry.first_bits())?;
+        Ok(entry.first_value())
+    }
+
+    /// Reads one or two symbols into `out`, which must not be empty, and returns how many
+    /// symbols were read. Two symbols are only read if the first is below `pair_limit`.
+    /// Codes that fit in the root table are read with `BitReader::read_unchecked`, so
+    /// `MAX_ROOT_TABLE_BITS` bits need to be available in the buffer.
+    #[inline]
+    pub fn read_up_to_two_unchecked(
+        &self,
+        br: &mut BitReader,
+        out: &mut [u32],
+    ) -> Result<usize, Error> {
+        let entry = self.packed[br.peek_unchecked(self.root_bits) as usize];
+        match entry.kind() {
+            ENTRY_PAIR if out.len() >= 2 => {
+                br.consume_unchecked(entry.total_bits());
+                out[0] = entry.first_value();
+                out[1] = entry.second_value();
+                Ok(2)
+            }
+            ENTRY_LONG => {
+                out[0] = self.read_long(br)?;
+                Ok(1)
+            }
+            _ => {
+                br.consume_unchecked(entry.first_bits());
+                out[0] = entry.first_value();
+                Ok(1)
+            }
+        }
+    }
 }
 
 #[derive(Debug)]
@@ -437,21 +591,232 @@ pub struct HuffmanCodes {
 }
 
 impl HuffmanCodes {
-    pub fn decode(num: usize, br: &mut BitReader) -> Result<HuffmanCodes, Error> {
-        let alphabet_sizes: Vec<u16> = (0..num)
-            .map(|_| Ok(decode_varint16(br)? + 1))
-            .collect::<Result<_, _>>()?;
+    /// Decodes `pair_limits.len()` prefix codes; see `Table::decode` for `pair_limits`.
+    pub fn decode(
+        pair_limits: &[u32],
+        br: &mut BitReader,
+        scratch: &mut EntropyScratch,
+    ) -> Result<HuffmanCodes, Error> {
+        let mut alphabet_sizes = scratch.symbols.take();
+        let mut codes = HuffmanCodes {
+            tables: scratch.huffman_tables.take(),
+        };
+        let result = codes.decode_tables(pair_limits, br, &mut alphabet_sizes, scratch);
+        scratch.symbols.give(alphabet_sizes);
+        match result {
+            Ok(()) => Ok(codes),
+            Err(err) => {
+                codes.recycle(scratch);
+                Err(err)
+            }
+        }
+    }
+
+    fn decode_tables(
+        &mut self,
+        pair_limits: &[u32],
+        br: &mut BitReader,
+        alphabet_sizes: &mut Vec<u16>,
+        scratch: &mut EntropyScratch,
+    ) -> Result<(), Error> {
+        for _ in 0..pair_limits.len() {
+            alphabet_sizes.push(decode_varint16(br)? + 1);
+        }
         let max = *alphabet_sizes.iter().max().unwrap();
         if max as usize > (1 << HUFFMAN_MAX_BITS) {
             return Err(Error::AlphabetTooLargeHuff(max as usize));
         }
-        let tables = alphabet_sizes
-            .iter()
-            .map(|sz| Table::decode(*sz as usize, br))
-            .collect::<Result<_, _>>()?;
-        Ok(HuffmanCodes { tables })
+        for (sz, limit) in alphabet_sizes.iter().zip(pair_limits) {
+            self.tables
+                .push(Table::decode(*sz as usize, br, *limit, scratch)?);
+        }
+        Ok(())
     }
+
+    /// Returns the buffers of the tables to `scratch`.
+    pub fn recycle(mut self, scratch: &mut EntropyScratch) {
+        for table in self.tables.drain(..) {
+            scratch.packed_entries.give(table.packed);
+            scratch.table_entries.give(table.entries);
+        }
+        scratch.huffman_tables.give(self.tables);
+    }
+
+    #[inline]
     pub fn read(&self, br: &mut BitReader, ctx: usize) -> Result<u32, Error> {
         self.tables[ctx].read(br)
     }
+
+    /// Reads one or two symbols into `out`; if two symbols are read, the first one is
+    /// below the pair limit of the table. See `Table::read_up_to_two_unchecked`.
+    #[inline]
+    pub fn read_up_to_two_unchecked(
+        &self,
+        br: &mut BitReader,
+        ctx: usize,
+        out: &mut [u32],
+    ) -> Result<usize, Error> {
+        self.tables[ctx].read_up_to_two_unchecked(br, out)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    // Canonical code for `code_lengths`, as (code, length) to be written MSB first.
+    fn canonical_codes(code_lengths: &[u8]) -> Vec<(u32, u8)> {
+        let mut codes = vec![(0, 0); code_lengths.len()];
+        let mut code = 0u32;
+        for len in 1..=HUFFMAN_MAX_BITS as u8 {
+            for (sym, _) in code_lengths.iter().enumerate().filter(|(_, l)| **l == len) {
+                codes[sym] = (code, len);
+                code += 1;
+            }
+            code <<= 1;
+        }
+        codes
+    }
+
+    fn encode(code_lengths: &[u8], symbols: &[usize]) -> Vec<u8> {
+        let codes = canonical_codes(code_lengths);
+        let mut bits = vec![];
+        for &sym in symbols {
+            let (code, len) = codes[sym];
+            bits.extend((0..len).rev().map(|i| (code >> i) & 1 != 0));
+        }
+        let mut data = vec![0u8; bits.len().div_ceil(8) + 8];
+        for (i, bit) in bits.iter().enumerate() {
+            data[i / 8] |= (*bit as u8) << (i % 8);
+        }
+        data
+    }
+
+    fn check_table(code_lengths: &[u8], pair_limit: u32, expect_pairs: bool) -> Result<(), Error> {
+        let symbols: Vec<usize> = (0..2000usize)
+            .map(|i| (i * 7919) % code_lengths.len())
+            .filter(|s| code_lengths[*s] != 0)
+            .collect();
+        let data = encode(code_lengths, &symbols);
+        let max_bits = *code_lengths.iter().max().unwrap() as usize;
+        let root_bits = max_bits.min(MAX_ROOT_TABLE_BITS);
+        let mut scratch = EntropyScratch::new();
+        let mut entries = vec![];
+        Table::build(root_bits, code_lengths, &mut entries, &mut scratch)?;
+        let table = Table::pack(root_bits, entries, pair_limit, &mut scratch);
+
+        let mut br = BitReader::new(&data);
+        for &sym in symbols.iter() {
+            assert_eq!(table.read(&mut br)?, sym as u32);
+        }
+
+        let mut br = BitReader::new(&data);
+        let mut out = vec![0; symbols.len()];
+        let mut pos = 0;
+        let mut num_pairs = 0;
+        while pos < out.len() {
+            br.refill_unchecked();
+            let n = table.read_up_to_two_unchecked(&mut br, &mut out[pos..])?;
+            if n == 2 {
+                assert!(out[pos] < pair_limit);
+                num_pairs += 1;
+            }
+            pos += n;
+        }
+        br.check_overflow()?;
+        assert_eq!(out, symbols.iter().map(|s| *s as u32).collect::<Vec<_>>());
+        assert_eq!(num_pairs > 0, expect_pairs);
+        Ok(())
+    }
+
+    #[test]
+    fn test_tables() -> Result<(), Error> {
+        check_table(&[1, 2, 3, 3], 0, false)?;
+        check_table(&[1, 2, 3, 3], 4, true)?;
+        check_table(&[1, 2, 0, 3, 3], 2, true)?;
+        // Codes longer than the root table.
+        let long: Vec<u8> = (1..=15).chain(std::iter::once(15)).collect();
+        check_table(&long, 0, false)?;
+        check_table(&long, 6, true)?;
+        // Two 8-bit codes do not fit in the root table.
+        let flat = vec![8u8; 256];
+        check_table(&flat, 256, false)?;
+        Ok(())
+    }
+
+    #[test]
+    fn test_code_lengths_repeat() -> Result<(), Error> {
+        // Code length code: 2 with code 0, 16 (repeat previous) with code 1.
+        let mut code_length_code_lengths = [0u8; CODE_LENGTHS_CODE];
+        code_length_code_lengths[2] = 1;
+        code_length_code_lengths[16] = 1;
+        // 2, then repeat it 3 times (16 with 2 extra bits equal to 0).
+        let mut br = BitReader::new(&[0b0010, 0]);
+        let mut code_lengths = vec![];
+        Table::decode_huffman_code_lengths(
+            code_length_code_lengths,
+            4,
+            &mut br,
+            &mut code_lengths,
+            &mut EntropyScratch::new(),
+        )?;
+        assert_eq!(code_lengths, vec![2, 2, 2, 2]);
+        Ok(())
+    }
+
+    #[test]
+    fn test_simple_codes() -> Result<(), Error> {
+        // Alphabet of 16, symbols of 4 bits. One symbol: 7, which takes no bits, then two
+        // symbols: 9 and 3, read with index 1 and 0 once sorted.
+        let mut br = BitReader::new(&[0b0111_0001, 0b1001_0101, 0b0001_0011, 0, 0, 0, 0, 0]);
+        let mut scratch = EntropyScratch::new();
+        let one = Table::decode(16, &mut br, 0, &mut scratch)?;
+        let two = Table::decode(16, &mut br, 0, &mut scratch)?;
+        assert_eq!(one.read(&mut br)?, 7);
+        assert_eq!(two.read(&mut br)?, 9);
+        assert_eq!(two.read(&mut br)?, 3);
+        Ok(())
+    }
+
+    #[test]
+    fn test_simple_code_layouts() -> Result<(), Error> {
+        // Symbols in the order of the stream, with their code lengths: codes are canonical,
+        // with codes of the same length in the order of their symbols.
+        let cases: [(&[usize], bool, &[u8]); 4] = [
+            (&[9, 3], false, &[1, 1]),
+            (&[9, 12, 3], false, &[1, 2, 2]),
+            (&[9, 12, 3, 5], false, &[2, 2, 2, 2]),
+            (&[9, 12, 3, 5], true, &[1, 2, 3, 3]),
+        ];
+        for (symbols, tree, lengths) in cases.iter() {
+            let mut bits = vec![];
+            let mut push = |n: usize, v: usize| bits.extend((0..n).map(|i| (v >> i) & 1 != 0));
+            push(2, 1);
+            push(2, symbols.len() - 1);
+            symbols.iter().for_each(|s| push(4, *s));
+            if symbols.len() == 4 {
+                push(1, *tree as usize);
+            }
+            let mut code_lengths = [0u8; 16];
+            for (s, len) in symbols.iter().zip(lengths.iter()) {
+                code_lengths[*s] = *len;
+            }
+            let codes = canonical_codes(&code_lengths);
+            for s in symbols.iter().chain(symbols.iter().rev()) {
+                let (code, len) = codes[*s];
+                bits.extend((0..len).rev().map(|i| (code >> i) & 1 != 0));
+            }
+            let mut data = vec![0u8; bits.len() / 8 + 8];
+            for (i, bit) in bits.iter().enumerate() {
+                data[i / 8] |= (*bit as u8) << (i % 8);
+            }
+            let mut br = BitReader::new(&data);
+            let table = Table::decode(16, &mut br, 0, &mut EntropyScratch::new())?;
+            assert!(table.packed.len() <= 8);
+            for s in symbols.iter().chain(symbols.iter().rev()) {
+                assert_eq!(table.read(&mut br)?, *s as u32);
+            }
+        }
+        Ok(())
+    }
 }
@@ -48,10 +48,15 @@ impl HybridUint {
             lsb_in_token,
         })
     }
-    pub fn read(&self, symbol: u32, br: &mut BitReader) -> Result<u32, Error> {
-        if symbol < self.split_token {
-            return Ok(symbol);
-        }
+    /// Symbols below this value are decoded as themselves, without reading any extra bits.
+    pub fn split_token(&self) -> u32 {
+        self.split_token
+    }
+
+    /// Returns the number of extra bits to read for a symbol that is at least `split_token`,
+    /// and a function to combine them with the symbol.
+    #[inline]
+    fn split_symbol(&self, symbol: u32) -> Result<(u32, impl Fn(u32) -> u32), Error> {
         let bits_in_token = self.lsb_in_token + self.msb_in_token;
         let nbits =
             self.split_exponent - bits_in_token + ((symbol - self.split_token) >> bits_in_token);
@@ -60,8 +65,30 @@ impl HybridUint {
         }
         let low = symbol & ((1 << self.lsb_in_token) - 1);
         let symbol_nolow = symbol >> self.lsb_in_token;
-        let bits = br.read(nbits as usize)? as u32;
         let hi = (symbol_nolow & ((1 << self.msb_in_token) - 1)) | (1 << self.msb_in_token);
-        Ok((((hi << nbits) | bits) << self.lsb_in_token) | low)
+        let lsb_in_token = self.lsb_in_token;
+        Ok((nbits, move |bits| {
+            (((hi << nbits) | bits) << lsb_in_token) | low
+        }))
+    }
+
+    pub fn read(&self, symbol: u32, br: &mut BitReader) -> Result<u32, Error> {
+        if symbol < self.split_token {
+            return Ok(symbol);
+        }
+        let (nbits, combine) = self.split_symbol(symbol)?;
+        let bits = br.read(nbits as usize)? as u32;
+        Ok(combine(bits))
+    }
+
+    /// Like `read`, but reads the extra bits with `BitReader::read_unchecked`, so up to 29 bits
+    /// need to be available in the buffer.
+    #[inline]
+    pub fn read_unchecked(&self, symbol: u32, br: &mut BitReader) -> Result<u32, Error> {
+        if symbol < self.split_token {
+            return Ok(symbol);
+        }
+        let (nbits, combine) = self.split_symbol(symbol)?;
+        Ok(combine(br.read_unchecked(nbits as usize) as u32))
     }
 }
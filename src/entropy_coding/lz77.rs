@@ -0,0 +1,283 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+const LOG_WINDOW_SIZE: usize = 20;
+const WINDOW_SIZE: usize = 1 << LOG_WINDOW_SIZE;
+const WINDOW_MASK: usize = WINDOW_SIZE - 1;
+
+pub const NUM_SPECIAL_DISTANCES: usize = 120;
+
+/* (dx, dy) offsets of the special distances, used when the image width is known. */
+#[rustfmt::skip]
+const SPECIAL_DISTANCES: [(i8, i8); NUM_SPECIAL_DISTANCES] = [
+    (0, 1), (1, 0), (1, 1), (-1, 1), (0, 2), (2, 0), (1, 2), (-1, 2),
+    (2, 1), (-2, 1), (2, 2), (-2, 2), (0, 3), (3, 0), (1, 3), (-1, 3),
+    (3, 1), (-3, 1), (2, 3), (-2, 3), (3, 2), (-3, 2), (0, 4), (4, 0),
+    (1, 4), (-1, 4), (4, 1), (-4, 1), (3, 3), (-3, 3), (2, 4), (-2, 4),
+    (4, 2), (-4, 2), (0, 5), (3, 4), (-3, 4), (4, 3), (-4, 3), (5, 0),
+    (1, 5), (-1, 5), (5, 1), (-5, 1), (2, 5), (-2, 5), (5, 2), (-5, 2),
+    (4, 4), (-4, 4), (3, 5), (-3, 5), (5, 3), (-5, 3), (0, 6), (6, 0),
+    (1, 6), (-1, 6), (6, 1), (-6, 1), (2, 6), (-2, 6), (6, 2), (-6, 2),
+    (4, 5), (-4, 5), (5, 4), (-5, 4), (3, 6), (-3, 6), (6, 3), (-6, 3),
+    (0, 7), (7, 0), (1, 7), (-1, 7), (5, 5), (-5, 5), (7, 1), (-7, 1),
+    (4, 6), (-4, 6), (6, 4), (-6, 4), (2, 7), (-2, 7), (7, 2), (-7, 2),
+    (3, 7), (-3, 7), (7, 3), (-7, 3), (5, 6), (-5, 6), (6, 5), (-6, 5),
+    (8, 0), (4, 7), (-4, 7), (7, 4), (-7, 4), (8, 1), (8, 2), (6, 6),
+    (-6, 6), (8, 3), (5, 7), (-5, 7), (7, 5), (-7, 5), (8, 4), (6, 7),
+    (-6, 7), (7, 6), (-7, 6), (8, 5), (7, 7), (-7, 7), (8, 6), (8, 7),
+];
+
+/// Converts a decoded distance symbol into an actual distance.
+/// `dist_multiplier` is the image width, or 0 if special distances are not in use.
+pub fn lz77_distance(distance: usize, dist_multiplier: usize) -> usize {
+    if dist_multiplier == 0 {
+        distance + 1
+    } else if distance < NUM_SPECIAL_DISTANCES {
+        let (dx, dy) = SPECIAL_DISTANCES[distance];
+        (dx as isize + dist_multiplier as isize * dy as isize).max(1) as usize
+    } else {
+        distance + 1 - NUM_SPECIAL_DISTANCES
+    }
+}
+
+/// Ring buffer holding the last `WINDOW_SIZE` decoded symbols.
+///
+/// Copies are not emitted symbol by symbol: when a copy starts, as much of it as
+/// fits in the window is materialized with bulk `copy_within` calls (doubling the
+/// copied span for short, overlapping distances), and the reader then just
+/// returns the already-written symbols.
+#[derive(Debug)]
+pub struct Lz77Window {
+    data: Vec<u32>,
+    // Number of symbols written to the window.
+    num_decoded: usize,
+    // Number of symbols returned to the caller; `num_read..num_decoded` are
+    // copied symbols that were materialized ahead of time.
+    num_read: usize,
+    // Remaining part of the current copy that is not in the window yet.
+    num_to_copy: usize,
+    copy_src: usize,
+    // Always a multiple of the copy distance, and at most `WINDOW_SIZE`.
+    copy_span: usize,
+}
+
+impl Lz77Window {
+    pub fn new() -> Lz77Window {
+        Lz77Window::with_buffer(vec![])
+    }
+
+    /// Creates an empty window, reusing the allocation of `data` if it is large enough.
+    pub fn with_buffer(mut data: Vec<u32>) -> Lz77Window {
+        // Copies never read positions that were not written, so old contents can stay.
+        data.resize(WINDOW_SIZE, 0);
+        Lz77Window {
+            data,
+            num_decoded: 0,
+            num_read: 0,
+            num_to_copy: 0,
+            copy_src: 0,
+            copy_span: 0,
+        }
+    }
+
+    /// Returns the buffer of the window, for reuse with `with_buffer`.
+    pub fn into_buffer(self) -> Vec<u32> {
+        self.data
+    }
+
+    /// Returns the next symbol of the current copy, if any.
+    #[inline]
+    pub fn next_copied(&mut self) -> Option<u32> {
+        if self.num_read == self.num_decoded {
+            if self.num_to_copy == 0 {
+                return None;
+            }
+            self.materialize();
+        }
+        let symbol = self.data[self.num_read & WINDOW_MASK];
+        self.num_read += 1;
+        Some(symbol)
+    }
+
+    /// Moves as many symbols of the current copy as possible to `out`, and returns how many
+    /// were written.
+    pub fn drain_copied(&mut self, out: &mut [u32]) -> usize {
+        let mut written = 0;
+        while written < out.len() {
+            if self.num_read == self.num_decoded {
+                if self.num_to_copy == 0 {
+                    break;
+                }
+                self.materialize();
+            }
+            let start = self.num_read & WINDOW_MASK;
+            let n = (out.len() - written)
+                .min(self.num_decoded - self.num_read)
+                .min(WINDOW_SIZE - start);
+            out[written..written + n].copy_from_slice(&self.data[start..start + n]);
+            written += n;
+            self.num_read += n;
+        }
+        written
+    }
+
+    #[inline]
+    pub fn push_literal(&mut self, symbol: u32) {
+        debug_assert_eq!(self.num_read, self.num_decoded);
+        self.data[self.num_decoded & WINDOW_MASK] = symbol;
+        self.num_decoded += 1;
+        self.num_read += 1;
+    }
+
+    /// Starts a copy of `length` symbols from `distance` symbols back; returns the
+    /// first copied symbol.
+    pub fn start_copy(&mut self, distance: usize, length: usize) -> u32 {
+        debug_assert!(length > 0);
+        debug_assert_eq!(self.num_read, self.num_decoded);
+        let distance = distance.min(self.num_decoded).min(WINDOW_SIZE);
+        if distance == 0 {
+            // Nothing was decoded yet: copies read from a zero-filled window.
+            self.push_literal(0);
+            self.num_to_copy = length - 1;
+            self.copy_src = 0;
+            self.copy_span = 1;
+            return 0;
+        }
+        self.num_to_copy = length;
+        self.copy_src = self.num_decoded - distance;
+        self.copy_span = distance;
+        self.next_copied().unwrap()
+    }
+
+    /// Writes up to `WINDOW_SIZE` symbols of the current copy to the window.
+    fn materialize(&mut self) {
+        // Writing more than the window ahead of the reader would overwrite
+        // symbols that were not returned yet.
+        let mut remaining = self.num_to_copy.min(WINDOW_SIZE);
+        self.num_to_copy -= remaining;
+        while remaining > 0 {
+            let src = self.copy_src & WINDOW_MASK;
+            let dst = (self.copy_src + self.copy_span) & WINDOW_MASK;
+            let n = remaining
+                .min(self.copy_span)
+                .min(WINDOW_SIZE - src)
+                .min(WINDOW_SIZE - dst);
+            if src != dst {
+                self.data.copy_within(src..src + n, dst);
+            }
+            remaining -= n;
+            self.num_decoded += n;
+            if n == self.copy_span && 2 * self.copy_span <= WINDOW_SIZE {
+                self.copy_span *= 2;
+            } else {
+                self.copy_src += n;
+            }
+        }
+    }
+}
+
+impl Default for Lz77Window {
+    fn default() -> Lz77Window {
+        Lz77Window::new()
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    // Symbol-by-symbol reference implementation.
+    fn reference(ops: &[(u32, usize, usize)]) -> Vec<u32> {
+        let mut out = vec![];
+        for &(literal, distance, length) in ops {
+            if length == 0 {
+                out.push(literal);
+                continue;
+            }
+            let distance = distance.min(out.len()).min(WINDOW_SIZE);
+            let start = out.len();
+            for i in 0..length {
+                let v = if distance == 0 {
+                    0
+                } else {
+                    out[start + i - distance]
+                };
+                out.push(v);
+            }
+        }
+        out
+    }
+
+    fn check(ops: &[(u32, usize, usize)]) {
+        let mut window = Lz77Window::new();
+        let mut out = vec![];
+        for &(literal, distance, length) in ops {
+            if length == 0 {
+                window.push_literal(literal);
+                out.push(literal);
+                continue;
+            }
+            out.push(window.start_copy(distance, length));
+            while let Some(v) = window.next_copied() {
+                out.push(v);
+            }
+        }
+        assert_eq!(out, reference(ops));
+    }
+
+    #[test]
+    fn test_copies() {
+        check(&[(1, 0, 0), (2, 0, 0), (3, 0, 0), (0, 1, 10), (0, 3, 7)]);
+        check(&[(0, 5, 3), (7, 0, 0), (0, 2, 1000)]);
+        let mut ops: Vec<_> = (0..100).map(|i| (i, 0, 0)).collect();
+        ops.extend([(0, 37, 5000), (0, 99, 3), (5, 0, 0), (0, 4000, 300)].iter());
+        check(&ops);
+    }
+
+    #[test]
+    fn test_drain_copied() {
+        let mut window = Lz77Window::new();
+        let mut expected = vec![];
+        for i in 0..10 {
+            window.push_literal(i);
+            expected.push(i);
+        }
+        let length = WINDOW_SIZE + 1000;
+        let mut out = vec![window.start_copy(3, length)];
+        let mut buf = vec![0; 4096];
+        loop {
+            let n = window.drain_copied(&mut buf[..]);
+            if n == 0 {
+                break;
+            }
+            out.extend_from_slice(&buf[..n]);
+        }
+        assert_eq!(out.len(), length);
+        for v in out {
+            expected.push(expected[expected.len() - 3]);
+            assert_eq!(v, *expected.last().unwrap());
+        }
+    }
+
+    #[test]
+    fn test_long_copies() {
+        let mut ops: Vec<_> = (0..1000).map(|i| (i * 7, 0, 0)).collect();
+        ops.push((0, 3, WINDOW_SIZE * 2 + 17));
+        ops.push((0, WINDOW_SIZE - 5, WINDOW_SIZE + 100));
+        ops.push((0, WINDOW_SIZE, 1000));
+        ops.push((0, WINDOW_SIZE + 100, 1000));
+        check(&ops);
+    }
+
+    #[test]
+    fn test_special_distances() {
+        assert_eq!(lz77_distance(0, 0), 1);
+        assert_eq!(lz77_distance(0, 100), 100);
+        assert_eq!(lz77_distance(1, 100), 1);
+        assert_eq!(lz77_distance(3, 100), 99);
+        assert_eq!(lz77_distance(3, 1), 1);
+        assert_eq!(lz77_distance(NUM_SPECIAL_DISTANCES + 4, 100), 5);
+    }
+}
@@ -0,0 +1,82 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use crate::entropy_coding::ans::AliasEntry;
+use crate::entropy_coding::huffman::{PackedEntry, Table, TableEntry};
+use crate::entropy_coding::hybrid_uint::HybridUint;
+
+/// Free list of buffers with the same element type.
+#[derive(Debug)]
+pub(crate) struct Pool<T> {
+    free: Vec<Vec<T>>,
+}
+
+impl<T> Default for Pool<T> {
+    fn default() -> Pool<T> {
+        Pool { free: vec![] }
+    }
+}
+
+impl<T> Pool<T> {
+    /// Returns an empty buffer, reusing a previously returned allocation if there is one.
+    pub(crate) fn take(&mut self) -> Vec<T> {
+        self.free.pop().unwrap_or_default()
+    }
+
+    pub(crate) fn give(&mut self, mut buf: Vec<T>) {
+        if buf.capacity() != 0 {
+            buf.clear();
+            self.free.push(buf);
+        }
+    }
+
+    fn len(&self) -> usize {
+        self.free.len()
+    }
+}
+
+/// Buffers for decoding `Histograms` and reading symbols, reused across decodes.
+///
+/// Buffers are taken by `Histograms::decode_with_scratch` and
+/// `Histograms::make_reader_with_scratch`, and returned by `Histograms::recycle` and
+/// `Reader::recycle`. Once every histogram of a frame is recycled, decoding the next frame
+/// with the same scratch does not allocate unless it needs larger buffers. A scratch is not
+/// shared between threads; each worker should keep its own.
+#[derive(Debug, Default)]
+pub struct EntropyScratch {
+    pub(crate) bytes: Pool<u8>,
+    pub(crate) symbols: Pool<u16>,
+    pub(crate) counts: Pool<u32>,
+    pub(crate) uint_configs: Pool<HybridUint>,
+    pub(crate) huffman_tables: Pool<Table>,
+    pub(crate) table_entries: Pool<TableEntry>,
+    pub(crate) packed_entries: Pool<PackedEntry>,
+    pub(crate) alias_entries: Pool<AliasEntry>,
+    pub(crate) lz77_windows: Pool<u32>,
+}
+
+impl EntropyScratch {
+    pub fn new() -> EntropyScratch {
+        EntropyScratch::default()
+    }
+
+    /// Number of buffers available for reuse.
+    pub fn num_free_buffers(&self) -> usize {
+        self.bytes.len()
+            + self.symbols.len()
+            + self.counts.len()
+            + self.uint_configs.len()
+            + self.huffman_tables.len()
+            + self.table_entries.len()
+            + self.packed_entries.len()
+            + self.alias_entries.len()
+            + self.lz77_windows.len()
+    }
+
+    /// Releases all the buffers, e.g. after decoding an unusually large frame.
+    pub fn clear(&mut self) {
+        *self = EntropyScratch::default();
+    }
+}
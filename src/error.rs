@@ -6,6 +6,7 @@
 use thiserror::Error;
 
 use crate::entropy_coding::huffman::HUFFMAN_MAX_BITS;
+use crate::var_dct::transform_type::TransformType;
 
 #[derive(Error, Debug)]
 pub enum Error {
@@ -45,6 +46,8 @@ pub enum Error {
     InvalidBox,
     #[error("ICC is too large")]
     ICCTooLarge,
+    #[error("Invalid ICC stream: symbol {0} > 255")]
+    InvalidICCStream(u32),
     #[error("Invalid HybridUintConfig: {0} {1} {2:?}")]
     InvalidUintConfig(u32, u32, Option<u32>),
     #[error("LZ77 enabled when explicitly disallowed")]
@@ -53,10 +56,18 @@ pub enum Error {
     AlphabetTooLargeHuff(usize),
     #[error("Invalid Huffman code")]
     InvalidHuffman,
+    #[error("ANS alphabet too large: {0}, max is {1}")]
+    AlphabetTooLargeAns(usize, usize),
+    #[error("Invalid ANS histogram")]
+    InvalidAnsHistogram,
+    #[error("Invalid ANS final state: {0:#x}")]
+    InvalidAnsState(u32),
     #[error("Integer too large: nbits {0} > 29")]
     IntegerTooLarge(u32),
     #[error("Invalid context map: context id {0} > 255")]
     InvalidContextMap(u32),
+    #[error("Invalid permutation")]
+    InvalidPermutation,
     #[error("Invalid context map: number of histogram {0}, number of distinct histograms {1}")]
     InvalidContextMapHole(u32, u32),
     // FrameHeader format errors
@@ -64,4 +75,46 @@ pub enum Error {
     InvalidEcUpsampling(u32, u32, u32),
     #[error("Num_ds: {0} should be smaller than num_passes: {1}")]
     NumPassesTooLarge(u32, u32),
+    #[error("Unsupported transform: {0:?}")]
+    UnsupportedTransform(TransformType),
+    // Modular format errors
+    #[error("Tree too large: more than {0} nodes")]
+    TreeTooLarge(usize),
+    #[error("Invalid property {0}")]
+    InvalidProperty(u32),
+    #[error("Invalid predictor {0}")]
+    InvalidPredictor(u32),
+    #[error("Invalid multiplier")]
+    InvalidMultiplier,
+    #[error("Unsupported modular transforms: {0}")]
+    UnsupportedModularTransforms(u32),
+    #[error("Global tree used without a global tree")]
+    NoGlobalTree,
+    // Output errors
+    #[error("Output row stride {0} is smaller than a row, {1} bytes")]
+    InvalidOutputStride(usize, usize),
+    #[error("Output buffer too small: {1} bytes, {0} needed")]
+    OutputBufferTooSmall(usize, usize),
+    #[error("Invalid output channel {0}")]
+    InvalidOutputChannel(usize),
+    #[error("Output buffer is {0:?}, image is {1:?}")]
+    OutputSizeMismatch((usize, usize), (usize, usize)),
+    // Animation errors
+    #[error("Invalid blending alpha channel {0}")]
+    InvalidBlendingAlphaChannel(u32),
+    #[error("Invalid seek index")]
+    InvalidSeekIndex,
+    // Decode limits errors
+    #[error("Image has {0} pixels, more than the limit of {1}")]
+    TooManyPixels(u64, u64),
+    #[error("Decoding needs about {0} bytes of memory, more than the limit of {1}")]
+    MemoryLimitExceeded(u64, u64),
+    // Decoder API errors
+    #[error("Input fed to a decoder that reads a borrowed file")]
+    FeedOnBorrowedInput,
+    // Async decoding errors
+    #[error("Decoding was cancelled")]
+    Cancelled,
+    #[error("Read error: {0}")]
+    Io(#[from] std::io::Error),
 }
@@ -0,0 +1,576 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use crate::error::Error;
+use crate::headers::color_encoding::ColorSpace;
+use crate::headers::frame_header::{BlendingInfo, BlendingMode, FrameLayer, FrameType};
+use crate::headers::FileHeaders;
+use crate::stats::record_allocation;
+
+/// Number of reference slots that frames can be saved to.
+pub const NUM_REFERENCES: usize = 4;
+
+/// A planar image with `f32` samples.
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct ImageBuffer {
+    width: usize,
+    height: usize,
+    channels: Vec<Vec<f32>>,
+}
+
+impl ImageBuffer {
+    pub fn new(width: usize, height: usize, num_channels: usize) -> ImageBuffer {
+        let mut buffer = ImageBuffer::default();
+        buffer.reset(width, height, num_channels);
+        buffer
+    }
+
+    /// Changes the size of the image, reusing its memory. The contents are unspecified.
+    pub fn reset(&mut self, width: usize, height: usize, num_channels: usize) {
+        self.width = width;
+        self.height = height;
+        self.channels.resize_with(num_channels, Vec::new);
+        for channel in self.channels.iter_mut() {
+            let capacity = channel.capacity();
+            channel.resize(width * height, 0.0);
+            record_allocation((channel.capacity() - capacity) * std::mem::size_of::<f32>());
+        }
+    }
+
+    pub fn width(&self) -> usize {
+        self.width
+    }
+
+    pub fn height(&self) -> usize {
+        self.height
+    }
+
+    pub fn num_channels(&self) -> usize {
+        self.channels.len()
+    }
+
+    /// The samples of channel `c`, in raster order.
+    pub fn channel(&self, c: usize) -> &[f32] {
+        &self.channels[c]
+    }
+
+    pub fn channel_mut(&mut self, c: usize) -> &mut [f32] {
+        &mut self.channels[c]
+    }
+
+    pub fn row(&self, c: usize, y: usize) -> &[f32] {
+        &self.channels[c][y * self.width..(y + 1) * self.width]
+    }
+
+    pub fn row_mut(&mut self, c: usize, y: usize) -> &mut [f32] {
+        &mut self.channels[c][y * self.width..(y + 1) * self.width]
+    }
+}
+
+/// Provides the frames of an image, in codestream order.
+pub trait FrameSource {
+    /// Reads the header of the next frame, or returns None after the last one.
+    fn next_frame(&mut self) -> Result<Option<FrameLayer>, Error>;
+
+    /// Decodes the frame whose header was just returned into `buffer`, which has the size of
+    /// the layer and one channel for each color and extra channel. LF frames are not passed
+    /// here: they are only used by the source to decode the frames that follow them.
+    fn decode_frame(&mut self, layer: &FrameLayer, buffer: &mut ImageBuffer) -> Result<(), Error>;
+}
+
+/// A composited frame of an animation, or the whole image if it is not animated.
+#[derive(Debug)]
+pub struct AnimationFrame {
+    pub image: ImageBuffer,
+    /// In ticks of `ImageMetadata::animation`.
+    pub duration: u32,
+    pub timecode: u32,
+    pub is_last: bool,
+}
+
+/// Iterates over the frames to display, compositing the frames of `source` with their
+/// references. Only the reference slots that frames were saved to are kept, and buffers are
+/// reused across frames (including those given back with `recycle`), so that memory does not
+/// depend on the number of frames.
+pub struct AnimationFrames<S: FrameSource> {
+    source: S,
+    width: usize,
+    height: usize,
+    num_color: usize,
+    /// For each extra channel, whether it is an associated alpha channel.
+    alpha_associated: Vec<bool>,
+    references: [Option<ImageBuffer>; NUM_REFERENCES],
+    pool: Vec<ImageBuffer>,
+    num_allocations: usize,
+    done: bool,
+}
+
+impl<S: FrameSource> AnimationFrames<S> {
+    pub fn new(
+        source: S,
+        width: usize,
+        height: usize,
+        num_color: usize,
+        alpha_associated: Vec<bool>,
+    ) -> AnimationFrames<S> {
+        AnimationFrames {
+            source,
+            width,
+            height,
+            num_color,
+            alpha_associated,
+            references: Default::default(),
+            pool: vec![],
+            num_allocations: 0,
+            done: false,
+        }
+    }
+
+    pub fn from_file_headers(source: S, file_headers: &FileHeaders) -> AnimationFrames<S> {
+        let metadata = &file_headers.image_metadata;
+        let num_color = if metadata.color_encoding.color_space == ColorSpace::Gray {
+            1
+        } else {
+            3
+        };
+        AnimationFrames::new(
+            source,
+            file_headers.size.xsize() as usize,
+            file_headers.size.ysize() as usize,
+            num_color,
+            metadata
+                .extra_channel_info
+                .iter()
+                .map(|ec| ec.alpha_associated())
+                .collect(),
+        )
+    }
+
+    /// Gives back the buffer of a frame that is not needed anymore, to be reused.
+    pub fn recycle(&mut self, frame: AnimationFrame) {
+        self.pool.push(frame.image);
+    }
+
+    /// Number of image buffers allocated so far.
+    pub fn num_allocations(&self) -> usize {
+        self.num_allocations
+    }
+
+    fn num_channels(&self) -> usize {
+        self.num_color + self.alpha_associated.len()
+    }
+
+    fn take_buffer(&mut self, width: usize, height: usize) -> ImageBuffer {
+        let num_channels = self.num_channels();
+        match self.pool.pop() {
+            Some(mut buffer) => {
+                buffer.reset(width, height, num_channels);
+                buffer
+            }
+            None => {
+                self.num_allocations += 1;
+                ImageBuffer::new(width, height, num_channels)
+            }
+        }
+    }
+
+    fn composite(
+        &mut self,
+        layer: &FrameLayer,
+        frame: &ImageBuffer,
+        blend: bool,
+    ) -> Result<ImageBuffer, Error> {
+        let mut out = self.take_buffer(self.width, self.height);
+        let blank = Default::default();
+        let references = if blend { &self.references } else { &blank };
+        let blender = Blender {
+            num_color: self.num_color,
+            alpha_associated: &self.alpha_associated,
+        };
+        match blender.blend(layer, frame, references, blend, &mut out) {
+            Ok(()) => Ok(out),
+            Err(err) => {
+                self.pool.push(out);
+                Err(err)
+            }
+        }
+    }
+
+    fn next_displayed(&mut self) -> Result<Option<AnimationFrame>, Error> {
+        while !self.done {
+            let layer = match self.source.next_frame()? {
+                Some(layer) => layer,
+                None => break,
+            };
+            if layer.frame_type == FrameType::LFFrame {
+                continue;
+            }
+            let mut frame = self.take_buffer(layer.width, layer.height);
+            self.source.decode_frame(&layer, &mut frame)?;
+            let displayed = layer.is_displayed();
+            let referenced = layer.can_be_referenced();
+            let mut composite = if displayed || (referenced && !layer.save_before_ct) {
+                Some(self.composite(&layer, &frame, true)?)
+            } else {
+                None
+            };
+            if referenced {
+                let saved = if layer.save_before_ct {
+                    self.composite(&layer, &frame, false)?
+                } else if displayed {
+                    let composite = composite.as_ref().unwrap();
+                    let mut copy = self.take_buffer(self.width, self.height);
+                    for c in 0..copy.num_channels() {
+                        copy.channel_mut(c).copy_from_slice(composite.channel(c));
+                    }
+                    copy
+                } else {
+                    composite.take().unwrap()
+                };
+                let slot = layer.save_as_reference as usize;
+                if let Some(old) = self.references[slot].replace(saved) {
+                    self.pool.push(old);
+                }
+            }
+            self.pool.push(frame);
+            if layer.is_last {
+                self.done = true;
+                self.references = Default::default();
+            }
+            if displayed {
+                return Ok(Some(AnimationFrame {
+                    image: composite.unwrap(),
+                    duration: layer.duration,
+                    timecode: layer.timecode,
+                    is_last: layer.is_last,
+                }));
+            }
+            if let Some(composite) = composite {
+                self.pool.push(composite);
+            }
+        }
+        self.done = true;
+        Ok(None)
+    }
+}
+
+impl<S: FrameSource> Iterator for AnimationFrames<S> {
+    type Item = Result<AnimationFrame, Error>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let res = self.next_displayed();
+        if res.is_err() {
+            self.done = true;
+        }
+        res.transpose()
+    }
+}
+
+struct Blender<'a> {
+    num_color: usize,
+    alpha_associated: &'a [bool],
+}
+
+impl<'a> Blender<'a> {
+    /// Composites `frame` over the references given by its blending info into `out`, or, if
+    /// `blend` is false, places it over a blank canvas.
+    fn blend(
+        &self,
+        layer: &FrameLayer,
+        frame: &ImageBuffer,
+        references: &[Option<ImageBuffer>; NUM_REFERENCES],
+        blend: bool,
+        out: &mut ImageBuffer,
+    ) -> Result<(), Error> {
+        let (width, height) = (out.width() as i64, out.height() as i64);
+        let x0 = layer.x0.clamp(0, width);
+        let x1 = (layer.x0 + layer.width as i64).clamp(x0, width);
+        let y0 = layer.y0.clamp(0, height);
+        let y1 = (layer.y0 + layer.height as i64).clamp(y0, height);
+        let covers_canvas = (x0, y0, x1, y1) == (0, 0, width, height);
+        let zeros = vec![0.0; out.width()];
+        let replace = BlendingInfo::default();
+        for c in 0..out.num_channels() {
+            let info = if !blend {
+                &replace
+            } else if c < self.num_color {
+                &layer.blending_info
+            } else {
+                &layer.ec_blending_info[c - self.num_color]
+            };
+            let reference = references[info.source as usize].as_ref();
+            let uses_alpha = matches!(
+                info.mode,
+                BlendingMode::Blend | BlendingMode::AlphaWeightedAdd
+            );
+            let alpha = self.num_color + info.alpha_channel as usize;
+            if uses_alpha && alpha >= out.num_channels() {
+                return Err(Error::InvalidBlendingAlphaChannel(info.alpha_channel));
+            }
+            if !(covers_canvas && info.mode == BlendingMode::Replace) {
+                match reference {
+                    Some(reference) => out.channel_mut(c).copy_from_slice(reference.channel(c)),
+                    None => out.channel_mut(c).fill(0.0),
+                }
+            }
+            let premultiplied = uses_alpha && self.alpha_associated[alpha - self.num_color];
+            for y in y0..y1 {
+                let frame_y = (y - layer.y0) as usize;
+                let frame_x = (x0 - layer.x0) as usize..(x1 - layer.x0) as usize;
+                let new = &frame.row(c, frame_y)[frame_x.clone()];
+                let (new_alpha, old_alpha) = if uses_alpha {
+                    let old_alpha = match reference {
+                        Some(reference) => &reference.row(alpha, y as usize)[x0 as usize..],
+                        None => &zeros[..],
+                    };
+                    (&frame.row(alpha, frame_y)[frame_x], old_alpha)
+                } else {
+                    (&[][..], &[][..])
+                };
+                let out = &mut out.row_mut(c, y as usize)[x0 as usize..x1 as usize];
+                blend_row(
+                    info,
+                    c == alpha,
+                    premultiplied,
+                    new,
+                    new_alpha,
+                    old_alpha,
+                    out,
+                );
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Blends a row of a frame into `out`, which contains the reference. `new_alpha` and
+/// `old_alpha` are the rows of the alpha channel of the frame and of the reference, for the
+/// modes that use it.
+fn blend_row(
+    info: &BlendingInfo,
+    is_alpha: bool,
+    premultiplied: bool,
+    new: &[f32],
+    new_alpha: &[f32],
+    old_alpha: &[f32],
+    out: &mut [f32],
+) {
+    let clamp = |v: f32| if info.clamp { v.clamp(0.0, 1.0) } else { v };
+    match info.mode {
+        BlendingMode::Replace => out.copy_from_slice(new),
+        BlendingMode::Add => {
+            for (out, new) in out.iter_mut().zip(new.iter()) {
+                *out += new;
+            }
+        }
+        BlendingMode::Mul => {
+            for (out, new) in out.iter_mut().zip(new.iter()) {
+                *out *= clamp(*new);
+            }
+        }
+        // The alpha channel keeps the alpha of the reference.
+        BlendingMode::AlphaWeightedAdd if is_alpha => {}
+        BlendingMode::AlphaWeightedAdd => {
+            for ((out, new), a) in out.iter_mut().zip(new.iter()).zip(new_alpha.iter()) {
+                *out += new * clamp(*a);
+            }
+        }
+        BlendingMode::Blend => {
+            let samples = out.iter_mut().zip(new.iter()).zip(new_alpha.iter());
+            for (((out, new), a), old_a) in samples.zip(old_alpha.iter()) {
+                let a = clamp(*a);
+                *out = if is_alpha {
+                    a + *out * (1.0 - a)
+                } else if premultiplied {
+                    new + *out * (1.0 - a)
+                } else {
+                    let out_a = a + old_a * (1.0 - a);
+                    if out_a > 0.0 {
+                        (new * a + *out * old_a * (1.0 - a)) / out_a
+                    } else {
+                        0.0
+                    }
+                };
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    /// Returns the frames of a list, counting how many are decoded.
+    struct VecSource {
+        frames: Vec<(FrameLayer, ImageBuffer)>,
+        next: usize,
+        num_decoded: usize,
+    }
+
+    impl VecSource {
+        fn new(frames: Vec<(FrameLayer, ImageBuffer)>) -> VecSource {
+            VecSource {
+                frames,
+                next: 0,
+                num_decoded: 0,
+            }
+        }
+    }
+
+    impl FrameSource for VecSource {
+        fn next_frame(&mut self) -> Result<Option<FrameLayer>, Error> {
+            self.next += 1;
+            Ok(self
+                .frames
+                .get(self.next - 1)
+                .map(|(layer, _)| layer.clone()))
+        }
+
+        fn decode_frame(&mut self, _: &FrameLayer, buffer: &mut ImageBuffer) -> Result<(), Error> {
+            self.num_decoded += 1;
+            let image = &self.frames[self.next - 1].1;
+            for c in 0..image.num_channels() {
+                buffer.channel_mut(c).copy_from_slice(image.channel(c));
+            }
+            Ok(())
+        }
+    }
+
+    fn layer(frame_type: FrameType, mode: BlendingMode, num_extra: usize) -> FrameLayer {
+        let blending_info = BlendingInfo {
+            mode,
+            ..BlendingInfo::default()
+        };
+        FrameLayer {
+            frame_type,
+            x0: 0,
+            y0: 0,
+            width: 4,
+            height: 4,
+            ec_blending_info: vec![blending_info.clone(); num_extra],
+            blending_info,
+            duration: 0,
+            timecode: 0,
+            is_last: false,
+            save_as_reference: 0,
+            save_before_ct: false,
+            lf_level: 0,
+            uses_lf_frame: false,
+            uses_patches: false,
+        }
+    }
+
+    fn image(width: usize, height: usize, values: &[f32]) -> ImageBuffer {
+        let mut image = ImageBuffer::new(width, height, values.len());
+        for (c, v) in values.iter().enumerate() {
+            image.channel_mut(c).fill(*v);
+        }
+        image
+    }
+
+    #[test]
+    fn test_layers() {
+        // A still image with a layer blended over the background, partly outside the canvas.
+        let background = layer(FrameType::RegularFrame, BlendingMode::Replace, 1);
+        let mut foreground = layer(FrameType::RegularFrame, BlendingMode::Blend, 1);
+        (
+            foreground.x0,
+            foreground.y0,
+            foreground.width,
+            foreground.height,
+        ) = (-1, 1, 2, 2);
+        foreground.is_last = true;
+        let mut overlay = image(2, 2, &[0.0, 0.0, 0.0, 0.5]);
+        for y in 0..2 {
+            overlay.row_mut(0, y)[1] = 1.0;
+        }
+        let source = VecSource::new(vec![
+            (background, image(4, 4, &[0.2, 0.2, 0.2, 1.0])),
+            (foreground, overlay),
+        ]);
+        let mut frames = AnimationFrames::new(source, 4, 4, 3, vec![false]);
+        let frame = frames.next().unwrap().unwrap();
+        assert!(frame.is_last);
+        assert!(frames.next().is_none());
+        let image = &frame.image;
+        for y in 0..4 {
+            for x in 0..4 {
+                let inside = x == 0 && (1..3).contains(&y);
+                let expected = if inside { 0.6 } else { 0.2 };
+                assert!((image.row(0, y)[x] - expected).abs() < 1e-6, "{} {}", x, y);
+                // The green channel of the frame is 0 there.
+                let expected = if inside { 0.1 } else { 0.2 };
+                assert!((image.row(1, y)[x] - expected).abs() < 1e-6, "{} {}", x, y);
+                assert_eq!(image.row(3, y)[x], 1.0);
+            }
+        }
+    }
+
+    #[test]
+    fn test_alpha_weighted_add() {
+        let background = layer(FrameType::RegularFrame, BlendingMode::Replace, 1);
+        let mut foreground = layer(FrameType::RegularFrame, BlendingMode::AlphaWeightedAdd, 1);
+        foreground.is_last = true;
+        let source = VecSource::new(vec![
+            (background, image(4, 4, &[0.2, 0.2, 0.2, 0.5])),
+            (foreground, image(4, 4, &[0.4, 0.0, 0.4, 0.25])),
+        ]);
+        let mut frames = AnimationFrames::new(source, 4, 4, 3, vec![false]);
+        let frame = frames.next().unwrap().unwrap();
+        for (c, expected) in [0.3, 0.2, 0.3, 0.5].iter().enumerate() {
+            let channel = frame.image.channel(c);
+            assert!(channel.iter().all(|v| (v - expected).abs() < 1e-6), "{}", c);
+        }
+    }
+
+    #[test]
+    fn test_animation() {
+        let mut frames = vec![];
+        let mut reference = layer(FrameType::ReferenceOnly, BlendingMode::Replace, 0);
+        reference.save_as_reference = 1;
+        frames.push((reference, image(4, 4, &[5.0])));
+        frames.push((
+            layer(FrameType::LFFrame, BlendingMode::Replace, 0),
+            image(4, 4, &[-1.0]),
+        ));
+        for i in 0..20 {
+            let mut frame = layer(FrameType::RegularFrame, BlendingMode::Add, 0);
+            frame.blending_info.source = 1;
+            frame.duration = i + 1;
+            frame.is_last = i == 19;
+            frames.push((frame, image(4, 4, &[i as f32])));
+        }
+        let mut frames = AnimationFrames::new(VecSource::new(frames), 4, 4, 1, vec![]);
+        let mut num_frames = 0;
+        while let Some(frame) = frames.next() {
+            let frame = frame.unwrap();
+            assert_eq!(frame.duration, num_frames + 1);
+            assert!(frame
+                .image
+                .channel(0)
+                .iter()
+                .all(|v| *v == 5.0 + num_frames as f32));
+            num_frames += 1;
+            frames.recycle(frame);
+        }
+        assert_eq!(num_frames, 20);
+        assert_eq!(frames.source.num_decoded, 21);
+        // The reference, the frame being decoded, and its composite.
+        assert_eq!(frames.num_allocations(), 3);
+    }
+
+    #[test]
+    fn test_invalid_alpha() {
+        let mut frame = layer(FrameType::RegularFrame, BlendingMode::Blend, 0);
+        frame.is_last = true;
+        let source = VecSource::new(vec![(frame, image(4, 4, &[1.0, 1.0, 1.0]))]);
+        let mut frames = AnimationFrames::new(source, 4, 4, 3, vec![]);
+        assert!(matches!(
+            frames.next(),
+            Some(Err(Error::InvalidBlendingAlphaChannel(0)))
+        ));
+        assert!(frames.next().is_none());
+    }
+}
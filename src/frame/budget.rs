@@ -0,0 +1,158 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use crate::error::Error;
+use crate::headers::color_encoding::ColorSpace;
+use crate::headers::frame_header::FrameHeader;
+use crate::headers::FileHeaders;
+
+/// Bytes per sample of the buffers of the decoder (f32, or i32 for modular).
+const BYTES_PER_SAMPLE: u64 = 4;
+
+/// Estimate of the resources that decoding a frame needs, computed from the headers only.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct DecodeCost {
+    /// Pixels of the image, or of the frame after upsampling if it is larger.
+    pub pixels: u64,
+    /// Samples of all the channels of the coded frame, a rough measure of the compute needed.
+    pub coded_samples: u64,
+    /// Peak memory of the frame, canvas and reference buffers, in bytes.
+    pub memory: u64,
+}
+
+impl DecodeCost {
+    pub fn estimate(file_headers: &FileHeaders, frame_header: &FrameHeader) -> DecodeCost {
+        let metadata = &file_headers.image_metadata;
+        let (img_width, img_height) = (file_headers.size.xsize(), file_headers.size.ysize());
+        let num_color =
+            if !metadata.xyb_encoded && metadata.color_encoding.color_space == ColorSpace::Gray {
+                1
+            } else {
+                3
+            };
+        let num_channels = num_color + metadata.extra_channel_info.len() as u64;
+        let dimensions = frame_header.dimensions(img_width, img_height);
+        let layer = frame_header.layer(img_width, img_height);
+
+        let frame_pixels = (dimensions.width as u64).saturating_mul(dimensions.height as u64);
+        let mut coded_samples = frame_pixels.saturating_mul(num_color);
+        // Extra channels can be coded at a lower resolution than the color channels.
+        let upsampled_width = dimensions.width as u64 * frame_header.upsampling() as u64;
+        let upsampled_height = dimensions.height as u64 * frame_header.upsampling() as u64;
+        for &ec_upsampling in frame_header.ec_upsampling() {
+            let ec_upsampling = ec_upsampling.max(1) as u64;
+            let ec_width = upsampled_width.div_ceil(ec_upsampling);
+            let ec_height = upsampled_height.div_ceil(ec_upsampling);
+            coded_samples = coded_samples.saturating_add(ec_width.saturating_mul(ec_height));
+        }
+
+        let mut memory = coded_samples.saturating_mul(BYTES_PER_SAMPLE);
+        if frame_header.is_modular() {
+            // Channels are decoded as integers, then converted.
+            memory = memory.saturating_mul(2);
+        } else if dimensions.num_passes > 1 {
+            // Coefficients are accumulated over the passes.
+            memory =
+                memory.saturating_add(frame_pixels.saturating_mul(num_color * BYTES_PER_SAMPLE));
+        }
+        let img_pixels = img_width as u64 * img_height as u64;
+        let canvas = img_pixels
+            .saturating_mul(num_channels)
+            .saturating_mul(BYTES_PER_SAMPLE);
+        memory = memory.saturating_add(canvas);
+        if layer.can_be_referenced() {
+            memory = memory.saturating_add(canvas);
+        }
+
+        DecodeCost {
+            pixels: img_pixels.max((layer.width as u64).saturating_mul(layer.height as u64)),
+            coded_samples,
+            memory,
+        }
+    }
+}
+
+/// Limits on the resources a decode may use, checked before any pixel is decoded, so that
+/// files that would need too much (e.g. decompression bombs) are rejected early.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct DecodeLimits {
+    /// Maximum of `DecodeCost::pixels`; also checked against the image size as soon as the file
+    /// headers are read.
+    pub max_pixels: u64,
+    /// Maximum of `DecodeCost::memory`.
+    pub max_memory: u64,
+}
+
+impl Default for DecodeLimits {
+    fn default() -> DecodeLimits {
+        DecodeLimits::unlimited()
+    }
+}
+
+impl DecodeLimits {
+    pub fn unlimited() -> DecodeLimits {
+        DecodeLimits {
+            max_pixels: u64::MAX,
+            max_memory: u64::MAX,
+        }
+    }
+
+    /// Checks the image size, before the frame headers are known.
+    pub fn check_image(&self, file_headers: &FileHeaders) -> Result<(), Error> {
+        let pixels = file_headers.size.xsize() as u64 * file_headers.size.ysize() as u64;
+        if pixels > self.max_pixels {
+            return Err(Error::TooManyPixels(pixels, self.max_pixels));
+        }
+        Ok(())
+    }
+
+    pub fn check(&self, cost: &DecodeCost) -> Result<(), Error> {
+        if cost.pixels > self.max_pixels {
+            Err(Error::TooManyPixels(cost.pixels, self.max_pixels))
+        } else if cost.memory > self.max_memory {
+            Err(Error::MemoryLimitExceeded(cost.memory, self.max_memory))
+        } else {
+            Ok(())
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::decoder::probe;
+    use crate::test_util::IMAGE;
+
+    #[test]
+    fn test_estimate() {
+        let info = probe(&IMAGE, true).unwrap();
+        let cost = info.decode_cost().unwrap();
+        // 1x1 VarDCT frame, with 3 color channels.
+        assert_eq!(cost.pixels, 1);
+        assert_eq!(cost.coded_samples, 3);
+        assert!(cost.memory >= 2 * 3 * BYTES_PER_SAMPLE);
+
+        let limits = DecodeLimits::unlimited();
+        assert!(limits.check(&cost).is_ok());
+        assert!(limits.check_image(&info.file_headers).is_ok());
+        let limits = DecodeLimits {
+            max_pixels: 0,
+            ..limits
+        };
+        assert!(matches!(
+            limits.check(&cost),
+            Err(Error::TooManyPixels(1, 0))
+        ));
+        assert!(limits.check_image(&info.file_headers).is_err());
+        let limits = DecodeLimits {
+            max_pixels: 1,
+            max_memory: cost.memory - 1,
+        };
+        assert!(matches!(
+            limits.check(&cost),
+            Err(Error::MemoryLimitExceeded(..))
+        ));
+    }
+}
@@ -0,0 +1,476 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use std::convert::TryFrom;
+use std::ops::Range;
+
+use num_traits::FromPrimitive;
+
+use crate::bmff::{CodestreamSegments, SegmentMap};
+use crate::decoder::{read_file_headers, read_frame_header_and_toc, skip_preview_frame};
+use crate::error::Error;
+use crate::frame::animation::NUM_REFERENCES;
+use crate::headers::frame_header::{BlendingMode, FrameHeaderNonserialized, FrameLayer, FrameType};
+use crate::icc::skip_icc;
+
+/// Number of levels of LF frames.
+const NUM_LF_LEVELS: usize = 4;
+
+const MAGIC: &[u8; 4] = b"JXSI";
+const VERSION: u8 = 2;
+
+/// A frame of the codestream, as recorded in a `SeekIndex`.
+#[derive(Debug, Clone, PartialEq)]
+pub struct FrameEntry {
+    /// Bytes of the codestream that contain the frame, from its header to the end of its data.
+    pub range: Range<usize>,
+    pub frame_type: FrameType,
+    pub duration: u32,
+    pub is_last: bool,
+    /// Whether the frame gives an image to display, i.e. an animation frame.
+    pub displayed: bool,
+    /// The earlier frames that must be decoded before this one, because it uses the reference
+    /// slots or the LF frames that they were saved to.
+    pub dependencies: Vec<usize>,
+}
+
+/// Index of the frames of a codestream, built by reading only the frame headers and the TOCs,
+/// to seek to an animation frame while decoding only the frames it depends on. It can be
+/// stored with `to_bytes` and loaded back with `from_bytes`.
+#[derive(Debug, Clone, PartialEq)]
+pub struct SeekIndex {
+    /// Size of the file headers and of the ICC profile, which precede the first frame.
+    pub headers_size: usize,
+    frames: Vec<FrameEntry>,
+    /// For each animation frame, its index in `frames`.
+    displayed: Vec<usize>,
+    /// Position of the codestream in the file.
+    segments: SegmentMap,
+}
+
+/// Computes the dependencies of frames, as they are added in codestream order.
+pub struct SeekIndexBuilder {
+    width: usize,
+    height: usize,
+    headers_size: usize,
+    frames: Vec<FrameEntry>,
+    segments: SegmentMap,
+    /// The last frame saved to each reference slot.
+    references: [Option<usize>; NUM_REFERENCES],
+    /// The last LF frame of each level.
+    lf_frames: [Option<usize>; NUM_LF_LEVELS],
+}
+
+impl SeekIndexBuilder {
+    /// Creates a builder for an image of `width` x `height`, whose frames start after
+    /// `headers_size` bytes.
+    pub fn new(width: usize, height: usize, headers_size: usize) -> SeekIndexBuilder {
+        SeekIndexBuilder {
+            width,
+            height,
+            headers_size,
+            frames: vec![],
+            segments: SegmentMap::default(),
+            references: [None; NUM_REFERENCES],
+            lf_frames: [None; NUM_LF_LEVELS],
+        }
+    }
+
+    /// Sets the position of the codestream in the file, for `SeekIndex::byte_ranges`. By
+    /// default, the file is a bare codestream.
+    pub fn set_segment_map(&mut self, segments: SegmentMap) {
+        self.segments = segments;
+    }
+
+    /// Reference slots whose content can appear in the frame.
+    fn reference_slots(&self, layer: &FrameLayer) -> Vec<usize> {
+        if layer.uses_patches {
+            return (0..NUM_REFERENCES).collect();
+        }
+        let covers_canvas = layer.x0 <= 0
+            && layer.y0 <= 0
+            && layer.x0 + layer.width as i64 >= self.width as i64
+            && layer.y0 + layer.height as i64 >= self.height as i64;
+        let mut slots: Vec<usize> = std::iter::once(&layer.blending_info)
+            .chain(layer.ec_blending_info.iter())
+            .filter(|info| !covers_canvas || info.mode != BlendingMode::Replace)
+            .map(|info| info.source as usize)
+            .collect();
+        slots.sort_unstable();
+        slots.dedup();
+        slots
+    }
+
+    pub fn add_frame(&mut self, layer: &FrameLayer, range: Range<usize>) {
+        let index = self.frames.len();
+        let mut dependencies = vec![];
+        if layer.frame_type != FrameType::LFFrame {
+            dependencies.extend(
+                self.reference_slots(layer)
+                    .iter()
+                    .filter_map(|slot| self.references[*slot]),
+            );
+        }
+        if layer.uses_lf_frame {
+            let level = layer.lf_level as usize + 1;
+            if let Some(lf_frame) = self.lf_frames.get(level - 1).copied().flatten() {
+                dependencies.push(lf_frame);
+            }
+        }
+        dependencies.sort_unstable();
+        dependencies.dedup();
+        if layer.can_be_referenced() {
+            self.references[layer.save_as_reference as usize] = Some(index);
+        }
+        if layer.frame_type == FrameType::LFFrame && layer.lf_level >= 1 {
+            self.lf_frames[layer.lf_level as usize - 1] = Some(index);
+        }
+        self.frames.push(FrameEntry {
+            range,
+            frame_type: layer.frame_type,
+            duration: layer.duration,
+            is_last: layer.is_last,
+            displayed: layer.is_displayed(),
+            dependencies,
+        });
+    }
+
+    pub fn finish(self) -> SeekIndex {
+        SeekIndex::new(self.headers_size, self.frames, self.segments)
+    }
+}
+
+impl SeekIndex {
+    fn new(headers_size: usize, frames: Vec<FrameEntry>, segments: SegmentMap) -> SeekIndex {
+        let displayed = (0..frames.len()).filter(|i| frames[*i].displayed).collect();
+        SeekIndex {
+            headers_size,
+            frames,
+            displayed,
+            segments,
+        }
+    }
+
+    /// Builds the index of the whole file in `data`, skipping over the frame data.
+    pub fn build(data: &[u8]) -> Result<SeekIndex, Error> {
+        let segments = CodestreamSegments::new(data)?;
+        let mut br = segments.bit_reader();
+        let mut read_frames = || -> Result<SeekIndex, Error> {
+            let file_headers = read_file_headers(&mut br)?;
+            if file_headers.image_metadata.color_encoding.want_icc {
+                skip_icc(&mut br)?;
+            }
+            let nonserialized = FrameHeaderNonserialized::from_file_headers(&file_headers);
+            let (width, height) = (nonserialized.img_width, nonserialized.img_height);
+            let headers_size = br.total_bits_read().div_ceil(8);
+            let mut builder = SeekIndexBuilder::new(width as usize, height as usize, headers_size);
+            builder.set_segment_map(segments.segment_map());
+            // The preview is not needed to decode the frames.
+            skip_preview_frame(&mut br, &file_headers)?;
+            loop {
+                let start = br.total_bits_read().div_ceil(8);
+                let (frame_header, toc) = read_frame_header_and_toc(&mut br, &nonserialized)?;
+                let data_size = toc.total_size();
+                let end = br.total_bits_read() / 8 + data_size;
+                br.skip_bits(data_size * 8)?;
+                builder.add_frame(&frame_header.layer(width, height), start..end);
+                if frame_header.is_last {
+                    return Ok(builder.finish());
+                }
+            }
+        };
+        match read_frames() {
+            Err(Error::OutOfBounds) => Err(Error::FileTruncated),
+            res => res,
+        }
+    }
+
+    pub fn frames(&self) -> &[FrameEntry] {
+        &self.frames
+    }
+
+    pub fn num_animation_frames(&self) -> usize {
+        self.displayed.len()
+    }
+
+    /// Index in `frames` of animation frame `n`.
+    pub fn animation_frame(&self, n: usize) -> Option<usize> {
+        self.displayed.get(n).copied()
+    }
+
+    /// The animation frame that is shown `ticks` after the start of the animation, or the last
+    /// one if the animation is over.
+    pub fn animation_frame_at(&self, ticks: u64) -> Option<usize> {
+        let mut start = 0;
+        for (n, frame) in self.displayed.iter().enumerate() {
+            start += self.frames[*frame].duration as u64;
+            if ticks < start {
+                return Some(n);
+            }
+        }
+        self.displayed.len().checked_sub(1)
+    }
+
+    /// The frames to decode, in order, to show animation frame `n`: the frame and all the frames
+    /// it depends on, directly or not.
+    pub fn decode_chain(&self, n: usize) -> Option<Vec<usize>> {
+        let target = self.animation_frame(n)?;
+        let mut needed = vec![false; target + 1];
+        needed[target] = true;
+        // Dependencies always come before the frames that use them.
+        for i in (0..=target).rev() {
+            if needed[i] {
+                for dependency in self.frames[i].dependencies.iter() {
+                    needed[*dependency] = true;
+                }
+            }
+        }
+        Some((0..=target).filter(|i| needed[*i]).collect())
+    }
+
+    /// Byte ranges of the file needed to show animation frame `n`, headers included, with
+    /// adjacent ranges merged. Ranges are split where the codestream continues in another box.
+    pub fn byte_ranges(&self, n: usize) -> Option<Vec<Range<usize>>> {
+        let mut ranges = vec![Range {
+            start: 0,
+            end: self.headers_size,
+        }];
+        for frame in self.decode_chain(n)? {
+            let range = self.frames[frame].range.clone();
+            match ranges.last_mut() {
+                Some(last) if range.start <= last.end => last.end = last.end.max(range.end),
+                _ => ranges.push(range),
+            }
+        }
+        Some(self.segments.file_ranges(&ranges))
+    }
+
+    pub fn to_bytes(&self) -> Vec<u8> {
+        let mut out = MAGIC.to_vec();
+        out.push(VERSION);
+        let write_u64 = |out: &mut Vec<u8>, v: u64| out.extend_from_slice(&v.to_le_bytes());
+        write_u64(&mut out, self.headers_size as u64);
+        write_u64(&mut out, self.frames.len() as u64);
+        for frame in self.frames.iter() {
+            write_u64(&mut out, frame.range.start as u64);
+            write_u64(&mut out, frame.range.end as u64);
+            out.push(frame.frame_type as u8);
+            out.push(frame.is_last as u8 | (frame.displayed as u8) << 1);
+            write_u64(&mut out, frame.duration as u64);
+            write_u64(&mut out, frame.dependencies.len() as u64);
+            for dependency in frame.dependencies.iter() {
+                write_u64(&mut out, *dependency as u64);
+            }
+        }
+        write_u64(&mut out, self.segments.segments().len() as u64);
+        for (offset, len) in self.segments.segments() {
+            write_u64(&mut out, *offset as u64);
+            write_u64(&mut out, *len as u64);
+        }
+        out
+    }
+
+    /// Reads an index written by `to_bytes`.
+    pub fn from_bytes(data: &[u8]) -> Result<SeekIndex, Error> {
+        if data.len() < MAGIC.len() + 1 || &data[..4] != MAGIC || data[4] != VERSION {
+            return Err(Error::InvalidSeekIndex);
+        }
+        let mut data = &data[5..];
+        let mut read = |size: usize| -> Result<u64, Error> {
+            if data.len() < size {
+                return Err(Error::InvalidSeekIndex);
+            }
+            let mut bytes = [0; 8];
+            bytes[..size].copy_from_slice(&data[..size]);
+            data = &data[size..];
+            let v = u64::from_le_bytes(bytes);
+            Ok(v)
+        };
+        let headers_size = read(8)? as usize;
+        let num_frames = read(8)? as usize;
+        let mut frames = vec![];
+        for i in 0..num_frames {
+            let range = read(8)? as usize..read(8)? as usize;
+            let frame_type = FrameType::from_u64(read(1)?).ok_or(Error::InvalidSeekIndex)?;
+            let flags = read(1)?;
+            let duration = u32::try_from(read(8)?).map_err(|_| Error::InvalidSeekIndex)?;
+            let num_dependencies = read(8)? as usize;
+            // Each dependency is an earlier frame, and they are sorted.
+            if range.start > range.end || flags > 3 || num_dependencies > i {
+                return Err(Error::InvalidSeekIndex);
+            }
+            let dependencies = (0..num_dependencies)
+                .map(|_| Ok(read(8)? as usize))
+                .collect::<Result<Vec<_>, Error>>()?;
+            if dependencies.windows(2).any(|w| w[0] >= w[1])
+                || dependencies.last().is_some_and(|d| *d >= i)
+            {
+                return Err(Error::InvalidSeekIndex);
+            }
+            frames.push(FrameEntry {
+                range,
+                frame_type,
+                duration,
+                is_last: flags & 1 != 0,
+                displayed: flags & 2 != 0,
+                dependencies,
+            });
+        }
+        let num_segments = read(8)? as usize;
+        let mut segments = SegmentMap::default();
+        let mut end = None;
+        for _ in 0..num_segments {
+            let (offset, len) = (read(8)? as usize, read(8)? as usize);
+            // Segments are in file order, and not adjacent since they would be merged.
+            if len == 0 || end.is_some_and(|end| offset <= end) {
+                return Err(Error::InvalidSeekIndex);
+            }
+            end = Some(offset.checked_add(len).ok_or(Error::InvalidSeekIndex)?);
+            segments.push(offset, len);
+        }
+        if !data.is_empty() {
+            return Err(Error::InvalidSeekIndex);
+        }
+        Ok(SeekIndex::new(headers_size, frames, segments))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::decoder::probe;
+    use crate::headers::frame_header::BlendingInfo;
+    use crate::test_util::{container, image_with_preview, IMAGE, IMAGE_HEADERS_SIZE};
+
+    fn layer(mode: BlendingMode, source: u32, save_as_reference: u32) -> FrameLayer {
+        FrameLayer {
+            frame_type: FrameType::RegularFrame,
+            x0: 0,
+            y0: 0,
+            width: 8,
+            height: 8,
+            blending_info: BlendingInfo {
+                mode,
+                source,
+                ..BlendingInfo::default()
+            },
+            ec_blending_info: vec![],
+            duration: 1,
+            timecode: 0,
+            is_last: false,
+            save_as_reference,
+            save_before_ct: false,
+            lf_level: 0,
+            uses_lf_frame: false,
+            uses_patches: false,
+        }
+    }
+
+    /// A keyframe saved to slot 1, frames that add to it, a new keyframe, and a frame that uses
+    /// an LF frame.
+    fn animation() -> SeekIndex {
+        let mut builder = SeekIndexBuilder::new(8, 8, 10);
+        let mut frames = vec![
+            layer(BlendingMode::Replace, 0, 1),
+            layer(BlendingMode::Add, 1, 0),
+            layer(BlendingMode::Add, 1, 0),
+            layer(BlendingMode::Replace, 2, 1),
+        ];
+        let mut cropped = layer(BlendingMode::Replace, 1, 0);
+        cropped.width = 4;
+        frames.push(cropped);
+        let mut lf_frame = layer(BlendingMode::Replace, 0, 0);
+        (lf_frame.frame_type, lf_frame.lf_level, lf_frame.duration) = (FrameType::LFFrame, 1, 0);
+        frames.push(lf_frame);
+        let mut with_lf = layer(BlendingMode::Replace, 0, 0);
+        (with_lf.uses_lf_frame, with_lf.is_last) = (true, true);
+        frames.push(with_lf);
+        for (i, frame) in frames.iter().enumerate() {
+            builder.add_frame(frame, 10 + 10 * i..20 + 10 * i);
+        }
+        builder.finish()
+    }
+
+    #[test]
+    fn test_decode_chain() {
+        let index = animation();
+        assert_eq!(index.num_animation_frames(), 6);
+        let dependencies: Vec<_> = index.frames().iter().map(|f| &f.dependencies).collect();
+        let expected: [&[usize]; 7] = [&[], &[0], &[0], &[], &[3], &[], &[5]];
+        assert_eq!(dependencies, expected);
+        assert_eq!(index.decode_chain(2), Some(vec![0, 2]));
+        assert_eq!(index.decode_chain(4), Some(vec![3, 4]));
+        assert_eq!(index.decode_chain(5), Some(vec![5, 6]));
+        assert_eq!(index.decode_chain(6), None);
+        assert_eq!(index.byte_ranges(2), Some(vec![0..20, 30..40]));
+        assert_eq!(index.animation_frame_at(0), Some(0));
+        assert_eq!(index.animation_frame_at(4), Some(4));
+        assert_eq!(index.animation_frame_at(100), Some(5));
+    }
+
+    #[test]
+    fn test_serialization() {
+        let index = animation();
+        let bytes = index.to_bytes();
+        assert_eq!(SeekIndex::from_bytes(&bytes).unwrap(), index);
+        for len in 0..bytes.len() {
+            assert!(SeekIndex::from_bytes(&bytes[..len]).is_err());
+        }
+        let mut extra = bytes.clone();
+        extra.push(0);
+        assert!(SeekIndex::from_bytes(&extra).is_err());
+    }
+
+    #[test]
+    fn test_build() {
+        let index = SeekIndex::build(&IMAGE).unwrap();
+        let frame_index = probe(&IMAGE, true).unwrap().frame_index.unwrap();
+        assert_eq!(index.frames().len(), 1);
+        let frame = &index.frames()[0];
+        assert!(frame.is_last && frame.displayed && frame.dependencies.is_empty());
+        assert_eq!(frame.range.end, frame_index.end_offset());
+        assert!(index.headers_size <= frame.range.start);
+        assert!(frame.range.start < frame_index.data_offset);
+        assert!(matches!(
+            SeekIndex::build(&IMAGE[..40]),
+            Err(Error::FileTruncated)
+        ));
+    }
+
+    #[test]
+    fn test_build_preview() {
+        let file = image_with_preview();
+        let index = SeekIndex::build(&file).unwrap();
+        assert_eq!(index.frames().len(), 1);
+        assert_eq!(
+            index.frames()[0].range.start,
+            file.len() - (IMAGE.len() - IMAGE_HEADERS_SIZE)
+        );
+        // The headers and the frame, without the preview.
+        let bytes: Vec<u8> = index
+            .byte_ranges(0)
+            .unwrap()
+            .iter()
+            .flat_map(|r| file[r.clone()].to_vec())
+            .collect();
+        assert_eq!(bytes[..index.headers_size], file[..index.headers_size]);
+        assert_eq!(bytes[index.headers_size..], IMAGE[IMAGE_HEADERS_SIZE..]);
+    }
+
+    #[test]
+    fn test_build_container() {
+        // The codestream is split in the frame data.
+        let file = container(&IMAGE, 50);
+        let index = SeekIndex::build(&file).unwrap();
+        assert_eq!(SeekIndex::from_bytes(&index.to_bytes()).unwrap(), index);
+        let ranges = index.byte_ranges(0).unwrap();
+        assert_eq!(ranges.len(), 2);
+        let bytes: Vec<u8> = ranges
+            .iter()
+            .flat_map(|r| file[r.clone()].to_vec())
+            .collect();
+        assert_eq!(bytes, IMAGE);
+    }
+}
@@ -0,0 +1,469 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use std::ops::Range;
+
+use crate::bit_reader::BitReader;
+use crate::bmff::SegmentMap;
+use crate::entropy_coding::decode::{Histograms, Reader};
+use crate::error::Error;
+use crate::headers::encodings::{Empty, U32Coder, UnconditionalCoder, U32};
+use crate::headers::frame_header::{FrameDimensions, Rect};
+use crate::runner::{run_map, Runner};
+use crate::trace::StageTrace;
+use crate::util::{CeilLog2, FloorLog2};
+
+const NUM_PERMUTATION_CONTEXTS: usize = 8;
+
+fn permutation_context(x: u32) -> usize {
+    (x + 1).ceil_log2().min(7) as usize
+}
+
+/// Converts a Lehmer code to the permutation it represents: element `i` of the result is the
+/// `lehmer[i]`-th smallest value that does not appear before it.
+fn permutation_from_lehmer(lehmer: &[u32]) -> Vec<u32> {
+    let n = lehmer.len();
+    if n == 0 {
+        return vec![];
+    }
+    // Fenwick tree over the values that were not used yet, all of them initially.
+    let mut tree: Vec<u32> = (0..=n).map(|i| (i & i.wrapping_neg()) as u32).collect();
+    let top = 1 << n.floor_log2();
+    lehmer
+        .iter()
+        .map(|&l| {
+            let mut pos = 0;
+            let mut rem = l;
+            let mut step = top;
+            while step > 0 {
+                if pos + step <= n && tree[pos + step] <= rem {
+                    pos += step;
+                    rem -= tree[pos];
+                }
+                step >>= 1;
+            }
+            let mut i = pos + 1;
+            while i <= n {
+                tree[i] -= 1;
+                i += i & i.wrapping_neg();
+            }
+            pos as u32
+        })
+        .collect()
+}
+
+/// Reads a permutation of `size` elements whose first `skip` elements are the identity.
+pub fn decode_permutation(
+    br: &mut BitReader,
+    reader: &mut Reader,
+    size: usize,
+    skip: usize,
+) -> Result<Vec<u32>, Error> {
+    let end = reader.read(br, permutation_context(size as u32))? as usize;
+    if end > size - skip {
+        return Err(Error::InvalidPermutation);
+    }
+    let mut lehmer = vec![0u32; size];
+    let mut prev = 0;
+    for (i, v) in lehmer.iter_mut().enumerate().skip(skip).take(end) {
+        *v = reader.read(br, permutation_context(prev))?;
+        if *v as usize >= size - i {
+            return Err(Error::InvalidPermutation);
+        }
+        prev = *v;
+    }
+    Ok(permutation_from_lehmer(&lehmer))
+}
+
+/// A section of the frame data. Sections are stored in this order, unless the TOC is permuted.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Section {
+    LfGlobal,
+    LfGroup(usize),
+    HfGlobal,
+    PassGroup { pass: usize, group: usize },
+}
+
+/// Table of contents of a frame: the byte range of each section, relative to the end of the
+/// TOC.
+#[derive(Debug)]
+pub struct Toc {
+    dimensions: FrameDimensions,
+    permuted: bool,
+    // Indexed by the position of the section in the unpermuted order.
+    ranges: Vec<Range<usize>>,
+}
+
+impl Toc {
+    /// Number of TOC entries of a frame; everything is in a single section if the frame has a
+    /// single group and a single pass.
+    pub fn num_entries(dimensions: &FrameDimensions) -> usize {
+        if dimensions.num_groups() == 1 && dimensions.num_passes == 1 {
+            1
+        } else {
+            2 + dimensions.num_lf_groups() + dimensions.num_groups() * dimensions.num_passes
+        }
+    }
+
+    /// Reads the TOC that follows the frame header.
+    pub fn read(br: &mut BitReader, dimensions: FrameDimensions) -> Result<Toc, Error> {
+        let stage = StageTrace::start("toc", br);
+        let num_entries = Toc::num_entries(&dimensions);
+        let permuted = br.read(1)? != 0;
+        let permutation = if permuted {
+            let histograms = Histograms::decode(NUM_PERMUTATION_CONTEXTS, br, true)?;
+            let mut reader = histograms.make_reader(br)?;
+            let permutation = decode_permutation(br, &mut reader, num_entries, 0)?;
+            reader.check_final_state()?;
+            Some(permutation)
+        } else {
+            None
+        };
+        br.jump_to_byte_boundary()?;
+        let entry_coder = U32Coder::Select(
+            U32::Bits(10),
+            U32::BitsOffset { n: 14, off: 1024 },
+            U32::BitsOffset { n: 22, off: 17408 },
+            U32::BitsOffset {
+                n: 30,
+                off: 4211712,
+            },
+        );
+        let mut offset = 0;
+        let mut ranges = Vec::with_capacity(num_entries);
+        for _ in 0..num_entries {
+            let size = u32::read_unconditional(&entry_coder, br, &Empty {})? as usize;
+            ranges.push(offset..offset + size);
+            offset += size;
+        }
+        br.jump_to_byte_boundary()?;
+        if let Some(permutation) = permutation {
+            ranges = permutation
+                .iter()
+                .map(|&i| ranges[i as usize].clone())
+                .collect();
+        }
+        stage.note(|| {
+            format!(
+                "{} entries, {} bytes{}",
+                num_entries,
+                offset,
+                if permuted { ", permuted" } else { "" }
+            )
+        });
+        stage.finish(br);
+        Ok(Toc {
+            dimensions,
+            permuted,
+            ranges,
+        })
+    }
+
+    pub fn dimensions(&self) -> &FrameDimensions {
+        &self.dimensions
+    }
+
+    pub fn is_permuted(&self) -> bool {
+        self.permuted
+    }
+
+    /// Whether all the frame data is in a single section.
+    pub fn is_single_section(&self) -> bool {
+        self.ranges.len() == 1
+    }
+
+    /// Total size of the frame data, in bytes.
+    pub fn total_size(&self) -> usize {
+        self.ranges.iter().map(|r| r.end).max().unwrap_or(0)
+    }
+
+    /// Position of `section` in the unpermuted order.
+    pub fn section_index(&self, section: Section) -> usize {
+        if self.is_single_section() {
+            return 0;
+        }
+        let num_lf_groups = self.dimensions.num_lf_groups();
+        let num_groups = self.dimensions.num_groups();
+        match section {
+            Section::LfGlobal => 0,
+            Section::LfGroup(group) => {
+                assert!(group < num_lf_groups);
+                1 + group
+            }
+            Section::HfGlobal => 1 + num_lf_groups,
+            Section::PassGroup { pass, group } => {
+                assert!(pass < self.dimensions.num_passes && group < num_groups);
+                2 + num_lf_groups + pass * num_groups + group
+            }
+        }
+    }
+
+    /// Byte range of `section`, relative to the end of the TOC. If the frame has a single
+    /// section, this is the range of all the frame data.
+    pub fn range(&self, section: Section) -> Range<usize> {
+        self.ranges[self.section_index(section)].clone()
+    }
+
+    /// Sections needed to decode the area `rect` of the frame, in unpermuted order: the global
+    /// sections, and the LF groups and groups (for all passes) that intersect `rect`.
+    pub fn sections_for_rect(&self, rect: &Rect) -> Vec<Section> {
+        self.sections_for_rect_and_passes(rect, self.dimensions.num_passes)
+    }
+
+    /// Same as `sections_for_rect`, but only includes the first `num_passes` passes of each
+    /// group. With 0 passes, only the LF is decoded.
+    pub fn sections_for_rect_and_passes(&self, rect: &Rect, num_passes: usize) -> Vec<Section> {
+        let dims = &self.dimensions;
+        let mut sections = vec![Section::LfGlobal];
+        sections.extend(
+            dims.lf_groups_in_rect(rect)
+                .into_iter()
+                .map(Section::LfGroup),
+        );
+        sections.push(Section::HfGlobal);
+        let groups = dims.groups_in_rect(rect);
+        for pass in 0..num_passes.min(dims.num_passes) {
+            sections.extend(
+                groups
+                    .iter()
+                    .map(|&group| Section::PassGroup { pass, group }),
+            );
+        }
+        sections
+    }
+
+    /// Returns the bytes of `section` in `data`, the frame data that follows the TOC.
+    pub fn section_data<'a>(&self, data: &'a [u8], section: Section) -> Result<&'a [u8], Error> {
+        data.get(self.range(section)).ok_or(Error::FileTruncated)
+    }
+
+    /// Calls `decode` for each of `sections` through `runner`, with a `BitReader` over the
+    /// bytes of the section in `data`, and returns the results in the same order as `sections`.
+    ///
+    /// If the frame has a single section, `sections` must be in codestream order: they are
+    /// decoded one after the other from the same `BitReader`, on the calling thread.
+    pub fn decode_sections<T, F>(
+        &self,
+        data: &[u8],
+        sections: &[Section],
+        runner: &dyn Runner,
+        decode: F,
+    ) -> Result<Vec<T>, Error>
+    where
+        T: Send,
+        F: Fn(Section, &mut BitReader) -> Result<T, Error> + Sync,
+    {
+        if self.is_single_section() {
+            let mut br = BitReader::new(self.section_data(data, Section::LfGlobal)?);
+            return sections.iter().map(|s| decode(*s, &mut br)).collect();
+        }
+        run_map(runner, sections.len(), |i| {
+            let mut br = BitReader::new(self.section_data(data, sections[i])?);
+            decode(sections[i], &mut br)
+        })
+    }
+}
+
+/// TOC of a frame, together with the position of the frame data in the codestream.
+#[derive(Debug)]
+pub struct FrameIndex {
+    /// Offset of the first byte after the TOC, in bytes from the beginning of the codestream.
+    pub data_offset: usize,
+    pub toc: Toc,
+    /// Position of the codestream in the file.
+    pub segments: SegmentMap,
+}
+
+impl FrameIndex {
+    /// Byte range of `section`, relative to the beginning of the codestream.
+    pub fn section_range(&self, section: Section) -> Range<usize> {
+        let range = self.toc.range(section);
+        self.data_offset + range.start..self.data_offset + range.end
+    }
+
+    /// Sorted, non-overlapping byte ranges of the file that contain `sections`, with adjacent
+    /// sections merged, and split where the codestream continues in another box.
+    pub fn byte_ranges(&self, sections: &[Section]) -> Vec<Range<usize>> {
+        let mut ranges: Vec<_> = sections.iter().map(|s| self.section_range(*s)).collect();
+        ranges.sort_by_key(|r| r.start);
+        let mut merged: Vec<Range<usize>> = Vec::with_capacity(ranges.len());
+        for range in ranges {
+            match merged.last_mut() {
+                Some(last) if range.start <= last.end => last.end = last.end.max(range.end),
+                _ => merged.push(range),
+            }
+        }
+        self.segments.file_ranges(&merged)
+    }
+
+    /// Offset of the end of the frame, in bytes from the beginning of the codestream.
+    pub fn end_offset(&self) -> usize {
+        self.data_offset + self.toc.total_size()
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::headers::frame_header::Rect;
+
+    fn dimensions(width: usize, height: usize, num_passes: usize) -> FrameDimensions {
+        FrameDimensions {
+            width,
+            height,
+            group_dim: 256,
+            xsize_groups: width.div_ceil(256),
+            ysize_groups: height.div_ceil(256),
+            xsize_lf_groups: width.div_ceil(2048),
+            ysize_lf_groups: height.div_ceil(2048),
+            num_passes,
+        }
+    }
+
+    #[test]
+    fn test_permutation_from_lehmer() {
+        assert_eq!(permutation_from_lehmer(&[2, 0, 1, 0]), [2, 0, 3, 1]);
+        assert_eq!(permutation_from_lehmer(&[0, 0, 0]), [0, 1, 2]);
+        let n = 1000u32;
+        let lehmer: Vec<u32> = (0..n).map(|i| (i * 7919) % (n - i)).collect();
+        let mut remaining: Vec<u32> = (0..n).collect();
+        let expected: Vec<u32> = lehmer
+            .iter()
+            .map(|&l| remaining.remove(l as usize))
+            .collect();
+        assert_eq!(permutation_from_lehmer(&lehmer), expected);
+    }
+
+    // TOC of a frame with 2 groups: LfGlobal, LfGroup(0), HfGlobal, 2 pass groups. Not
+    // permuted; sizes with selector 0 and 10 bits: 1, 2, 3, 4, 5.
+    fn toc_with_two_groups() -> Vec<u8> {
+        let mut bits = vec![0u8];
+        for size in 1..=5u32 {
+            bits.extend_from_slice(&[0, 0]);
+            bits.extend((0..10).map(|i| ((size >> i) & 1) as u8));
+        }
+        let mut data = vec![0u8; bits.len().div_ceil(8) + 1];
+        // The permuted bit is followed by padding to the next byte.
+        for (i, bit) in bits.iter().enumerate() {
+            let pos = if i == 0 { 0 } else { i + 7 };
+            data[pos / 8] |= bit << (pos % 8);
+        }
+        data
+    }
+
+    #[test]
+    fn test_toc() -> Result<(), Error> {
+        let dims = dimensions(300, 100, 1);
+        assert_eq!(Toc::num_entries(&dims), 5);
+        assert_eq!(
+            dims.group_rect(1),
+            Rect {
+                x0: 256,
+                y0: 0,
+                width: 44,
+                height: 100
+            }
+        );
+        let data = toc_with_two_groups();
+        let mut br = BitReader::new(&data);
+        let toc = Toc::read(&mut br, dims)?;
+        assert!(!toc.is_permuted());
+        assert_eq!(toc.range(Section::LfGlobal), 0..1);
+        assert_eq!(toc.range(Section::LfGroup(0)), 1..3);
+        assert_eq!(toc.range(Section::HfGlobal), 3..6);
+        assert_eq!(toc.range(Section::PassGroup { pass: 0, group: 1 }), 10..15);
+        assert_eq!(toc.total_size(), 15);
+        assert_eq!(br.total_bits_read(), 8 + 5 * 12 + 4);
+        Ok(())
+    }
+
+    #[test]
+    fn test_sections_for_rect() -> Result<(), Error> {
+        let toc = Toc::read(
+            &mut BitReader::new(&toc_with_two_groups()),
+            dimensions(300, 100, 1),
+        )?;
+        let rect = |x0, width| Rect {
+            x0,
+            y0: 10,
+            width,
+            height: 10,
+        };
+        let global = [Section::LfGlobal, Section::LfGroup(0), Section::HfGlobal];
+        let group = |group| Section::PassGroup { pass: 0, group };
+        assert_eq!(
+            toc.sections_for_rect(&rect(250, 10)),
+            [&global[..], &[group(0), group(1)]].concat()
+        );
+        assert_eq!(
+            toc.sections_for_rect(&rect(260, 100)),
+            [&global[..], &[group(1)]].concat()
+        );
+        let mut index = FrameIndex {
+            data_offset: 100,
+            toc,
+            segments: SegmentMap::default(),
+        };
+        let sections = index.toc.sections_for_rect(&rect(260, 10));
+        assert_eq!(index.byte_ranges(&sections), [100..106, 110..115]);
+        // The codestream continues in another box after 103 bytes.
+        index.segments.push(40, 103);
+        index.segments.push(160, 100);
+        assert_eq!(index.byte_ranges(&sections), [140..143, 160..163, 167..172]);
+        assert_eq!(
+            index.toc.sections_for_rect_and_passes(&rect(0, 300), 0),
+            global
+        );
+        Ok(())
+    }
+
+    #[test]
+    fn test_decode_sections() -> Result<(), Error> {
+        use crate::runner::{DefaultRunner, SingleThreadRunner};
+        let toc = Toc::read(
+            &mut BitReader::new(&toc_with_two_groups()),
+            dimensions(300, 100, 1),
+        )?;
+        let data: Vec<u8> = (0..15).collect();
+        let sections = [
+            Section::PassGroup { pass: 0, group: 1 },
+            Section::LfGlobal,
+            Section::HfGlobal,
+        ];
+        let sum_bytes = |_, br: &mut BitReader| -> Result<u64, Error> {
+            let mut sum = 0;
+            while let Ok(v) = br.read(8) {
+                sum += v;
+            }
+            Ok(sum)
+        };
+        let expected = vec![10 + 11 + 12 + 13 + 14, 0, 3 + 4 + 5];
+        for runner in [
+            &SingleThreadRunner as &dyn Runner,
+            &DefaultRunner::default(),
+        ] {
+            assert_eq!(
+                toc.decode_sections(&data, &sections, runner, sum_bytes)?,
+                expected
+            );
+        }
+        assert!(toc
+            .decode_sections(&data[..12], &sections, &SingleThreadRunner, sum_bytes)
+            .is_err());
+        Ok(())
+    }
+
+    #[test]
+    fn test_single_section() -> Result<(), Error> {
+        let dims = dimensions(256, 256, 1);
+        // Not permuted, size 1024 + 3 with selector 1.
+        let mut br = BitReader::new(&[0, 0b1101, 0, 0]);
+        let toc = Toc::read(&mut br, dims)?;
+        assert!(toc.is_single_section());
+        assert_eq!(toc.range(Section::HfGlobal), 0..1027);
+        assert_eq!(toc.range(Section::PassGroup { pass: 0, group: 0 }), 0..1027);
+        Ok(())
+    }
+}
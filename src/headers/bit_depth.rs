@@ -11,7 +11,7 @@ use crate::bit_reader::BitReader;
 use crate::error::Error;
 use crate::headers::encodings::*;
 
-#[derive(UnconditionalCoder, Debug)]
+#[derive(UnconditionalCoder, Debug, Clone)]
 #[validate]
 pub struct BitDepth {
     #[default(false)]
@@ -28,6 +28,14 @@ pub struct BitDepth {
 }
 
 impl BitDepth {
+    pub fn floating_point_sample(&self) -> bool {
+        self.floating_point_sample
+    }
+
+    pub fn bits_per_sample(&self) -> u32 {
+        self.bits_per_sample
+    }
+
     fn check(&self, _: &Empty) -> Result<(), Error> {
         if self.floating_point_sample {
             if self.exponent_bits_per_sample < 2 || self.exponent_bits_per_sample > 8 {
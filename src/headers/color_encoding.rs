@@ -79,14 +79,14 @@ pub struct CustomTransferFunctionNonserialized {
 pub struct CustomTransferFunction {
     #[condition(nonserialized.color_space != ColorSpace::XYB)]
     #[default(false)]
-    have_gamma: bool,
+    pub have_gamma: bool,
     #[condition(have_gamma)]
     #[default(3333333)] // XYB gamma
     #[coder(Bits(24))]
     gamma: u32,
     #[condition(!have_gamma && nonserialized.color_space != ColorSpace::XYB)]
     #[default(TransferFunction::SRGB)]
-    transfer_function: TransferFunction,
+    pub transfer_function: TransferFunction,
 }
 
 impl CustomTransferFunction {
@@ -13,6 +13,7 @@ pub enum U32 {
 }
 
 impl U32 {
+    #[inline]
     pub fn read(&self, br: &mut BitReader) -> Result<u32, Error> {
         match *self {
             U32::Bits(n) => Ok(br.read(n)? as u32),
@@ -72,6 +73,7 @@ impl UnconditionalCoder<()> for f32 {
 
 impl UnconditionalCoder<U32Coder> for u32 {
     type Nonserialized = Empty;
+    #[inline]
     fn read_unconditional(
         config: &U32Coder,
         br: &mut BitReader,
@@ -117,14 +119,14 @@ impl UnconditionalCoder<()> for u64 {
             1 => Ok(1 + br.read(4)?),
             2 => Ok(17 + br.read(8)?),
             _ => {
-                let mut result: u64 = br.read(12)? as u64;
+                let mut result: u64 = br.read(12)?;
                 let mut shift = 12;
                 while br.read(1)? == 1 {
                     if shift >= 60 {
                         assert_eq!(shift, 60);
-                        return Ok(result | ((br.read(4)? as u64) << shift));
+                        return Ok(result | (br.read(4)? << shift));
                     }
-                    result |= (br.read(8)? as u64) << shift;
+                    result |= br.read(8)? << shift;
                     shift += 8;
                 }
                 Ok(result)
@@ -396,3 +398,57 @@ impl UnconditionalCoder<()> for Extensions {
         Ok(Extensions {})
     }
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use jxl_headers_derive::UnconditionalCoder;
+
+    #[derive(UnconditionalCoder, Debug, PartialEq)]
+    struct Fused {
+        #[all_default]
+        #[default(true)]
+        all_default: bool,
+        #[default(false)]
+        a: bool,
+        #[coder(Bits(3) + 1)]
+        #[default(2)]
+        b: u32,
+        #[coder(Bits(2))]
+        #[default(0)]
+        c: u32,
+        #[coder(Bits(4))]
+        #[default(5)]
+        #[condition(a)]
+        d: u32,
+        #[default(true)]
+        #[condition(a)]
+        e: bool,
+    }
+
+    fn read_fused(data: &[u8]) -> (Fused, usize) {
+        let mut br = BitReader::new(data);
+        let fused = Fused::read_unconditional(&(), &mut br, &Empty {}).unwrap();
+        (fused, br.total_bits_read())
+    }
+
+    #[test]
+    fn test_fused_fields() {
+        let fused = |all_default, a, b, c, d, e| Fused {
+            all_default,
+            a,
+            b,
+            c,
+            d,
+            e,
+        };
+        assert_eq!(read_fused(&[0x01]), (fused(true, false, 2, 0, 5, true), 1));
+        // a = 1, b = 4 + 1, c = 3, d = 9, e = 0.
+        assert_eq!(
+            read_fused(&[0xf2, 0x04]),
+            (fused(false, true, 5, 3, 9, false), 12)
+        );
+        // a = 0, b = 0 + 1, c = 2.
+        assert_eq!(read_fused(&[0x40]), (fused(false, false, 1, 2, 5, true), 7));
+    }
+}
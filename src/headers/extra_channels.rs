@@ -36,7 +36,7 @@ enum ExtraChannel {
     Optional,
 }
 
-#[derive(UnconditionalCoder, Debug)]
+#[derive(UnconditionalCoder, Debug, Clone)]
 #[validate]
 pub struct ExtraChannelInfo {
     #[all_default]
@@ -61,6 +61,11 @@ pub struct ExtraChannelInfo {
 }
 
 impl ExtraChannelInfo {
+    /// Whether this is an alpha channel that the color channels are premultiplied by.
+    pub fn alpha_associated(&self) -> bool {
+        self.ec_type == ExtraChannel::Alpha && self.alpha_associated
+    }
+
     fn check(&self, _: &Empty) -> Result<(), Error> {
         if self.dim_shift > 3 {
             Err(Error::DimShiftTooLarge(self.dim_shift))
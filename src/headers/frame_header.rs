@@ -3,14 +3,14 @@
 use crate::{
     bit_reader::BitReader,
     error::Error,
-    headers::{encodings::*, extra_channels::ExtraChannelInfo},
+    headers::{encodings::*, extra_channels::ExtraChannelInfo, FileHeaders},
 };
 
 use jxl_headers_derive::UnconditionalCoder;
 use num_derive::FromPrimitive;
 
 #[derive(UnconditionalCoder, Copy, Clone, PartialEq, Debug, FromPrimitive)]
-enum FrameType {
+pub enum FrameType {
     RegularFrame = 0,
     LFFrame = 1,
     ReferenceOnly = 2,
@@ -64,8 +64,40 @@ struct Passes {
     last_pass: Vec<u32>,
 }
 
+/// How much of a progressive frame to decode.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PassLimit {
+    /// Decode all the passes.
+    All,
+    /// Decode at most the given number of passes; 0 means LF only.
+    Passes(usize),
+    /// Decode just enough passes for an image downsampled by the given factor: 8 or more
+    /// needs the LF only.
+    Downsampling(u32),
+}
+
+impl Passes {
+    fn passes_needed(&self, limit: PassLimit) -> usize {
+        let num_passes = self.num_passes as usize;
+        match limit {
+            PassLimit::All => num_passes,
+            PassLimit::Passes(n) => n.min(num_passes),
+            PassLimit::Downsampling(factor) if factor >= 8 => 0,
+            PassLimit::Downsampling(factor) => self
+                .downsample
+                .iter()
+                .zip(self.last_pass.iter())
+                .filter(|(downsample, _)| **downsample <= factor)
+                .map(|(_, last_pass)| *last_pass as usize + 1)
+                .min()
+                .unwrap_or(num_passes)
+                .min(num_passes),
+        }
+    }
+}
+
 #[derive(UnconditionalCoder, Copy, Clone, PartialEq, Debug, FromPrimitive)]
-enum BlendingMode {
+pub enum BlendingMode {
     Replace = 0,
     Add = 1,
     Blend = 2,
@@ -73,7 +105,7 @@ enum BlendingMode {
     Mul = 4,
 }
 
-struct BlendingInfoNonserialized {
+pub struct BlendingInfoNonserialized {
     num_extra_channels: u32,
     have_crop: bool,
     x0: i32,
@@ -86,10 +118,10 @@ struct BlendingInfoNonserialized {
 
 #[derive(UnconditionalCoder, Debug, PartialEq, Clone)]
 #[nonserialized(BlendingInfoNonserialized)]
-struct BlendingInfo {
+pub struct BlendingInfo {
     #[coder(u2S(0, 1, 2, Bits(2) + 3))]
     #[default(BlendingMode::Replace)]
-    mode: BlendingMode,
+    pub mode: BlendingMode,
 
     /* Spec: "Let multi_extra be true if and only if and the number of extra channels is at least two."
     libjxl condition is num_extra_channels > 0 */
@@ -97,12 +129,12 @@ struct BlendingInfo {
     #[default(0)]
     #[condition(nonserialized.num_extra_channels > 0 &&
         (mode == BlendingMode::Blend || mode == BlendingMode::AlphaWeightedAdd))]
-    alpha_channel: u32,
+    pub alpha_channel: u32,
 
     #[default(false)]
     #[condition(nonserialized.num_extra_channels > 0 &&
         (mode == BlendingMode::Blend || mode == BlendingMode::AlphaWeightedAdd || mode == BlendingMode::Mul))]
-    clamp: bool,
+    pub clamp: bool,
 
     #[coder(u2S(0, 1, 2, 3))]
     #[default(0)]
@@ -113,7 +145,7 @@ struct BlendingInfo {
         (nonserialized.x0 == 0 && nonserialized.y0 == 0 &&
         nonserialized.width as i64 + nonserialized.x0 as i64 >= nonserialized.img_width as i64 &&
         nonserialized.height as i64 + nonserialized.y0 as i64 >= nonserialized.img_height as i64)))]
-    source: u32,
+    pub source: u32,
 }
 
 struct RestorationFilterNonserialized {
@@ -225,6 +257,34 @@ pub struct FrameHeaderNonserialized {
     pub img_height: u32,
 }
 
+impl FrameHeaderNonserialized {
+    pub fn from_file_headers(file_headers: &FileHeaders) -> FrameHeaderNonserialized {
+        let image_metadata = &file_headers.image_metadata;
+        FrameHeaderNonserialized {
+            xyb_encoded: image_metadata.xyb_encoded,
+            num_extra_channels: image_metadata.extra_channel_info.len() as u32,
+            extra_channel_info: image_metadata.extra_channel_info.clone(),
+            have_animation: image_metadata.animation.is_some(),
+            have_timecode: match image_metadata.animation {
+                Some(ref a) => a.have_timecodes,
+                None => false,
+            },
+            img_width: file_headers.size.xsize(),
+            img_height: file_headers.size.ysize(),
+        }
+    }
+
+    /// For the preview frame, which has the size of the preview, if the image has one.
+    pub fn for_preview(file_headers: &FileHeaders) -> Option<FrameHeaderNonserialized> {
+        let preview = file_headers.image_metadata.preview.as_ref()?;
+        Some(FrameHeaderNonserialized {
+            img_width: preview.xsize(),
+            img_height: preview.ysize(),
+            ..FrameHeaderNonserialized::from_file_headers(file_headers)
+        })
+    }
+}
+
 #[derive(UnconditionalCoder, Debug, PartialEq)]
 #[nonserialized(FrameHeaderNonserialized)]
 #[aligned]
@@ -371,7 +431,299 @@ pub struct FrameHeader {
     extensions: Extensions,
 }
 
+/// Size of a frame and of its groups, in pixels of the coded frame.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct FrameDimensions {
+    pub width: usize,
+    pub height: usize,
+    pub group_dim: usize,
+    pub xsize_groups: usize,
+    pub ysize_groups: usize,
+    pub xsize_lf_groups: usize,
+    pub ysize_lf_groups: usize,
+    pub num_passes: usize,
+}
+
+/// A rectangle in pixels.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Rect {
+    pub x0: usize,
+    pub y0: usize,
+    pub width: usize,
+    pub height: usize,
+}
+
+/// Where a frame goes on the canvas, how it is blended and what happens to it afterwards.
+#[derive(Debug, Clone, PartialEq)]
+pub struct FrameLayer {
+    pub frame_type: FrameType,
+    /// Position of the frame on the canvas, in image pixels; it can be partly outside.
+    pub x0: i64,
+    pub y0: i64,
+    pub width: usize,
+    pub height: usize,
+    /// Blending of the color channels, then of each extra channel.
+    pub blending_info: BlendingInfo,
+    pub ec_blending_info: Vec<BlendingInfo>,
+    /// In ticks of `ImageMetadata::animation`.
+    pub duration: u32,
+    pub timecode: u32,
+    pub is_last: bool,
+    pub save_as_reference: u32,
+    pub save_before_ct: bool,
+    /// For LF frames, the number of times the frame is downsampled by 8.
+    pub lf_level: u32,
+    /// Whether the LF of the frame is the LF frame with the next level.
+    pub uses_lf_frame: bool,
+    /// Whether the frame has patches, which can come from any reference slot.
+    pub uses_patches: bool,
+}
+
+impl FrameLayer {
+    /// Whether the frame is saved in reference slot `save_as_reference` after it is decoded.
+    pub fn can_be_referenced(&self) -> bool {
+        !self.is_last
+            && (self.duration == 0 || self.save_as_reference > 0)
+            && self.frame_type != FrameType::LFFrame
+    }
+
+    /// Whether compositing the frame gives an image to display: frames with no duration are
+    /// only layers of the next one.
+    pub fn is_displayed(&self) -> bool {
+        matches!(
+            self.frame_type,
+            FrameType::RegularFrame | FrameType::SkipProgressive
+        ) && (self.duration > 0 || self.is_last)
+    }
+}
+
+impl Rect {
+    pub fn is_empty(&self) -> bool {
+        self.width == 0 || self.height == 0
+    }
+
+    pub fn intersects(&self, other: &Rect) -> bool {
+        !self.is_empty()
+            && !other.is_empty()
+            && self.x0 < other.x0 + other.width
+            && other.x0 < self.x0 + self.width
+            && self.y0 < other.y0 + other.height
+            && other.y0 < self.y0 + self.height
+    }
+}
+
+impl FrameDimensions {
+    pub fn num_groups(&self) -> usize {
+        self.xsize_groups * self.ysize_groups
+    }
+
+    pub fn num_lf_groups(&self) -> usize {
+        self.xsize_lf_groups * self.ysize_lf_groups
+    }
+
+    fn grid_rect(&self, index: usize, xsize_grid: usize, dim: usize) -> Rect {
+        let x0 = (index % xsize_grid) * dim;
+        let y0 = (index / xsize_grid) * dim;
+        Rect {
+            x0,
+            y0,
+            width: dim.min(self.width - x0),
+            height: dim.min(self.height - y0),
+        }
+    }
+
+    /// Area of the frame covered by a group; groups are numbered in raster order.
+    pub fn group_rect(&self, group: usize) -> Rect {
+        assert!(group < self.num_groups());
+        self.grid_rect(group, self.xsize_groups, self.group_dim)
+    }
+
+    /// Area of the frame covered by an LF group, which is 8 times larger than a group.
+    pub fn lf_group_rect(&self, lf_group: usize) -> Rect {
+        assert!(lf_group < self.num_lf_groups());
+        self.grid_rect(lf_group, self.xsize_lf_groups, self.group_dim * 8)
+    }
+
+    /// Size of the frame downsampled by `factor`, as produced by a decode limited with
+    /// `PassLimit::Downsampling(factor)`.
+    pub fn downsampled_size(&self, factor: u32) -> (usize, usize) {
+        let factor = factor.max(1) as usize;
+        (self.width.div_ceil(factor), self.height.div_ceil(factor))
+    }
+
+    fn grid_cells_in_rect(
+        &self,
+        rect: &Rect,
+        xsize_grid: usize,
+        ysize_grid: usize,
+        dim: usize,
+    ) -> Vec<usize> {
+        if rect.is_empty() || rect.x0 >= self.width || rect.y0 >= self.height {
+            return vec![];
+        }
+        let gx1 = ((rect.x0 + rect.width - 1) / dim).min(xsize_grid - 1);
+        let gy1 = ((rect.y0 + rect.height - 1) / dim).min(ysize_grid - 1);
+        (rect.y0 / dim..=gy1)
+            .flat_map(|gy| (rect.x0 / dim..=gx1).map(move |gx| gy * xsize_grid + gx))
+            .collect()
+    }
+
+    /// Groups that intersect `rect`, in raster order.
+    pub fn groups_in_rect(&self, rect: &Rect) -> Vec<usize> {
+        self.grid_cells_in_rect(rect, self.xsize_groups, self.ysize_groups, self.group_dim)
+    }
+
+    /// LF groups that intersect `rect`, in raster order.
+    pub fn lf_groups_in_rect(&self, rect: &Rect) -> Vec<usize> {
+        self.grid_cells_in_rect(
+            rect,
+            self.xsize_lf_groups,
+            self.ysize_lf_groups,
+            self.group_dim * 8,
+        )
+    }
+}
+
 impl FrameHeader {
+    /// Computes the size of the coded frame, for an image of `img_width` x `img_height`.
+    pub fn dimensions(&self, img_width: u32, img_height: u32) -> FrameDimensions {
+        let (mut width, mut height) = if self.have_crop {
+            (self.width as usize, self.height as usize)
+        } else {
+            (img_width as usize, img_height as usize)
+        };
+        let upsampling = self.upsampling as usize;
+        width = width.div_ceil(upsampling);
+        height = height.div_ceil(upsampling);
+        if self.lf_level > 0 {
+            let shift = 3 * self.lf_level;
+            width = (width + (1 << shift) - 1) >> shift;
+            height = (height + (1 << shift) - 1) >> shift;
+        }
+        let group_dim = 128usize << self.group_size_shift;
+        let lf_group_dim = group_dim * 8;
+        FrameDimensions {
+            width,
+            height,
+            group_dim,
+            xsize_groups: width.div_ceil(group_dim),
+            ysize_groups: height.div_ceil(group_dim),
+            xsize_lf_groups: width.div_ceil(lf_group_dim),
+            ysize_lf_groups: height.div_ceil(lf_group_dim),
+            num_passes: self.passes.num_passes as usize,
+        }
+    }
+
+    /// Number of passes to decode to satisfy `limit`.
+    pub fn passes_needed(&self, limit: PassLimit) -> usize {
+        self.passes.passes_needed(limit)
+    }
+
+    pub fn upsampling(&self) -> u32 {
+        self.upsampling
+    }
+
+    pub fn is_modular(&self) -> bool {
+        self.encoding == Encoding::Modular
+    }
+
+    pub fn frame_type(&self) -> FrameType {
+        self.frame_type
+    }
+
+    /// Placement and blending of the frame on a canvas of `img_width` x `img_height`.
+    pub fn layer(&self, img_width: u32, img_height: u32) -> FrameLayer {
+        let (x0, y0, width, height) = if self.have_crop {
+            (self.x0, self.y0, self.width, self.height)
+        } else {
+            (0, 0, img_width, img_height)
+        };
+        FrameLayer {
+            frame_type: self.frame_type,
+            x0: x0 as i64,
+            y0: y0 as i64,
+            width: width as usize,
+            height: height as usize,
+            blending_info: self.blending_info.clone(),
+            ec_blending_info: self.ec_blending_info.clone(),
+            duration: self.duration,
+            timecode: self.timecode,
+            is_last: self.is_last,
+            save_as_reference: self.save_as_reference,
+            save_before_ct: self.save_before_ct,
+            lf_level: self.lf_level,
+            uses_lf_frame: self.flags & Flags::USE_LF_FRAME != 0,
+            uses_patches: self.flags & Flags::ENABLE_PATCHES != 0,
+        }
+    }
+
+    pub fn ec_upsampling(&self) -> &[u32] {
+        &self.ec_upsampling
+    }
+
+    /// Weights of the sides and of the corners of the gaborish kernel of each color channel,
+    /// if the filter is enabled.
+    pub fn gaborish_weights(&self) -> Option<[[f32; 2]; 3]> {
+        let f = &self.restoration_filter;
+        if !f.gab {
+            return None;
+        }
+        Some([
+            [f.gab_x_weight1, f.gab_x_weight2],
+            [f.gab_y_weight1, f.gab_y_weight2],
+            [f.gab_b_weight1, f.gab_b_weight2],
+        ])
+    }
+
+    /// Number of pixels of the coded frame around a pixel that are needed to reconstruct it,
+    /// because of upsampling and of the restoration filters.
+    pub fn border(&self) -> usize {
+        /* Sum of the borders of the EPF stages that run for each value of epf_iters. */
+        const EPF_BORDER: [usize; 4] = [0, 2, 3, 6];
+        let filter = &self.restoration_filter;
+        let upsampling_border = if self.upsampling > 1 { 2 } else { 0 };
+        upsampling_border + filter.gab as usize + EPF_BORDER[filter.epf_iters as usize]
+    }
+
+    /// Returns the area of the coded frame, with `dimensions`, that is needed to reconstruct
+    /// `image_rect` of the image, or None if the frame does not cover any of it.
+    pub fn frame_rect(&self, image_rect: &Rect, dimensions: &FrameDimensions) -> Option<Rect> {
+        if image_rect.is_empty() {
+            return None;
+        }
+        let (origin_x, origin_y) = if self.have_crop {
+            (self.x0 as i64, self.y0 as i64)
+        } else {
+            (0, 0)
+        };
+        let scale = self.upsampling as i64 * (1 << (3 * self.lf_level));
+        let border = self.border() as i64;
+        let map = |start: usize, size: usize, origin: i64, frame_size: usize| {
+            let begin = (start as i64 - origin).div_euclid(scale) - border;
+            let end = (start as i64 + size as i64 - origin + scale - 1).div_euclid(scale) + border;
+            let begin = begin.max(0);
+            let end = end.min(frame_size as i64);
+            if begin < end {
+                Some((begin as usize, (end - begin) as usize))
+            } else {
+                None
+            }
+        };
+        let (x0, width) = map(image_rect.x0, image_rect.width, origin_x, dimensions.width)?;
+        let (y0, height) = map(
+            image_rect.y0,
+            image_rect.height,
+            origin_y,
+            dimensions.height,
+        )?;
+        Some(Rect {
+            x0,
+            y0,
+            width,
+            height,
+        })
+    }
+
     fn check(&self, nonserialized: &FrameHeaderNonserialized) -> Result<(), Error> {
         if self.upsampling > 1 {
             if let Some((info, upsampling)) = nonserialized
@@ -486,6 +838,29 @@ mod test_frame_header {
         );
     }
 
+    #[test]
+    fn test_passes_needed() {
+        let passes = Passes {
+            num_passes: 4,
+            num_ds: 2,
+            shift: vec![0, 0, 0],
+            downsample: vec![4, 2],
+            last_pass: vec![0, 2],
+        };
+        assert_eq!(passes.passes_needed(PassLimit::All), 4);
+        assert_eq!(passes.passes_needed(PassLimit::Passes(2)), 2);
+        assert_eq!(passes.passes_needed(PassLimit::Passes(7)), 4);
+        assert_eq!(passes.passes_needed(PassLimit::Downsampling(8)), 0);
+        assert_eq!(passes.passes_needed(PassLimit::Downsampling(4)), 1);
+        assert_eq!(passes.passes_needed(PassLimit::Downsampling(3)), 3);
+        assert_eq!(passes.passes_needed(PassLimit::Downsampling(2)), 3);
+        assert_eq!(passes.passes_needed(PassLimit::Downsampling(1)), 4);
+        assert_eq!(
+            Passes::default().passes_needed(PassLimit::Downsampling(2)),
+            1
+        );
+    }
+
     #[test]
     fn test_extra_channel() {
         test_frame_header(
@@ -26,14 +26,14 @@ pub struct OpsinInverseMatrix {
     #[default([11.031566901960783, -9.866943921568629, -0.16462299647058826,
                -3.254147380392157,  4.418770392156863,  -0.16462299647058826,
                -3.6588512862745097, 2.7129230470588235, 1.9459282392156863])]
-    inverse_matrix: [f32; 9],
+    pub inverse_matrix: [f32; 9],
     #[default([0.0037930732552754493, 0.0037930732552754493, 0.0037930732552754493])]
-    opsin_biases: [f32; 3],
+    pub opsin_biases: [f32; 3],
     #[default([1.0 - 0.05465007330715401, 1.0 - 0.07005449891748593, 1.0 - 0.049935103337343655, 0.145])]
-    quant_biases: [f32; 4],
+    pub quant_biases: [f32; 4],
 }
 
-const DEFAULT_KERN_2: [f32; 15] = [
+pub const DEFAULT_KERN_2: [f32; 15] = [
     -0.01716200,
     -0.03452303,
     -0.04022174,
@@ -51,7 +51,7 @@ const DEFAULT_KERN_2: [f32; 15] = [
     -0.00213539,
 ];
 
-const DEFAULT_KERN_4: [f32; 55] = [
+pub const DEFAULT_KERN_4: [f32; 55] = [
     -0.02419067,
     -0.03491987,
     -0.03693351,
@@ -109,7 +109,7 @@ const DEFAULT_KERN_4: [f32; 55] = [
     -0.00384443,
 ];
 
-const DEFAULT_KERN_8: [f32; 210] = [
+pub const DEFAULT_KERN_8: [f32; 210] = [
     -0.02928613,
     -0.03706353,
     -0.03783812,
@@ -326,10 +326,11 @@ const DEFAULT_KERN_8: [f32; 210] = [
 #[nonserialized(CustomTransformDataNonserialized)]
 pub struct CustomTransformData {
     #[all_default]
+    #[default(true)]
     all_default: bool,
     #[condition(nonserialized.xyb_encoded)]
     #[default(OpsinInverseMatrix::default())]
-    opsin_inverse_matrix: OpsinInverseMatrix,
+    pub opsin_inverse_matrix: OpsinInverseMatrix,
     #[default(0)]
     #[coder(Bits(3))]
     custom_weight_mask: u32,
@@ -343,3 +344,20 @@ pub struct CustomTransformData {
     #[default(DEFAULT_KERN_8)]
     weights8: [f32; 210],
 }
+
+impl CustomTransformData {
+    /// Weights of the upsampling kernel for the given factor, 2, 4 or 8.
+    pub fn upsampling_weights(&self, factor: u32) -> &[f32] {
+        match factor {
+            2 => &self.weights2,
+            4 => &self.weights4,
+            8 => &self.weights8,
+            _ => panic!("invalid upsampling factor {}", factor),
+        }
+    }
+
+    /// Whether the upsampling weights for `factor` are not the default ones.
+    pub fn has_custom_upsampling_weights(&self, factor: u32) -> bool {
+        self.custom_weight_mask & (factor >> 1) != 0
+    }
+}
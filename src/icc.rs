@@ -4,22 +4,215 @@
 // license that can be found in the LICENSE file.
 
 use crate::bit_reader::*;
-use crate::entropy_coding::decode::Histograms;
+use crate::entropy_coding::decode::{Histograms, HistogramsCache};
+use crate::entropy_coding::scratch::EntropyScratch;
 use crate::error::Error;
 use crate::headers::encodings::*;
+use crate::stats::record_allocation;
+use crate::trace::StageTrace;
 
 const ICC_CONTEXTS: usize = 41;
 
-pub fn read_icc(br: &mut BitReader) -> Result<Vec<u8>, Error> {
+fn byte_kind1(b: u8) -> usize {
+    match b {
+        b'a'..=b'z' | b'A'..=b'Z' => 0,
+        b'0'..=b'9' | b'.' | b',' => 1,
+        0 => 2,
+        1 => 3,
+        2..=15 => 4,
+        255 => 6,
+        241..=254 => 5,
+        _ => 7,
+    }
+}
+
+fn byte_kind2(b: u8) -> usize {
+    match b {
+        b'a'..=b'z' | b'A'..=b'Z' => 0,
+        b'0'..=b'9' | b'.' | b',' => 1,
+        0..=15 => 2,
+        241..=255 => 3,
+        _ => 4,
+    }
+}
+
+fn icc_context(i: usize, b1: u8, b2: u8) -> usize {
+    if i <= 128 {
+        0
+    } else {
+        1 + byte_kind1(b1) + byte_kind2(b2) * 8
+    }
+}
+
+/// Reads `len` bytes of the ICC stream with `histograms`, calling `f` on each byte.
+fn read_icc_bytes<F>(
+    histograms: &Histograms,
+    len: usize,
+    br: &mut BitReader,
+    scratch: &mut EntropyScratch,
+    mut f: F,
+) -> Result<(), Error>
+where
+    F: FnMut(u8),
+{
+    let mut reader = histograms.make_reader_with_scratch(br, None, scratch)?;
+    let mut read = || {
+        let (mut b1, mut b2) = (0u8, 0u8);
+        for i in 0..len {
+            let sym = reader.read(br, icc_context(i, b1, b2))?;
+            if sym > u8::MAX as u32 {
+                return Err(Error::InvalidICCStream(sym));
+            }
+            f(sym as u8);
+            b2 = b1;
+            b1 = sym as u8;
+        }
+        reader.check_final_state()
+    };
+    let result = read();
+    reader.recycle(scratch);
+    result
+}
+
+/// Decodes the entropy-coded ICC stream, calling `f` on each byte. If `cache` is given, with
+/// the content hash of the file and the position of the start of `br` in its codestream, the
+/// histograms are looked up there.
+fn decode_icc_stream<F>(
+    br: &mut BitReader,
+    cache: Option<(&mut HistogramsCache, u64, usize)>,
+    scratch: &mut EntropyScratch,
+    f: F,
+) -> Result<(), Error>
+where
+    F: FnMut(u8),
+{
+    let stage = StageTrace::start("icc", br);
     let len = u64::read_unconditional(&(), br, &Empty {})?;
     if len > 1u64 << 20 {
         return Err(Error::ICCTooLarge);
     }
-    println!("Encoded len: {}", len);
 
-    let histograms = Histograms::decode(ICC_CONTEXTS, br, /*allow_lz77=*/ true)?;
+    match cache {
+        Some((cache, content_hash, origin)) => {
+            let bit_offset = origin + br.total_bits_read();
+            let histograms = cache.decode(
+                content_hash,
+                bit_offset,
+                ICC_CONTEXTS,
+                br,
+                /*allow_lz77=*/ true,
+            )?;
+            read_icc_bytes(&histograms, len as usize, br, scratch, f)?;
+        }
+        None => {
+            let histograms = Histograms::decode_with_scratch(
+                ICC_CONTEXTS,
+                br,
+                /*allow_lz77=*/ true,
+                scratch,
+            )?;
+            let result = read_icc_bytes(&histograms, len as usize, br, scratch, f);
+            histograms.recycle(scratch);
+            result?;
+        }
+    }
+    stage.note(|| format!("{} bytes of encoded ICC profile", len));
+    stage.finish(br);
+    Ok(())
+}
 
-    println!("{:#?}", histograms);
+/// Reads the ICC stream. The bytes are in their encoded form: the ICC-specific prediction is
+/// not undone, so they are not an ICC profile.
+pub fn read_encoded_icc(br: &mut BitReader) -> Result<Vec<u8>, Error> {
+    read_encoded_icc_with_scratch(br, &mut EntropyScratch::new())
+}
+
+/// Same as `read_encoded_icc`, but takes the entropy decoding buffers from `scratch`, and gives
+/// them back.
+pub fn read_encoded_icc_with_scratch(
+    br: &mut BitReader,
+    scratch: &mut EntropyScratch,
+) -> Result<Vec<u8>, Error> {
+    let mut encoded = vec![];
+    decode_icc_stream(br, None, scratch, |b| encoded.push(b))?;
+    record_allocation(encoded.capacity());
+    Ok(encoded)
+}
+
+/// Same as `read_encoded_icc_with_scratch`, but the histograms are looked up in `cache` with
+/// the key of `content_hash`, which identifies the file, and of their position in the
+/// codestream; `origin` is the position of the start of `br` in the codestream, in bits.
+pub fn read_encoded_icc_cached(
+    br: &mut BitReader,
+    cache: &mut HistogramsCache,
+    content_hash: u64,
+    origin: usize,
+    scratch: &mut EntropyScratch,
+) -> Result<Vec<u8>, Error> {
+    let mut encoded = vec![];
+    decode_icc_stream(br, Some((cache, content_hash, origin)), scratch, |b| {
+        encoded.push(b)
+    })?;
+    record_allocation(encoded.capacity());
+    Ok(encoded)
+}
+
+/// Skips over the ICC stream. As the stream does not declare its size in bytes, this still needs
+/// to entropy-decode it, but it does not store the result.
+pub fn skip_icc(br: &mut BitReader) -> Result<(), Error> {
+    decode_icc_stream(br, None, &mut EntropyScratch::new(), |_| {})
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::test_util::BitWriter;
+
+    // An ICC stream of 2 bytes, 0 and 200, with a prefix code in which 0, 1, 2 and 200 have
+    // 2-bit codes, and all contexts in the same cluster.
+    fn icc_stream() -> Vec<u8> {
+        let mut bw = BitWriter::default();
+        // Length: 1 + 1.
+        bw.write(2, 1);
+        bw.write(4, 1);
+        // No LZ77, simple context map with a single cluster.
+        bw.write(1, 0);
+        bw.write(1, 1);
+        bw.write(2, 0);
+        // Prefix codes, uint config with split_exponent = 15, alphabet size 256.
+        bw.write(1, 1);
+        bw.write(4, 15);
+        bw.write(1, 1);
+        bw.write(4, 7);
+        bw.write(7, 127);
+        // Simple code with 4 symbols of 8 bits each.
+        bw.write(2, 1);
+        bw.write(2, 3);
+        for sym in [0, 1, 2, 200].iter() {
+            bw.write(8, *sym);
+        }
+        bw.write(1, 0);
+        // The codes of 0 and 200.
+        bw.write(2, 0);
+        bw.write(2, 3);
+        bw.finish()
+    }
+
+    #[test]
+    fn test_cached_icc() -> Result<(), Error> {
+        let stream = icc_stream();
+        let encoded = read_encoded_icc(&mut BitReader::new(&stream))?;
+        assert_eq!(encoded, [0, 200]);
 
-    Ok(vec![])
+        let mut cache = HistogramsCache::new();
+        let mut scratch = EntropyScratch::new();
+        for (content_hash, len) in [(1, 1), (1, 1), (2, 2)] {
+            let mut br = BitReader::new(&stream);
+            let cached =
+                read_encoded_icc_cached(&mut br, &mut cache, content_hash, 0, &mut scratch)?;
+            assert_eq!(cached, encoded);
+            assert_eq!(cache.len(), len);
+        }
+        Ok(())
+    }
 }
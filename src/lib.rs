@@ -3,10 +3,25 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+pub mod async_decoder;
 pub mod bit_reader;
 pub mod bmff;
+pub mod color;
+pub mod config;
+pub mod decoder;
 pub mod entropy_coding;
 pub mod error;
+pub mod frame;
 pub mod headers;
 pub mod icc;
+pub mod modular;
+pub mod render;
+pub mod runner;
+pub mod simd;
+pub mod stats;
+#[cfg(any(test, feature = "test-util"))]
+#[doc(hidden)]
+pub mod test_util;
+mod trace;
 mod util;
+pub mod var_dct;
@@ -3,68 +3,69 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
-use jxl::bit_reader::BitReader;
-use jxl::bmff::JxlCodestream;
-use jxl::headers::{
-    encodings::UnconditionalCoder,
-    frame_header::{FrameHeader, FrameHeaderNonserialized},
-    FileHeaders,
-};
-use jxl::icc::read_icc;
+use jxl::decoder::{DecoderStatus, JxlDecoder};
 use std::env;
-use std::fs;
+use std::fs::File;
+use std::io::Read;
 
-use jxl::headers::JxlHeader;
+const CHUNK_SIZE: usize = 1 << 16;
 
-fn parse_jxl_codestream(data: &[u8]) -> Result<(), jxl::error::Error> {
-    let mut br = BitReader::new(data);
-    let fh = FileHeaders::read(&mut br)?;
-    println!("Image size: {} x {}", fh.size.xsize(), fh.size.ysize());
-    let _icc = if fh.image_metadata.color_encoding.want_icc {
-        let r = read_icc(&mut br)?;
-        println!("ICC: {} {:?}", r.len(), r);
-        Some(r)
-    } else {
-        None
-    };
+fn decode_jxl(
+    decoder: &mut JxlDecoder,
+    mut file: Option<&mut File>,
+) -> Result<(), jxl::error::Error> {
+    let mut chunk = vec![0u8; CHUNK_SIZE];
+    loop {
+        match decoder.process()? {
+            DecoderStatus::NeedMoreInput => {
+                let file = file.as_mut().unwrap();
+                let len = file
+                    .read(&mut chunk)
+                    .expect("Something went wrong reading the file");
+                if len == 0 {
+                    decoder.finish_input()?;
+                } else {
+                    decoder.feed(&chunk[..len])?;
+                }
+            }
+            DecoderStatus::FileHeaders => {
+                let fh = decoder.file_headers().unwrap();
+                println!("Image size: {} x {}", fh.size.xsize(), fh.size.ysize());
+                if let Some(icc) = decoder.encoded_icc() {
+                    println!("Encoded ICC stream: {} bytes", icc.len());
+                }
+            }
+            DecoderStatus::FrameHeader => {}
+            DecoderStatus::Done => return Ok(()),
+        }
+    }
+}
 
-    let have_timecode = match fh.image_metadata.animation {
-        Some(ref a) => a.have_timecodes,
-        None => false,
-    };
-    let _frame_header = FrameHeader::read_unconditional(
-        &(),
-        &mut br,
-        &FrameHeaderNonserialized {
-            xyb_encoded: fh.image_metadata.xyb_encoded,
-            num_extra_channels: fh.image_metadata.extra_channel_info.len() as u32,
-            extra_channel_info: fh.image_metadata.extra_channel_info,
-            have_animation: fh.image_metadata.animation.is_some(),
-            have_timecode,
-            img_width: fh.size.xsize(),
-            img_height: fh.size.ysize(),
-        },
-    )?;
+#[cfg(feature = "mmap")]
+fn decode_mapped(file: &File) -> Result<(), jxl::error::Error> {
+    // SAFETY: the file must not be modified while it is being decoded.
+    let mmap = unsafe { memmap2::Mmap::map(file) }.expect("Something went wrong mapping the file");
+    JxlDecoder::from_bytes(&mmap).and_then(|mut decoder| decode_jxl(&mut decoder, None))
+}
 
-    Ok(())
+#[cfg(not(feature = "mmap"))]
+fn decode_mapped(_: &File) -> Result<(), jxl::error::Error> {
+    panic!("--mmap needs the `mmap` feature")
 }
 
 fn main() {
     let args: Vec<String> = env::args().collect();
-    assert_eq!(args.len(), 2);
-    let file = &args[1];
-    let contents = fs::read(file).expect("Something went wrong reading the file");
-    let codestream = JxlCodestream::new(contents);
-    let codestream = if let Ok(cs) = codestream {
-        cs
+    let (use_mmap, path) = match &args[1..] {
+        [path] => (false, path),
+        [flag, path] if flag == "--mmap" => (true, path),
+        _ => panic!("Usage: {} [--mmap] file.jxl", args[0]),
+    };
+    let mut file = File::open(path).expect("Something went wrong opening the file");
+    let res = if use_mmap {
+        decode_mapped(&file)
     } else {
-        println!(
-            "Error parsing JXL codestream: {}",
-            codestream.err().unwrap()
-        );
-        return;
+        decode_jxl(&mut JxlDecoder::new(), Some(&mut file))
     };
-    let res = parse_jxl_codestream(codestream.get());
     if let Err(err) = res {
         println!("Error parsing JXL codestream: {}", err)
     }
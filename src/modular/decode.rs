@@ -0,0 +1,724 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use jxl_headers_derive::UnconditionalCoder;
+
+use crate::bit_reader::BitReader;
+use crate::entropy_coding::decode::{Histograms, Reader};
+use crate::error::Error;
+use crate::headers::encodings::*;
+use crate::headers::JxlHeader;
+use crate::modular::predict::{Neighbors, WeightedHeader, WeightedPredictor};
+use crate::modular::tree::{
+    Leaf, Predictor, Tree, TreeNode, NUM_NONREF_PROPERTIES, WP_ERROR_PROPERTY,
+};
+use crate::trace::StageTrace;
+use crate::util::unpack_signed;
+
+/// Header of a modular sub-bitstream.
+#[derive(UnconditionalCoder, Debug)]
+pub struct GroupHeader {
+    pub use_global_tree: bool,
+    #[default(WeightedHeader::default())]
+    pub wp_header: WeightedHeader,
+    #[coder(u2S(0, 1, Bits(4) + 2, Bits(8) + 18))]
+    pub nb_transforms: u32,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ModularChannel {
+    pub width: usize,
+    pub height: usize,
+    pub hshift: u32,
+    pub vshift: u32,
+    /// Rows of `width` values.
+    pub data: Vec<i32>,
+}
+
+impl ModularChannel {
+    pub fn new(width: usize, height: usize) -> ModularChannel {
+        ModularChannel {
+            width,
+            height,
+            hshift: 0,
+            vshift: 0,
+            data: vec![0; width * height],
+        }
+    }
+
+    fn is_compatible(&self, other: &ModularChannel) -> bool {
+        self.width == other.width
+            && self.height == other.height
+            && self.hshift == other.hshift
+            && self.vshift == other.vshift
+    }
+}
+
+/// A tree and the histograms of the contexts of its leaves.
+#[derive(Debug)]
+pub struct ModularCodes {
+    pub tree: Tree,
+    pub histograms: Histograms,
+}
+
+impl ModularCodes {
+    pub fn read(br: &mut BitReader, tree_size_limit: usize) -> Result<ModularCodes, Error> {
+        let tree = Tree::read(br, tree_size_limit)?;
+        let histograms = Histograms::decode(tree.num_leaves(), br, true)?;
+        Ok(ModularCodes { tree, histograms })
+    }
+}
+
+/// Largest tree allowed for a group with the given channels, as in libjxl.
+pub fn tree_size_limit(channels: &[ModularChannel]) -> usize {
+    let num_pixels: usize = channels.iter().map(|c| c.width * c.height).sum();
+    (1024 + num_pixels).min(1 << 20)
+}
+
+/// Decodes a modular sub-bitstream into `channels`, whose sizes are already known: its
+/// header, then the tree unless the global one is used, then the channels.
+pub fn decode_group(
+    br: &mut BitReader,
+    channels: &mut [ModularChannel],
+    stream: usize,
+    global: Option<&ModularCodes>,
+) -> Result<(), Error> {
+    let stage = StageTrace::start("modular_group", br);
+    let header = GroupHeader::read(br)?;
+    if header.nb_transforms != 0 {
+        return Err(Error::UnsupportedModularTransforms(header.nb_transforms));
+    }
+    let local;
+    let codes = if header.use_global_tree {
+        global.ok_or(Error::NoGlobalTree)?
+    } else {
+        local = ModularCodes::read(br, tree_size_limit(channels))?;
+        &local
+    };
+    decode_channels(br, codes, &header.wp_header, channels, stream)?;
+    stage.finish(br);
+    Ok(())
+}
+
+/// Decodes the pixels of `channels` in order, with a single entropy coded stream.
+pub fn decode_channels(
+    br: &mut BitReader,
+    codes: &ModularCodes,
+    wp_header: &WeightedHeader,
+    channels: &mut [ModularChannel],
+    stream: usize,
+) -> Result<(), Error> {
+    decode_channels_with(br, codes, wp_header, channels, stream, DecodePath::new)
+}
+
+fn decode_channels_with(
+    br: &mut BitReader,
+    codes: &ModularCodes,
+    wp_header: &WeightedHeader,
+    channels: &mut [ModularChannel],
+    stream: usize,
+    make_path: impl Fn(Tree) -> DecodePath,
+) -> Result<(), Error> {
+    let max_width = channels.iter().map(|c| c.width).max().unwrap_or(0);
+    let mut reader = codes.histograms.make_reader_with_width(br, max_width)?;
+    for i in 0..channels.len() {
+        let (previous, rest) = channels.split_at_mut(i);
+        let channel = &mut rest[0];
+        if channel.width == 0 || channel.height == 0 {
+            continue;
+        }
+        let path = make_path(codes.tree.filter(i, stream));
+        let mut decoder = ChannelDecoder {
+            br: &mut *br,
+            reader: &mut reader,
+            wp_header,
+        };
+        decoder.decode(&path, channel, previous, i, stream)?;
+    }
+    reader.check_final_state()
+}
+
+/// How the pixels of a channel are decoded, chosen from the part of the tree that applies to
+/// the channel, so that common trees do not walk the tree for each pixel.
+#[derive(Debug, Clone, PartialEq)]
+pub enum DecodePath {
+    /// A single leaf without the weighted predictor: the residuals of each row are read at
+    /// once, and no properties are computed. This is also the case of trees that only split
+    /// on the channel or the stream.
+    SingleLeaf(Leaf),
+    /// A single leaf with the weighted predictor, which is run without computing the other
+    /// properties.
+    SingleWeighted(Leaf),
+    /// Weighted predictor leaves, selected only by its error property: the leaf is looked up
+    /// from the property, clamped to `min..min + lut.len()`.
+    WeightedLookup { min: i32, lut: Vec<Leaf> },
+    /// Any other tree, walked for each pixel.
+    Generic(Tree),
+}
+
+const MAX_LOOKUP_SIZE: usize = 1024;
+
+impl DecodePath {
+    pub fn new(tree: Tree) -> DecodePath {
+        if let [TreeNode::Leaf(leaf)] = tree.nodes() {
+            return if leaf.predictor == Predictor::Weighted {
+                DecodePath::SingleWeighted(*leaf)
+            } else {
+                DecodePath::SingleLeaf(*leaf)
+            };
+        }
+        let only_weighted = tree.leaves().all(|l| l.predictor == Predictor::Weighted)
+            && tree.max_property() == Some(WP_ERROR_PROPERTY)
+            && tree.nodes().iter().all(|node| match node {
+                TreeNode::Split { property, .. } => *property == WP_ERROR_PROPERTY,
+                TreeNode::Leaf(_) => true,
+            });
+        if only_weighted {
+            let values = tree.nodes().iter().filter_map(|node| match node {
+                TreeNode::Split { value, .. } => Some(*value as i64),
+                TreeNode::Leaf(_) => None,
+            });
+            let min = values.clone().min().unwrap();
+            // Every value above the largest split value reaches the same leaf.
+            let max = values.max().unwrap() + 1;
+            if ((max - min + 1) as usize) <= MAX_LOOKUP_SIZE {
+                let mut properties = [0; NUM_NONREF_PROPERTIES];
+                let lut = (min..=max)
+                    .map(|v| {
+                        properties[WP_ERROR_PROPERTY as usize] = v as i32;
+                        *tree.leaf(&properties)
+                    })
+                    .collect();
+                return DecodePath::WeightedLookup {
+                    min: min as i32,
+                    lut,
+                };
+            }
+        }
+        DecodePath::Generic(tree)
+    }
+}
+
+struct ChannelDecoder<'a, 'b, 'c> {
+    br: &'a mut BitReader<'b>,
+    reader: &'a mut Reader<'c>,
+    wp_header: &'a WeightedHeader,
+}
+
+#[inline(always)]
+fn pixel_value(prediction: i64, leaf: &Leaf, token: u32) -> i32 {
+    let residual = unpack_signed(token) as i64;
+    (prediction + leaf.offset as i64 + residual * leaf.multiplier as i64) as i32
+}
+
+impl<'a, 'b, 'c> ChannelDecoder<'a, 'b, 'c> {
+    fn decode(
+        &mut self,
+        path: &DecodePath,
+        channel: &mut ModularChannel,
+        previous: &[ModularChannel],
+        index: usize,
+        stream: usize,
+    ) -> Result<(), Error> {
+        match path {
+            DecodePath::SingleLeaf(leaf) => self.decode_single_leaf(leaf, channel),
+            DecodePath::SingleWeighted(leaf) => self.decode_single_weighted(leaf, channel),
+            DecodePath::WeightedLookup { min, lut } => {
+                self.decode_weighted_lookup(*min, lut, channel)
+            }
+            DecodePath::Generic(tree) => {
+                self.decode_generic(tree, channel, previous, index, stream)
+            }
+        }
+    }
+
+    fn decode_single_leaf(
+        &mut self,
+        leaf: &Leaf,
+        channel: &mut ModularChannel,
+    ) -> Result<(), Error> {
+        let width = channel.width;
+        let mut tokens = vec![0; width];
+        for y in 0..channel.height {
+            self.reader.read_many(self.br, leaf.context, &mut tokens)?;
+            let data = &mut channel.data[..];
+            match leaf.predictor {
+                Predictor::Zero => {
+                    let row = &mut data[y * width..(y + 1) * width];
+                    for (v, token) in row.iter_mut().zip(tokens.iter()) {
+                        *v = pixel_value(0, leaf, *token);
+                    }
+                }
+                Predictor::Gradient if y > 0 => gradient_row(data, width, y, &tokens, leaf),
+                predictor => {
+                    for (x, token) in tokens.iter().enumerate() {
+                        let nb = Neighbors::new(data, width, x, y);
+                        data[y * width + x] = pixel_value(predictor.predict(&nb, 0), leaf, *token);
+                    }
+                }
+            }
+        }
+        Ok(())
+    }
+
+    fn decode_single_weighted(
+        &mut self,
+        leaf: &Leaf,
+        channel: &mut ModularChannel,
+    ) -> Result<(), Error> {
+        let width = channel.width;
+        let mut wp = WeightedPredictor::new(self.wp_header, width);
+        let mut tokens = vec![0; width];
+        for y in 0..channel.height {
+            self.reader.read_many(self.br, leaf.context, &mut tokens)?;
+            for (x, token) in tokens.iter().enumerate() {
+                let nb = Neighbors::new(&channel.data, width, x, y);
+                let (prediction, _) = wp.predict(x, y, &nb);
+                let value = pixel_value(prediction, leaf, *token);
+                channel.data[y * width + x] = value;
+                wp.update(x, y, value);
+            }
+        }
+        Ok(())
+    }
+
+    fn decode_weighted_lookup(
+        &mut self,
+        min: i32,
+        lut: &[Leaf],
+        channel: &mut ModularChannel,
+    ) -> Result<(), Error> {
+        let width = channel.width;
+        let max = min + lut.len() as i32 - 1;
+        let mut wp = WeightedPredictor::new(self.wp_header, width);
+        for y in 0..channel.height {
+            for x in 0..width {
+                let nb = Neighbors::new(&channel.data, width, x, y);
+                let (prediction, error) = wp.predict(x, y, &nb);
+                let leaf = &lut[(error.clamp(min, max) - min) as usize];
+                let token = self.reader.read(self.br, leaf.context)?;
+                let value = pixel_value(prediction, leaf, token);
+                channel.data[y * width + x] = value;
+                wp.update(x, y, value);
+            }
+        }
+        Ok(())
+    }
+
+    fn decode_generic(
+        &mut self,
+        tree: &Tree,
+        channel: &mut ModularChannel,
+        previous: &[ModularChannel],
+        index: usize,
+        stream: usize,
+    ) -> Result<(), Error> {
+        let width = channel.width;
+        let num_properties = tree
+            .max_property()
+            .map_or(0, |p| p as usize + 1)
+            .max(NUM_NONREF_PROPERTIES);
+        // Each previous channel of the same size adds 4 properties, starting with the closest.
+        let num_references = (num_properties - NUM_NONREF_PROPERTIES).div_ceil(4);
+        let references: Vec<&ModularChannel> = previous
+            .iter()
+            .rev()
+            .filter(|c| c.is_compatible(channel))
+            .take(num_references)
+            .collect();
+        let mut wp = if tree.uses_weighted_predictor() {
+            Some(WeightedPredictor::new(self.wp_header, width))
+        } else {
+            None
+        };
+        let mut properties = vec![0; NUM_NONREF_PROPERTIES + 4 * num_references];
+        properties[0] = index as i32;
+        properties[1] = stream as i32;
+        for y in 0..channel.height {
+            properties[2] = y as i32;
+            properties[9] = 0;
+            for x in 0..width {
+                let nb = Neighbors::new(&channel.data, width, x, y);
+                properties[3] = x as i32;
+                properties[4] = nb.n.abs() as i32;
+                properties[5] = nb.w.abs() as i32;
+                properties[6] = nb.n as i32;
+                properties[7] = nb.w as i32;
+                // Uses the gradient of the previous pixel, before it is overwritten.
+                properties[8] = (nb.w - properties[9] as i64) as i32;
+                properties[9] = (nb.w + nb.n - nb.nw) as i32;
+                properties[10] = (nb.w - nb.nw) as i32;
+                properties[11] = (nb.nw - nb.n) as i32;
+                properties[12] = (nb.n - nb.ne) as i32;
+                properties[13] = (nb.n - nb.nn) as i32;
+                properties[14] = (nb.w - nb.ww) as i32;
+                let weighted = match wp.as_mut() {
+                    Some(wp) => {
+                        let (prediction, error) = wp.predict(x, y, &nb);
+                        properties[WP_ERROR_PROPERTY as usize] = error;
+                        prediction
+                    }
+                    None => 0,
+                };
+                for (r, reference) in references.iter().enumerate() {
+                    let p = &mut properties[NUM_NONREF_PROPERTIES + 4 * r..];
+                    let (value, prediction) = reference_value(reference, x, y);
+                    p[0] = value.abs() as i32;
+                    p[1] = value as i32;
+                    p[2] = (value - prediction).abs() as i32;
+                    p[3] = (value - prediction) as i32;
+                }
+                let leaf = tree.leaf(&properties);
+                let token = self.reader.read(self.br, leaf.context)?;
+                let value = pixel_value(leaf.predictor.predict(&nb, weighted), leaf, token);
+                channel.data[y * width + x] = value;
+                if let Some(wp) = wp.as_mut() {
+                    wp.update(x, y, value);
+                }
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Value of a pixel of a previous channel, and its clamped gradient prediction, for which
+/// the missing left neighbor is 0.
+fn reference_value(channel: &ModularChannel, x: usize, y: usize) -> (i64, i64) {
+    let width = channel.width;
+    let pos = y * width + x;
+    let w = if x > 0 {
+        channel.data[pos - 1] as i64
+    } else {
+        0
+    };
+    let n = if y > 0 {
+        channel.data[pos - width] as i64
+    } else {
+        w
+    };
+    let nw = if x > 0 && y > 0 {
+        channel.data[pos - width - 1] as i64
+    } else {
+        w
+    };
+    let nb = Neighbors {
+        n,
+        w,
+        nw,
+        ne: n,
+        nn: n,
+        ww: w,
+        nee: n,
+    };
+    (channel.data[pos] as i64, nb.clamped_gradient())
+}
+
+/// Decodes row `y > 0` with the gradient predictor; only the first pixel needs the edge
+/// rules.
+#[inline(always)]
+fn gradient_row(data: &mut [i32], width: usize, y: usize, tokens: &[u32], leaf: &Leaf) {
+    let (above, rest) = data.split_at_mut(y * width);
+    let up = &above[(y - 1) * width..];
+    let row = &mut rest[..width];
+    // W is N for the first pixel, so the prediction is N.
+    row[0] = pixel_value(up[0] as i64, leaf, tokens[0]);
+    for x in 1..width {
+        let (w, n, nw) = (row[x - 1] as i64, up[x] as i64, up[x - 1] as i64);
+        let prediction = (w + n - nw).max(w.min(n)).min(w.max(n));
+        row[x] = pixel_value(prediction, leaf, tokens[x]);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::test_util::BitWriter;
+
+    /// Prefix coded histograms without LZ77, where the histogram of each context is a simple
+    /// code over 1, 2 or 4 symbols below 256.
+    struct Codes {
+        symbols: Vec<Vec<u32>>,
+    }
+
+    impl Codes {
+        fn write(bw: &mut BitWriter, symbols: Vec<Vec<u32>>) -> Codes {
+            bw.write(1, 0);
+            if symbols.len() > 1 {
+                bw.write(1, 1);
+                bw.write(2, 3);
+                for i in 0..symbols.len() {
+                    bw.write(3, i as u64);
+                }
+            }
+            bw.write(1, 1);
+            for _ in symbols.iter() {
+                bw.write(4, 15);
+            }
+            for _ in symbols.iter() {
+                bw.write(1, 1);
+                bw.write(4, 7);
+                bw.write(7, 127);
+            }
+            for s in symbols.iter() {
+                bw.write(2, 1);
+                bw.write(2, s.len() as u64 - 1);
+                for v in s.iter() {
+                    bw.write(8, *v as u64);
+                }
+                if s.len() == 4 {
+                    bw.write(1, 0);
+                }
+            }
+            let symbols = symbols
+                .into_iter()
+                .map(|mut s| {
+                    s.sort_unstable();
+                    s
+                })
+                .collect();
+            Codes { symbols }
+        }
+
+        fn symbol(&self, bw: &mut BitWriter, context: usize, symbol: u32) {
+            let symbols = &self.symbols[context];
+            let index = symbols.iter().position(|s| *s == symbol).unwrap();
+            let bits = [0, 0, 1, 0, 2][symbols.len()];
+            bw.write(bits, index as u64);
+        }
+    }
+
+    #[derive(Clone, Copy)]
+    enum Node {
+        Split(u32, u32),
+        Leaf(u32, u32),
+    }
+
+    /// Writes a tree given in breadth first order, as (property, packed split value) or
+    /// (predictor, packed offset), and histograms with the given residual symbols for each
+    /// leaf.
+    fn write_tree(bw: &mut BitWriter, nodes: &[Node], residuals: &[u32]) -> Codes {
+        let mut symbols = vec![vec![]; 6];
+        let mut add = |context: usize, s: u32| {
+            if !symbols[context].contains(&s) {
+                symbols[context].push(s);
+            }
+        };
+        add(4, 0);
+        add(5, 0);
+        for node in nodes.iter() {
+            match *node {
+                Node::Split(property, value) => {
+                    add(1, property + 1);
+                    add(0, value);
+                }
+                Node::Leaf(predictor, offset) => {
+                    add(1, 0);
+                    add(2, predictor);
+                    add(3, offset);
+                }
+            }
+        }
+        for s in symbols.iter_mut() {
+            if s.is_empty() {
+                s.push(0);
+            }
+            if s.len() == 3 {
+                s.push(255);
+            }
+        }
+        let tree_codes = Codes::write(bw, symbols);
+        let mut num_leaves = 0;
+        for node in nodes.iter() {
+            match *node {
+                Node::Split(property, value) => {
+                    tree_codes.symbol(bw, 1, property + 1);
+                    tree_codes.symbol(bw, 0, value);
+                }
+                Node::Leaf(predictor, offset) => {
+                    tree_codes.symbol(bw, 1, 0);
+                    tree_codes.symbol(bw, 2, predictor);
+                    tree_codes.symbol(bw, 3, offset);
+                    tree_codes.symbol(bw, 4, 0);
+                    tree_codes.symbol(bw, 5, 0);
+                    num_leaves += 1;
+                }
+            }
+        }
+        Codes::write(bw, vec![residuals.to_vec(); num_leaves])
+    }
+
+    /// Decodes channels of the given sizes with the given tree and pseudo-random residuals,
+    /// read with the contexts given by `contexts(channel, x, y)`, both with `DecodePath::new`
+    /// and with the generic path. Returns the channels and the paths used.
+    ///
+    /// When the contexts depend on the decoded values, `residuals` must be a single symbol,
+    /// which takes no bits in any context.
+    fn decode(
+        nodes: &[Node],
+        residuals: &[u32],
+        contexts: impl Fn(usize, usize, usize) -> usize,
+        sizes: &[(usize, usize)],
+    ) -> (Vec<ModularChannel>, Vec<DecodePath>) {
+        let mut bw = BitWriter::default();
+        // GroupHeader: local tree, default weighted predictor, no transforms.
+        bw.write(1, 0);
+        bw.write(1, 1);
+        bw.write(2, 0);
+        let codes = write_tree(&mut bw, nodes, residuals);
+        let mut state = 1u32;
+        for (c, (width, height)) in sizes.iter().enumerate() {
+            for y in 0..*height {
+                for x in 0..*width {
+                    state = state.wrapping_mul(1103515245).wrapping_add(12345);
+                    let residual = residuals[(state >> 16) as usize % residuals.len()];
+                    codes.symbol(&mut bw, contexts(c, x, y), residual);
+                }
+            }
+        }
+        let data = bw.finish();
+        let new_channels = || -> Vec<ModularChannel> {
+            sizes
+                .iter()
+                .map(|(w, h)| ModularChannel::new(*w, *h))
+                .collect()
+        };
+
+        let mut channels = new_channels();
+        let mut br = BitReader::new(&data);
+        decode_group(&mut br, &mut channels, 0, None).unwrap();
+
+        let mut generic = new_channels();
+        let mut br = BitReader::new(&data);
+        GroupHeader::read(&mut br).unwrap();
+        let codes = ModularCodes::read(&mut br, 1024).unwrap();
+        let wp_header = WeightedHeader::default();
+        decode_channels_with(
+            &mut br,
+            &codes,
+            &wp_header,
+            &mut generic,
+            0,
+            DecodePath::Generic,
+        )
+        .unwrap();
+        assert_eq!(channels, generic);
+        let paths = (0..sizes.len())
+            .map(|c| DecodePath::new(codes.tree.filter(c, 0)))
+            .collect();
+        (channels, paths)
+    }
+
+    const RESIDUALS: [u32; 4] = [0, 1, 2, 3];
+
+    #[test]
+    fn test_single_leaf() {
+        let gradient = Predictor::Gradient as u32;
+        let nodes = [Node::Leaf(gradient, 0)];
+        let (channels, paths) = decode(&nodes, &RESIDUALS, |_, _, _| 0, &[(13, 7)]);
+        assert!(matches!(paths[0], DecodePath::SingleLeaf(_)));
+        assert_eq!(channels[0].data.len(), 13 * 7);
+
+        // Offset 2, and residuals of -1.
+        let nodes = [Node::Leaf(Predictor::Zero as u32, 4)];
+        let (channels, _) = decode(&nodes, &[1], |_, _, _| 0, &[(3, 2)]);
+        assert_eq!(channels[0].data, vec![1; 6]);
+    }
+
+    #[test]
+    fn test_channel_split() {
+        // channel > 0 ? west : gradient.
+        let nodes = [
+            Node::Split(0, 0),
+            Node::Leaf(Predictor::West as u32, 0),
+            Node::Leaf(Predictor::Gradient as u32, 0),
+        ];
+        let contexts = |c: usize, _, _| if c > 0 { 0 } else { 1 };
+        let sizes = [(9, 5), (9, 5), (4, 3)];
+        let (_, paths) = decode(&nodes, &RESIDUALS, contexts, &sizes);
+        let predictors: Vec<_> = paths
+            .iter()
+            .map(|path| match path {
+                DecodePath::SingleLeaf(leaf) => leaf.predictor,
+                path => panic!("{:?}", path),
+            })
+            .collect();
+        let (west, gradient) = (Predictor::West, Predictor::Gradient);
+        assert_eq!(predictors, [gradient, west, west]);
+    }
+
+    #[test]
+    fn test_weighted() {
+        let weighted = Predictor::Weighted as u32;
+        let nodes = [Node::Leaf(weighted, 0)];
+        let (_, paths) = decode(&nodes, &RESIDUALS, |_, _, _| 0, &[(17, 9)]);
+        assert!(matches!(paths[0], DecodePath::SingleWeighted(_)));
+
+        // error > 2 ? weighted : (error > -1 ? weighted + 1 : weighted - 1)
+        let nodes = [
+            Node::Split(WP_ERROR_PROPERTY, 4),
+            Node::Leaf(weighted, 0),
+            Node::Split(WP_ERROR_PROPERTY, 1),
+            Node::Leaf(weighted, 2),
+            Node::Leaf(weighted, 1),
+        ];
+        let (_, paths) = decode(&nodes, &[5], |_, _, _| 0, &[(23, 11), (5, 4)]);
+        match &paths[0] {
+            DecodePath::WeightedLookup { min, lut } => {
+                assert_eq!(*min, -1);
+                let contexts: Vec<_> = lut.iter().map(|l| l.context).collect();
+                assert_eq!(contexts, [2, 1, 1, 1, 0]);
+            }
+            path => panic!("{:?}", path),
+        }
+    }
+
+    #[test]
+    fn test_generic() {
+        // W > 3 ? (previous channel > 0 ? select : average) : weighted
+        let nodes = [
+            Node::Split(7, 6),
+            Node::Split(16, 0),
+            Node::Leaf(Predictor::Weighted as u32, 1),
+            Node::Leaf(Predictor::Select as u32, 3),
+            Node::Leaf(Predictor::AverageAll as u32, 2),
+        ];
+        let sizes = [(12, 6), (12, 6), (7, 3)];
+        let (_, paths) = decode(&nodes, &[4], |_, _, _| 0, &sizes);
+        assert!(paths.iter().all(|p| matches!(p, DecodePath::Generic(_))));
+
+        let mut bw = BitWriter::default();
+        bw.write(1, 1);
+        bw.write(1, 1);
+        bw.write(2, 1);
+        let data = bw.finish();
+        let mut channels = vec![ModularChannel::new(3, 2)];
+        assert!(matches!(
+            decode_group(&mut BitReader::new(&data), &mut channels, 0, None),
+            Err(Error::UnsupportedModularTransforms(1))
+        ));
+    }
+
+    #[test]
+    fn test_tree_size_limit() {
+        let channels = [ModularChannel::new(100, 100), ModularChannel::new(50, 20)];
+        assert_eq!(tree_size_limit(&channels), 1024 + 11000);
+        assert_eq!(tree_size_limit(&[ModularChannel::new(2048, 1024)]), 1 << 20);
+
+        let nodes = [
+            Node::Split(7, 6),
+            Node::Leaf(Predictor::Zero as u32, 0),
+            Node::Leaf(Predictor::West as u32, 0),
+        ];
+        let mut bw = BitWriter::default();
+        write_tree(&mut bw, &nodes, &[0]);
+        let data = bw.finish();
+        // As in libjxl, trees of `size_limit + 1` nodes are accepted.
+        assert!(ModularCodes::read(&mut BitReader::new(&data), 2).is_ok());
+        assert!(matches!(
+            ModularCodes::read(&mut BitReader::new(&data), 1),
+            Err(Error::TreeTooLarge(1))
+        ));
+    }
+}
@@ -0,0 +1,363 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use jxl_headers_derive::UnconditionalCoder;
+
+use crate::bit_reader::BitReader;
+use crate::error::Error;
+use crate::headers::encodings::*;
+use crate::modular::tree::Predictor;
+
+/// Parameters of the weighted predictor.
+#[derive(UnconditionalCoder, Debug, Clone, PartialEq)]
+pub struct WeightedHeader {
+    #[all_default]
+    #[default(true)]
+    all_default: bool,
+    #[coder(Bits(5))]
+    #[default(16)]
+    p1c: u32,
+    #[coder(Bits(5))]
+    #[default(10)]
+    p2c: u32,
+    #[coder(Bits(5))]
+    #[default(7)]
+    p3ca: u32,
+    #[coder(Bits(5))]
+    #[default(7)]
+    p3cb: u32,
+    #[coder(Bits(5))]
+    #[default(7)]
+    p3cc: u32,
+    #[coder(Bits(5))]
+    #[default(0)]
+    p3cd: u32,
+    #[coder(Bits(5))]
+    #[default(0)]
+    p3ce: u32,
+    #[coder(Bits(4))]
+    #[default(0xd)]
+    w0: u32,
+    #[coder(Bits(4))]
+    #[default(0xc)]
+    w1: u32,
+    #[coder(Bits(4))]
+    #[default(0xc)]
+    w2: u32,
+    #[coder(Bits(4))]
+    #[default(0xc)]
+    w3: u32,
+}
+
+/// Values around the pixel being decoded, replaced by the closest available one near the
+/// edges of the channel.
+#[derive(Debug, Clone, Copy)]
+pub struct Neighbors {
+    pub n: i64,
+    pub w: i64,
+    pub nw: i64,
+    pub ne: i64,
+    pub nn: i64,
+    pub ww: i64,
+    pub nee: i64,
+}
+
+impl Neighbors {
+    /// Neighbors of pixel (`x`, `y`) of a channel with rows of `width` values, of which the
+    /// ones before the pixel are decoded.
+    #[inline(always)]
+    pub fn new(data: &[i32], width: usize, x: usize, y: usize) -> Neighbors {
+        let row = y * width;
+        let up = row.wrapping_sub(width);
+        let w = if x > 0 {
+            data[row + x - 1] as i64
+        } else if y > 0 {
+            data[up + x] as i64
+        } else {
+            0
+        };
+        let n = if y > 0 { data[up + x] as i64 } else { w };
+        let nw = if x > 0 && y > 0 {
+            data[up + x - 1] as i64
+        } else {
+            w
+        };
+        let ne = if x + 1 < width && y > 0 {
+            data[up + x + 1] as i64
+        } else {
+            n
+        };
+        let nn = if y > 1 {
+            data[up - width + x] as i64
+        } else {
+            n
+        };
+        let ww = if x > 1 { data[row + x - 2] as i64 } else { w };
+        let nee = if x + 2 < width && y > 0 {
+            data[up + x + 2] as i64
+        } else {
+            ne
+        };
+        Neighbors {
+            n,
+            w,
+            nw,
+            ne,
+            nn,
+            ww,
+            nee,
+        }
+    }
+
+    /// `W + N - NW`, clamped to the range of `W` and `N`.
+    #[inline(always)]
+    pub fn clamped_gradient(&self) -> i64 {
+        let (min, max) = (self.w.min(self.n), self.w.max(self.n));
+        (self.w + self.n - self.nw).max(min).min(max)
+    }
+}
+
+impl Predictor {
+    /// Prediction for a pixel; `weighted` is the prediction of the weighted predictor, only
+    /// used by `Predictor::Weighted`.
+    #[inline(always)]
+    pub fn predict(&self, nb: &Neighbors, weighted: i64) -> i64 {
+        match self {
+            Predictor::Zero => 0,
+            Predictor::West => nb.w,
+            Predictor::North => nb.n,
+            Predictor::AverageWestAndNorth => (nb.w + nb.n) / 2,
+            Predictor::Select => {
+                let p = nb.w + nb.n - nb.nw;
+                if (p - nb.w).abs() < (p - nb.n).abs() {
+                    nb.w
+                } else {
+                    nb.n
+                }
+            }
+            Predictor::Gradient => nb.clamped_gradient(),
+            Predictor::Weighted => weighted,
+            Predictor::NorthEast => nb.ne,
+            Predictor::NorthWest => nb.nw,
+            Predictor::WestWest => nb.ww,
+            Predictor::AverageWestAndNorthWest => (nb.w + nb.nw) / 2,
+            Predictor::AverageNorthAndNorthWest => (nb.n + nb.nw) / 2,
+            Predictor::AverageNorthAndNorthEast => (nb.n + nb.ne) / 2,
+            Predictor::AverageAll => {
+                (6 * nb.n - 2 * nb.nn + 7 * nb.w + nb.ww + nb.nee + 3 * nb.ne + 8) / 16
+            }
+        }
+    }
+}
+
+const NUM_PREDICTORS: usize = 4;
+const PRED_EXTRA_BITS: i64 = 3;
+const PREDICTION_ROUND: i64 = ((1 << PRED_EXTRA_BITS) >> 1) - 1;
+
+/// State of the weighted predictor over a channel, which mixes 4 predictions with weights
+/// derived from their errors on the previous pixels. Predictions and errors are kept with
+/// `PRED_EXTRA_BITS` fractional bits.
+#[derive(Debug)]
+pub struct WeightedPredictor {
+    p1c: i64,
+    p2c: i64,
+    p3c: [i64; 5],
+    max_weights: [u32; NUM_PREDICTORS],
+    width: usize,
+    /// Errors of each sub-predictor and of the prediction, on two rows with two pixels of
+    /// padding each.
+    pred_errors: [Vec<u32>; NUM_PREDICTORS],
+    errors: Vec<i32>,
+    predictions: [i64; NUM_PREDICTORS],
+    prediction: i64,
+}
+
+fn error_weight(x: u32, max_weight: u32) -> u32 {
+    let floor_log2 = 31 - x.saturating_add(1).leading_zeros() as i32;
+    let shift = (floor_log2 - 5).max(0) as u32;
+    4 + ((max_weight as u64 * DIV_LOOKUP[(x >> shift) as usize] as u64) >> shift) as u32
+}
+
+/// `DIV_LOOKUP[i] = (1 << 24) / (i + 1)`.
+const DIV_LOOKUP: [u32; 64] = {
+    let mut table = [0; 64];
+    let mut i = 0;
+    while i < 64 {
+        table[i] = (1 << 24) / (i as u32 + 1);
+        i += 1;
+    }
+    table
+};
+
+fn weighted_average(predictions: &[i64; NUM_PREDICTORS], mut weights: [u32; 4]) -> i64 {
+    let log_weight = 31 - weights.iter().sum::<u32>().leading_zeros();
+    weights.iter_mut().for_each(|w| *w >>= log_weight - 4);
+    let weight_sum: u32 = weights.iter().sum();
+    let mut sum = (weight_sum >> 1) as i64 - 1;
+    for (p, w) in predictions.iter().zip(weights.iter()) {
+        sum += p * *w as i64;
+    }
+    (sum * DIV_LOOKUP[weight_sum as usize - 1] as i64) >> 24
+}
+
+impl WeightedPredictor {
+    pub fn new(header: &WeightedHeader, width: usize) -> WeightedPredictor {
+        let size = (width + 2) * 2;
+        WeightedPredictor {
+            p1c: header.p1c as i64,
+            p2c: header.p2c as i64,
+            p3c: [
+                header.p3ca as i64,
+                header.p3cb as i64,
+                header.p3cc as i64,
+                header.p3cd as i64,
+                header.p3ce as i64,
+            ],
+            max_weights: [header.w0, header.w1, header.w2, header.w3],
+            width,
+            pred_errors: [vec![0; size], vec![0; size], vec![0; size], vec![0; size]],
+            errors: vec![0; size],
+            predictions: [0; NUM_PREDICTORS],
+            prediction: 0,
+        }
+    }
+
+    fn rows(&self, y: usize) -> (usize, usize) {
+        if y & 1 != 0 {
+            (0, self.width + 2)
+        } else {
+            (self.width + 2, 0)
+        }
+    }
+
+    /// Returns the prediction for pixel (`x`, `y`) and the value of the largest error
+    /// property. `update` must be called with the decoded value before the next pixel.
+    #[inline(always)]
+    pub fn predict(&mut self, x: usize, y: usize, nb: &Neighbors) -> (i64, i32) {
+        let (cur_row, prev_row) = self.rows(y);
+        let pos_n = prev_row + x;
+        let pos_ne = if x + 1 < self.width { pos_n + 1 } else { pos_n };
+        let pos_nw = if x > 0 { pos_n - 1 } else { pos_n };
+        let mut weights = [0; NUM_PREDICTORS];
+        for (i, weight) in weights.iter_mut().enumerate() {
+            let errors = &self.pred_errors[i];
+            // The error at N also contains the one at W, and the one at NW the one at WW.
+            let sum = errors[pos_n]
+                .wrapping_add(errors[pos_ne])
+                .wrapping_add(errors[pos_nw]);
+            *weight = error_weight(sum, self.max_weights[i]);
+        }
+        let n = nb.n << PRED_EXTRA_BITS;
+        let w = nb.w << PRED_EXTRA_BITS;
+        let ne = nb.ne << PRED_EXTRA_BITS;
+        let nw = nb.nw << PRED_EXTRA_BITS;
+        let nn = nb.nn << PRED_EXTRA_BITS;
+        let te_w = if x == 0 {
+            0
+        } else {
+            self.errors[cur_row + x - 1] as i64
+        };
+        let te_n = self.errors[pos_n] as i64;
+        let te_nw = self.errors[pos_nw] as i64;
+        let te_ne = self.errors[pos_ne] as i64;
+        let sum_wn = te_n + te_w;
+
+        let mut max_error = te_w;
+        for e in [te_n, te_nw, te_ne].iter() {
+            if e.abs() > max_error.abs() {
+                max_error = *e;
+            }
+        }
+
+        self.predictions = [
+            w + ne - n,
+            n - (((sum_wn + te_ne) * self.p1c) >> 5),
+            w - (((sum_wn + te_nw) * self.p2c) >> 5),
+            n - ((te_nw * self.p3c[0]
+                + te_n * self.p3c[1]
+                + te_ne * self.p3c[2]
+                + (nn - n) * self.p3c[3]
+                + (nw - w) * self.p3c[4])
+                >> 5),
+        ];
+        let mut prediction = weighted_average(&self.predictions, weights);
+        // Clamp to the neighbors, unless all the errors have the same sign.
+        if ((te_n ^ te_w) | (te_n ^ te_nw)) <= 0 {
+            let max = w.max(ne.max(n));
+            let min = w.min(ne.min(n));
+            prediction = prediction.max(min).min(max);
+        }
+        self.prediction = prediction;
+        (
+            (prediction + PREDICTION_ROUND) >> PRED_EXTRA_BITS,
+            max_error as i32,
+        )
+    }
+
+    #[inline(always)]
+    pub fn update(&mut self, x: usize, y: usize, value: i32) {
+        let (cur_row, prev_row) = self.rows(y);
+        let value = (value as i64) << PRED_EXTRA_BITS;
+        self.errors[cur_row + x] = (self.prediction - value) as i32;
+        for (errors, prediction) in self.pred_errors.iter_mut().zip(self.predictions.iter()) {
+            let error = (((prediction - value).abs() + PREDICTION_ROUND) >> PRED_EXTRA_BITS) as u32;
+            errors[cur_row + x] = error;
+            // Also counts as the error at W for the next pixel.
+            errors[prev_row + x + 1] = errors[prev_row + x + 1].wrapping_add(error);
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_neighbors() {
+        #[rustfmt::skip]
+        let data = [
+            1, 2, 3,
+            4, 5, 6,
+            7, 8, 0,
+        ];
+        let nb = Neighbors::new(&data, 3, 1, 2);
+        assert_eq!(
+            (nb.n, nb.w, nb.nw, nb.ne, nb.nn, nb.ww, nb.nee),
+            (5, 7, 4, 6, 2, 7, 6)
+        );
+        let nb = Neighbors::new(&data, 3, 0, 0);
+        assert_eq!(
+            (nb.n, nb.w, nb.nw, nb.ne, nb.nn, nb.ww, nb.nee),
+            (0, 0, 0, 0, 0, 0, 0)
+        );
+        let nb = Neighbors::new(&data, 3, 0, 1);
+        assert_eq!((nb.n, nb.w, nb.nw, nb.ne), (1, 1, 1, 2));
+        assert_eq!(Predictor::Gradient.predict(&nb, 0), 1);
+        assert_eq!(
+            Predictor::AverageAll.predict(&nb, 0),
+            (6 + 7 - 2 + 1 + 3 + 6 + 8) / 16
+        );
+    }
+
+    #[test]
+    fn test_weighted_constant() {
+        // A constant channel is predicted exactly once the errors settle.
+        let width = 8;
+        let mut wp = WeightedPredictor::new(&WeightedHeader::default(), width);
+        let data = vec![100; width * 4];
+        for y in 0..4 {
+            for x in 0..width {
+                let nb = Neighbors::new(&data, width, x, y);
+                let (prediction, _) = wp.predict(x, y, &nb);
+                if y > 0 {
+                    assert_eq!(prediction, 100);
+                }
+                wp.update(x, y, 100);
+            }
+        }
+        assert_eq!(error_weight(0, 0xd), 4 + 0xd * (1 << 24));
+        assert_eq!(weighted_average(&[8, 8, 8, 8], [16, 16, 16, 16]), 8);
+    }
+}
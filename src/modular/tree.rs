@@ -0,0 +1,293 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use num_derive::FromPrimitive;
+use num_traits::FromPrimitive;
+
+use crate::bit_reader::BitReader;
+use crate::entropy_coding::decode::Histograms;
+use crate::error::Error;
+use crate::util::unpack_signed;
+
+/// Properties that do not depend on previously decoded channels; the next ones come in
+/// groups of 4 for each previous channel of the same size.
+pub const NUM_NONREF_PROPERTIES: usize = 16;
+pub const CHANNEL_PROPERTY: u32 = 0;
+pub const STREAM_PROPERTY: u32 = 1;
+/// Largest error of the weighted predictor around the pixel.
+pub const WP_ERROR_PROPERTY: u32 = 15;
+
+const SPLIT_VAL_CONTEXT: usize = 0;
+const PROPERTY_CONTEXT: usize = 1;
+const PREDICTOR_CONTEXT: usize = 2;
+const OFFSET_CONTEXT: usize = 3;
+const MULTIPLIER_LOG_CONTEXT: usize = 4;
+const MULTIPLIER_BITS_CONTEXT: usize = 5;
+const NUM_TREE_CONTEXTS: usize = 6;
+
+const MAX_PROPERTY: u32 = 255;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, FromPrimitive)]
+pub enum Predictor {
+    Zero = 0,
+    West = 1,
+    North = 2,
+    AverageWestAndNorth = 3,
+    Select = 4,
+    Gradient = 5,
+    Weighted = 6,
+    NorthEast = 7,
+    NorthWest = 8,
+    WestWest = 9,
+    AverageWestAndNorthWest = 10,
+    AverageNorthAndNorthWest = 11,
+    AverageNorthAndNorthEast = 12,
+    AverageAll = 13,
+}
+
+/// Decoding parameters for the pixels that reach a leaf of the tree: the value is
+/// `prediction + offset + residual * multiplier`, with the residual read with `context`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Leaf {
+    pub predictor: Predictor,
+    pub offset: i32,
+    pub multiplier: u32,
+    pub context: usize,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum TreeNode {
+    /// Goes to `left` if the property is larger than `value`, to `right` otherwise.
+    Split {
+        property: u32,
+        value: i32,
+        left: usize,
+        right: usize,
+    },
+    Leaf(Leaf),
+}
+
+/// Meta-adaptive tree, which selects the predictor and context of each pixel from its
+/// properties. The root is the first node.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Tree {
+    nodes: Vec<TreeNode>,
+}
+
+impl Tree {
+    /// Reads a tree, which fails once more than `size_limit` nodes are read and more remain, as
+    /// in libjxl.
+    pub fn read(br: &mut BitReader, size_limit: usize) -> Result<Tree, Error> {
+        let histograms = Histograms::decode(NUM_TREE_CONTEXTS, br, true)?;
+        let mut reader = histograms.make_reader(br)?;
+        let mut nodes = vec![];
+        let mut num_leaves = 0;
+        // Nodes are stored in breadth first order: `to_decode` nodes were announced by the
+        // nodes read so far, but not read yet.
+        let mut to_decode = 1;
+        while to_decode > 0 {
+            if nodes.len() > size_limit {
+                return Err(Error::TreeTooLarge(size_limit));
+            }
+            to_decode -= 1;
+            let property = reader.read(br, PROPERTY_CONTEXT)?;
+            if property > MAX_PROPERTY + 1 {
+                return Err(Error::InvalidProperty(property));
+            }
+            if property == 0 {
+                let predictor = reader.read(br, PREDICTOR_CONTEXT)?;
+                let predictor =
+                    Predictor::from_u32(predictor).ok_or(Error::InvalidPredictor(predictor))?;
+                let offset = unpack_signed(reader.read(br, OFFSET_CONTEXT)?);
+                let multiplier_log = reader.read(br, MULTIPLIER_LOG_CONTEXT)?;
+                if multiplier_log >= 31 {
+                    return Err(Error::InvalidMultiplier);
+                }
+                let multiplier_bits = reader.read(br, MULTIPLIER_BITS_CONTEXT)?;
+                if multiplier_bits >= (1 << (31 - multiplier_log)) - 1 {
+                    return Err(Error::InvalidMultiplier);
+                }
+                nodes.push(TreeNode::Leaf(Leaf {
+                    predictor,
+                    offset,
+                    multiplier: (multiplier_bits + 1) << multiplier_log,
+                    context: num_leaves,
+                }));
+                num_leaves += 1;
+            } else {
+                let value = unpack_signed(reader.read(br, SPLIT_VAL_CONTEXT)?);
+                let left = nodes.len() + to_decode + 1;
+                nodes.push(TreeNode::Split {
+                    property: property - 1,
+                    value,
+                    left,
+                    right: left + 1,
+                });
+                to_decode += 2;
+            }
+        }
+        reader.check_final_state()?;
+        Ok(Tree { nodes })
+    }
+
+    pub fn nodes(&self) -> &[TreeNode] {
+        &self.nodes
+    }
+
+    pub fn num_leaves(&self) -> usize {
+        self.nodes.len().div_ceil(2)
+    }
+
+    /// Leaf reached by a pixel with the given properties.
+    #[inline]
+    pub fn leaf(&self, properties: &[i32]) -> &Leaf {
+        let mut node = 0;
+        loop {
+            match &self.nodes[node] {
+                TreeNode::Split {
+                    property,
+                    value,
+                    left,
+                    right,
+                } => {
+                    node = if properties[*property as usize] > *value {
+                        *left
+                    } else {
+                        *right
+                    };
+                }
+                TreeNode::Leaf(leaf) => return leaf,
+            }
+        }
+    }
+
+    /// The part of the tree reachable by the pixels of the given channel and stream, with the
+    /// splits on these two properties resolved.
+    pub fn filter(&self, channel: usize, stream: usize) -> Tree {
+        let static_value = |property: u32| match property {
+            CHANNEL_PROPERTY => Some(channel as i64),
+            STREAM_PROPERTY => Some(stream as i64),
+            _ => None,
+        };
+        let mut nodes: Vec<TreeNode> = vec![];
+        // Nodes still to copy, with the split that points to them and whether they are its
+        // left child. An explicit stack, as trees can be very deep.
+        let mut stack = vec![(0, None)];
+        while let Some((mut node, parent)) = stack.pop() {
+            while let TreeNode::Split {
+                property,
+                value,
+                left,
+                right,
+            } = self.nodes[node]
+            {
+                match static_value(property) {
+                    Some(v) if v > value as i64 => node = left,
+                    Some(_) => node = right,
+                    None => break,
+                }
+            }
+            let pos = nodes.len();
+            if let Some((parent, is_left)) = parent {
+                if let TreeNode::Split { left, right, .. } = &mut nodes[parent] {
+                    *(if is_left { left } else { right }) = pos;
+                }
+            }
+            nodes.push(self.nodes[node]);
+            if let TreeNode::Split { left, right, .. } = self.nodes[node] {
+                stack.push((right, Some((pos, false))));
+                stack.push((left, Some((pos, true))));
+            }
+        }
+        Tree { nodes }
+    }
+
+    /// Largest property used by a split, if any.
+    pub fn max_property(&self) -> Option<u32> {
+        self.nodes
+            .iter()
+            .filter_map(|node| match node {
+                TreeNode::Split { property, .. } => Some(*property),
+                TreeNode::Leaf(_) => None,
+            })
+            .max()
+    }
+
+    pub fn leaves(&self) -> impl Iterator<Item = &Leaf> {
+        self.nodes.iter().filter_map(|node| match node {
+            TreeNode::Leaf(leaf) => Some(leaf),
+            TreeNode::Split { .. } => None,
+        })
+    }
+
+    /// Whether the weighted predictor has to run, for a leaf or for its error property.
+    pub fn uses_weighted_predictor(&self) -> bool {
+        self.leaves().any(|leaf| leaf.predictor == Predictor::Weighted)
+            || self.nodes.iter().any(|node| {
+                matches!(node, TreeNode::Split { property, .. } if *property == WP_ERROR_PROPERTY)
+            })
+    }
+}
+
+#[cfg(test)]
+pub(crate) mod test {
+    use super::*;
+
+    pub(crate) fn leaf(predictor: Predictor, offset: i32, context: usize) -> TreeNode {
+        TreeNode::Leaf(Leaf {
+            predictor,
+            offset,
+            multiplier: 1,
+            context,
+        })
+    }
+
+    pub(crate) fn split(property: u32, value: i32, left: usize) -> TreeNode {
+        TreeNode::Split {
+            property,
+            value,
+            left,
+            right: left + 1,
+        }
+    }
+
+    pub(crate) fn tree(nodes: Vec<TreeNode>) -> Tree {
+        Tree { nodes }
+    }
+
+    #[test]
+    fn test_filter() {
+        // channel > 0 ? (stream > 3 ? gradient : (W > 5 ? west : north)) : zero
+        let tree = tree(vec![
+            split(CHANNEL_PROPERTY, 0, 1),
+            split(STREAM_PROPERTY, 3, 3),
+            leaf(Predictor::Zero, 0, 0),
+            leaf(Predictor::Gradient, 0, 1),
+            split(7, 5, 5),
+            leaf(Predictor::West, 0, 2),
+            leaf(Predictor::North, 0, 3),
+        ]);
+        assert_eq!(tree.filter(0, 7).nodes(), &[leaf(Predictor::Zero, 0, 0)]);
+        assert_eq!(
+            tree.filter(1, 7).nodes(),
+            &[leaf(Predictor::Gradient, 0, 1)]
+        );
+        let filtered = tree.filter(2, 3);
+        assert_eq!(
+            filtered.nodes(),
+            &[
+                split(7, 5, 1),
+                leaf(Predictor::West, 0, 2),
+                leaf(Predictor::North, 0, 3)
+            ]
+        );
+        let mut properties = [0; NUM_NONREF_PROPERTIES];
+        properties[7] = 6;
+        assert_eq!(filtered.leaf(&properties).context, 2);
+        assert_eq!(tree.leaf(&properties).context, 0);
+        assert_eq!(filtered.max_property(), Some(7));
+        assert!(!tree.uses_weighted_predictor());
+    }
+}
@@ -0,0 +1,438 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use half::f16;
+
+use crate::error::Error;
+use crate::headers::bit_depth::BitDepth;
+use crate::render::pipeline::{RenderPipeline, RowSink, RowSource};
+use crate::runner::Runner;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum SampleType {
+    U8,
+    U16,
+    F16,
+    F32,
+}
+
+impl SampleType {
+    pub fn bytes(&self) -> usize {
+        match self {
+            SampleType::U8 => 1,
+            SampleType::U16 | SampleType::F16 => 2,
+            SampleType::F32 => 4,
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Layout {
+    /// The samples of each pixel are next to each other.
+    Interleaved,
+    /// Each channel is stored in its own plane, after the previous one.
+    Planar,
+}
+
+/// How samples are written to an `OutputBuffer`. Multi-byte samples are in native byte order,
+/// and integer samples map 0.0 to 1.0 to their full range.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct PixelFormat {
+    pub sample_type: SampleType,
+    pub layout: Layout,
+    /// The channels of the pipeline to write, in order, such as `[2, 1, 0, 3]` for BGRA.
+    pub channels: Vec<usize>,
+    /// Whether to add ordered dithering before rounding to integers.
+    pub dither: bool,
+}
+
+impl PixelFormat {
+    pub fn new(sample_type: SampleType, layout: Layout, num_channels: usize) -> PixelFormat {
+        PixelFormat {
+            sample_type,
+            layout,
+            channels: (0..num_channels).collect(),
+            dither: false,
+        }
+    }
+
+    /// Interleaved samples of the smallest type that holds samples of `bit_depth`.
+    pub fn for_bit_depth(bit_depth: &BitDepth, num_channels: usize) -> PixelFormat {
+        let bits = bit_depth.bits_per_sample();
+        let sample_type = match (bit_depth.floating_point_sample(), bits) {
+            (false, 0..=8) => SampleType::U8,
+            (false, 9..=16) => SampleType::U16,
+            (true, 0..=16) => SampleType::F16,
+            _ => SampleType::F32,
+        };
+        PixelFormat::new(sample_type, Layout::Interleaved, num_channels)
+    }
+
+    /// Bytes of a row of `width` pixels, in one plane.
+    pub fn row_bytes(&self, width: usize) -> usize {
+        match self.layout {
+            Layout::Interleaved => width * self.channels.len() * self.sample_type.bytes(),
+            Layout::Planar => width * self.sample_type.bytes(),
+        }
+    }
+
+    fn num_planes(&self) -> usize {
+        match self.layout {
+            Layout::Interleaved => 1,
+            Layout::Planar => self.channels.len(),
+        }
+    }
+}
+
+/// A caller-provided buffer into which the pipeline writes its output directly, converting it
+/// to the pixel format as its last stage, so that no intermediate image is needed.
+pub struct OutputBuffer<'a> {
+    data: &'a mut [u8],
+    width: usize,
+    height: usize,
+    format: PixelFormat,
+    /// Bytes from a row to the next one.
+    row_stride: usize,
+    /// Bytes from a plane to the next one, for the planar layout.
+    plane_stride: usize,
+}
+
+impl<'a> OutputBuffer<'a> {
+    /// `row_stride` is the number of bytes from one row to the next; with the planar layout,
+    /// planes follow each other every `row_stride * height` bytes.
+    pub fn new(
+        data: &'a mut [u8],
+        width: usize,
+        height: usize,
+        format: PixelFormat,
+        row_stride: usize,
+    ) -> Result<OutputBuffer<'a>, Error> {
+        let row_bytes = format.row_bytes(width);
+        if row_stride < row_bytes {
+            return Err(Error::InvalidOutputStride(row_stride, row_bytes));
+        }
+        let plane_stride = row_stride * height;
+        let needed = if width == 0 || height == 0 {
+            0
+        } else {
+            (format.num_planes() - 1) * plane_stride + (height - 1) * row_stride + row_bytes
+        };
+        if data.len() < needed {
+            return Err(Error::OutputBufferTooSmall(needed, data.len()));
+        }
+        Ok(OutputBuffer {
+            data,
+            width,
+            height,
+            format,
+            row_stride,
+            plane_stride,
+        })
+    }
+
+    /// Renders the output of `pipeline` into the buffer, with one sink for each strip.
+    pub fn render(
+        &mut self,
+        pipeline: &RenderPipeline,
+        source: &dyn RowSource,
+        runner: &dyn Runner,
+    ) -> Result<(), Error> {
+        let sinks = self.strip_sinks(pipeline)?;
+        pipeline.render(source, runner, sinks)
+    }
+
+    /// Splits the buffer into sinks for the strips of `pipeline`, which can be written in
+    /// parallel.
+    pub fn strip_sinks(&mut self, pipeline: &RenderPipeline) -> Result<Vec<BufferSink<'_>>, Error> {
+        let size = (pipeline.width(), pipeline.height());
+        if size != (self.width, self.height) {
+            return Err(Error::OutputSizeMismatch((self.width, self.height), size));
+        }
+        if let Some(c) = self
+            .format
+            .channels
+            .iter()
+            .find(|c| **c >= pipeline.num_channels())
+        {
+            return Err(Error::InvalidOutputChannel(*c));
+        }
+        let OutputBuffer {
+            data,
+            format,
+            row_stride,
+            plane_stride,
+            ..
+        } = self;
+        let (format, row_stride, plane_stride) = (&*format, *row_stride, *plane_stride);
+        let num_strips = pipeline.num_strips();
+        let mut sinks: Vec<BufferSink> = (0..num_strips)
+            .map(|strip| BufferSink {
+                planes: vec![],
+                y0: pipeline.strip_rect(strip).y0,
+                row_stride,
+                format,
+            })
+            .collect();
+        let mut rest = &mut data[..];
+        for _ in 0..format.num_planes() {
+            let plane_len = plane_stride.min(rest.len());
+            let (mut plane_data, next) = std::mem::take(&mut rest).split_at_mut(plane_len);
+            rest = next;
+            for (strip, sink) in sinks.iter_mut().enumerate() {
+                let len = if strip + 1 == num_strips {
+                    plane_data.len()
+                } else {
+                    pipeline.strip_rect(strip).height * row_stride
+                };
+                let (strip_data, next) = std::mem::take(&mut plane_data).split_at_mut(len);
+                plane_data = next;
+                sink.planes.push(strip_data);
+            }
+        }
+        Ok(sinks)
+    }
+}
+
+/// Writes the rows of a strip into an `OutputBuffer`.
+pub struct BufferSink<'a> {
+    /// The data of the strip, in each plane.
+    planes: Vec<&'a mut [u8]>,
+    y0: usize,
+    row_stride: usize,
+    format: &'a PixelFormat,
+}
+
+/// 8x8 ordered dithering matrix, with values in 0..64.
+const BAYER: [[u8; 8]; 8] = [
+    [0, 32, 8, 40, 2, 34, 10, 42],
+    [48, 16, 56, 24, 50, 18, 58, 26],
+    [12, 44, 4, 36, 14, 46, 6, 38],
+    [60, 28, 52, 20, 62, 30, 54, 22],
+    [3, 35, 11, 43, 1, 33, 9, 41],
+    [51, 19, 59, 27, 49, 17, 57, 25],
+    [15, 47, 7, 39, 13, 45, 5, 37],
+    [63, 31, 55, 23, 61, 29, 53, 21],
+];
+
+/// Converts `row`, which starts at `(x0, y)`, to integers in `0..=max`, with `step` bytes from a
+/// sample to the next.
+#[inline(always)]
+fn write_integers<const N: usize>(
+    row: &[f32],
+    out: &mut [u8],
+    step: usize,
+    max: f32,
+    dither: Option<(usize, usize)>,
+    to_bytes: impl Fn(u32) -> [u8; N],
+) {
+    let samples = out.chunks_mut(step).zip(row.iter());
+    match dither {
+        Some((x0, y)) => {
+            let bayer = &BAYER[y % 8];
+            for (x, (out, v)) in samples.enumerate() {
+                let offset = (bayer[(x0 + x) % 8] as f32 + 0.5) / 64.0 - 0.5;
+                let v = (v * max + offset).round().clamp(0.0, max);
+                out[..N].copy_from_slice(&to_bytes(v as u32));
+            }
+        }
+        None => {
+            for (out, v) in samples {
+                let v = (v * max).round().clamp(0.0, max);
+                out[..N].copy_from_slice(&to_bytes(v as u32));
+            }
+        }
+    }
+}
+
+fn write_samples(
+    format: &PixelFormat,
+    row: &[f32],
+    out: &mut [u8],
+    step: usize,
+    x0: usize,
+    y: usize,
+) {
+    let dither = if format.dither { Some((x0, y)) } else { None };
+    match format.sample_type {
+        SampleType::U8 => write_integers(row, out, step, 255.0, dither, |v| [v as u8]),
+        SampleType::U16 => write_integers(row, out, step, 65535.0, dither, |v| {
+            (v as u16).to_ne_bytes()
+        }),
+        SampleType::F16 => {
+            for (out, v) in out.chunks_mut(step).zip(row.iter()) {
+                out[..2].copy_from_slice(&f16::from_f32(*v).to_bits().to_ne_bytes());
+            }
+        }
+        SampleType::F32 => {
+            for (out, v) in out.chunks_mut(step).zip(row.iter()) {
+                out[..4].copy_from_slice(&v.to_ne_bytes());
+            }
+        }
+    }
+}
+
+impl<'a> RowSink for BufferSink<'a> {
+    fn write_row(&mut self, x0: usize, y: usize, rows: &mut [&mut [f32]]) -> Result<(), Error> {
+        let format = self.format;
+        let bytes = format.sample_type.bytes();
+        let start = (y - self.y0) * self.row_stride;
+        let width = rows[0].len();
+        match format.layout {
+            Layout::Interleaved => {
+                let step = bytes * format.channels.len();
+                let out = &mut self.planes[0][start + x0 * step..start + (x0 + width) * step];
+                for (i, c) in format.channels.iter().enumerate() {
+                    write_samples(format, rows[*c], &mut out[i * bytes..], step, x0, y);
+                }
+            }
+            Layout::Planar => {
+                for (plane, c) in self.planes.iter_mut().zip(format.channels.iter()) {
+                    let out = &mut plane[start + x0 * bytes..start + (x0 + width) * bytes];
+                    write_samples(format, rows[*c], out, bytes, x0, y);
+                }
+            }
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::render::pipeline::{InPlaceStage, Stage};
+    use crate::runner::SingleThreadRunner;
+
+    /// Channel `c` of pixel `(x, y)` is `(x + 2 * y + c) / 64`.
+    struct Ramp;
+
+    impl RowSource for Ramp {
+        fn fill_row(&self, c: usize, x0: usize, y: usize, row: &mut [f32]) {
+            for (x, v) in row.iter_mut().enumerate() {
+                *v = (x0 + x + 2 * y + c) as f32 / 64.0;
+            }
+        }
+    }
+
+    struct Nothing;
+
+    impl InPlaceStage for Nothing {
+        fn name(&self) -> &'static str {
+            "nothing"
+        }
+
+        fn process_row(&self, _: usize, _: usize, _: &mut [&mut [f32]]) {}
+    }
+
+    fn pipeline(width: usize, height: usize) -> RenderPipeline {
+        let stages = vec![Stage::InPlace(Box::new(Nothing))];
+        RenderPipeline::new(width, height, vec![0; 3], stages).with_strip_size(3, 2)
+    }
+
+    fn expected(x: usize, y: usize, c: usize) -> f32 {
+        (x + 2 * y + c) as f32 / 64.0
+    }
+
+    #[test]
+    fn test_interleaved() {
+        let (width, height) = (7, 5);
+        let pipeline = pipeline(width, height);
+        let mut format = PixelFormat::new(SampleType::U8, Layout::Interleaved, 3);
+        format.channels = vec![2, 1, 0];
+        // The last row is not padded.
+        let stride = 3 * width + 5;
+        let mut data = vec![0u8; stride * (height - 1) + 3 * width];
+        OutputBuffer::new(&mut data, width, height, format, stride)
+            .unwrap()
+            .render(&pipeline, &Ramp, &SingleThreadRunner)
+            .unwrap();
+        for y in 0..height {
+            for x in 0..width {
+                for (i, c) in [2, 1, 0].iter().enumerate() {
+                    let v = (expected(x, y, *c).min(1.0) * 255.0).round() as u8;
+                    assert_eq!(data[y * stride + 3 * x + i], v);
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn test_planar() {
+        let (width, height) = (6, 4);
+        let pipeline = pipeline(width, height);
+        let format = PixelFormat::new(SampleType::F32, Layout::Planar, 3);
+        let stride = 4 * width;
+        let mut data = vec![0u8; 3 * stride * height];
+        let mut buffer = OutputBuffer::new(&mut data, width, height, format, stride).unwrap();
+        buffer
+            .render(&pipeline, &Ramp, &SingleThreadRunner)
+            .unwrap();
+        for (i, v) in data.chunks(4).enumerate() {
+            let (c, y, x) = (i / (width * height), i / width % height, i % width);
+            assert_eq!(
+                f32::from_ne_bytes([v[0], v[1], v[2], v[3]]),
+                expected(x, y, c)
+            );
+        }
+
+        let format = PixelFormat::new(SampleType::F16, Layout::Planar, 1);
+        let mut data = vec![0u8; 2 * width * height];
+        let mut buffer = OutputBuffer::new(&mut data, width, height, format, 2 * width).unwrap();
+        buffer
+            .render(&pipeline, &Ramp, &SingleThreadRunner)
+            .unwrap();
+        // Multiples of 1/64 below 1 are exact in half precision.
+        for (i, v) in data.chunks(2).enumerate() {
+            let v = f16::from_bits(u16::from_ne_bytes([v[0], v[1]]));
+            assert_eq!(v.to_f32(), expected(i % width, i / width, 0));
+        }
+    }
+
+    #[test]
+    fn test_dither() {
+        // A constant halfway between two levels is dithered to both, with the right mean.
+        let mut format = PixelFormat::new(SampleType::U16, Layout::Interleaved, 1);
+        format.dither = true;
+        let row = vec![100.5 / 65535.0; 64];
+        let mut sum = 0;
+        for y in 0..8 {
+            let mut out = vec![0u8; 2 * 64];
+            write_samples(&format, &row, &mut out, 2, 0, y);
+            for v in out.chunks(2) {
+                let v = u16::from_ne_bytes([v[0], v[1]]);
+                assert!(v == 100 || v == 101);
+                sum += v as u32;
+            }
+        }
+        assert_eq!(sum, 8 * 64 * 100 + 8 * 64 / 2);
+    }
+
+    #[test]
+    fn test_errors() {
+        let pipeline = pipeline(4, 4);
+        let format = PixelFormat::new(SampleType::U16, Layout::Interleaved, 3);
+        let mut data = vec![0u8; 100];
+        assert!(matches!(
+            OutputBuffer::new(&mut data, 4, 4, format.clone(), 20),
+            Err(Error::InvalidOutputStride(20, 24))
+        ));
+        assert!(matches!(
+            OutputBuffer::new(&mut data, 4, 4, format.clone(), 26),
+            Err(Error::OutputBufferTooSmall(102, 100))
+        ));
+        let mut format = format;
+        format.channels = vec![0, 3];
+        let mut buffer = OutputBuffer::new(&mut data, 4, 4, format, 24).unwrap();
+        assert!(matches!(
+            buffer.strip_sinks(&pipeline),
+            Err(Error::InvalidOutputChannel(3))
+        ));
+        let format = PixelFormat::new(SampleType::U8, Layout::Planar, 1);
+        let mut buffer = OutputBuffer::new(&mut data, 3, 4, format, 3).unwrap();
+        assert!(matches!(
+            buffer.strip_sinks(&pipeline),
+            Err(Error::OutputSizeMismatch((3, 4), (4, 4)))
+        ));
+    }
+}
@@ -0,0 +1,752 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use std::sync::Mutex;
+
+use crate::error::Error;
+use crate::headers::frame_header::Rect;
+use crate::runner::Runner;
+use crate::stats::{record_allocation, StageTimes, StatsCollector, Timer};
+
+/// Largest border of an `InOutStage`.
+pub const MAX_BORDER: usize = 3;
+/// Largest shift of an `InOutStage`.
+pub const MAX_SHIFT: u32 = 3;
+/// Number of channels up to which the list of rows given to the in-place stages and the sink is
+/// kept on the stack; with more channels, it is allocated for each row.
+const MAX_STACK_ROWS: usize = 32;
+
+/// A stage that computes each output pixel from a neighborhood of input pixels of the same
+/// channel, possibly upsampling the channel.
+pub trait InOutStage: Send + Sync {
+    fn name(&self) -> &'static str;
+    fn uses_channel(&self, channel: usize) -> bool;
+    /// Number of input pixels needed on each side of a pixel, at most `MAX_BORDER`.
+    fn border(&self) -> usize;
+    /// log2 of the upsampling factor, at most `MAX_SHIFT`.
+    fn shift(&self) -> u32 {
+        0
+    }
+    /// Processes a row of input pixels: `input` holds the `2 * border + 1` rows centered on
+    /// it, each with `border` extra pixels on both sides, and `output` the `1 << shift` rows
+    /// that it produces, with `1 << shift` pixels for each input pixel.
+    fn process_row(&self, channel: usize, input: &[&[f32]], output: &mut [&mut [f32]]);
+}
+
+/// A stage that transforms pixels in place, on rows of all the channels at the output
+/// resolution.
+pub trait InPlaceStage: Send + Sync {
+    fn name(&self) -> &'static str;
+    /// Processes the pixels of row `y` from column `x0`, with one row for each channel.
+    fn process_row(&self, x0: usize, y: usize, rows: &mut [&mut [f32]]);
+}
+
+pub enum Stage {
+    InOut(Box<dyn InOutStage>),
+    InPlace(Box<dyn InPlaceStage>),
+}
+
+/// The input of the pipeline, such as the decoded channels of a frame.
+pub trait RowSource: Sync {
+    /// Fills `row` with the pixels of `channel` from `(x0, y)`, in the coordinates of the
+    /// channel before upsampling.
+    fn fill_row(&self, channel: usize, x0: usize, y: usize, row: &mut [f32]);
+}
+
+/// Receives the output of the pipeline.
+pub trait RowSink {
+    /// Receives the pixels of row `y` from column `x0`, with one row for each channel. Within a
+    /// strip, rows are given from top to bottom for each range of columns.
+    fn write_row(&mut self, x0: usize, y: usize, rows: &mut [&mut [f32]]) -> Result<(), Error>;
+}
+
+/// Reconstructs an image from its input channels by running the stages on rows of small tiles,
+/// so that only a few rows of each stage are stored at any time, instead of full images.
+///
+/// The image is split in strips of rows, which are independent and can be rendered in
+/// parallel. Each strip is rendered in tiles of at most `tile_width` columns, and each stage
+/// keeps the rows that it still needs in a ring buffer, so that the memory used depends on the
+/// tile width and on the borders of the stages, not on the image size. Pixels outside of the
+/// image are mirrored.
+pub struct RenderPipeline {
+    width: usize,
+    height: usize,
+    /// log2 of the upsampling of each channel in the input.
+    channel_shifts: Vec<u32>,
+    in_out: Vec<Box<dyn InOutStage>>,
+    in_place: Vec<Box<dyn InPlaceStage>>,
+    /// Stages of `in_out` that process each channel, in order.
+    chains: Vec<Vec<usize>>,
+    strip_height: usize,
+    tile_width: usize,
+}
+
+pub const DEFAULT_STRIP_HEIGHT: usize = 64;
+pub const DEFAULT_TILE_WIDTH: usize = 1024;
+
+impl RenderPipeline {
+    /// Creates a pipeline with output of the given size, whose channel `c` is upsampled
+    /// `1 << channel_shifts[c]` times in the input.
+    ///
+    /// Panics if the stages do not upsample each channel to the output size, or if an
+    /// `InOutStage` follows an `InPlaceStage`.
+    pub fn new(
+        width: usize,
+        height: usize,
+        channel_shifts: Vec<u32>,
+        stages: Vec<Stage>,
+    ) -> RenderPipeline {
+        let mut in_out: Vec<Box<dyn InOutStage>> = vec![];
+        let mut in_place = vec![];
+        let mut chains = vec![vec![]; channel_shifts.len()];
+        let mut shifts = channel_shifts.clone();
+        for stage in stages {
+            match stage {
+                Stage::InOut(stage) => {
+                    assert!(
+                        in_place.is_empty(),
+                        "{} after in-place stages",
+                        stage.name()
+                    );
+                    assert!(stage.border() <= MAX_BORDER && stage.shift() <= MAX_SHIFT);
+                    for (c, chain) in chains.iter_mut().enumerate() {
+                        if stage.uses_channel(c) {
+                            assert!(
+                                stage.shift() <= shifts[c],
+                                "{} upsamples too much",
+                                stage.name()
+                            );
+                            shifts[c] -= stage.shift();
+                            chain.push(in_out.len());
+                        }
+                    }
+                    in_out.push(stage);
+                }
+                Stage::InPlace(stage) => in_place.push(stage),
+            }
+        }
+        assert!(
+            shifts.iter().all(|s| *s == 0),
+            "channels are not fully upsampled"
+        );
+        RenderPipeline {
+            width,
+            height,
+            channel_shifts,
+            in_out,
+            in_place,
+            chains,
+            strip_height: DEFAULT_STRIP_HEIGHT,
+            tile_width: DEFAULT_TILE_WIDTH,
+        }
+    }
+
+    /// Sets the size of the strips and of the tiles in which they are rendered.
+    pub fn with_strip_size(mut self, tile_width: usize, strip_height: usize) -> RenderPipeline {
+        assert!(tile_width > 0 && strip_height > 0);
+        self.tile_width = tile_width;
+        self.strip_height = strip_height;
+        self
+    }
+
+    pub fn width(&self) -> usize {
+        self.width
+    }
+
+    pub fn height(&self) -> usize {
+        self.height
+    }
+
+    pub fn num_channels(&self) -> usize {
+        self.channel_shifts.len()
+    }
+
+    pub fn num_strips(&self) -> usize {
+        self.height.div_ceil(self.strip_height)
+    }
+
+    /// The rows of the output in the given strip.
+    pub fn strip_rect(&self, strip: usize) -> Rect {
+        let y0 = strip * self.strip_height;
+        Rect {
+            x0: 0,
+            y0,
+            width: self.width,
+            height: self.strip_height.min(self.height - y0),
+        }
+    }
+
+    /// Size of channel `c` in the input.
+    pub fn input_size(&self, channel: usize) -> (usize, usize) {
+        let shift = self.channel_shifts[channel];
+        (
+            shift_size(self.width, shift),
+            shift_size(self.height, shift),
+        )
+    }
+
+    /// Renders all the strips with `runner`, and gives the rows of strip `i` to `sinks[i]`.
+    /// Each concurrently running strip uses its own buffers, which are reused by the next
+    /// strips.
+    pub fn render<S: RowSink + Send>(
+        &self,
+        source: &dyn RowSource,
+        runner: &dyn Runner,
+        sinks: Vec<S>,
+    ) -> Result<(), Error> {
+        self.render_with_buffers(source, runner, sinks, &mut vec![])
+    }
+
+    /// Same as `render`, but takes the buffers of the strips from `buffers`, and puts them back
+    /// afterwards so that they can be reused by the next pipelines.
+    pub fn render_with_buffers<S: RowSink + Send>(
+        &self,
+        source: &dyn RowSource,
+        runner: &dyn Runner,
+        sinks: Vec<S>,
+        buffers: &mut Vec<StripBuffers>,
+    ) -> Result<(), Error> {
+        assert_eq!(sinks.len(), self.num_strips());
+        // Each strip locks its own sink, so these locks are never contended.
+        let sinks: Vec<Mutex<S>> = sinks.into_iter().map(Mutex::new).collect();
+        let pool = Mutex::new(std::mem::take(buffers));
+        // Tasks may run on other threads, which record their stats with the caller's.
+        let stats = StatsCollector::current();
+        let result = runner.run(sinks.len(), &|strip| {
+            stats.collect(|| {
+                let mut strip_buffers = pool.lock().unwrap().pop().unwrap_or_default();
+                let allocated = strip_buffers.allocated_bytes();
+                let mut sink = sinks[strip].lock().unwrap();
+                let result = self.render_strip(strip, source, &mut strip_buffers, &mut *sink);
+                record_allocation(strip_buffers.allocated_bytes().saturating_sub(allocated));
+                pool.lock().unwrap().push(strip_buffers);
+                result
+            })
+        });
+        *buffers = pool.into_inner().unwrap();
+        result
+    }
+
+    /// Renders one strip on the calling thread.
+    pub fn render_strip(
+        &self,
+        strip: usize,
+        source: &dyn RowSource,
+        buffers: &mut StripBuffers,
+        sink: &mut dyn RowSink,
+    ) -> Result<(), Error> {
+        let rect = self.strip_rect(strip);
+        buffers
+            .channels
+            .resize_with(self.num_channels(), Default::default);
+        // Stages of `in_out`, then of `in_place`.
+        let mut times = StageTimes::new(self.in_out.len() + self.in_place.len());
+        let mut x0 = 0;
+        while x0 < self.width {
+            let x1 = (x0 + self.tile_width).min(self.width);
+            for c in 0..self.num_channels() {
+                self.setup_levels(c, x0, x1, &mut buffers.channels[c]);
+            }
+            for y in rect.y0..rect.y0 + rect.height {
+                for (c, levels) in buffers.channels.iter_mut().enumerate() {
+                    self.ensure_row(source, c, levels, self.chains[c].len(), y, &mut times);
+                }
+                let mut stack_rows: [&mut [f32]; MAX_STACK_ROWS] = Default::default();
+                let mut heap_rows = vec![];
+                let rows = if self.num_channels() <= MAX_STACK_ROWS {
+                    &mut stack_rows[..self.num_channels()]
+                } else {
+                    heap_rows.resize_with(self.num_channels(), Default::default);
+                    &mut heap_rows[..]
+                };
+                for (row, levels) in rows.iter_mut().zip(buffers.channels.iter_mut()) {
+                    let level = levels.last_mut().unwrap();
+                    let (offset, len) = level.read;
+                    *row = &mut level.row_mut(y)[offset..offset + len];
+                }
+                for (i, stage) in self.in_place.iter().enumerate() {
+                    let timer = Timer::start();
+                    stage.process_row(x0, y, rows);
+                    times.add(self.in_out.len() + i, timer);
+                }
+                sink.write_row(x0, y, rows)?;
+            }
+            x0 = x1;
+        }
+        let in_out_names = self.in_out.iter().map(|stage| stage.name());
+        times.finish(in_out_names.chain(self.in_place.iter().map(|stage| stage.name())));
+        Ok(())
+    }
+
+    /// Computes the columns of each level of channel `c` that are needed for the output
+    /// columns `x0..x1`, from the last level to the input.
+    fn setup_levels(&self, c: usize, x0: usize, x1: usize, levels: &mut Vec<Level>) {
+        let chain = &self.chains[c];
+        levels.resize_with(chain.len() + 1, Default::default);
+        // Shifts of the channel at each level.
+        let mut shift = 0;
+        let mut read = (x0 as i64, x1 as i64);
+        let mut consumer_border = 0;
+        for i in (0..levels.len()).rev() {
+            let producer_shift = if i > 0 {
+                self.in_out[chain[i - 1]].shift()
+            } else {
+                0
+            };
+            let (width, height) = (
+                shift_size(self.width, shift),
+                shift_size(self.height, shift),
+            );
+            let computed = (read.0.max(0), read.1.min(width as i64));
+            // Pixels written by the producer of the level.
+            let (write, next_read) = if i > 0 {
+                let border = self.in_out[chain[i - 1]].border() as i64;
+                let k = 1i64 << producer_shift;
+                let input = (
+                    computed.0 >> producer_shift,
+                    (computed.1 + k - 1) >> producer_shift,
+                );
+                (
+                    (input.0 * k, input.1 * k),
+                    (input.0 - border, input.1 + border),
+                )
+            } else {
+                (computed, computed)
+            };
+            let start = read.0.min(write.0);
+            let stride = (read.1.max(write.1) - start) as usize;
+            let k = 1usize << producer_shift;
+            let capacity = (2 * consumer_border + k).next_multiple_of(k);
+            let level = &mut levels[i];
+            level.width = width;
+            level.height = height;
+            level.x0 = start;
+            level.stride = stride;
+            level.capacity = capacity;
+            level.shift = producer_shift;
+            level.read = ((read.0 - start) as usize, (read.1 - read.0) as usize);
+            level.write = ((write.0 - start) as usize, (write.1 - write.0) as usize);
+            level.end = None;
+            level.data.clear();
+            level.data.resize(capacity * stride, 0.0);
+            if i > 0 {
+                consumer_border = self.in_out[chain[i - 1]].border();
+            }
+            shift += producer_shift;
+            read = next_read;
+        }
+    }
+
+    /// Makes row `y` of level `i` of channel `c` available, computing it and the rows of the
+    /// previous levels that it depends on if needed.
+    fn ensure_row(
+        &self,
+        source: &dyn RowSource,
+        c: usize,
+        levels: &mut [Level],
+        i: usize,
+        y: usize,
+        times: &mut StageTimes,
+    ) {
+        let level = &mut levels[i];
+        let end = match level.end {
+            Some(end) if y < end => {
+                debug_assert!(y + level.capacity >= end);
+                return;
+            }
+            Some(end) => end,
+            // Groups of rows produced together start at a multiple of their size.
+            None => (y >> level.shift) << level.shift,
+        };
+        level.end = Some(end);
+        if i == 0 {
+            for row in end..=y {
+                let (offset, len) = level.write;
+                let x0 = (level.x0 + offset as i64) as usize;
+                source.fill_row(c, x0, row, &mut level.row_mut(row)[offset..offset + len]);
+                level.mirror_columns(row);
+                level.end = Some(row + 1);
+            }
+            return;
+        }
+        let stage_index = self.chains[c][i - 1];
+        let stage = &self.in_out[stage_index];
+        let border = stage.border();
+        let mut end = end;
+        while end <= y {
+            let input_y = end >> levels[i].shift;
+            let input_height = levels[i - 1].height;
+            let lo = input_y.saturating_sub(border);
+            let hi = (input_y + border).min(input_height - 1);
+            for row in lo..=hi {
+                self.ensure_row(source, c, levels, i - 1, row, times);
+            }
+            let (previous, current) = levels.split_at_mut(i);
+            let input = &previous[i - 1];
+            let output = &mut current[0];
+
+            let mut input_rows: [&[f32]; 2 * MAX_BORDER + 1] = Default::default();
+            let (offset, len) = input.read;
+            for (d, row) in input_rows[..2 * border + 1].iter_mut().enumerate() {
+                let y = mirror(input_y as i64 + d as i64 - border as i64, input_height);
+                *row = &input.row(y)[offset..offset + len];
+            }
+            let k = 1 << output.shift;
+            let (offset, len) = output.write;
+            let stride = output.stride;
+            // Groups are aligned, and the capacity is a multiple of their size, so the rows of
+            // a group are contiguous.
+            let first = end % output.capacity;
+            let group = &mut output.data[first * stride..(first + k) * stride];
+            let mut output_rows: [&mut [f32]; 1 << MAX_SHIFT] = Default::default();
+            for (out, row) in output_rows.iter_mut().zip(group.chunks_exact_mut(stride)) {
+                *out = &mut row[offset..offset + len];
+            }
+            let timer = Timer::start();
+            stage.process_row(c, &input_rows[..2 * border + 1], &mut output_rows[..k]);
+            times.add(stage_index, timer);
+            for row in end..(end + k).min(output.height) {
+                output.mirror_columns(row);
+            }
+            end += k;
+            output.end = Some(end);
+        }
+    }
+}
+
+/// `ceil(size / (1 << shift))`.
+fn shift_size(size: usize, shift: u32) -> usize {
+    (size + (1 << shift) - 1) >> shift
+}
+
+/// Maps a coordinate outside of `0..size` to the one mirrored inside it. `size` must not be
+/// zero.
+fn mirror(mut v: i64, size: usize) -> usize {
+    assert!(size > 0, "mirroring in an empty range");
+    let size = size as i64;
+    loop {
+        if v < 0 {
+            v = -v - 1;
+        } else if v >= size {
+            v = 2 * size - 1 - v;
+        } else {
+            return v as usize;
+        }
+    }
+}
+
+/// The stored rows of the output of a stage, or of the input, for one channel.
+#[derive(Debug, Default)]
+struct Level {
+    /// `capacity` rows of `stride` pixels, the first one being in column `x0`.
+    data: Vec<f32>,
+    x0: i64,
+    stride: usize,
+    capacity: usize,
+    width: usize,
+    height: usize,
+    /// log2 of the number of rows computed together.
+    shift: u32,
+    /// Offset and length of the pixels of each row read by the next stage.
+    read: (usize, usize),
+    /// Offset and length of the pixels written by the previous stage.
+    write: (usize, usize),
+    /// The rows from `end - capacity` to `end` are available, if it is set.
+    end: Option<usize>,
+}
+
+impl Level {
+    fn row(&self, y: usize) -> &[f32] {
+        let start = (y % self.capacity) * self.stride;
+        &self.data[start..start + self.stride]
+    }
+
+    fn row_mut(&mut self, y: usize) -> &mut [f32] {
+        let start = (y % self.capacity) * self.stride;
+        &mut self.data[start..start + self.stride]
+    }
+
+    /// Fills the columns of row `y` that are outside of the image.
+    fn mirror_columns(&mut self, y: usize) {
+        let (x0, width) = (self.x0, self.width);
+        let before = (-x0).max(0) as usize;
+        let after = (width as i64 - x0).max(0) as usize;
+        let row = self.row_mut(y);
+        for x in (0..before.min(row.len())).chain(after..row.len()) {
+            row[x] = row[(mirror(x0 + x as i64, width) as i64 - x0) as usize];
+        }
+    }
+}
+
+/// The buffers used to render a strip, which can be reused for other strips, and other
+/// pipelines.
+#[derive(Debug, Default)]
+pub struct StripBuffers {
+    /// The levels of each channel.
+    channels: Vec<Vec<Level>>,
+}
+
+impl StripBuffers {
+    /// Number of bytes allocated for the rows.
+    pub fn allocated_bytes(&self) -> usize {
+        self.channels
+            .iter()
+            .flatten()
+            .map(|level| level.data.capacity() * std::mem::size_of::<f32>())
+            .sum()
+    }
+}
+
+#[cfg(test)]
+pub(crate) mod test {
+    use super::*;
+    use crate::runner::SingleThreadRunner;
+
+    pub(crate) struct Planes {
+        pub(crate) planes: Vec<(usize, Vec<f32>)>,
+    }
+
+    impl RowSource for Planes {
+        fn fill_row(&self, channel: usize, x0: usize, y: usize, row: &mut [f32]) {
+            let (width, data) = &self.planes[channel];
+            row.copy_from_slice(&data[y * width + x0..y * width + x0 + row.len()]);
+        }
+    }
+
+    pub(crate) struct Collect {
+        pub(crate) width: usize,
+        pub(crate) planes: Vec<Vec<f32>>,
+    }
+
+    impl RowSink for Collect {
+        fn write_row(&mut self, x0: usize, y: usize, rows: &mut [&mut [f32]]) -> Result<(), Error> {
+            for (plane, row) in self.planes.iter_mut().zip(rows.iter()) {
+                plane[y * self.width + x0..][..row.len()].copy_from_slice(row);
+            }
+            Ok(())
+        }
+    }
+
+    /// Box filter of radius 1, upsampling 2x when `shift` is 1.
+    struct BoxFilter {
+        shift: u32,
+    }
+
+    impl InOutStage for BoxFilter {
+        fn name(&self) -> &'static str {
+            "box"
+        }
+
+        fn uses_channel(&self, channel: usize) -> bool {
+            channel == 0
+        }
+
+        fn border(&self) -> usize {
+            1
+        }
+
+        fn shift(&self) -> u32 {
+            self.shift
+        }
+
+        fn process_row(&self, _: usize, input: &[&[f32]], output: &mut [&mut [f32]]) {
+            let k = 1 << self.shift;
+            for x in 0..input[0].len() - 2 {
+                let sum: f32 = input
+                    .iter()
+                    .map(|row| row[x] + row[x + 1] + row[x + 2])
+                    .sum();
+                for row in output.iter_mut() {
+                    for v in row[x * k..(x + 1) * k].iter_mut() {
+                        *v = sum / 9.0;
+                    }
+                }
+            }
+        }
+    }
+
+    struct AddChannels;
+
+    impl InPlaceStage for AddChannels {
+        fn name(&self) -> &'static str {
+            "add"
+        }
+
+        fn process_row(&self, _: usize, _: usize, rows: &mut [&mut [f32]]) {
+            let (first, rest) = rows.split_at_mut(1);
+            for (a, b) in first[0].iter_mut().zip(rest[0].iter()) {
+                *a += *b;
+            }
+        }
+    }
+
+    fn reference_box(width: usize, height: usize, data: &[f32]) -> Vec<f32> {
+        let mut out = vec![0.0; width * height];
+        for y in 0..height {
+            for x in 0..width {
+                let mut sum = 0.0;
+                for dy in -1..=1 {
+                    for dx in -1..=1 {
+                        let sy = mirror(y as i64 + dy, height);
+                        let sx = mirror(x as i64 + dx, width);
+                        sum += data[sy * width + sx];
+                    }
+                }
+                out[y * width + x] = sum / 9.0;
+            }
+        }
+        out
+    }
+
+    fn render(pipeline: &RenderPipeline, source: &Planes, width: usize) -> Vec<Vec<f32>> {
+        let size = width * pipeline.height;
+        let mut sink = Collect {
+            width,
+            planes: vec![vec![0.0; size]; pipeline.num_channels()],
+        };
+        let mut buffers = StripBuffers::default();
+        for strip in 0..pipeline.num_strips() {
+            pipeline
+                .render_strip(strip, source, &mut buffers, &mut sink)
+                .unwrap();
+        }
+        sink.planes
+    }
+
+    fn pattern(width: usize, height: usize, seed: usize) -> Vec<f32> {
+        (0..width * height)
+            .map(|i| ((i * 7919 + seed * 31) % 97) as f32 + 1.0)
+            .collect()
+    }
+
+    #[test]
+    fn test_mirror() {
+        let mirrored: Vec<usize> = (-3..6).map(|v| mirror(v, 3)).collect();
+        assert_eq!(mirrored, [2, 1, 0, 0, 1, 2, 2, 1, 0]);
+        assert_eq!(mirror(-2, 1), 0);
+    }
+
+    #[test]
+    #[should_panic]
+    fn test_mirror_empty() {
+        mirror(0, 0);
+    }
+
+    #[test]
+    fn test_strips_and_tiles() {
+        let (width, height) = (37, 29);
+        let source = Planes {
+            planes: vec![
+                (width, pattern(width, height, 0)),
+                (width, pattern(width, height, 1)),
+            ],
+        };
+        let expected = reference_box(width, height, &source.planes[0].1);
+        let stages = || {
+            vec![
+                Stage::InOut(Box::new(BoxFilter { shift: 0 })),
+                Stage::InOut(Box::new(BoxFilter { shift: 0 })),
+                Stage::InPlace(Box::new(AddChannels)),
+            ]
+        };
+        let twice = reference_box(width, height, &expected);
+        for (tile_width, strip_height) in [(width, height), (8, 5), (1, 1), (3, 64)].iter() {
+            let pipeline = RenderPipeline::new(width, height, vec![0, 0], stages())
+                .with_strip_size(*tile_width, *strip_height);
+            let out = render(&pipeline, &source, width);
+            for (i, v) in out[0].iter().enumerate() {
+                let e = twice[i] + source.planes[1].1[i];
+                assert!((v - e).abs() < 1e-3, "{} {} {}", i, v, e);
+            }
+            assert_eq!(out[1], source.planes[1].1);
+        }
+    }
+
+    #[test]
+    fn test_upsampling() {
+        let (width, height) = (23, 18);
+        let (in_width, in_height) = (12, 9);
+        let input = pattern(in_width, in_height, 3);
+        let source = Planes {
+            planes: vec![(in_width, input.clone())],
+        };
+        let filtered = reference_box(in_width, in_height, &input);
+        let expected: Vec<f32> = (0..width * height)
+            .map(|i| filtered[(i / width / 2) * in_width + (i % width) / 2])
+            .collect();
+        for (tile_width, strip_height) in [(width, height), (5, 3), (2, 7)].iter() {
+            let stages = vec![Stage::InOut(Box::new(BoxFilter { shift: 1 }))];
+            let pipeline = RenderPipeline::new(width, height, vec![1], stages)
+                .with_strip_size(*tile_width, *strip_height);
+            assert_eq!(pipeline.input_size(0), (in_width, in_height));
+            let out = render(&pipeline, &source, width);
+            for (i, v) in out[0].iter().enumerate() {
+                assert!(
+                    (v - expected[i]).abs() < 1e-3,
+                    "{} {} {}",
+                    i,
+                    v,
+                    expected[i]
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn test_many_channels() {
+        let (width, height) = (7, 5);
+        for num_channels in [MAX_STACK_ROWS, MAX_STACK_ROWS + 1].iter().copied() {
+            let source = Planes {
+                planes: (0..num_channels)
+                    .map(|c| (width, pattern(width, height, c)))
+                    .collect(),
+            };
+            let stages = vec![Stage::InPlace(Box::new(AddChannels))];
+            let pipeline = RenderPipeline::new(width, height, vec![0; num_channels], stages);
+            let out = render(&pipeline, &source, width);
+            for (i, v) in out[0].iter().enumerate() {
+                assert_eq!(*v, source.planes[0].1[i] + source.planes[1].1[i]);
+            }
+            for (plane, (_, expected)) in out.iter().zip(source.planes.iter()).skip(1) {
+                assert_eq!(plane, expected);
+            }
+        }
+    }
+
+    #[test]
+    fn test_bounded_buffers() {
+        let (width, height) = (4000, 300);
+        let source = Planes {
+            planes: vec![(width, vec![1.0; width * height])],
+        };
+        let stages = vec![Stage::InOut(Box::new(BoxFilter { shift: 0 }))];
+        let pipeline = RenderPipeline::new(width, height, vec![0], stages);
+        let mut buffers = StripBuffers::default();
+        struct Check;
+        impl RowSink for Check {
+            fn write_row(
+                &mut self,
+                _: usize,
+                _: usize,
+                rows: &mut [&mut [f32]],
+            ) -> Result<(), Error> {
+                assert!(rows[0].iter().all(|v| (v - 1.0).abs() < 1e-6));
+                Ok(())
+            }
+        }
+        for strip in 0..pipeline.num_strips() {
+            pipeline
+                .render_strip(strip, &source, &mut buffers, &mut Check)
+                .unwrap();
+        }
+        // 3 input rows and 1 output row of at most a tile and its border.
+        let limit = 4 * (DEFAULT_TILE_WIDTH + 2) * std::mem::size_of::<f32>();
+        assert!(buffers.allocated_bytes() <= limit);
+        let sinks = (0..pipeline.num_strips()).map(|_| Check).collect();
+        pipeline
+            .render(&source, &SingleThreadRunner, sinks)
+            .unwrap();
+    }
+}
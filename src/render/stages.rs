@@ -0,0 +1,323 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use std::sync::Arc;
+
+use crate::color::xyb::XybToRgb;
+use crate::config::DecoderConfig;
+use crate::headers::frame_header::FrameHeader;
+use crate::headers::transform_data::CustomTransformData;
+use crate::render::pipeline::{InOutStage, InPlaceStage, Stage};
+
+/// The 5x5 kernels of each output pixel of a block, for upsampling 2, 4 or 8 times. They are
+/// shared, so they only need to be computed once for the default weights.
+#[derive(Debug, Clone, PartialEq)]
+pub struct UpsampleKernels {
+    factor: u32,
+    kernels: Arc<[[[f32; 5]; 5]]>,
+}
+
+impl UpsampleKernels {
+    /// Computes the kernels from the weights given by `CustomTransformData::upsampling_weights`.
+    pub fn new(factor: u32, weights: &[f32]) -> UpsampleKernels {
+        let k = factor as usize;
+        // The weights are the upper triangle of a symmetric (5 * half) x (5 * half) matrix that
+        // gives the kernels of the top left quadrant of the block; the others are mirrored.
+        let half = k / 2;
+        let n = 5 * half;
+        assert_eq!(weights.len(), n * (n + 1) / 2);
+        let weight = |i: usize, j: usize| {
+            let (y, x) = (i.min(j), i.max(j));
+            weights[n * y - y * (y.max(1) - 1) / 2 + x - y]
+        };
+        let mut kernels = vec![[[0.0; 5]; 5]; k * k];
+        for oy in 0..k {
+            for ox in 0..k {
+                let (qy, my) = if oy < half {
+                    (oy, false)
+                } else {
+                    (k - 1 - oy, true)
+                };
+                let (qx, mx) = if ox < half {
+                    (ox, false)
+                } else {
+                    (k - 1 - ox, true)
+                };
+                for iy in 0..5 {
+                    for ix in 0..5 {
+                        let ky = if my { 4 - iy } else { iy };
+                        let kx = if mx { 4 - ix } else { ix };
+                        kernels[oy * k + ox][iy][ix] = weight(5 * qy + ky, 5 * qx + kx);
+                    }
+                }
+            }
+        }
+        UpsampleKernels {
+            factor,
+            kernels: kernels.into(),
+        }
+    }
+
+    pub fn factor(&self) -> u32 {
+        self.factor
+    }
+}
+
+/// Upsamples channels 2, 4 or 8 times with the 5x5 kernels of the spec, then clamps each pixel
+/// to the range of the input pixels around it.
+pub struct Upsample {
+    channels: Vec<usize>,
+    shift: u32,
+    kernels: UpsampleKernels,
+}
+
+impl Upsample {
+    /// Creates the stage from the weights given by `CustomTransformData::upsampling_weights`.
+    pub fn new(factor: u32, weights: &[f32], channels: Vec<usize>) -> Upsample {
+        Upsample::with_kernels(UpsampleKernels::new(factor, weights), channels)
+    }
+
+    pub fn with_kernels(kernels: UpsampleKernels, channels: Vec<usize>) -> Upsample {
+        Upsample {
+            channels,
+            shift: kernels.factor.trailing_zeros(),
+            kernels,
+        }
+    }
+}
+
+impl InOutStage for Upsample {
+    fn name(&self) -> &'static str {
+        "upsample"
+    }
+
+    fn uses_channel(&self, channel: usize) -> bool {
+        self.channels.contains(&channel)
+    }
+
+    fn border(&self) -> usize {
+        2
+    }
+
+    fn shift(&self) -> u32 {
+        self.shift
+    }
+
+    fn process_row(&self, _: usize, input: &[&[f32]], output: &mut [&mut [f32]]) {
+        let k = 1 << self.shift;
+        let mut window = [[0.0f32; 5]; 5];
+        for x in 0..input[0].len() - 4 {
+            let (mut min, mut max) = (f32::INFINITY, f32::NEG_INFINITY);
+            for (w, row) in window.iter_mut().zip(input.iter()) {
+                w.copy_from_slice(&row[x..x + 5]);
+                for v in w.iter() {
+                    min = min.min(*v);
+                    max = max.max(*v);
+                }
+            }
+            for (oy, row) in output.iter_mut().enumerate() {
+                for ox in 0..k {
+                    let kernel = &self.kernels.kernels[oy * k + ox];
+                    let mut sum = 0.0;
+                    for (kr, wr) in kernel.iter().zip(window.iter()) {
+                        for (kv, wv) in kr.iter().zip(wr.iter()) {
+                            sum += kv * wv;
+                        }
+                    }
+                    row[x * k + ox] = sum.clamp(min, max);
+                }
+            }
+        }
+    }
+}
+
+/// The gaborish filter: a normalized 3x3 convolution with weights for the sides and the
+/// corners, for the color channels.
+pub struct Gaborish {
+    num_color: usize,
+    /// For each channel, the weights of the center, of the sides and of the corners.
+    weights: [[f32; 3]; 3],
+}
+
+impl Gaborish {
+    pub fn new(weights: [[f32; 2]; 3], num_color: usize) -> Gaborish {
+        let normalized = |[side, corner]: [f32; 2]| {
+            let norm = 1.0 / (1.0 + 4.0 * (side + corner));
+            [norm, side * norm, corner * norm]
+        };
+        Gaborish {
+            num_color: num_color.min(3),
+            weights: [
+                normalized(weights[0]),
+                normalized(weights[1]),
+                normalized(weights[2]),
+            ],
+        }
+    }
+}
+
+impl InOutStage for Gaborish {
+    fn name(&self) -> &'static str {
+        "gaborish"
+    }
+
+    fn uses_channel(&self, channel: usize) -> bool {
+        channel < self.num_color
+    }
+
+    fn border(&self) -> usize {
+        1
+    }
+
+    fn process_row(&self, channel: usize, input: &[&[f32]], output: &mut [&mut [f32]]) {
+        let [center, side, corner] = self.weights[channel];
+        let (top, mid, bottom) = (input[0], input[1], input[2]);
+        for (x, out) in output[0].iter_mut().enumerate() {
+            let sides = top[x + 1] + bottom[x + 1] + mid[x] + mid[x + 2];
+            let corners = top[x] + top[x + 2] + bottom[x] + bottom[x + 2];
+            *out = center * mid[x + 1] + side * sides + corner * corners;
+        }
+    }
+}
+
+/// Converts the first three channels from XYB to the output color encoding.
+pub struct XybStage(pub XybToRgb);
+
+impl InPlaceStage for XybStage {
+    fn name(&self) -> &'static str {
+        "xyb"
+    }
+
+    fn process_row(&self, _: usize, _: usize, rows: &mut [&mut [f32]]) {
+        let (x, rest) = rows.split_at_mut(1);
+        let (y, b) = rest.split_at_mut(1);
+        self.0.convert_rows(x[0], y[0], b[0]);
+    }
+}
+
+/// The stages that reconstruct a frame from its decoded channels, `num_color` color channels
+/// followed by the extra channels, in the order of the spec. Returns them with the upsampling
+/// of each channel, for `RenderPipeline::new`.
+///
+/// Only gaborish, upsampling and the XYB conversion are done: the edge preserving filter,
+/// patches, splines, noise and blending are not supported yet.
+pub fn frame_stages(
+    config: &DecoderConfig,
+    frame_header: &FrameHeader,
+    transform_data: &CustomTransformData,
+    num_color: usize,
+    xyb: Option<XybToRgb>,
+) -> (Vec<u32>, Vec<Stage>) {
+    let mut stages = vec![];
+    if let Some(weights) = frame_header.gaborish_weights() {
+        stages.push(Stage::InOut(Box::new(Gaborish::new(weights, num_color))));
+    }
+    // The color channels, then each extra channel.
+    let color = (frame_header.upsampling(), (0..num_color).collect());
+    let extra = frame_header
+        .ec_upsampling()
+        .iter()
+        .enumerate()
+        .map(|(i, factor)| (*factor, vec![num_color + i]));
+    let mut shifts = vec![];
+    for (factor, channels) in std::iter::once(color).chain(extra) {
+        shifts.extend(channels.iter().map(|_| factor.trailing_zeros()));
+        if factor > 1 {
+            let kernels = config.upsampling_kernels(factor, transform_data);
+            stages.push(Stage::InOut(Box::new(Upsample::with_kernels(
+                kernels, channels,
+            ))));
+        }
+    }
+    if let Some(xyb) = xyb {
+        assert_eq!(num_color, 3);
+        stages.push(Stage::InPlace(Box::new(XybStage(xyb))));
+    }
+    (shifts, stages)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::render::pipeline::test::{Collect, Planes};
+    use crate::render::pipeline::{RenderPipeline, StripBuffers};
+
+    fn run(factor: u32, source: &Planes, tile_width: usize, strip_height: usize) -> Vec<f32> {
+        let transform_data = CustomTransformData::default();
+        let weights = transform_data.upsampling_weights(factor);
+        let stage = Upsample::new(factor, weights, vec![0]);
+        let (source_width, source_data) = &source.planes[0];
+        let width = source_width * factor as usize;
+        let height = source_data.len() / source_width * factor as usize;
+        let pipeline = RenderPipeline::new(
+            width,
+            height,
+            vec![factor.trailing_zeros()],
+            vec![Stage::InOut(Box::new(stage))],
+        )
+        .with_strip_size(tile_width, strip_height);
+        let mut sink = Collect {
+            width,
+            planes: vec![vec![0.0; width * height]],
+        };
+        let mut buffers = StripBuffers::default();
+        for strip in 0..pipeline.num_strips() {
+            pipeline
+                .render_strip(strip, source, &mut buffers, &mut sink)
+                .unwrap();
+        }
+        sink.planes.swap_remove(0)
+    }
+
+    #[test]
+    fn test_upsample() {
+        let (width, height) = (9, 7);
+        let constant = Planes {
+            planes: vec![(width, vec![0.25; width * height])],
+        };
+        // A ramp, which is symmetric around its center.
+        let ramp = Planes {
+            planes: vec![(
+                width,
+                (0..width * height)
+                    .map(|i| ((i % width) as f32 - 4.0).abs() + ((i / width) as f32 - 3.0).abs())
+                    .collect(),
+            )],
+        };
+        for factor in [2, 4, 8].iter().copied() {
+            let k = factor as usize;
+            assert!(run(factor, &constant, 1000, 1000)
+                .iter()
+                .all(|v| (v - 0.25).abs() < 1e-6));
+            let out = run(factor, &ramp, 1000, 1000);
+            let out_width = width * k;
+            for y in 0..height * k {
+                for x in 0..out_width {
+                    let v = out[y * out_width + x];
+                    let mirrored = out[y * out_width + out_width - 1 - x];
+                    assert!((v - mirrored).abs() < 1e-4, "{} {} {}", factor, x, y);
+                    assert!((0.0..=7.0).contains(&v));
+                }
+            }
+            assert_eq!(run(factor, &ramp, 5, 3), out);
+        }
+    }
+
+    #[test]
+    fn test_gaborish() {
+        let gaborish = Gaborish::new([[0.1, 0.05], [0.2, 0.0], [0.0, 0.0]], 3);
+        let rows = [[1.0, 2.0, 3.0], [4.0, 5.0, 6.0], [7.0, 8.0, 9.0]];
+        let input: Vec<&[f32]> = rows.iter().map(|r| &r[..]).collect();
+        let mut out = [0.0f32];
+        for (c, expected) in [5.0f32, 5.0, 5.0].iter().enumerate() {
+            gaborish.process_row(c, &input, &mut [&mut out[..]]);
+            assert!((out[0] - expected).abs() < 1e-5);
+        }
+        let rows = [[0.0, 0.0, 0.0], [0.0, 1.0, 0.0], [0.0, 0.0, 0.0]];
+        let input: Vec<&[f32]> = rows.iter().map(|r| &r[..]).collect();
+        gaborish.process_row(0, &input, &mut [&mut out[..]]);
+        assert!((out[0] - 1.0 / 1.6).abs() < 1e-5);
+    }
+}
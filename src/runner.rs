@@ -0,0 +1,204 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex};
+
+use crate::error::Error;
+
+/// Runs independent tasks, such as the decoding of the groups of a frame, possibly in parallel.
+///
+/// Implement this to run the decoder on an existing executor instead of a dedicated pool.
+pub trait Runner: Sync {
+    /// Calls `task(i)` once for each `i` in `0..num_tasks`, in any order and on any thread, and
+    /// returns an error if any of the calls failed. Tasks after a failure may be skipped.
+    fn run(
+        &self,
+        num_tasks: usize,
+        task: &(dyn Fn(usize) -> Result<(), Error> + Sync),
+    ) -> Result<(), Error>;
+}
+
+/// Runs all the tasks on the calling thread, in order.
+#[derive(Debug, Default, Clone, Copy)]
+pub struct SingleThreadRunner;
+
+impl Runner for SingleThreadRunner {
+    fn run(
+        &self,
+        num_tasks: usize,
+        task: &(dyn Fn(usize) -> Result<(), Error> + Sync),
+    ) -> Result<(), Error> {
+        (0..num_tasks).try_for_each(task)
+    }
+}
+
+/// Runs tasks on a rayon thread pool, the global one unless another pool is given.
+#[cfg(feature = "rayon")]
+#[derive(Debug, Default, Clone)]
+pub struct RayonRunner {
+    pool: Option<std::sync::Arc<rayon::ThreadPool>>,
+}
+
+#[cfg(feature = "rayon")]
+impl RayonRunner {
+    pub fn new() -> RayonRunner {
+        RayonRunner::default()
+    }
+
+    pub fn with_pool(pool: std::sync::Arc<rayon::ThreadPool>) -> RayonRunner {
+        RayonRunner { pool: Some(pool) }
+    }
+}
+
+#[cfg(feature = "rayon")]
+impl Runner for RayonRunner {
+    fn run(
+        &self,
+        num_tasks: usize,
+        task: &(dyn Fn(usize) -> Result<(), Error> + Sync),
+    ) -> Result<(), Error> {
+        use rayon::prelude::*;
+        let run = || (0..num_tasks).into_par_iter().try_for_each(task);
+        match &self.pool {
+            Some(pool) => pool.install(run),
+            None => run(),
+        }
+    }
+}
+
+/// Runner used when none is specified.
+#[cfg(feature = "rayon")]
+pub type DefaultRunner = RayonRunner;
+#[cfg(not(feature = "rayon"))]
+pub type DefaultRunner = SingleThreadRunner;
+
+/// Flag that asks a decode to stop. Clones share the same flag, so it can be set from another
+/// thread or task than the one decoding.
+#[derive(Debug, Default, Clone)]
+pub struct CancelToken(Arc<AtomicBool>);
+
+impl CancelToken {
+    pub fn new() -> CancelToken {
+        CancelToken::default()
+    }
+
+    pub fn cancel(&self) {
+        self.0.store(true, Ordering::Relaxed);
+    }
+
+    pub fn is_cancelled(&self) -> bool {
+        self.0.load(Ordering::Relaxed)
+    }
+
+    /// Returns `Error::Cancelled` if `cancel` was called.
+    pub fn check(&self) -> Result<(), Error> {
+        if self.is_cancelled() {
+            Err(Error::Cancelled)
+        } else {
+            Ok(())
+        }
+    }
+}
+
+/// Runner that skips the remaining tasks once its token is cancelled, so that an abandoned decode
+/// stops in the middle of a frame instead of decoding all its groups.
+pub struct CancellableRunner<R: Runner> {
+    runner: R,
+    token: CancelToken,
+}
+
+impl<R: Runner> CancellableRunner<R> {
+    pub fn new(runner: R, token: CancelToken) -> CancellableRunner<R> {
+        CancellableRunner { runner, token }
+    }
+
+    pub fn token(&self) -> &CancelToken {
+        &self.token
+    }
+}
+
+impl<R: Runner> Runner for CancellableRunner<R> {
+    fn run(
+        &self,
+        num_tasks: usize,
+        task: &(dyn Fn(usize) -> Result<(), Error> + Sync),
+    ) -> Result<(), Error> {
+        self.token.check()?;
+        self.runner.run(num_tasks, &|i| {
+            self.token.check()?;
+            task(i)
+        })
+    }
+}
+
+/// Runs `task(i)` for each `i` in `0..num_tasks` with `runner`, and returns the results in order.
+pub fn run_map<T, F>(runner: &dyn Runner, num_tasks: usize, task: F) -> Result<Vec<T>, Error>
+where
+    T: Send,
+    F: Fn(usize) -> Result<T, Error> + Sync,
+{
+    // Each task writes to its own slot, so the locks are never contended.
+    let results: Vec<Mutex<Option<T>>> = (0..num_tasks).map(|_| Mutex::new(None)).collect();
+    runner.run(num_tasks, &|i| {
+        let result = task(i)?;
+        *results[i].lock().unwrap() = Some(result);
+        Ok(())
+    })?;
+    Ok(results
+        .into_iter()
+        .map(|r| r.into_inner().unwrap().unwrap())
+        .collect())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn check_runner(runner: &dyn Runner) {
+        let squares = run_map(runner, 100, |i| Ok(i * i)).unwrap();
+        assert_eq!(squares, (0..100).map(|i| i * i).collect::<Vec<_>>());
+        let res = run_map(runner, 100, |i| {
+            if i == 37 {
+                Err(Error::InvalidPermutation)
+            } else {
+                Ok(i)
+            }
+        });
+        assert!(matches!(res, Err(Error::InvalidPermutation)));
+        assert!(run_map(runner, 0, Ok).unwrap().is_empty());
+    }
+
+    #[test]
+    fn test_single_thread() {
+        check_runner(&SingleThreadRunner);
+    }
+
+    #[test]
+    fn test_cancellable() {
+        let runner = CancellableRunner::new(SingleThreadRunner, CancelToken::new());
+        check_runner(&runner);
+        let token = runner.token().clone();
+        let res = run_map(&runner, 100, |i| {
+            if i == 10 {
+                token.cancel();
+            }
+            Ok(i)
+        });
+        assert!(matches!(res, Err(Error::Cancelled)));
+        assert!(matches!(run_map(&runner, 1, Ok), Err(Error::Cancelled)));
+    }
+
+    #[cfg(feature = "rayon")]
+    #[test]
+    fn test_rayon() {
+        check_runner(&RayonRunner::new());
+        let pool = rayon::ThreadPoolBuilder::new()
+            .num_threads(3)
+            .build()
+            .unwrap();
+        check_runner(&RayonRunner::with_pool(std::sync::Arc::new(pool)));
+    }
+}
@@ -0,0 +1,136 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use std::sync::atomic::{AtomicU8, Ordering};
+
+/// Instruction set used by the vectorized kernels.
+///
+/// Kernels are written as portable loops over rows, and compiled once per level with the
+/// corresponding target features enabled; the best level supported by the CPU is selected at
+/// runtime. On aarch64 NEON is always available, so `Neon` and `Scalar` run the same code.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+#[repr(u8)]
+pub enum SimdLevel {
+    Scalar = 0,
+    Sse41 = 1,
+    Avx2 = 2,
+    Neon = 3,
+}
+
+static MAX_LEVEL: AtomicU8 = AtomicU8::new(u8::MAX);
+
+impl SimdLevel {
+    /// Best level supported by the CPU.
+    pub fn detected() -> SimdLevel {
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        {
+            if is_x86_feature_detected!("avx2") && is_x86_feature_detected!("fma") {
+                return SimdLevel::Avx2;
+            }
+            if is_x86_feature_detected!("sse4.1") {
+                return SimdLevel::Sse41;
+            }
+        }
+        #[cfg(target_arch = "aarch64")]
+        {
+            return SimdLevel::Neon;
+        }
+        #[allow(unreachable_code)]
+        SimdLevel::Scalar
+    }
+
+    /// Level used by the kernels: the detected one, capped by `set_max_level`.
+    pub fn current() -> SimdLevel {
+        SimdLevel::capped(SimdLevel::detected(), MAX_LEVEL.load(Ordering::Relaxed))
+    }
+
+    /// Best level up to `max` for a CPU whose best level is `detected`; only the levels of the
+    /// architecture of `detected` are considered.
+    fn capped(detected: SimdLevel, max: u8) -> SimdLevel {
+        match (detected, max) {
+            (_, max) if max >= detected as u8 => detected,
+            (SimdLevel::Avx2, 1) => SimdLevel::Sse41,
+            _ => SimdLevel::Scalar,
+        }
+    }
+
+    /// Caps the level used by the kernels, e.g. to compare against the scalar code.
+    pub fn set_max_level(level: SimdLevel) {
+        MAX_LEVEL.store(level as u8, Ordering::Relaxed);
+    }
+
+    /// Removes the cap set by `set_max_level`.
+    pub fn reset_max_level() {
+        MAX_LEVEL.store(u8::MAX, Ordering::Relaxed);
+    }
+}
+
+/// Defines a function whose body is compiled once per `SimdLevel`, and that runs the version
+/// for `SimdLevel::current()`. Everything the body calls in its inner loops must be
+/// `#[inline(always)]` to be compiled with the target features.
+macro_rules! simd_function {
+    ($(#[$attr:meta])* $vis:vis fn $name:ident($($arg:ident: $ty:ty),* $(,)?) $body:block) => {
+        $(#[$attr])*
+        $vis fn $name($($arg: $ty),*) {
+            #[inline(always)]
+            fn kernel($($arg: $ty),*) $body
+
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            {
+                #[target_feature(enable = "avx2,fma")]
+                unsafe fn avx2($($arg: $ty),*) {
+                    kernel($($arg),*)
+                }
+                #[target_feature(enable = "sse4.1")]
+                unsafe fn sse41($($arg: $ty),*) {
+                    kernel($($arg),*)
+                }
+                match $crate::simd::SimdLevel::current() {
+                    // SAFETY: the level is only selected if the CPU supports its features.
+                    $crate::simd::SimdLevel::Avx2 => return unsafe { avx2($($arg),*) },
+                    $crate::simd::SimdLevel::Sse41 => return unsafe { sse41($($arg),*) },
+                    _ => {}
+                }
+            }
+            kernel($($arg),*)
+        }
+    };
+}
+
+pub(crate) use simd_function;
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    simd_function!(
+        fn add(a: &[f32], b: &[f32], out: &mut [f32]) {
+            for ((a, b), out) in a.iter().zip(b.iter()).zip(out.iter_mut()) {
+                *out = a + b;
+            }
+        }
+    );
+
+    #[test]
+    fn test_dispatch() {
+        let a: Vec<f32> = (0..37).map(|i| i as f32).collect();
+        let mut out = vec![0.0; 37];
+        add(&a, &a, &mut out);
+        assert!(out.iter().enumerate().all(|(i, x)| *x == 2.0 * i as f32));
+        assert!(SimdLevel::current() <= SimdLevel::detected());
+    }
+
+    #[test]
+    fn test_capped() {
+        use SimdLevel::*;
+        let capped = |detected, max: SimdLevel| SimdLevel::capped(detected, max as u8);
+        assert_eq!(capped(Avx2, Sse41), Sse41);
+        assert_eq!(capped(Sse41, Avx2), Sse41);
+        assert_eq!(capped(Avx2, Neon), Avx2);
+        assert_eq!(capped(Neon, Avx2), Scalar);
+        assert_eq!(capped(Neon, Sse41), Scalar);
+        assert_eq!(SimdLevel::capped(Neon, u8::MAX), Neon);
+    }
+}
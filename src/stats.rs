@@ -0,0 +1,285 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+//! Counters of where decoding time and memory go, collected when the `stats` feature is
+//! enabled. Without the feature, `StatsCollector` and the internal timers are empty and all
+//! their methods compile to nothing; `DecodeStats` still exists, but stays empty.
+
+use std::time::Duration;
+
+#[cfg(feature = "stats")]
+use std::cell::RefCell;
+#[cfg(feature = "stats")]
+use std::sync::{Arc, Mutex};
+#[cfg(feature = "stats")]
+use std::time::Instant;
+
+/// A section of the codestream, such as the file headers, the ICC profile, histograms or a
+/// group.
+#[derive(Debug, Clone, PartialEq)]
+pub struct SectionStats {
+    pub name: &'static str,
+    pub bits: usize,
+    pub time: Duration,
+}
+
+/// A set of decoded histograms.
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct HistogramsStats {
+    pub num_contexts: usize,
+    /// Number of symbols read with each cluster.
+    pub symbols: Vec<u64>,
+}
+
+#[derive(Debug, Clone, Default, PartialEq)]
+pub struct DecodeStats {
+    /// The sections that were read, in the order they ended; they can be nested, e.g. the
+    /// histograms of the ICC profile are also part of it.
+    pub sections: Vec<SectionStats>,
+    /// The histograms that were read with, in order. Histograms reused from a cache are
+    /// counted again in each decode that reads with them.
+    pub histograms: Vec<HistogramsStats>,
+    /// Time spent reading and building the prefix code and ANS tables.
+    pub table_build_time: Duration,
+    /// Time spent in each type of render pipeline stage.
+    pub stage_times: Vec<(&'static str, Duration)>,
+    /// Bytes allocated for the encoded ICC profile, pipeline strips and image buffers.
+    pub bytes_allocated: usize,
+}
+
+#[cfg(feature = "stats")]
+impl DecodeStats {
+    fn add_stage_time(&mut self, name: &'static str, time: Duration) {
+        match self.stage_times.iter_mut().find(|(n, _)| *n == name) {
+            Some((_, total)) => *total += time,
+            None => self.stage_times.push((name, time)),
+        }
+    }
+}
+
+#[cfg(feature = "stats")]
+thread_local! {
+    static CURRENT: RefCell<Option<Arc<Mutex<DecodeStats>>>> = const { RefCell::new(None) };
+}
+
+/// Collects the stats of the decoding work that runs inside `collect`, including the tasks
+/// that it starts on other threads through a `Runner`.
+#[derive(Debug, Clone, Default)]
+pub struct StatsCollector {
+    #[cfg(feature = "stats")]
+    stats: Option<Arc<Mutex<DecodeStats>>>,
+}
+
+#[cfg(feature = "stats")]
+impl StatsCollector {
+    pub fn new() -> StatsCollector {
+        StatsCollector {
+            stats: Some(Arc::new(Mutex::new(DecodeStats::default()))),
+        }
+    }
+
+    /// The collector of the work running on this thread, if any.
+    pub(crate) fn current() -> StatsCollector {
+        StatsCollector {
+            stats: CURRENT.with(|c| c.borrow().clone()),
+        }
+    }
+
+    /// Runs `f`, recording its stats in this collector.
+    pub fn collect<T, F: FnOnce() -> T>(&self, f: F) -> T {
+        struct Restore(Option<Arc<Mutex<DecodeStats>>>);
+        impl Drop for Restore {
+            fn drop(&mut self) {
+                CURRENT.with(|c| *c.borrow_mut() = self.0.take());
+            }
+        }
+        let _restore = Restore(CURRENT.with(|c| c.replace(self.stats.clone())));
+        f()
+    }
+
+    /// The stats collected so far.
+    pub fn stats(&self) -> DecodeStats {
+        match &self.stats {
+            Some(stats) => stats.lock().unwrap().clone(),
+            None => DecodeStats::default(),
+        }
+    }
+}
+
+#[cfg(not(feature = "stats"))]
+impl StatsCollector {
+    #[inline(always)]
+    pub fn new() -> StatsCollector {
+        StatsCollector {}
+    }
+
+    #[inline(always)]
+    pub(crate) fn current() -> StatsCollector {
+        StatsCollector {}
+    }
+
+    #[inline(always)]
+    pub fn collect<T, F: FnOnce() -> T>(&self, f: F) -> T {
+        f()
+    }
+
+    pub fn stats(&self) -> DecodeStats {
+        DecodeStats::default()
+    }
+}
+
+/// Calls `f` on the stats of the collector of this thread, if any.
+#[cfg(feature = "stats")]
+fn record<T, F: FnOnce(&mut DecodeStats) -> T>(f: F) -> Option<T> {
+    CURRENT.with(|c| {
+        c.borrow()
+            .as_ref()
+            .map(|stats| f(&mut stats.lock().unwrap()))
+    })
+}
+
+/// Measures the time of an operation.
+pub(crate) struct Timer {
+    #[cfg(feature = "stats")]
+    start: Instant,
+}
+
+#[cfg(feature = "stats")]
+impl Timer {
+    pub fn start() -> Timer {
+        Timer {
+            start: Instant::now(),
+        }
+    }
+
+    pub fn elapsed(&self) -> Duration {
+        self.start.elapsed()
+    }
+}
+
+#[cfg(not(feature = "stats"))]
+impl Timer {
+    #[inline(always)]
+    pub fn start() -> Timer {
+        Timer {}
+    }
+}
+
+#[cfg(feature = "stats")]
+pub(crate) fn record_section(name: &'static str, bits: usize, time: Duration) {
+    record(|s| s.sections.push(SectionStats { name, bits, time }));
+}
+
+/// Records a new use of a set of histograms, and returns its index for `record_symbols`.
+#[cfg(feature = "stats")]
+pub(crate) fn record_histograms(num_contexts: usize, num_clusters: usize) -> Option<usize> {
+    record(|s| {
+        s.histograms.push(HistogramsStats {
+            num_contexts,
+            symbols: vec![0; num_clusters],
+        });
+        s.histograms.len() - 1
+    })
+}
+
+#[cfg(feature = "stats")]
+pub(crate) fn record_symbols(histograms: usize, symbols: &[u64]) {
+    record(|s| {
+        if let Some(h) = s.histograms.get_mut(histograms) {
+            for (total, count) in h.symbols.iter_mut().zip(symbols) {
+                *total += count;
+            }
+        }
+    });
+}
+
+#[cfg(feature = "stats")]
+pub(crate) fn record_table_build(timer: Timer) {
+    let time = timer.elapsed();
+    record(|s| s.table_build_time += time);
+}
+
+#[cfg(not(feature = "stats"))]
+#[inline(always)]
+pub(crate) fn record_table_build(_timer: Timer) {}
+
+#[cfg(feature = "stats")]
+pub(crate) fn record_allocation(bytes: usize) {
+    record(|s| s.bytes_allocated += bytes);
+}
+
+#[cfg(not(feature = "stats"))]
+#[inline(always)]
+pub(crate) fn record_allocation(_bytes: usize) {}
+
+/// Time spent in each stage of a render pipeline, accumulated locally while rendering a strip.
+pub(crate) struct StageTimes {
+    #[cfg(feature = "stats")]
+    times: Vec<Duration>,
+}
+
+#[cfg(feature = "stats")]
+impl StageTimes {
+    pub fn new(num_stages: usize) -> StageTimes {
+        StageTimes {
+            times: vec![Duration::ZERO; num_stages],
+        }
+    }
+
+    pub fn add(&mut self, stage: usize, timer: Timer) {
+        self.times[stage] += timer.elapsed();
+    }
+
+    /// Adds the times to the collector of this thread; `names` are the names of the stages.
+    pub fn finish<I: Iterator<Item = &'static str>>(self, names: I) {
+        record(|s| {
+            for (name, time) in names.zip(self.times) {
+                s.add_stage_time(name, time);
+            }
+        });
+    }
+}
+
+#[cfg(not(feature = "stats"))]
+impl StageTimes {
+    #[inline(always)]
+    pub fn new(_num_stages: usize) -> StageTimes {
+        StageTimes {}
+    }
+
+    #[inline(always)]
+    pub fn add(&mut self, _stage: usize, _timer: Timer) {}
+
+    #[inline(always)]
+    pub fn finish<I: Iterator<Item = &'static str>>(self, _names: I) {}
+}
+
+#[cfg(all(test, feature = "stats"))]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_collect() {
+        let collector = StatsCollector::new();
+        record_allocation(100);
+        collector.collect(|| {
+            record_allocation(10);
+            let index = record_histograms(3, 2).unwrap();
+            record_symbols(index, &[5, 1]);
+            record_symbols(index, &[1, 0]);
+            let mut times = StageTimes::new(2);
+            times.add(1, Timer::start());
+            times.finish(["a", "b"].iter().copied());
+            StatsCollector::current().collect(|| record_section("toc", 12, Duration::ZERO));
+        });
+        record_allocation(100);
+        let stats = collector.stats();
+        assert_eq!(stats.bytes_allocated, 10);
+        assert_eq!(stats.histograms[0].symbols, [6, 1]);
+        assert_eq!(stats.stage_times.len(), 2);
+        assert_eq!(stats.sections[0].bits, 12);
+        assert!(StatsCollector::current().stats().sections.is_empty());
+    }
+}
@@ -0,0 +1,85 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+//! Fixtures shared by the tests of several modules, and by the benchmarks through the
+//! `test-util` feature.
+
+/// A bare codestream of a 1x1 image with a single VarDCT frame; the same image as `test_basic`
+/// in frame_header.rs.
+pub const IMAGE: [u8; 65] = [
+    0xFF, 0x0A, 0x00, 0x90, 0x01, 0x00, 0x12, 0x88, 0x02, 0x00, 0xD4, 0x00, 0x55, 0x0F, 0x00, 0x00,
+    0xA8, 0x50, 0x19, 0x65, 0xDC, 0xE0, 0xE5, 0x5C, 0xCF, 0x97, 0x1F, 0x3A, 0x2C, 0xA6, 0x6D, 0x5C,
+    0x67, 0x68, 0xAB, 0x6D, 0x0B, 0x4B, 0x12, 0x45, 0xC6, 0xB1, 0x49, 0x3A, 0x81, 0x43, 0x92, 0x58,
+    0x04, 0x36, 0x2E, 0x98, 0x07, 0x18, 0x00, 0x86, 0x99, 0x03, 0x27, 0x33, 0x50, 0xE4, 0x4A, 0x12,
+    0x00,
+];
+
+/// Size of the file headers of `IMAGE`; its frame follows.
+pub const IMAGE_HEADERS_SIZE: usize = 5;
+
+/// An 8x8 image with a 1x1 preview, whose frames are both the frame of `IMAGE`.
+pub fn image_with_preview() -> Vec<u8> {
+    // Signature, small size 8 pixels high with a 1:1 ratio.
+    let mut fields = vec![(16, 0x0AFF), (1, 1), (5, 0), (3, 1)];
+    // Image metadata: not all default, extra fields, identity orientation, no intrinsic size.
+    fields.extend([(1, 0), (1, 1), (3, 0), (1, 0)]);
+    // A preview, not a multiple of 8, 1 pixel high with a 1:1 ratio.
+    fields.extend([(1, 1), (1, 0), (2, 0), (6, 0), (3, 1)]);
+    // No animation, 8 bits per sample, 16-bit modular buffers, no extra channels, XYB.
+    fields.extend([(1, 0), (1, 0), (2, 0), (1, 1), (2, 0), (1, 1)]);
+    // Default color encoding, tone mapping and transform data, no extensions.
+    fields.extend([(1, 1), (1, 1), (2, 0), (1, 1)]);
+    let mut writer = BitWriter::default();
+    for (num, value) in fields {
+        writer.write(num, value);
+    }
+    let mut file = writer.data;
+    for _ in 0..2 {
+        file.extend_from_slice(&IMAGE[IMAGE_HEADERS_SIZE..]);
+    }
+    file
+}
+
+/// A container with `codestream` split in two jxlp boxes, the first one with `split` bytes.
+pub fn container(codestream: &[u8], split: usize) -> Vec<u8> {
+    let mut file = vec![
+        0x00, 0x00, 0x00, 0x0C, b'J', b'X', b'L', b' ', 0x0D, 0x0A, 0x87, 0x0A,
+    ];
+    file.extend_from_slice(&[0, 0, 0, 20, b'f', b't', b'y', b'p']);
+    file.extend_from_slice(b"jxl \0\0\0\0jxl ");
+    let (first, second) = codestream.split_at(split);
+    file.extend_from_slice(&(first.len() as u32 + 12).to_be_bytes());
+    file.extend_from_slice(b"jxlp\0\0\0\0");
+    file.extend_from_slice(first);
+    file.extend_from_slice(&(second.len() as u32 + 12).to_be_bytes());
+    file.extend_from_slice(b"jxlp\x80\0\0\x01");
+    file.extend_from_slice(second);
+    file
+}
+
+/// Writes bits in the order in which `BitReader` reads them.
+#[derive(Default)]
+pub struct BitWriter {
+    pub data: Vec<u8>,
+    num_bits: usize,
+}
+
+impl BitWriter {
+    pub fn write(&mut self, num: usize, value: u64) {
+        for i in 0..num {
+            if self.num_bits.is_multiple_of(8) {
+                self.data.push(0);
+            }
+            self.data[self.num_bits / 8] |= (((value >> i) & 1) as u8) << (self.num_bits % 8);
+            self.num_bits += 1;
+        }
+    }
+
+    /// Returns the data, padded with zeros so that it can be read past the last bit written.
+    pub fn finish(mut self) -> Vec<u8> {
+        self.write(64, 0);
+        self.data
+    }
+}
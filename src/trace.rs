@@ -0,0 +1,76 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+//! Instrumentation of decoding stages, printed to stderr when the `tracing` feature is
+//! enabled, and recorded as sections of the `DecodeStats` when the `stats` feature is. Without
+//! either feature, `StageTrace` is empty and all its methods compile to nothing; in particular,
+//! the closures passed to `StageTrace::note` are only called with `tracing`.
+
+use crate::bit_reader::BitReader;
+
+#[cfg(any(feature = "tracing", feature = "stats"))]
+use std::time::Instant;
+
+/// A decoding stage, reported with the number of bits it read and the time it took.
+pub struct StageTrace {
+    #[cfg(any(feature = "tracing", feature = "stats"))]
+    name: &'static str,
+    #[cfg(any(feature = "tracing", feature = "stats"))]
+    start: Instant,
+    #[cfg(any(feature = "tracing", feature = "stats"))]
+    start_bits: usize,
+}
+
+#[cfg(any(feature = "tracing", feature = "stats"))]
+impl StageTrace {
+    /// Starts a stage that reads from `br`.
+    pub fn start(name: &'static str, br: &BitReader) -> StageTrace {
+        StageTrace {
+            name,
+            start: Instant::now(),
+            start_bits: br.total_bits_read(),
+        }
+    }
+
+    /// Reports additional information about the stage.
+    #[cfg(feature = "tracing")]
+    pub fn note<F: FnOnce() -> String>(&self, f: F) {
+        eprintln!("[jxl] {}: {}", self.name, f());
+    }
+
+    #[cfg(not(feature = "tracing"))]
+    #[inline(always)]
+    pub fn note<F: FnOnce() -> String>(&self, _f: F) {}
+
+    /// Ends the stage, reporting the bits read from `br` since `start`.
+    pub fn finish(self, br: &BitReader) {
+        let bits = br.total_bits_read() - self.start_bits;
+        let time = self.start.elapsed();
+        #[cfg(feature = "tracing")]
+        eprintln!(
+            "[jxl] {}: {} bits ({} bytes) in {:?}",
+            self.name,
+            bits,
+            bits.div_ceil(8),
+            time
+        );
+        #[cfg(feature = "stats")]
+        crate::stats::record_section(self.name, bits, time);
+    }
+}
+
+#[cfg(not(any(feature = "tracing", feature = "stats")))]
+impl StageTrace {
+    #[inline(always)]
+    pub fn start(_name: &'static str, _br: &BitReader) -> StageTrace {
+        StageTrace {}
+    }
+
+    #[inline(always)]
+    pub fn note<F: FnOnce() -> String>(&self, _f: F) {}
+
+    #[inline(always)]
+    pub fn finish(self, _br: &BitReader) {}
+}
@@ -44,6 +44,12 @@ where
     }
 }
 
+/// Inverse of the zigzag mapping of signed integers to unsigned ones: 0, -1, 1, -2, ...
+#[inline(always)]
+pub fn unpack_signed(value: u32) -> i32 {
+    ((value >> 1) as i32) ^ -((value & 1) as i32)
+}
+
 #[cfg(test)]
 mod test {
     use super::*;
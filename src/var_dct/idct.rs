@@ -0,0 +1,491 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use std::f64::consts::{PI, SQRT_2};
+use std::sync::Arc;
+
+use crate::error::Error;
+use crate::simd::simd_function;
+use crate::var_dct::transform_type::TransformType;
+
+const MAX_SIZE: usize = 256;
+
+/// Constants of the inverse transforms, which do not depend on the image and can be shared.
+#[derive(Debug, Clone)]
+pub struct TransformTables {
+    /// For each size `n`, `multipliers[n / 2 + i]` is `1 / (2 cos((2i + 1) pi / 2n))`.
+    multipliers: Arc<[f32]>,
+}
+
+impl Default for TransformTables {
+    fn default() -> TransformTables {
+        let mut multipliers = vec![0.0; MAX_SIZE];
+        let mut n = 2;
+        while n <= MAX_SIZE {
+            for i in 0..n / 2 {
+                let angle = (2 * i + 1) as f64 * PI / (2 * n) as f64;
+                multipliers[n / 2 + i] = (0.5 / angle.cos()) as f32;
+            }
+            n *= 2;
+        }
+        TransformTables {
+            multipliers: multipliers.into(),
+        }
+    }
+}
+
+/// Buffers and constants for the inverse transforms, reused across blocks.
+#[derive(Debug, Default)]
+pub struct TransformScratch {
+    tables: TransformTables,
+    block: Vec<f32>,
+    tmp: Vec<f32>,
+}
+
+impl TransformScratch {
+    pub fn new() -> TransformScratch {
+        TransformScratch::default()
+    }
+
+    /// Creates a scratch that uses already computed tables.
+    pub fn with_tables(tables: TransformTables) -> TransformScratch {
+        TransformScratch {
+            tables,
+            block: vec![],
+            tmp: vec![],
+        }
+    }
+}
+
+/// Writes the pixels of the block with transform `ty` and `coefficients` to `pixels`, with
+/// `stride` floats between rows.
+///
+/// Coefficients are scaled so that a block with only the lowest frequency coefficient set is
+/// constant and equal to it. Blocks that are a single DCT store the coefficients of `R` rows
+/// and `C` columns with a row for each vertical frequency if `R <= C`, and with a row for each
+/// horizontal frequency otherwise; the other 8x8 transforms use the layout of the bitstream.
+pub fn inverse_transform(
+    ty: TransformType,
+    coefficients: &[f32],
+    pixels: &mut [f32],
+    stride: usize,
+    scratch: &mut TransformScratch,
+) -> Result<(), Error> {
+    if ty.is_afv() {
+        return Err(Error::UnsupportedTransform(ty));
+    }
+    let (rows, cols) = ty.size();
+    assert!(coefficients.len() >= rows * cols);
+    assert!(stride >= cols && pixels.len() >= (rows - 1) * stride + cols);
+    if scratch.block.len() < rows * cols {
+        scratch.block.resize(rows * cols, 0.0);
+        scratch.tmp.resize(rows * cols, 0.0);
+    }
+    transform_kernel(ty, coefficients, pixels, stride, scratch);
+    Ok(())
+}
+
+simd_function!(
+    fn transform_kernel(
+        ty: TransformType,
+        coefficients: &[f32],
+        pixels: &mut [f32],
+        stride: usize,
+        scratch: &mut TransformScratch,
+    ) {
+        let TransformScratch { tables, block, tmp } = scratch;
+        let multipliers = &tables.multipliers[..];
+        let (rows, cols) = ty.size();
+        match ty {
+            TransformType::Identity => identity(coefficients, pixels, stride),
+            TransformType::Dct2x2 => dct2x2(coefficients, pixels, stride),
+            TransformType::Dct4x4 => {
+                let dcs = sub_block_dcs(coefficients);
+                for y in 0..2 {
+                    for x in 0..2 {
+                        for iy in 0..4 {
+                            for ix in 0..4 {
+                                let coeff = coefficients[(y + iy * 2) * 8 + x + ix * 2];
+                                block[iy * 4 + ix] = coeff;
+                            }
+                        }
+                        block[0] = dcs[y * 2 + x];
+                        let out = &mut pixels[y * 4 * stride + x * 4..];
+                        idct2d(block, tmp, 4, 4, out, stride, multipliers);
+                    }
+                }
+            }
+            TransformType::Dct4x8 | TransformType::Dct8x4 => {
+                // Two 4x8 blocks on top of each other, or two 8x4 blocks side by side.
+                let dcs = [
+                    coefficients[0] + coefficients[8],
+                    coefficients[0] - coefficients[8],
+                ];
+                for (i, dc) in dcs.iter().enumerate() {
+                    for iy in 0..4 {
+                        let row = (i + iy * 2) * 8;
+                        block[iy * 8..(iy + 1) * 8].copy_from_slice(&coefficients[row..row + 8]);
+                    }
+                    block[0] = *dc;
+                    if ty == TransformType::Dct4x8 {
+                        let out = &mut pixels[i * 4 * stride..];
+                        idct2d(block, tmp, 4, 8, out, stride, multipliers);
+                    } else {
+                        let out = &mut pixels[i * 4..];
+                        idct2d(block, tmp, 8, 4, out, stride, multipliers);
+                    }
+                }
+            }
+            _ => {
+                block[..rows * cols].copy_from_slice(&coefficients[..rows * cols]);
+                idct2d(block, tmp, rows, cols, pixels, stride, multipliers);
+            }
+        }
+    }
+);
+
+/// Inverse DCT of the columns of `data`, which has `n` rows of `lanes` values, computed with
+/// the same operations on every lane so that whole rows are processed at once. `tmp` must be
+/// at least as large as `data`.
+///
+/// This follows the recursive decomposition of a size `n` IDCT into two of size `n / 2`, one
+/// on the even coefficients and one on the sums of consecutive odd ones, but runs it a level
+/// at a time: first all the splits, then all the merges.
+#[inline(always)]
+fn idct1d(data: &mut [f32], tmp: &mut [f32], n: usize, lanes: usize, multipliers: &[f32]) {
+    let len = n * lanes;
+    let mut src = &mut data[..len];
+    let mut dst = &mut tmp[..len];
+    let row = |k: usize| k * lanes..(k + 1) * lanes;
+    let mut size = n;
+    while size > 1 {
+        let half = size / 2;
+        for start in (0..n).step_by(size) {
+            for k in 0..half {
+                dst[row(start + k)].copy_from_slice(&src[row(start + 2 * k)]);
+            }
+            for (d, s) in dst[row(start + half)]
+                .iter_mut()
+                .zip(src[row(start + 1)].iter())
+            {
+                *d = *s * SQRT_2 as f32;
+            }
+            for k in 1..half {
+                let (before, after) = src[row(start + 2 * k - 1).start..].split_at(2 * lanes);
+                for ((d, a), b) in dst[row(start + half + k)]
+                    .iter_mut()
+                    .zip(before[..lanes].iter())
+                    .zip(after[..lanes].iter())
+                {
+                    *d = a + b;
+                }
+            }
+        }
+        std::mem::swap(&mut src, &mut dst);
+        size = half;
+    }
+    size = 2;
+    while size <= n {
+        let half = size / 2;
+        let multipliers = &multipliers[half..size];
+        for start in (0..n).step_by(size) {
+            let (even, odd) = src[start * lanes..(start + size) * lanes].split_at(half * lanes);
+            let (first, last) =
+                dst[start * lanes..(start + size) * lanes].split_at_mut(half * lanes);
+            for (i, multiplier) in multipliers.iter().enumerate() {
+                let mirrored = half - 1 - i;
+                for (((e, o), f), l) in even[row(i)]
+                    .iter()
+                    .zip(odd[row(i)].iter())
+                    .zip(first[row(i)].iter_mut())
+                    .zip(last[row(mirrored)].iter_mut())
+                {
+                    let o = o * multiplier;
+                    *f = e + o;
+                    *l = e - o;
+                }
+            }
+        }
+        std::mem::swap(&mut src, &mut dst);
+        size *= 2;
+    }
+    // There is an even number of passes, so the result is back in `data`.
+}
+
+#[inline(always)]
+fn transpose(src: &[f32], dst: &mut [f32], rows: usize, cols: usize) {
+    for (y, src_row) in src.chunks_exact(cols).take(rows).enumerate() {
+        for (x, v) in src_row.iter().enumerate() {
+            dst[x * rows + y] = *v;
+        }
+    }
+}
+
+/// Inverse DCT of a block of `rows` x `cols` pixels, whose coefficients are in `block` as
+/// described in `inverse_transform`. Overwrites `block` and `tmp`.
+#[inline(always)]
+fn idct2d(
+    block: &mut [f32],
+    tmp: &mut [f32],
+    rows: usize,
+    cols: usize,
+    pixels: &mut [f32],
+    stride: usize,
+    multipliers: &[f32],
+) {
+    let (coeff_rows, coeff_cols) = (rows.min(cols), rows.max(cols));
+    // Transform along the columns of the coefficients, then along their rows.
+    idct1d(block, tmp, coeff_rows, coeff_cols, multipliers);
+    transpose(block, tmp, coeff_rows, coeff_cols);
+    idct1d(tmp, block, coeff_cols, coeff_rows, multipliers);
+    if rows <= cols {
+        transpose(&tmp[..rows * cols], block, cols, rows);
+    } else {
+        block[..rows * cols].copy_from_slice(&tmp[..rows * cols]);
+    }
+    for (out, row) in pixels
+        .chunks_mut(stride)
+        .zip(block.chunks_exact(cols).take(rows))
+    {
+        out[..cols].copy_from_slice(row);
+    }
+}
+
+/// Combines the 2x2 groups of the `2n` x `2n` top left coefficients, each spread over an `n` x
+/// `n` quadrant, with a 2x2 Hadamard transform into contiguous 2x2 blocks. Returns the 8x8
+/// block with the result in its top left corner and the rest of `coefficients` elsewhere.
+#[inline(always)]
+fn dct2_top_block(coefficients: &[f32], n: usize) -> [f32; 64] {
+    let mut out = [0.0; 64];
+    out.copy_from_slice(&coefficients[..64]);
+    for y in 0..n {
+        for x in 0..n {
+            let c00 = coefficients[y * 8 + x];
+            let c01 = coefficients[y * 8 + n + x];
+            let c10 = coefficients[(y + n) * 8 + x];
+            let c11 = coefficients[(y + n) * 8 + n + x];
+            out[y * 16 + x * 2] = c00 + c01 + c10 + c11;
+            out[y * 16 + x * 2 + 1] = c00 + c01 - c10 - c11;
+            out[y * 16 + 8 + x * 2] = c00 - c01 + c10 - c11;
+            out[y * 16 + 8 + x * 2 + 1] = c00 - c01 - c10 + c11;
+        }
+    }
+    out
+}
+
+/// The DCs of the four 4x4 blocks of `Dct4x4` and `Identity`, in row order: a 2x2 Hadamard
+/// transform of coefficients 0, 1, 8 and 9 (`IDCT2TopBlock<2>` in libjxl).
+#[inline(always)]
+fn sub_block_dcs(coefficients: &[f32]) -> [f32; 4] {
+    let (c00, c01, c10, c11) = (
+        coefficients[0],
+        coefficients[1],
+        coefficients[8],
+        coefficients[9],
+    );
+    [
+        c00 + c01 + c10 + c11,
+        c00 + c01 - c10 - c11,
+        c00 - c01 + c10 - c11,
+        c00 - c01 - c10 + c11,
+    ]
+}
+
+#[inline(always)]
+fn dct2x2(coefficients: &[f32], pixels: &mut [f32], stride: usize) {
+    let mut block = dct2_top_block(coefficients, 1);
+    block = dct2_top_block(&block, 2);
+    block = dct2_top_block(&block, 4);
+    for (out, row) in pixels.chunks_mut(stride).zip(block.chunks_exact(8)) {
+        out[..8].copy_from_slice(row);
+    }
+}
+
+/// Four 4x4 blocks, each with its average in its second pixel of the second row, and the
+/// differences from it in the other pixels.
+#[inline(always)]
+fn identity(coefficients: &[f32], pixels: &mut [f32], stride: usize) {
+    let dcs = sub_block_dcs(coefficients);
+    for y in 0..2 {
+        for x in 0..2 {
+            let coeff = |iy: usize, ix: usize| coefficients[(y + iy * 2) * 8 + x + ix * 2];
+            let mut residual_sum = 0.0;
+            for iy in 0..4 {
+                for ix in 0..4 {
+                    if ix != 0 || iy != 0 {
+                        residual_sum += coeff(iy, ix);
+                    }
+                }
+            }
+            let center = dcs[y * 2 + x] - residual_sum * (1.0 / 16.0);
+            for iy in 0..4 {
+                for ix in 0..4 {
+                    // The center pixel takes the place of the average, whose slot in turn
+                    // holds the difference of the top left pixel.
+                    let value = match (iy, ix) {
+                        (0, 0) => coeff(1, 1) + center,
+                        (1, 1) => center,
+                        _ => coeff(iy, ix) + center,
+                    };
+                    pixels[(y * 4 + iy) * stride + x * 4 + ix] = value;
+                }
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::simd::SimdLevel;
+    use num_traits::FromPrimitive;
+
+    fn coefficients(len: usize, seed: u32) -> Vec<f32> {
+        let mut state = seed;
+        (0..len)
+            .map(|_| {
+                state = state.wrapping_mul(1103515245).wrapping_add(12345);
+                ((state >> 8) % 2001) as f32 / 1000.0 - 1.0
+            })
+            .collect()
+    }
+
+    fn reference_idct2d(coefficients: &[f32], rows: usize, cols: usize) -> Vec<f64> {
+        let basis = |k: usize, i: usize, n: usize| {
+            let scale = if k == 0 { 1.0 } else { SQRT_2 };
+            scale * ((2 * i + 1) as f64 * k as f64 * PI / (2 * n) as f64).cos()
+        };
+        let coeff = |ky: usize, kx: usize| {
+            if rows <= cols {
+                coefficients[ky * cols + kx]
+            } else {
+                coefficients[kx * rows + ky]
+            }
+        };
+        let mut pixels = vec![0.0; rows * cols];
+        for y in 0..rows {
+            for x in 0..cols {
+                for ky in 0..rows {
+                    for kx in 0..cols {
+                        pixels[y * cols + x] +=
+                            coeff(ky, kx) as f64 * basis(ky, y, rows) * basis(kx, x, cols);
+                    }
+                }
+            }
+        }
+        pixels
+    }
+
+    fn transform(ty: TransformType, coefficients: &[f32], stride: usize) -> Vec<f32> {
+        let (rows, _) = ty.size();
+        let mut pixels = vec![0.0; rows * stride];
+        inverse_transform(
+            ty,
+            coefficients,
+            &mut pixels,
+            stride,
+            &mut TransformScratch::new(),
+        )
+        .unwrap();
+        pixels
+    }
+
+    #[test]
+    fn test_full_dct() {
+        for i in 0..TransformType::NUM_TYPES {
+            let ty = TransformType::from_usize(i).unwrap();
+            let (rows, cols) = ty.size();
+            // The reference is quartic in the block size.
+            if !ty.is_full_dct() || rows * cols > 64 * 64 {
+                continue;
+            }
+            let coefficients = coefficients(rows * cols, i as u32);
+            let stride = cols + 3;
+            let pixels = transform(ty, &coefficients, stride);
+            let expected = reference_idct2d(&coefficients, rows, cols);
+            for y in 0..rows {
+                for x in 0..cols {
+                    let (got, want) = (pixels[y * stride + x] as f64, expected[y * cols + x]);
+                    assert!((got - want).abs() < 1e-3, "{:?} {} {}", ty, got, want);
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn test_constant_blocks() {
+        for i in 0..TransformType::NUM_TYPES {
+            let ty = TransformType::from_usize(i).unwrap();
+            let (rows, cols) = ty.size();
+            let mut coefficients = vec![0.0; rows * cols];
+            coefficients[0] = 0.5;
+            if ty.is_afv() {
+                let mut pixels = vec![0.0; 64];
+                let res = inverse_transform(
+                    ty,
+                    &coefficients,
+                    &mut pixels,
+                    8,
+                    &mut TransformScratch::new(),
+                );
+                assert!(matches!(res, Err(Error::UnsupportedTransform(_))));
+                continue;
+            }
+            let pixels = transform(ty, &coefficients, cols);
+            for (y, row) in pixels.chunks(cols).enumerate() {
+                for (x, v) in row.iter().enumerate() {
+                    assert!((v - 0.5).abs() < 1e-5, "{:?} {} {} {}", ty, y, x, v);
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn test_sub_block_dcs() {
+        // Only the coefficients combined into the DCs of the 4x4 blocks are set, so each block
+        // is constant and equal to its DC.
+        for ty in [TransformType::Dct4x4, TransformType::Identity] {
+            let mut coefficients = vec![0.0; 64];
+            coefficients[0] = 0.5;
+            coefficients[1] = 0.25;
+            coefficients[8] = -0.125;
+            coefficients[9] = 0.0625;
+            let dcs = [0.6875, 0.8125, 0.0625, 0.4375];
+            let pixels = transform(ty, &coefficients, 8);
+            for (y, row) in pixels.chunks(8).enumerate() {
+                for (x, v) in row.iter().enumerate() {
+                    let expected = dcs[(y / 4) * 2 + x / 4];
+                    assert!((v - expected).abs() < 1e-5, "{:?} {} {} {}", ty, y, x, v);
+                }
+            }
+        }
+
+        // Only coefficient 1: the top blocks are 1, and the bottom ones -1.
+        for ty in [TransformType::Dct4x4, TransformType::Identity] {
+            let mut coefficients = vec![0.0; 64];
+            coefficients[1] = 1.0;
+            let pixels = transform(ty, &coefficients, 8);
+            for (y, row) in pixels.chunks(8).enumerate() {
+                for v in row.iter() {
+                    let expected = if y < 4 { 1.0 } else { -1.0 };
+                    assert!((v - expected).abs() < 1e-5, "{:?} {} {}", ty, y, v);
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn test_simd_levels() {
+        let ty = TransformType::Dct32x16;
+        let coefficients = coefficients(32 * 16, 7);
+        let pixels = transform(ty, &coefficients, 16);
+        SimdLevel::set_max_level(SimdLevel::Scalar);
+        let scalar = transform(ty, &coefficients, 16);
+        SimdLevel::reset_max_level();
+        for (a, b) in pixels.iter().zip(scalar.iter()) {
+            assert!((a - b).abs() < 1e-4);
+        }
+    }
+}
@@ -0,0 +1,110 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+use num_derive::FromPrimitive;
+
+/// Transform applied to a VarDCT block, in the order of the bitstream. `DctRxC` covers `R`
+/// rows and `C` columns of pixels.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, FromPrimitive)]
+pub enum TransformType {
+    Dct8 = 0,
+    Identity = 1,
+    Dct2x2 = 2,
+    Dct4x4 = 3,
+    Dct16 = 4,
+    Dct32 = 5,
+    Dct16x8 = 6,
+    Dct8x16 = 7,
+    Dct32x8 = 8,
+    Dct8x32 = 9,
+    Dct32x16 = 10,
+    Dct16x32 = 11,
+    Dct4x8 = 12,
+    Dct8x4 = 13,
+    Afv0 = 14,
+    Afv1 = 15,
+    Afv2 = 16,
+    Afv3 = 17,
+    Dct64 = 18,
+    Dct64x32 = 19,
+    Dct32x64 = 20,
+    Dct128 = 21,
+    Dct128x64 = 22,
+    Dct64x128 = 23,
+    Dct256 = 24,
+    Dct256x128 = 25,
+    Dct128x256 = 26,
+}
+
+impl TransformType {
+    pub const NUM_TYPES: usize = 27;
+
+    /// Number of rows and columns of pixels covered by the block.
+    pub fn size(&self) -> (usize, usize) {
+        use TransformType::*;
+        match self {
+            Dct8 | Identity | Dct2x2 | Dct4x4 | Dct4x8 | Dct8x4 | Afv0 | Afv1 | Afv2 | Afv3 => {
+                (8, 8)
+            }
+            Dct16 => (16, 16),
+            Dct32 => (32, 32),
+            Dct16x8 => (16, 8),
+            Dct8x16 => (8, 16),
+            Dct32x8 => (32, 8),
+            Dct8x32 => (8, 32),
+            Dct32x16 => (32, 16),
+            Dct16x32 => (16, 32),
+            Dct64 => (64, 64),
+            Dct64x32 => (64, 32),
+            Dct32x64 => (32, 64),
+            Dct128 => (128, 128),
+            Dct128x64 => (128, 64),
+            Dct64x128 => (64, 128),
+            Dct256 => (256, 256),
+            Dct256x128 => (256, 128),
+            Dct128x256 => (128, 256),
+        }
+    }
+
+    /// Number of 8x8 blocks covered in each direction.
+    pub fn covered_blocks(&self) -> (usize, usize) {
+        let (rows, cols) = self.size();
+        (rows / 8, cols / 8)
+    }
+
+    /// Whether the block is a single DCT over all of its pixels. The coefficients of these
+    /// blocks are stored with a row for each vertical frequency, transposed if the block is
+    /// taller than wide, so that rows are always at least as long as columns.
+    pub fn is_full_dct(&self) -> bool {
+        use TransformType::*;
+        !matches!(
+            self,
+            Identity | Dct2x2 | Dct4x4 | Dct4x8 | Dct8x4 | Afv0 | Afv1 | Afv2 | Afv3
+        )
+    }
+
+    pub fn is_afv(&self) -> bool {
+        use TransformType::*;
+        matches!(self, Afv0 | Afv1 | Afv2 | Afv3)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use num_traits::FromPrimitive;
+
+    #[test]
+    fn test_sizes() {
+        for i in 0..TransformType::NUM_TYPES {
+            let ty = TransformType::from_usize(i).unwrap();
+            let (rows, cols) = ty.size();
+            assert!(rows.is_power_of_two() && cols.is_power_of_two());
+            assert_eq!(ty.covered_blocks(), (rows / 8, cols / 8));
+        }
+        assert!(TransformType::from_usize(TransformType::NUM_TYPES).is_none());
+        assert_eq!(TransformType::Dct16x8.size(), (16, 8));
+    }
+}